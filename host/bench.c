@@ -0,0 +1,493 @@
+/*
+ * USB/IP benchmark client.
+ *
+ * Imports a device from a running server (usbip_server or the firmware) and
+ * keeps a fixed number of CMD_SUBMITs in flight on one endpoint, measuring
+ * throughput and the round trip of every URB from its CMD_SUBMIT leaving to
+ * its RET_SUBMIT arriving. Results are printed as text, one JSON object or
+ * one CSV line, so runs can be compared by scripts (see bench_suite.sh).
+ */
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "usbip_port.h"
+#include "usbip_network.h"
+
+enum bench_type { BENCH_BULK, BENCH_INT, BENCH_CTRL };
+enum bench_dir { BENCH_IN, BENCH_OUT, BENCH_LOOP };
+enum bench_format { FORMAT_TEXT, FORMAT_JSON, FORMAT_CSV };
+
+struct bench {
+	const char *host;
+	const char *port;
+	char busid[SYSFS_BUS_ID_SIZE];
+	uint32_t devid;
+	int ep;
+	enum bench_type type;
+	enum bench_dir dir;
+	int size;
+	int depth;
+	long count;
+	double seconds;
+	long warmup;
+	enum bench_format format;
+	const char *name;
+
+	int sockfd;
+	uint32_t seqnum;
+	uint8_t *buf;
+
+	/* send time of the URBs in flight, by seqnum */
+	struct {
+		uint32_t seqnum;
+		int dir;
+		int64_t sent;
+	} *inflight;
+	unsigned mask;
+
+	/* measured */
+	int64_t *lat;
+	long nlat;
+	long maxlat;
+	uint64_t bytes;
+	long errors;
+};
+
+static const char *const type_names[] = { "bulk", "int", "ctrl" };
+static const char *const dir_names[] = { "in", "out", "loop" };
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -H host     server address, default 127.0.0.1\n"
+		"  -p port     server port, default %d\n"
+		"  -B busid    device to import, default the first one listed\n"
+		"  -t type     bulk, int or ctrl (GET_DESCRIPTOR on EP 0), default bulk\n"
+		"  -d dir      in, out or loop (alternating OUT and IN), default in\n"
+		"  -e ep       endpoint number, default 1\n"
+		"  -s size     transfer_buffer_length, default 16384\n"
+		"  -q depth    URBs in flight, default 8\n"
+		"  -n count    URBs to measure, default 10000\n"
+		"  -T seconds  measure for a time instead of a count\n"
+		"  -w count    URBs before measuring, default 100\n"
+		"  -f format   text, json or csv, default text\n"
+		"  -N name     name of the run in the output\n",
+		prog, CONFIG_EXAMPLE_PORT);
+}
+
+static int lookup(const char *arg, const char *const *names, int n)
+{
+	for (int i = 0; i < n; i++) {
+		if (!strcmp(arg, names[i]))
+			return i;
+	}
+	return -1;
+}
+
+static int bench_connect(struct bench *b)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res, *ai;
+	int fd = -1;
+
+	if (getaddrinfo(b->host, b->port, &hints, &res)) {
+		fprintf(stderr, "cannot resolve %s\n", b->host);
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd < 0) {
+		fprintf(stderr, "cannot connect to %s:%s: %s\n", b->host, b->port,
+			strerror(errno));
+		return -1;
+	}
+	usbip_net_set_nodelay(fd);
+	return fd;
+}
+
+/* OP_REQ_DEVLIST on its own connection, picks the first device if none given */
+static int bench_devlist(struct bench *b)
+{
+	struct op_devlist_reply reply;
+	struct usbip_usb_device udev;
+	struct usbip_usb_interface uinf;
+	uint16_t code = OP_REP_DEVLIST;
+	int found = 0;
+	int status;
+	int fd;
+
+	fd = bench_connect(b);
+	if (fd < 0)
+		return -1;
+
+	if (usbip_net_send_op_common(fd, OP_REQ_DEVLIST, 0) < 0 ||
+	    usbip_net_recv_op_common(fd, &code, &status) < 0 ||
+	    usbip_net_recv(fd, &reply, sizeof(reply)) < 0)
+		goto err;
+	PACK_OP_DEVLIST_REPLY(0, &reply);
+
+	for (uint32_t i = 0; i < reply.ndev; i++) {
+		if (usbip_net_recv(fd, &udev, sizeof(udev)) < 0)
+			goto err;
+		usbip_net_pack_usb_device(0, &udev);
+		for (int j = 0; j < udev.bNumInterfaces; j++) {
+			if (usbip_net_recv(fd, &uinf, sizeof(uinf)) < 0)
+				goto err;
+		}
+
+		if (!found && (!b->busid[0] || !strcmp(b->busid, udev.busid))) {
+			snprintf(b->busid, sizeof(b->busid), "%s", udev.busid);
+			found = 1;
+		}
+	}
+	close(fd);
+
+	if (!found) {
+		fprintf(stderr, "%s not exported by the server\n",
+			b->busid[0] ? b->busid : "a device");
+		return -1;
+	}
+	return 0;
+err:
+	fprintf(stderr, "devlist request failed\n");
+	close(fd);
+	return -1;
+}
+
+static int bench_import(struct bench *b)
+{
+	struct op_import_request req;
+	struct op_import_reply reply;
+	uint16_t code = OP_REP_IMPORT;
+	int status;
+
+	b->sockfd = bench_connect(b);
+	if (b->sockfd < 0)
+		return -1;
+
+	memset(&req, 0, sizeof(req));
+	snprintf(req.busid, sizeof(req.busid), "%s", b->busid);
+	PACK_OP_IMPORT_REQUEST(1, &req);
+
+	if (usbip_net_send_op_common(b->sockfd, OP_REQ_IMPORT, 0) < 0 ||
+	    usbip_net_send(b->sockfd, &req, sizeof(req)) < 0 ||
+	    usbip_net_recv_op_common(b->sockfd, &code, &status) < 0 ||
+	    usbip_net_recv(b->sockfd, &reply, sizeof(reply)) < 0) {
+		fprintf(stderr, "import of %s failed\n", b->busid);
+		return -1;
+	}
+	PACK_OP_IMPORT_REPLY(0, &reply);
+
+	b->devid = reply.udev.busnum << 16 | reply.udev.devnum;
+	return 0;
+}
+
+static int bench_submit(struct bench *b, int dir)
+{
+	struct usbip_header *pdu = (struct usbip_header *)b->buf;
+	size_t len = sizeof(*pdu);
+	uint32_t seqnum = ++b->seqnum;
+
+	memset(pdu, 0, sizeof(*pdu));
+	pdu->base.command = USBIP_CMD_SUBMIT;
+	pdu->base.seqnum = seqnum;
+	pdu->base.devid = b->devid;
+	pdu->base.direction = dir;
+	pdu->base.ep = b->type == BENCH_CTRL ? 0 : b->ep;
+	pdu->u.cmd_submit.transfer_buffer_length = b->size;
+	if (b->type == BENCH_INT)
+		pdu->u.cmd_submit.interval = 1;
+
+	if (b->type == BENCH_CTRL) {
+		/* GET_DESCRIPTOR(configuration), as long as the device has */
+		usb_setup_packet_t setup = {
+			.bmRequestType = USB_BM_REQUEST_TYPE_DIR_IN,
+			.bRequest = USB_B_REQUEST_GET_DESCRIPTOR,
+			.wValue = USB_B_DESCRIPTOR_TYPE_CONFIGURATION << 8,
+			.wLength = b->size,
+		};
+		memcpy(pdu->u.cmd_submit.setup, &setup, sizeof(setup));
+	}
+	usbip_net_pack_header(1, pdu);
+
+	/* header and OUT data leave in one send() */
+	if (dir == USBIP_DIR_OUT)
+		len += b->size;
+
+	b->inflight[seqnum & b->mask].seqnum = seqnum;
+	b->inflight[seqnum & b->mask].dir = dir;
+	b->inflight[seqnum & b->mask].sent = usbip_time_us();
+
+	return usbip_net_send(b->sockfd, b->buf, len) < 0 ? -1 : 0;
+}
+
+static int bench_complete(struct bench *b, int measure)
+{
+	struct usbip_header pdu;
+	int64_t now;
+	int actual;
+	int dir;
+
+	if (usbip_net_recv(b->sockfd, &pdu, sizeof(pdu)) < 0) {
+		fprintf(stderr, "connection lost\n");
+		return -1;
+	}
+	usbip_net_pack_header(0, &pdu);
+	now = usbip_time_us();
+
+	if (pdu.base.command != USBIP_RET_SUBMIT ||
+	    b->inflight[pdu.base.seqnum & b->mask].seqnum != pdu.base.seqnum) {
+		fprintf(stderr, "unexpected reply %u seqnum %u\n",
+			pdu.base.command, pdu.base.seqnum);
+		return -1;
+	}
+
+	dir = b->inflight[pdu.base.seqnum & b->mask].dir;
+	actual = pdu.u.ret_submit.actual_length;
+	if (dir == USBIP_DIR_IN && actual > 0 &&
+	    usbip_net_recv(b->sockfd, b->buf + sizeof(pdu), actual) < 0) {
+		fprintf(stderr, "connection lost\n");
+		return -1;
+	}
+
+	if (!measure)
+		return 0;
+
+	if (pdu.u.ret_submit.status)
+		b->errors++;
+	b->bytes += actual;
+
+	if (b->nlat == b->maxlat) {
+		b->maxlat = b->maxlat ? b->maxlat * 2 : 65536;
+		b->lat = realloc(b->lat, b->maxlat * sizeof(*b->lat));
+		if (!b->lat)
+			return -1;
+	}
+	b->lat[b->nlat++] = now - b->inflight[pdu.base.seqnum & b->mask].sent;
+	return 0;
+}
+
+static int bench_next_dir(struct bench *b)
+{
+	if (b->type == BENCH_CTRL || b->dir == BENCH_IN)
+		return USBIP_DIR_IN;
+	if (b->dir == BENCH_OUT)
+		return USBIP_DIR_OUT;
+	/* loop: the OUT always goes first */
+	return b->seqnum & 1 ? USBIP_DIR_IN : USBIP_DIR_OUT;
+}
+
+static int bench_run(struct bench *b, int64_t *elapsed)
+{
+	long submitted = 0, completed = 0;
+	long total = b->count + b->warmup;
+	int64_t start = 0, deadline = 0;
+
+	for (int i = 0; i < b->depth && (b->seconds || submitted < total); i++, submitted++) {
+		if (bench_submit(b, bench_next_dir(b)) < 0)
+			return -1;
+	}
+
+	while (completed < submitted) {
+		int measure = completed >= b->warmup;
+		int more;
+
+		if (completed == b->warmup) {
+			start = usbip_time_us();
+			deadline = start + (int64_t)(b->seconds * 1e6);
+		}
+
+		if (bench_complete(b, measure) < 0)
+			return -1;
+		completed++;
+
+		if (b->seconds)
+			more = completed < b->warmup || usbip_time_us() < deadline;
+		else
+			more = submitted < total;
+		if (more) {
+			if (bench_submit(b, bench_next_dir(b)) < 0)
+				return -1;
+			submitted++;
+		}
+	}
+
+	*elapsed = usbip_time_us() - start;
+	return 0;
+}
+
+static int cmp_lat(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int64_t percentile(const struct bench *b, double p)
+{
+	long i = (long)(p * b->nlat);
+
+	if (!b->nlat)
+		return 0;
+	if (i >= b->nlat)
+		i = b->nlat - 1;
+	return b->lat[i];
+}
+
+static void bench_report(struct bench *b, int64_t elapsed)
+{
+	double secs = elapsed > 0 ? elapsed / 1e6 : 1e-6;
+	double mbps = b->bytes / secs / 1e6;
+	double urbs = b->nlat / secs;
+	char name[64];
+	int64_t p50, p99, p999, max;
+
+	qsort(b->lat, b->nlat, sizeof(*b->lat), cmp_lat);
+	p50 = percentile(b, 0.50);
+	p99 = percentile(b, 0.99);
+	p999 = percentile(b, 0.999);
+	max = b->nlat ? b->lat[b->nlat - 1] : 0;
+
+	if (b->name)
+		snprintf(name, sizeof(name), "%s", b->name);
+	else
+		snprintf(name, sizeof(name), "%s-%s-%d-q%d", type_names[b->type],
+			 dir_names[b->dir], b->size, b->depth);
+
+	switch (b->format) {
+	case FORMAT_JSON:
+		printf("{\"name\":\"%s\",\"busid\":\"%s\",\"type\":\"%s\",\"dir\":\"%s\","
+		       "\"size\":%d,\"depth\":%d,\"urbs\":%ld,\"bytes\":%llu,"
+		       "\"seconds\":%.6f,\"errors\":%ld,\"mbps\":%.3f,\"urbs_per_s\":%.1f,"
+		       "\"p50_us\":%lld,\"p99_us\":%lld,\"p999_us\":%lld,\"max_us\":%lld}\n",
+		       name, b->busid, type_names[b->type], dir_names[b->dir],
+		       b->size, b->depth, b->nlat, (unsigned long long)b->bytes,
+		       secs, b->errors, mbps, urbs,
+		       (long long)p50, (long long)p99, (long long)p999, (long long)max);
+		break;
+	case FORMAT_CSV:
+		printf("%s,%s,%s,%s,%d,%d,%ld,%llu,%.6f,%ld,%.3f,%.1f,%lld,%lld,%lld,%lld\n",
+		       name, b->busid, type_names[b->type], dir_names[b->dir],
+		       b->size, b->depth, b->nlat, (unsigned long long)b->bytes,
+		       secs, b->errors, mbps, urbs,
+		       (long long)p50, (long long)p99, (long long)p999, (long long)max);
+		break;
+	default:
+		printf("%s on %s: %ld URBs, %llu bytes in %.3f s, %ld errors\n"
+		       "  %.3f MB/s, %.1f URB/s\n"
+		       "  round trip p50 %lld us, p99 %lld us, p99.9 %lld us, max %lld us\n",
+		       name, b->busid, b->nlat, (unsigned long long)b->bytes, secs,
+		       b->errors, mbps, urbs,
+		       (long long)p50, (long long)p99, (long long)p999, (long long)max);
+		break;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct bench b = {
+		.host = "127.0.0.1",
+		.ep = 1,
+		.type = BENCH_BULK,
+		.dir = BENCH_IN,
+		.size = 16384,
+		.depth = 8,
+		.count = 10000,
+		.warmup = 100,
+		.format = FORMAT_TEXT,
+	};
+	char port[8];
+	int64_t elapsed;
+	int opt;
+
+	snprintf(port, sizeof(port), "%d", CONFIG_EXAMPLE_PORT);
+	b.port = port;
+	usbip_log_level = USBIP_LOG_ERROR;
+
+	while ((opt = getopt(argc, argv, "H:p:B:t:d:e:s:q:n:T:w:f:N:h")) != -1) {
+		switch (opt) {
+		case 'H':
+			b.host = optarg;
+			break;
+		case 'p':
+			b.port = optarg;
+			break;
+		case 'B':
+			snprintf(b.busid, sizeof(b.busid), "%s", optarg);
+			break;
+		case 't':
+			b.type = lookup(optarg, type_names, 3);
+			break;
+		case 'd':
+			b.dir = lookup(optarg, dir_names, 3);
+			break;
+		case 'e':
+			b.ep = atoi(optarg);
+			break;
+		case 's':
+			b.size = atoi(optarg);
+			break;
+		case 'q':
+			b.depth = atoi(optarg);
+			break;
+		case 'n':
+			b.count = atol(optarg);
+			break;
+		case 'T':
+			b.seconds = atof(optarg);
+			break;
+		case 'w':
+			b.warmup = atol(optarg);
+			break;
+		case 'f':
+			b.format = lookup(optarg, (const char *const[]){ "text", "json", "csv" }, 3);
+			break;
+		case 'N':
+			b.name = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if ((int)b.type < 0 || (int)b.dir < 0 || (int)b.format < 0 ||
+	    b.size < 0 || b.depth < 1 || b.ep < 0 || b.ep > 15) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (b.mask = 1; b.mask < 2u * b.depth; b.mask <<= 1)
+		;
+	b.inflight = calloc(b.mask, sizeof(*b.inflight));
+	b.mask--;
+	b.buf = malloc(sizeof(struct usbip_header) + b.size);
+	if (!b.inflight || !b.buf)
+		return 1;
+	memset(b.buf, 0xa5, sizeof(struct usbip_header) + b.size);
+
+	if (bench_devlist(&b) < 0 || bench_import(&b) < 0)
+		return 1;
+	if (bench_run(&b, &elapsed) < 0)
+		return 1;
+
+	bench_report(&b, elapsed);
+	close(b.sockfd);
+	return 0;
+}
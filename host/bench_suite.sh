@@ -0,0 +1,78 @@
+#!/bin/sh
+# Benchmark matrix against the emulated devices of usbip_server.
+#
+#   bench_suite.sh [build dir] [baseline.jsonl]
+#
+# Starts usbip_server with each emulated device, runs usbip_bench over a set
+# of sizes, directions and queue depths and prints one JSON object per run.
+# With a baseline (the saved output of an earlier run), every run is compared
+# against it by name, and the script fails when MB/s drops or the p99 round
+# trip grows by more than BENCH_TOLERANCE percent (default 10). The server
+# listens on BENCH_PORT (default 3240), for a machine where that one is taken.
+set -e
+
+BUILD=${1:-build-host}
+BASELINE=$2
+TOLERANCE=${BENCH_TOLERANCE:-10}
+PORT=${BENCH_PORT:-3240}
+SERVER=$BUILD/host/usbip_server
+BENCH=$BUILD/host/usbip_bench
+OUT=$(mktemp)
+PID=
+
+cleanup() {
+	[ -n "$PID" ] && kill "$PID" 2>/dev/null
+	rm -f "$OUT"
+}
+trap cleanup EXIT
+
+start() {
+	[ -n "$PID" ] && kill "$PID" 2>/dev/null && wait "$PID" 2>/dev/null || true
+	"$SERVER" -q -p "$PORT" "$@" &
+	PID=$!
+	sleep 0.5
+}
+
+run() {
+	"$BENCH" -p "$PORT" -f json "$@" | tee -a "$OUT"
+}
+
+start -d sourcesink
+for size in 512 4096 16384 65536; do
+	for depth in 1 8 32; do
+		run -d in -s $size -q $depth -n 5000
+		run -d out -s $size -q $depth -n 5000
+	done
+done
+run -t ctrl -s 64 -q 1 -n 5000
+
+start -d loopback
+# the round trip of a lone small URB, which reply coalescing must not delay
+run -d loop -s 64 -q 1 -n 5000
+for size in 512 16384; do
+	run -d loop -s $size -q 8 -n 5000
+done
+
+start -d hid
+run -t int -d in -s 16 -q 4 -n 1000
+
+[ -z "$BASELINE" ] && exit 0
+
+# name mbps p99_us, one line per run
+extract() {
+	sed -e 's/.*"name":"\([^"]*\)".*"mbps":\([0-9.]*\).*"p99_us":\([0-9]*\).*/\1 \2 \3/' "$1"
+}
+
+extract "$BASELINE" > "$OUT.base"
+extract "$OUT" | awk -v tol="$TOLERANCE" '
+	FNR == NR { mbps[$1] = $2; p99[$1] = $3; next }
+	!($1 in mbps) { next }
+	mbps[$1] > 0 && $2 < mbps[$1] * (1 - tol / 100) {
+		printf "REGRESSION %s: %.3f MB/s, baseline %.3f\n", $1, $2, mbps[$1]; bad = 1
+	}
+	p99[$1] > 0 && $3 > p99[$1] * (1 + tol / 100) {
+		printf "REGRESSION %s: p99 %d us, baseline %d\n", $1, $3, p99[$1]; bad = 1
+	}
+	END { exit bad }
+' "$OUT.base" - || { rm -f "$OUT.base"; exit 1; }
+rm -f "$OUT.base"
@@ -0,0 +1,284 @@
+/*
+ * Test of the LZ4 block codec in main/usbip_lz.c, which decompresses what
+ * clients send straight off the network.
+ *
+ * Round trips random and compressible buffers of 0 to 64 KiB, then feeds
+ * the decoder malformed blocks and mutations of valid ones. Input and
+ * output end right at an inaccessible page and start after guard bytes, so
+ * reading or writing past them crashes or fails the test.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "usbip_lz.h"
+
+#define GUARD		64
+#define GUARD_BYTE	0xa5
+
+/* a buffer of size bytes ending at a PROT_NONE page, guard bytes ahead */
+struct fenced {
+	uint8_t *map;
+	size_t map_len;
+	uint8_t *buf;
+	size_t size;
+};
+
+static int failures;
+
+#define CHECK(cond, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			printf("FAIL %s:%d: ", __FILE__, __LINE__);	\
+			printf(__VA_ARGS__);				\
+			printf("\n");					\
+			failures++;					\
+		}							\
+	} while (0)
+
+static void fence_init(struct fenced *f, size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t data = (size + GUARD + page - 1) / page * page;
+
+	f->map_len = data + page;
+	f->map = mmap(NULL, f->map_len, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (f->map == MAP_FAILED) {
+		perror("mmap");
+		exit(2);
+	}
+	if (mprotect(f->map + data, page, PROT_NONE) < 0) {
+		perror("mprotect");
+		exit(2);
+	}
+	f->buf = f->map + data - size;
+	f->size = size;
+	memset(f->map, GUARD_BYTE, data - size);
+}
+
+static void fence_free(struct fenced *f)
+{
+	munmap(f->map, f->map_len);
+}
+
+/* nothing was written ahead of the buffer */
+static int fence_intact(const struct fenced *f)
+{
+	for (const uint8_t *p = f->map; p < f->buf; p++) {
+		if (*p != GUARD_BYTE)
+			return 0;
+	}
+	return 1;
+}
+
+static int decompress_fenced(const uint8_t *src, int len, int cap)
+{
+	struct fenced in, out;
+	int ret;
+
+	fence_init(&in, len);
+	fence_init(&out, cap);
+	memcpy(in.buf, src, len);
+	ret = usbip_lz_decompress(in.buf, len, out.buf, cap);
+	CHECK(fence_intact(&out), "written ahead of the output");
+	CHECK(ret <= cap, "%d bytes decompressed into %d", ret, cap);
+	fence_free(&in);
+	fence_free(&out);
+	return ret;
+}
+
+static void fill_random(uint8_t *p, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		p[i] = rand();
+}
+
+/* records with a few fields changing, runs and text-like repeats */
+static void fill_compressible(uint8_t *p, size_t n)
+{
+	static const char words[] = "usbip urb submit unlink bulk int iso ";
+
+	for (size_t i = 0; i < n; i++) {
+		switch ((i / 4096) % 3) {
+		case 0:
+			p[i] = 0;
+			break;
+		case 1:
+			p[i] = i % 32 == 7 ? (uint8_t)(i / 32) : (uint8_t)(i % 32);
+			break;
+		default:
+			p[i] = words[(i * 7 / 5) % (sizeof(words) - 1)];
+			break;
+		}
+	}
+}
+
+static void round_trip(struct usbip_lz *lz, const uint8_t *src, int len,
+		       const char *kind)
+{
+	int cap = len + len / 255 + 16;
+	uint8_t *comp = malloc(cap);
+	struct fenced out;
+	int clen, dlen;
+
+	clen = usbip_lz_compress(lz, src, len, comp, cap);
+	if (len == 0) {
+		CHECK(clen == 0, "empty %s compressed to %d", kind, clen);
+		free(comp);
+		return;
+	}
+	CHECK(clen > 0, "%s of %d did not compress into %d", kind, len, cap);
+	if (clen <= 0) {
+		free(comp);
+		return;
+	}
+
+	fence_init(&out, len);
+	dlen = usbip_lz_decompress(comp, clen, out.buf, len);
+	CHECK(dlen == len, "%s of %d came back as %d", kind, len, dlen);
+	CHECK(dlen != len || !memcmp(out.buf, src, len),
+	      "%s of %d came back different", kind, len);
+	CHECK(fence_intact(&out), "%s of %d written ahead of the output",
+	      kind, len);
+	fence_free(&out);
+
+	/* one byte short of room */
+	CHECK(decompress_fenced(comp, clen, len - 1) < 0,
+	      "%s of %d fit into %d", kind, len, len - 1);
+
+	/* a cap below the input is the test of whether compression pays */
+	if (len > 64)
+		CHECK(usbip_lz_compress(lz, src, len, comp, 8) == 0,
+		      "%s of %d compressed into 8", kind, len);
+
+	free(comp);
+}
+
+static void test_round_trips(void)
+{
+	static const int sizes[] = {
+		0, 1, 4, 5, 12, 13, 15, 16, 64, 255, 256, 270, 511, 512,
+		4095, 4096, 16384, 40000, 65535, 65536,
+	};
+	struct usbip_lz lz;
+	uint8_t *src = malloc(USBIP_LZ_MAX);
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		fill_random(src, sizes[i]);
+		round_trip(&lz, src, sizes[i], "random");
+		fill_compressible(src, sizes[i]);
+		round_trip(&lz, src, sizes[i], "compressible");
+		memset(src, 0, sizes[i]);
+		round_trip(&lz, src, sizes[i], "zeros");
+	}
+	for (int i = 0; i < 200; i++) {
+		int len = rand() % (USBIP_LZ_MAX + 1);
+
+		if (i & 1)
+			fill_random(src, len);
+		else
+			fill_compressible(src, len);
+		round_trip(&lz, src, len, i & 1 ? "random" : "compressible");
+	}
+
+	/* blocks are limited to 64 KiB */
+	CHECK(usbip_lz_compress(&lz, src, USBIP_LZ_MAX + 1, src, 16) == 0,
+	      "a block over 64 KiB compressed");
+	free(src);
+}
+
+struct malformed {
+	const char *what;
+	uint8_t block[16];
+	int len;
+	int cap;
+};
+
+static const struct malformed malformed[] = {
+	{ "empty block", { 0 }, 0, 16 },
+	{ "offset 0", { 0x10, 'a', 0x00, 0x00, 0x10, 'b' }, 6, 16 },
+	{ "offset past the output", { 0x10, 'a', 0x02, 0x00, 0x10, 'b' }, 6, 16 },
+	{ "offset into nothing", { 0x00, 0x01, 0x00, 0x10, 'b' }, 5, 16 },
+	{ "offset cut short", { 0x10, 'a', 0x01 }, 3, 16 },
+	{ "literals past the input", { 0x50, 'a', 'b' }, 3, 16 },
+	{ "literals past the output", { 0x50, 'a', 'b', 'c', 'd', 'e' }, 6, 4 },
+	{ "match past the output", { 0x14, 'a', 0x01, 0x00, 0x00 }, 5, 8 },
+	{ "long match past the output",
+	  { 0x1f, 'a', 0x01, 0x00, 0xff, 0x10, 0x00 }, 7, 64 },
+	{ "literal length byte missing", { 0xf0 }, 1, 64 },
+	{ "literal length cut short", { 0xf0, 0xff }, 2, 512 },
+	{ "literal length past the input", { 0xf0, 0x05, 'a' }, 3, 64 },
+	{ "match length byte missing", { 0x1f, 'a', 0x01, 0x00 }, 4, 64 },
+	{ "match length cut short", { 0x1f, 'a', 0x01, 0x00, 0xff }, 5, 512 },
+	{ "match and no last literals",
+	  { 0x10, 'a', 0x01, 0x00 }, 4, 16 },
+};
+
+static void test_malformed(void)
+{
+	/* well-formed ones, so the table above fails for its own reasons */
+	static const uint8_t ok[] = { 0x14, 'a', 0x01, 0x00, 0x10, 'b' };
+	static const uint8_t ok_run[] = { 0x10, 'a', 0x01, 0x00, 0x10, 'b' };
+
+	for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+		const struct malformed *m = &malformed[i];
+
+		CHECK(decompress_fenced(m->block, m->len, m->cap) < 0,
+		      "%s accepted", m->what);
+	}
+
+	CHECK(decompress_fenced(ok, sizeof(ok), 10) == 10,
+	      "well-formed block rejected");
+	CHECK(decompress_fenced(ok, sizeof(ok), 9) < 0,
+	      "well-formed block fit into 9");
+	CHECK(decompress_fenced(ok_run, sizeof(ok_run), 6) == 6,
+	      "well-formed run rejected");
+}
+
+/* flipped bytes and cut ends of valid blocks, decoded into a tight output */
+static void test_mutations(void)
+{
+	struct usbip_lz lz;
+	uint8_t *src = malloc(USBIP_LZ_MAX);
+	uint8_t *comp = malloc(USBIP_LZ_MAX + 512);
+
+	for (int i = 0; i < 2000; i++) {
+		int len = 1 + rand() % 8192;
+		int clen, cap;
+
+		fill_compressible(src, len);
+		if (i & 1)
+			fill_random(src + len / 2, len / 4);
+		clen = usbip_lz_compress(&lz, src, len, comp, len + 512);
+		if (clen <= 0)
+			continue;
+
+		for (int j = 1 + rand() % 4; j; j--)
+			comp[rand() % clen] = rand();
+		if (i % 3 == 0)
+			clen = rand() % (clen + 1);
+		cap = i % 5 == 0 ? rand() % (len + 1) : len;
+
+		decompress_fenced(comp, clen, cap);
+	}
+	free(src);
+	free(comp);
+}
+
+int main(void)
+{
+	srand(1);
+	test_round_trips();
+	test_malformed();
+	test_mutations();
+
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
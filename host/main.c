@@ -0,0 +1,159 @@
+/*
+ * USB/IP server for Linux, built from the same core as the ESP32 firmware.
+ * It exists to measure and profile the protocol code without a board.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "usbip_port.h"
+#include "usbip.h"
+#include "tcp_server.h"
+#include "emu_device.h"
+#include "usbip_trace.h"
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-v] [-q] [-p port] [-d device] [-l us] [-b bytes/s] [-r us]\n"
+		"       [-s KiB]\n"
+		"  -v  debug logging\n"
+		"  -q  errors only\n"
+		"  -p  port to listen on, default %d\n"
+		"  -d  export an emulated device, busids 2-1, 2-2, ... in order:\n"
+		"      loopback, sourcesink, hid, cdc or msc, may be repeated\n"
+		"  -l  latency added to every transfer (loopback, cdc, msc)\n"
+		"  -b  bandwidth limit (loopback, cdc, msc)\n"
+		"  -r  hid report interval, default 1000\n"
+		"  -s  msc disk size, default 64\n"
+		"SIGUSR1 prints the URB trace, SIGUSR2 the latency histograms\n"
+		"and resets them.\n", prog, CONFIG_EXAMPLE_PORT);
+}
+
+/*
+ * SIGUSR1 prints the trace of the URB path, SIGUSR2 the latency histograms,
+ * which start over afterwards.
+ */
+static sigset_t trace_set;
+
+static void trace_signal_task(void *arg)
+{
+	int sig;
+
+	while (sigwait(&trace_set, &sig) == 0) {
+		if (sig == SIGUSR1) {
+			usbip_trace_dump();
+		} else {
+			usbip_hist_dump();
+			usbip_hist_reset();
+		}
+		fflush(stdout);
+	}
+}
+
+static int emu_create(const char *busid, const char *type, uint32_t latency_us,
+		      uint32_t bandwidth, uint32_t interval_us, size_t disk_kb)
+{
+	if (!strcmp(type, "loopback") || !strcmp(type, "sourcesink")) {
+		struct emu_loopback_config cfg = {
+			.loopback = !strcmp(type, "loopback"),
+			.latency_us = latency_us,
+			.bandwidth = bandwidth,
+		};
+		return emu_loopback_create(busid, &cfg);
+	}
+	if (!strcmp(type, "hid")) {
+		struct emu_hid_config cfg = { .report_interval_us = interval_us };
+		return emu_hid_create(busid, &cfg);
+	}
+	if (!strcmp(type, "cdc")) {
+		struct emu_cdc_config cfg = {
+			.latency_us = latency_us,
+			.bandwidth = bandwidth,
+		};
+		return emu_cdc_create(busid, &cfg);
+	}
+	if (!strcmp(type, "msc")) {
+		struct emu_msc_config cfg = {
+			.latency_us = latency_us,
+			.bandwidth = bandwidth,
+			.disk_size = disk_kb * 1024,
+		};
+		return emu_msc_create(busid, &cfg);
+	}
+
+	fprintf(stderr, "unknown device type: %s\n", type);
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	const char *devices[CONFIG_USBIP_MAX_DEVICES];
+	int ndevices = 0;
+	uint32_t latency_us = 0, bandwidth = 0, interval_us = 1000;
+	size_t disk_kb = 64;
+	int port = CONFIG_EXAMPLE_PORT;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "vqp:d:l:b:r:s:h")) != -1) {
+		switch (opt) {
+		case 'v':
+			usbip_log_level = USBIP_LOG_DEBUG;
+			break;
+		case 'q':
+			usbip_log_level = USBIP_LOG_ERROR;
+			break;
+		case 'p':
+			port = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			if (ndevices == CONFIG_USBIP_MAX_DEVICES) {
+				fprintf(stderr, "at most %d devices\n", CONFIG_USBIP_MAX_DEVICES);
+				return 1;
+			}
+			devices[ndevices++] = optarg;
+			break;
+		case 'l':
+			latency_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			bandwidth = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			interval_us = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			disk_kb = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	/* a client going away must not kill the server */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* blocked in every thread, only the trace task takes it */
+	sigemptyset(&trace_set);
+	sigaddset(&trace_set, SIGUSR1);
+	sigaddset(&trace_set, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &trace_set, NULL);
+	usbip_task_create(trace_signal_task, "trace", 4096, NULL, 1);
+
+	usbip_init();
+
+	for (int i = 0; i < ndevices; i++) {
+		char busid[SYSFS_BUS_ID_SIZE];
+
+		snprintf(busid, sizeof(busid), "2-%d", i + 1);
+		if (emu_create(busid, devices[i], latency_us, bandwidth,
+			       interval_us, disk_kb) < 0)
+			return 1;
+	}
+
+	tcp_server_task(&port);
+	return 0;
+}
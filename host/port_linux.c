@@ -0,0 +1,342 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/random.h>
+
+#include "usbip_port.h"
+
+int usbip_log_level = USBIP_LOG_INFO;
+
+void usbip_log_write(int level, const char *tag, const char *fmt, ...)
+{
+	static const char letters[] = "NEWID";
+	va_list ap;
+
+	fprintf(stderr, "%c (%lld) %s: ", letters[level],
+		(long long)(usbip_time_us() / 1000), tag);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+/* ---------------------------------------------------------------------- */
+/* Tasks */
+
+struct task_start {
+	void (*fn)(void *);
+	void *arg;
+};
+
+static void *task_entry(void *p)
+{
+	struct task_start start = *(struct task_start *)p;
+
+	free(p);
+	start.fn(start.arg);
+	return NULL;
+}
+
+int usbip_task_create(void (*fn)(void *), const char *name,
+		      uint32_t stack_size, void *arg, int prio)
+{
+	struct task_start *start;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	(void)stack_size;	/* FreeRTOS sizes are far too small for glibc */
+	(void)prio;
+
+	start = malloc(sizeof(*start));
+	if (!start)
+		return -1;
+	start->fn = fn;
+	start->arg = arg;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, task_entry, start);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		free(start);
+		return -1;
+	}
+
+#ifdef __GLIBC__
+	pthread_setname_np(thread, name);
+#else
+	(void)name;
+#endif
+	return 0;
+}
+
+void usbip_task_exit(void)
+{
+	pthread_exit(NULL);
+}
+
+void usbip_delay_ms(uint32_t ms)
+{
+	struct timespec ts = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (long)(ms % 1000) * 1000000,
+	};
+
+	while (nanosleep(&ts, &ts) < 0)
+		;
+}
+
+int64_t usbip_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint32_t usbip_random(void)
+{
+	uint32_t r;
+
+	if (getrandom(&r, sizeof(r), 0) != sizeof(r))
+		r = (uint32_t)usbip_time_us() ^ (uint32_t)rand();
+	return r;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Mutexes, semaphores and queues */
+
+struct usbip_mutex {
+	pthread_mutex_t mutex;
+};
+
+struct usbip_sem {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned count;
+	unsigned max;
+};
+
+struct usbip_queue {
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	unsigned head;
+	unsigned count;
+	unsigned len;
+	void *items[];
+};
+
+usbip_mutex_t usbip_mutex_create(void)
+{
+	struct usbip_mutex *m = malloc(sizeof(*m));
+
+	if (m)
+		pthread_mutex_init(&m->mutex, NULL);
+	return m;
+}
+
+void usbip_mutex_lock(usbip_mutex_t m)
+{
+	pthread_mutex_lock(&m->mutex);
+}
+
+void usbip_mutex_unlock(usbip_mutex_t m)
+{
+	pthread_mutex_unlock(&m->mutex);
+}
+
+void usbip_mutex_delete(usbip_mutex_t m)
+{
+	pthread_mutex_destroy(&m->mutex);
+	free(m);
+}
+
+usbip_sem_t usbip_sem_create(unsigned max, unsigned initial)
+{
+	struct usbip_sem *s = malloc(sizeof(*s));
+	pthread_condattr_t attr;
+
+	if (!s)
+		return NULL;
+	pthread_mutex_init(&s->mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&s->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	s->count = initial;
+	s->max = max;
+	return s;
+}
+
+void usbip_sem_take(usbip_sem_t s)
+{
+	pthread_mutex_lock(&s->mutex);
+	while (!s->count)
+		pthread_cond_wait(&s->cond, &s->mutex);
+	s->count--;
+	pthread_mutex_unlock(&s->mutex);
+}
+
+int usbip_sem_take_timeout(usbip_sem_t s, uint32_t timeout_us)
+{
+	struct timespec ts;
+	int ret = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += timeout_us / 1000000;
+	ts.tv_nsec += (long)(timeout_us % 1000000) * 1000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&s->mutex);
+	while (!s->count && ret == 0)
+		ret = pthread_cond_timedwait(&s->cond, &s->mutex, &ts);
+	if (s->count) {
+		s->count--;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&s->mutex);
+
+	return ret ? -1 : 0;
+}
+
+void usbip_sem_give(usbip_sem_t s)
+{
+	pthread_mutex_lock(&s->mutex);
+	if (s->count < s->max) {
+		s->count++;
+		pthread_cond_signal(&s->cond);
+	}
+	pthread_mutex_unlock(&s->mutex);
+}
+
+void usbip_sem_delete(usbip_sem_t s)
+{
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->mutex);
+	free(s);
+}
+
+usbip_queue_t usbip_queue_create(unsigned len)
+{
+	struct usbip_queue *q = calloc(1, sizeof(*q) + len * sizeof(void *));
+	pthread_condattr_t attr;
+
+	if (!q)
+		return NULL;
+	pthread_mutex_init(&q->mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&q->not_empty, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&q->not_full, NULL);
+	q->len = len;
+	return q;
+}
+
+void usbip_queue_send(usbip_queue_t q, void *item)
+{
+	pthread_mutex_lock(&q->mutex);
+	while (q->count == q->len)
+		pthread_cond_wait(&q->not_full, &q->mutex);
+	q->items[(q->head + q->count) % q->len] = item;
+	q->count++;
+	pthread_cond_signal(&q->not_empty);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+void *usbip_queue_recv(usbip_queue_t q)
+{
+	void *item;
+
+	pthread_mutex_lock(&q->mutex);
+	while (!q->count)
+		pthread_cond_wait(&q->not_empty, &q->mutex);
+	item = q->items[q->head];
+	q->head = (q->head + 1) % q->len;
+	q->count--;
+	pthread_cond_signal(&q->not_full);
+	pthread_mutex_unlock(&q->mutex);
+	return item;
+}
+
+int usbip_queue_recv_timeout(usbip_queue_t q, uint32_t timeout_us,
+			     void **item)
+{
+	struct timespec ts;
+	int ret = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += timeout_us / 1000000;
+	ts.tv_nsec += (long)(timeout_us % 1000000) * 1000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&q->mutex);
+	while (!q->count && timeout_us && ret == 0)
+		ret = pthread_cond_timedwait(&q->not_empty, &q->mutex, &ts);
+	if (q->count) {
+		*item = q->items[q->head];
+		q->head = (q->head + 1) % q->len;
+		q->count--;
+		pthread_cond_signal(&q->not_full);
+		ret = 0;
+	} else {
+		ret = -1;
+	}
+	pthread_mutex_unlock(&q->mutex);
+
+	return ret ? -1 : 0;
+}
+
+void usbip_queue_delete(usbip_queue_t q)
+{
+	pthread_cond_destroy(&q->not_full);
+	pthread_cond_destroy(&q->not_empty);
+	pthread_mutex_destroy(&q->mutex);
+	free(q);
+}
+
+/* ---------------------------------------------------------------------- */
+/* Transfers, allocated the way usb_host_transfer_alloc() does it */
+
+int usbip_transfer_alloc(size_t data_buffer_size, int num_isoc_packets,
+			 usb_transfer_t **transfer)
+{
+	usb_transfer_t *t;
+	uint8_t *buf;
+
+	t = calloc(1, sizeof(*t) + num_isoc_packets * sizeof(usb_isoc_packet_desc_t));
+	buf = malloc(data_buffer_size ? data_buffer_size : 1);
+	if (!t || !buf) {
+		free(t);
+		free(buf);
+		return -1;
+	}
+
+	usb_transfer_t init = {
+		.data_buffer = buf,
+		.data_buffer_size = data_buffer_size,
+		.num_isoc_packets = num_isoc_packets,
+	};
+	memcpy(t, &init, sizeof(init));
+
+	*transfer = t;
+	return 0;
+}
+
+void usbip_transfer_free(usb_transfer_t *transfer)
+{
+	if (!transfer)
+		return;
+	free(transfer->data_buffer);
+	free(transfer);
+}
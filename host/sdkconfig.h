@@ -0,0 +1,151 @@
+#pragma once
+/*
+ * Configuration of the host build. Mirrors the defaults of
+ * main/Kconfig.projbuild, every value can be overridden with -D.
+ */
+
+#ifndef CONFIG_LOG_MAXIMUM_LEVEL
+#define CONFIG_LOG_MAXIMUM_LEVEL	3
+#endif
+
+#ifndef CONFIG_EXAMPLE_IPV4
+#define CONFIG_EXAMPLE_IPV4		1
+#endif
+
+#ifndef CONFIG_EXAMPLE_PORT
+#define CONFIG_EXAMPLE_PORT		3240
+#endif
+
+#ifndef CONFIG_EXAMPLE_KEEPALIVE_IDLE
+#define CONFIG_EXAMPLE_KEEPALIVE_IDLE	5
+#endif
+
+#ifndef CONFIG_EXAMPLE_KEEPALIVE_INTERVAL
+#define CONFIG_EXAMPLE_KEEPALIVE_INTERVAL	5
+#endif
+
+#ifndef CONFIG_EXAMPLE_KEEPALIVE_COUNT
+#define CONFIG_EXAMPLE_KEEPALIVE_COUNT	3
+#endif
+
+#ifndef CONFIG_USBIP_MAX_DEVICES
+#define CONFIG_USBIP_MAX_DEVICES	8
+#endif
+
+#ifndef CONFIG_USBIP_MAX_SESSIONS
+#define CONFIG_USBIP_MAX_SESSIONS	4
+#endif
+
+#ifndef CONFIG_USBIP_MAX_URBS
+#define CONFIG_USBIP_MAX_URBS		32
+#endif
+
+#ifndef CONFIG_USBIP_URBS_PER_EP
+#define CONFIG_USBIP_URBS_PER_EP	4
+#endif
+
+#ifndef CONFIG_USBIP_ISO_URBS_PER_EP
+#define CONFIG_USBIP_ISO_URBS_PER_EP	8
+#endif
+
+/* interrupt IN prefetch is off unless CONFIG_USBIP_INT_PREFETCH_HID/_ALL is set */
+#ifndef CONFIG_USBIP_INT_PREFETCH_REPORTS
+#define CONFIG_USBIP_INT_PREFETCH_REPORTS	8
+#endif
+
+/* bulk IN read-ahead is off unless CONFIG_USBIP_BULK_READAHEAD_STREAMING/_ALL is set */
+#ifndef CONFIG_USBIP_BULK_READAHEAD_TRANSFERS
+#define CONFIG_USBIP_BULK_READAHEAD_TRANSFERS	4
+#endif
+
+#ifndef CONFIG_USBIP_BULK_READAHEAD_SIZE
+#define CONFIG_USBIP_BULK_READAHEAD_SIZE	4096
+#endif
+
+#ifndef CONFIG_USBIP_LOG_LEVEL_CORE
+#define CONFIG_USBIP_LOG_LEVEL_CORE	CONFIG_LOG_MAXIMUM_LEVEL
+#endif
+
+#ifndef CONFIG_USBIP_LOG_LEVEL_STUB
+#define CONFIG_USBIP_LOG_LEVEL_STUB	CONFIG_LOG_MAXIMUM_LEVEL
+#endif
+
+#ifndef CONFIG_USBIP_LOG_LEVEL_EMU
+#define CONFIG_USBIP_LOG_LEVEL_EMU	CONFIG_LOG_MAXIMUM_LEVEL
+#endif
+
+#ifndef CONFIG_USBIP_TRACE_EVENTS
+#define CONFIG_USBIP_TRACE_EVENTS	256
+#endif
+
+#ifndef CONFIG_USBIP_TX_COALESCE_BYTES
+#define CONFIG_USBIP_TX_COALESCE_BYTES	4096
+#endif
+
+#ifndef CONFIG_USBIP_TX_COALESCE_US
+#define CONFIG_USBIP_TX_COALESCE_US	0
+#endif
+
+#ifndef CONFIG_USBIP_COMPRESSION
+#define CONFIG_USBIP_COMPRESSION	1
+#endif
+
+#ifndef CONFIG_USBIP_COMPRESSION_MIN
+#define CONFIG_USBIP_COMPRESSION_MIN	256
+#endif
+
+#ifndef CONFIG_USBIP_UDP_INT
+#define CONFIG_USBIP_UDP_INT	1
+#endif
+
+#ifndef CONFIG_USBIP_UDP_WINDOW
+#define CONFIG_USBIP_UDP_WINDOW	16
+#endif
+
+#ifndef CONFIG_USBIP_UDP_RTO_MS
+#define CONFIG_USBIP_UDP_RTO_MS	20
+#endif
+
+#ifndef CONFIG_USBIP_RESUME
+#define CONFIG_USBIP_RESUME	1
+#endif
+
+#ifndef CONFIG_USBIP_RESUME_GRACE_MS
+#define CONFIG_USBIP_RESUME_GRACE_MS	10000
+#endif
+
+#ifndef CONFIG_USBIP_RESUME_BUFFER
+#define CONFIG_USBIP_RESUME_BUFFER	16384
+#endif
+
+#ifndef CONFIG_USBIP_RX_BUFFER_SIZE
+#define CONFIG_USBIP_RX_BUFFER_SIZE	2048
+#endif
+
+#ifndef CONFIG_USBIP_POOL_CTRL_TRANSFERS
+#define CONFIG_USBIP_POOL_CTRL_TRANSFERS	4
+#endif
+
+#ifndef CONFIG_USBIP_POOL_CTRL_SIZE
+#define CONFIG_USBIP_POOL_CTRL_SIZE	512
+#endif
+
+#ifndef CONFIG_USBIP_POOL_INT_TRANSFERS
+#define CONFIG_USBIP_POOL_INT_TRANSFERS	8
+#endif
+
+#ifndef CONFIG_USBIP_POOL_INT_SIZE
+#define CONFIG_USBIP_POOL_INT_SIZE	512
+#endif
+
+#ifndef CONFIG_USBIP_POOL_BULK_TRANSFERS
+#define CONFIG_USBIP_POOL_BULK_TRANSFERS	12
+#endif
+
+#ifndef CONFIG_USBIP_POOL_BULK_SIZE
+#define CONFIG_USBIP_POOL_BULK_SIZE	8192
+#endif
+
+#ifndef CONFIG_USBIP_POOL_HEAP_FALLBACK
+#define CONFIG_USBIP_POOL_HEAP_FALLBACK	0
+#endif
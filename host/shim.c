@@ -0,0 +1,1216 @@
+/*
+ * Client side of the server's extensions, for Linux.
+ *
+ * A local USB/IP server in front of usbip_server or the firmware. It takes
+ * the connections of the standard client (usbip attach --tcp-port) and asks
+ * the server for its extensions ahead of the import, so the kernel sees
+ * plain USB/IP while
+ *
+ *  - OUT payloads are compressed and IN payloads decompressed on their way
+ *    through (USBIP_FEAT_COMPRESS),
+ *  - URBs of interrupt endpoints, and their unlinks, go as datagrams next
+ *    to the TCP session (USBIP_FEAT_UDP_INT). USB/IP does not tell endpoint
+ *    types, so interrupt URBs are the ones with an interval that are not
+ *    isochronous.
+ *  - the session outlives a dropped connection (USBIP_FEAT_RESUME): the
+ *    shim connects again within the time the server grants, both sides
+ *    send again what the other missed, and the client sees nothing of it.
+ *
+ * A server without the extensions closes the connection on
+ * OP_REQ_FEATURES; the import is then made on a new connection and relayed
+ * as it is.
+ *
+ *     usbip_shim -H esp32.local &
+ *     usbip --tcp-port 3241 attach -r 127.0.0.1 -b 1-1
+ *
+ * This is a reference for clients rather than a tool: one thread per
+ * direction and one for datagrams, payloads copied through buffers.
+ */
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "usbip_port.h"
+#include "usbip_network.h"
+#include "usbip_lz.h"
+
+#define SHIM_PORT		"3241"
+/* chunks of payload relayed as it is */
+#define SHIM_COPY_SIZE		65536
+/* largest PDU passed on to the client in one piece */
+#define SHIM_MAX_PDU		(16 << 20)
+/* directions and channels of the URBs in flight, by seqnum */
+#define SHIM_SEQ_SLOTS		4096
+/* datagrams not acknowledged by the server are sent again this often */
+#define SHIM_UDP_RTO_US		(CONFIG_USBIP_UDP_RTO_MS * 1000)
+/* how often the udp thread looks for the end of the session */
+#define SHIM_UDP_POLL_MS	20
+/* the last bytes sent to the server, for a resume; socket buffers included */
+#define SHIM_RESUME_BUFFER	(8 << 20)
+/* a new connection is tried this often while the server waits for it */
+#define SHIM_RESUME_RETRY_MS	100
+
+struct shim {
+	const char *host;
+	const char *port;
+	const char *listen_port;
+	int min;
+	uint32_t features;	/* asked for */
+};
+
+struct shim_slot {
+	uint32_t seq;		/* 0 when free */
+	int64_t sent_us;
+	size_t len;
+	uint8_t *buf;
+};
+
+/* The datagram channel, see struct usbip_udp_header. */
+struct shim_udp {
+	int fd;			/* connected to udp_port of the server */
+	uint32_t token;
+	int window;
+	size_t max;
+	volatile int stop;
+	pthread_t thread;
+
+	/* protects what follows */
+	pthread_mutex_t lock;
+	pthread_cond_t room;	/* a slot was freed */
+	uint32_t next_seq;
+	struct shim_slot slot[32];
+	/* the server's datagrams: all below recv_next, bit i for recv_next + i */
+	uint32_t recv_next;
+	uint32_t recv_bits;
+
+	uint32_t urbs;		/* sent as datagrams */
+	uint32_t resent;
+	uint32_t tcp;		/* over TCP, the window was full */
+	uint32_t replies;
+	uint32_t dups;
+};
+
+/*
+ * The connection to the server of a session that can be resumed, see
+ * OP_REQ_RESUME. A new one is put on the same descriptor with dup2(), so
+ * the threads keep using sc->server; gen tells them it changed under them.
+ */
+struct shim_link {
+	uint8_t token[8];
+	int64_t grace_us;
+
+	/* the up thread's sends, and the swap of the connection */
+	pthread_mutex_t send_lock;
+	uint32_t sent;
+	uint8_t *ring;
+	size_t ring_head;
+	size_t ring_kept;
+
+	/* protects what follows */
+	pthread_mutex_t lock;
+	pthread_cond_t changed;	/* a resume is over */
+	unsigned gen;
+	int resuming;
+	int dead;		/* not resumed, the session is over */
+	uint32_t received;
+
+	uint32_t resumed;
+	uint64_t replayed;
+};
+
+struct shim_conn {
+	const struct shim *sh;
+	int client;
+	int server;
+	uint32_t features;
+	size_t compress_max;
+	struct shim_udp *udp;	/* NULL unless granted */
+	struct shim_link *link;	/* NULL unless granted */
+	atomic_int done;	/* the client is gone, no resume */
+	char busid[SYSFS_BUS_ID_SIZE];
+
+	/* the down and udp threads both send the client whole PDUs */
+	pthread_mutex_t client_lock;
+	atomic_uchar dir[SHIM_SEQ_SLOTS];
+	atomic_uchar udp_sent[SHIM_SEQ_SLOTS];
+
+	/* counted by the thread of each direction */
+	uint32_t out_urbs;
+	uint64_t out_raw;
+	uint64_t out_wire;
+	uint32_t in_urbs;
+	uint64_t in_raw;
+	uint64_t in_wire;
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -H host     server address, default 127.0.0.1\n"
+		"  -p port     server port, default %d\n"
+		"  -l port     port the client attaches to, default %s\n"
+		"  -m bytes    smallest OUT payload compressed, default %d\n"
+		"  -C          do not ask for compression\n"
+		"  -U          do not ask for interrupt URBs over UDP\n"
+		"  -R          do not ask for sessions resumed on a new connection\n",
+		prog, CONFIG_EXAMPLE_PORT, SHIM_PORT, CONFIG_USBIP_COMPRESSION_MIN);
+}
+
+static int shim_connect(const struct shim *sh, int quiet)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res, *ai;
+	int fd = -1;
+
+	if (getaddrinfo(sh->host, sh->port, &hints, &res)) {
+		fprintf(stderr, "cannot resolve %s\n", sh->host);
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd < 0 && !quiet)
+		fprintf(stderr, "cannot connect to %s:%s: %s\n", sh->host,
+			sh->port, strerror(errno));
+	return fd;
+}
+
+/* One whole PDU to the client. */
+static int shim_to_client(struct shim_conn *sc, void *pdu, size_t len,
+			  void *data, size_t data_len)
+{
+	struct iovec iov[2] = {
+		{ .iov_base = pdu, .iov_len = len },
+		{ .iov_base = data, .iov_len = data_len },
+	};
+	ssize_t ret;
+
+	pthread_mutex_lock(&sc->client_lock);
+	ret = usbip_net_sendv(sc->client, iov, data_len ? 2 : 1);
+	pthread_mutex_unlock(&sc->client_lock);
+	return ret < 0 ? -1 : 0;
+}
+
+static void shim_udp_header_locked(struct shim_udp *u, uint8_t *buf,
+				   uint32_t seq)
+{
+	struct usbip_udp_header hdr;
+
+	hdr.token = htonl(u->token);
+	hdr.seq = htonl(seq);
+	hdr.ack = htonl(u->recv_next - 1);
+	hdr.ack_bits = htonl(u->recv_bits >> 1);
+	memcpy(buf, &hdr, sizeof(hdr));
+}
+
+static void shim_udp_ack_locked(struct shim_udp *u)
+{
+	uint8_t buf[sizeof(struct usbip_udp_header)];
+
+	shim_udp_header_locked(u, buf, 0);
+	send(u->fd, buf, sizeof(buf), 0);
+}
+
+static void shim_udp_acked_locked(struct shim_udp *u, uint32_t ack,
+				  uint32_t bits)
+{
+	for (int i = 0; i < u->window; i++) {
+		struct shim_slot *slot = &u->slot[i];
+		uint32_t d = slot->seq - ack - 2;
+
+		if (!slot->seq)
+			continue;
+		if ((int32_t)(slot->seq - ack) <= 0 || (d < 32 && (bits >> d) & 1)) {
+			slot->seq = 0;
+			pthread_cond_broadcast(&u->room);
+		}
+	}
+}
+
+/* a free slot, as long as the server can keep track of the next seq */
+static struct shim_slot *shim_udp_slot_locked(struct shim_udp *u)
+{
+	struct shim_slot *free_slot = NULL;
+
+	for (int i = 0; i < u->window; i++) {
+		struct shim_slot *slot = &u->slot[i];
+
+		if (!slot->seq)
+			free_slot = slot;
+		else if (u->next_seq - slot->seq >= (uint32_t)u->window)
+			return NULL;
+	}
+	return free_slot;
+}
+
+/*
+ * Send a PDU, header in network order, as a datagram. With the window full
+ * it is -1 for the caller to send it over TCP, or with wait set a wait for
+ * room: an unlink may not overtake its URB.
+ */
+static int shim_udp_send(struct shim_udp *u, const struct usbip_header *wire,
+			 const uint8_t *data, size_t len, int wait)
+{
+	size_t head = sizeof(struct usbip_udp_header) + sizeof(*wire);
+	struct shim_slot *slot;
+
+	pthread_mutex_lock(&u->lock);
+	while (!(slot = shim_udp_slot_locked(u))) {
+		if (!wait || u->stop) {
+			u->tcp++;
+			pthread_mutex_unlock(&u->lock);
+			return -1;
+		}
+		pthread_cond_wait(&u->room, &u->lock);
+	}
+
+	memcpy(slot->buf + sizeof(struct usbip_udp_header), wire, sizeof(*wire));
+	memcpy(slot->buf + head, data, len);
+	slot->seq = u->next_seq++;
+	slot->len = head + len;
+	slot->sent_us = usbip_time_us();
+	shim_udp_header_locked(u, slot->buf, slot->seq);
+	send(u->fd, slot->buf, slot->len, 0);
+	u->urbs++;
+	pthread_mutex_unlock(&u->lock);
+	return 0;
+}
+
+/* Send again what is due; returns the ms to wait for more. */
+static int shim_udp_resend(struct shim_udp *u)
+{
+	int64_t now = usbip_time_us();
+	int64_t wait = SHIM_UDP_POLL_MS * 1000;
+
+	pthread_mutex_lock(&u->lock);
+	for (int i = 0; i < u->window; i++) {
+		struct shim_slot *slot = &u->slot[i];
+
+		if (!slot->seq)
+			continue;
+		if (now - slot->sent_us >= SHIM_UDP_RTO_US) {
+			shim_udp_header_locked(u, slot->buf, slot->seq);
+			send(u->fd, slot->buf, slot->len, 0);
+			slot->sent_us = now;
+			u->resent++;
+		}
+		if (slot->sent_us + SHIM_UDP_RTO_US - now < wait)
+			wait = slot->sent_us + SHIM_UDP_RTO_US - now;
+	}
+	pthread_mutex_unlock(&u->lock);
+
+	return wait / 1000 + 1;
+}
+
+static void shim_udp_input(struct shim_conn *sc, uint8_t *buf)
+{
+	struct shim_udp *u = sc->udp;
+	struct usbip_udp_header hdr;
+	struct usbip_header pdu;
+	size_t head = sizeof(hdr) + sizeof(pdu);
+	uint32_t seq, d;
+	ssize_t n;
+	int ret;
+
+	n = recv(u->fd, buf, u->max, 0);
+	if (n < (ssize_t)sizeof(hdr))
+		return;
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (ntohl(hdr.token) != u->token)
+		return;
+
+	pthread_mutex_lock(&u->lock);
+	shim_udp_acked_locked(u, ntohl(hdr.ack), ntohl(hdr.ack_bits));
+
+	seq = ntohl(hdr.seq);
+	d = seq - u->recv_next;
+	memcpy(&pdu, buf + sizeof(hdr), sizeof(pdu));
+	if (!seq || (size_t)n < head || (int32_t)d >= 32 ||
+	    /* a RET_UNLINK never ahead of the RET_SUBMIT it may follow */
+	    (d && ntohl(pdu.base.command) == USBIP_RET_UNLINK)) {
+		pthread_mutex_unlock(&u->lock);
+		return;
+	}
+	if ((int32_t)d < 0 || (u->recv_bits >> d) & 1) {
+		u->dups++;
+		shim_udp_ack_locked(u);
+		pthread_mutex_unlock(&u->lock);
+		return;
+	}
+	pthread_mutex_unlock(&u->lock);
+
+	ret = shim_to_client(sc, buf + sizeof(hdr), n - sizeof(hdr), NULL, 0);
+
+	pthread_mutex_lock(&u->lock);
+	if (ret == 0) {
+		u->replies++;
+		u->recv_bits |= 1u << d;
+		while (u->recv_bits & 1) {
+			u->recv_bits >>= 1;
+			u->recv_next++;
+		}
+		shim_udp_ack_locked(u);
+	}
+	pthread_mutex_unlock(&u->lock);
+}
+
+static void *shim_udp_thread(void *arg)
+{
+	struct shim_conn *sc = arg;
+	struct shim_udp *u = sc->udp;
+	uint8_t *buf = malloc(u->max);
+
+	while (buf && !u->stop) {
+		struct pollfd pfd = { .fd = u->fd, .events = POLLIN };
+
+		if (poll(&pfd, 1, shim_udp_resend(u)) > 0)
+			shim_udp_input(sc, buf);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void shim_udp_free(struct shim_udp *u)
+{
+	if (!u)
+		return;
+	for (int i = 0; i < u->window; i++)
+		free(u->slot[i].buf);
+	if (u->fd >= 0)
+		close(u->fd);
+	pthread_mutex_destroy(&u->lock);
+	pthread_cond_destroy(&u->room);
+	free(u);
+}
+
+/* The datagram channel granted in reply, to the server's address. */
+static struct shim_udp *shim_udp_open(struct shim_conn *sc,
+				      const struct op_features_reply *reply)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	struct shim_udp *u;
+
+	if (reply->udp_window < 1 || reply->udp_window > 32 ||
+	    reply->udp_max < sizeof(struct usbip_udp_header) +
+			     sizeof(struct usbip_header))
+		return NULL;
+
+	u = calloc(1, sizeof(*u));
+	if (!u)
+		return NULL;
+	u->fd = -1;
+	pthread_mutex_init(&u->lock, NULL);
+	pthread_cond_init(&u->room, NULL);
+	u->token = reply->udp_token;
+	u->window = reply->udp_window;
+	u->max = reply->udp_max;
+	u->next_seq = 1;
+	u->recv_next = 1;
+	for (int i = 0; i < u->window; i++) {
+		u->slot[i].buf = malloc(u->max);
+		if (!u->slot[i].buf)
+			goto err;
+	}
+
+	if (getpeername(sc->server, (struct sockaddr *)&addr, &len) < 0)
+		goto err;
+	if (addr.ss_family == AF_INET6)
+		((struct sockaddr_in6 *)&addr)->sin6_port = htons(reply->udp_port);
+	else
+		((struct sockaddr_in *)&addr)->sin_port = htons(reply->udp_port);
+	u->fd = socket(addr.ss_family, SOCK_DGRAM, 0);
+	if (u->fd < 0 || connect(u->fd, (struct sockaddr *)&addr, len) < 0)
+		goto err;
+	return u;
+err:
+	fprintf(stderr, "%s: no datagram channel: %s\n", sc->busid,
+		strerror(errno));
+	shim_udp_free(u);
+	return NULL;
+}
+
+static void shim_link_free(struct shim_link *l)
+{
+	if (!l)
+		return;
+	pthread_mutex_destroy(&l->send_lock);
+	pthread_mutex_destroy(&l->lock);
+	pthread_cond_destroy(&l->changed);
+	free(l->ring);
+	free(l);
+}
+
+static struct shim_link *shim_link_new(const struct op_features_reply *reply)
+{
+	struct shim_link *l = calloc(1, sizeof(*l));
+
+	if (!l)
+		return NULL;
+	pthread_mutex_init(&l->send_lock, NULL);
+	pthread_mutex_init(&l->lock, NULL);
+	pthread_cond_init(&l->changed, NULL);
+	memcpy(l->token, reply->resume_token, sizeof(l->token));
+	l->grace_us = (int64_t)reply->resume_ms * 1000;
+	l->ring = malloc(SHIM_RESUME_BUFFER);
+	if (!l->ring) {
+		shim_link_free(l);
+		return NULL;
+	}
+	return l;
+}
+
+/* Keep what is sent, the tail of it when it is larger than the buffer. */
+static void shim_link_keep(struct shim_link *l, const struct iovec *iov,
+			   int iovcnt)
+{
+	for (int i = 0; i < iovcnt; i++) {
+		const uint8_t *p = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+
+		l->sent += len;
+		if (len > SHIM_RESUME_BUFFER) {
+			p += len - SHIM_RESUME_BUFFER;
+			len = SHIM_RESUME_BUFFER;
+		}
+		l->ring_kept += len;
+		while (len > 0) {
+			size_t n = SHIM_RESUME_BUFFER - l->ring_head;
+
+			if (n > len)
+				n = len;
+			memcpy(l->ring + l->ring_head, p, n);
+			l->ring_head = (l->ring_head + n) % SHIM_RESUME_BUFFER;
+			p += n;
+			len -= n;
+		}
+	}
+	if (l->ring_kept > SHIM_RESUME_BUFFER)
+		l->ring_kept = SHIM_RESUME_BUFFER;
+}
+
+/*
+ * A new connection for the session; the server's count of the bytes it got
+ * in *received. -1 once the server refuses or the grace time is over.
+ */
+static int shim_link_connect(struct shim_conn *sc, uint32_t from,
+			     uint32_t *received)
+{
+	struct shim_link *l = sc->link;
+	int64_t deadline = usbip_time_us() + l->grace_us;
+
+	while (usbip_time_us() < deadline && !atomic_load(&sc->done)) {
+		struct op_resume_request req;
+		struct op_resume_reply reply;
+		uint16_t code = OP_REP_RESUME;
+		int status = -1;
+		int fd = shim_connect(sc->sh, 1);
+
+		if (fd >= 0) {
+			memcpy(req.token, l->token, sizeof(req.token));
+			req.received = from;
+			PACK_OP_RESUME_REQUEST(1, &req);
+			if (usbip_net_send_op_common(fd, OP_REQ_RESUME, 0) >= 0 &&
+			    usbip_net_send(fd, &req, sizeof(req)) >= 0 &&
+			    usbip_net_recv_op_common(fd, &code, &status) >= 0 &&
+			    usbip_net_recv(fd, &reply, sizeof(reply)) >= 0) {
+				PACK_OP_RESUME_REPLY(0, &reply);
+				*received = reply.received;
+				return fd;
+			}
+			close(fd);
+			/* busy while the server lets go of the old connection */
+			if (status >= 0 && status != ST_DEV_BUSY) {
+				fprintf(stderr, "%s: resume refused, status %d\n",
+					sc->busid, status);
+				return -1;
+			}
+		}
+		usbip_delay_ms(SHIM_RESUME_RETRY_MS);
+	}
+	return -1;
+}
+
+/*
+ * After the connection failed under gen: take the session up on a new one,
+ * or wait for the thread that does. -1 when the session is over.
+ */
+static int shim_link_resume(struct shim_conn *sc, unsigned gen)
+{
+	struct shim_link *l = sc->link;
+	uint32_t received, missed = 0;
+	int64_t start = usbip_time_us();
+	int fd, ret;
+
+	pthread_mutex_lock(&l->lock);
+	if (l->resuming || gen != l->gen) {
+		while (l->resuming)
+			pthread_cond_wait(&l->changed, &l->lock);
+		ret = l->dead ? -1 : 0;
+		pthread_mutex_unlock(&l->lock);
+		return ret;
+	}
+	if (l->dead || atomic_load(&sc->done)) {
+		pthread_mutex_unlock(&l->lock);
+		return -1;
+	}
+	/* what the old connection still delivers is dropped from now on */
+	l->resuming = 1;
+	l->gen++;
+	received = l->received;
+	pthread_mutex_unlock(&l->lock);
+
+	shutdown(sc->server, SHUT_RDWR);
+	fprintf(stderr, "%s: connection lost, resuming\n", sc->busid);
+	fd = shim_link_connect(sc, received, &received);
+
+	if (fd >= 0) {
+		pthread_mutex_lock(&l->send_lock);
+		missed = l->sent - received;
+		if (missed > l->ring_kept) {
+			fprintf(stderr, "%s: %u bytes lost, %zu kept\n",
+				sc->busid, missed, l->ring_kept);
+			close(fd);
+			fd = -1;
+		} else {
+			size_t first = (l->ring_head + SHIM_RESUME_BUFFER -
+					missed) % SHIM_RESUME_BUFFER;
+			size_t n = SHIM_RESUME_BUFFER - first;
+			struct iovec iov[2];
+
+			if (n > missed)
+				n = missed;
+			iov[0].iov_base = l->ring + first;
+			iov[0].iov_len = n;
+			iov[1].iov_base = l->ring;
+			iov[1].iov_len = missed - n;
+
+			dup2(fd, sc->server);
+			close(fd);
+			usbip_net_set_nodelay(sc->server);
+			/* a failure here shows on the next send or recv */
+			if (missed)
+				usbip_net_sendv(sc->server, iov, 2);
+		}
+		pthread_mutex_unlock(&l->send_lock);
+	}
+
+	pthread_mutex_lock(&l->lock);
+	l->resuming = 0;
+	if (fd < 0) {
+		l->dead = 1;
+	} else {
+		l->resumed++;
+		l->replayed += missed;
+	}
+	pthread_cond_broadcast(&l->changed);
+	pthread_mutex_unlock(&l->lock);
+
+	if (fd < 0) {
+		fprintf(stderr, "%s: not resumed\n", sc->busid);
+		return -1;
+	}
+	/* the server takes datagrams from where the next one comes from */
+	if (sc->udp) {
+		pthread_mutex_lock(&sc->udp->lock);
+		shim_udp_ack_locked(sc->udp);
+		pthread_mutex_unlock(&sc->udp->lock);
+	}
+	fprintf(stderr, "%s: resumed after %lld ms, %u bytes sent again\n",
+		sc->busid, (long long)(usbip_time_us() - start) / 1000, missed);
+	return 0;
+}
+
+/* All of iov to the server; kept for a resume when the session can have one. */
+static int shim_server_sendv(struct shim_conn *sc, struct iovec *iov,
+			     int iovcnt)
+{
+	struct shim_link *l = sc->link;
+	unsigned gen;
+	ssize_t ret;
+
+	if (!l)
+		return usbip_net_sendv(sc->server, iov, iovcnt) < 0 ? -1 : 0;
+
+	pthread_mutex_lock(&l->send_lock);
+	pthread_mutex_lock(&l->lock);
+	gen = l->gen;
+	pthread_mutex_unlock(&l->lock);
+	shim_link_keep(l, iov, iovcnt);
+	ret = usbip_net_sendv(sc->server, iov, iovcnt);
+	pthread_mutex_unlock(&l->send_lock);
+
+	/* kept, it goes out again on the next connection */
+	if (ret < 0)
+		return shim_link_resume(sc, gen);
+	return 0;
+}
+
+static int shim_server_send(struct shim_conn *sc, void *buf, size_t len)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+	return shim_server_sendv(sc, &iov, 1);
+}
+
+/* len bytes from the server, across connections when it can be resumed. */
+static int shim_server_recv(struct shim_conn *sc, void *buf, size_t len)
+{
+	struct shim_link *l = sc->link;
+	uint8_t *p = buf;
+
+	if (!l)
+		return usbip_net_recv(sc->server, buf, len) < 0 ? -1 : 0;
+
+	while (len > 0) {
+		unsigned gen;
+		int failed = 0;
+		ssize_t n;
+
+		pthread_mutex_lock(&l->lock);
+		while (l->resuming)
+			pthread_cond_wait(&l->changed, &l->lock);
+		gen = l->gen;
+		if (l->dead) {
+			pthread_mutex_unlock(&l->lock);
+			return -1;
+		}
+		pthread_mutex_unlock(&l->lock);
+
+		n = recv(sc->server, p, len, 0);
+
+		pthread_mutex_lock(&l->lock);
+		if (gen != l->gen) {
+			/* the old connection, the server sends it again */
+		} else if (n > 0) {
+			l->received += n;
+			p += n;
+			len -= n;
+		} else {
+			failed = 1;
+		}
+		pthread_mutex_unlock(&l->lock);
+
+		if (failed && shim_link_resume(sc, gen) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Relay n bytes of the client's stream as they are. */
+static int shim_copy_up(struct shim_conn *sc, uint8_t *buf, size_t n)
+{
+	while (n > 0) {
+		size_t len = n < SHIM_COPY_SIZE ? n : SHIM_COPY_SIZE;
+
+		if (usbip_net_recv(sc->client, buf, len) < 0 ||
+		    shim_server_send(sc, buf, len) < 0)
+			return -1;
+		n -= len;
+	}
+	return 0;
+}
+
+/* Ask for the extensions; 0 with nothing granted if the server does not know. */
+static int shim_features(struct shim_conn *sc)
+{
+	struct op_features_request req = { .features = sc->sh->features };
+	struct op_features_reply reply;
+	uint16_t code = OP_REP_FEATURES;
+	int status;
+
+	PACK_OP_FEATURES_REQUEST(1, &req);
+	if (usbip_net_send_op_common(sc->server, OP_REQ_FEATURES, 0) < 0 ||
+	    usbip_net_send(sc->server, &req, sizeof(req)) < 0 ||
+	    usbip_net_recv_op_common(sc->server, &code, &status) < 0 ||
+	    usbip_net_recv(sc->server, &reply, sizeof(reply)) < 0) {
+		close(sc->server);
+		sc->server = shim_connect(sc->sh, 0);
+		return sc->server < 0 ? -1 : 0;
+	}
+	PACK_OP_FEATURES_REPLY(0, &reply);
+
+	sc->features = reply.features;
+	sc->compress_max = reply.compress_max;
+	if (sc->compress_max > USBIP_LZ_MAX)
+		sc->compress_max = USBIP_LZ_MAX;
+	if (sc->features & USBIP_FEAT_UDP_INT) {
+		sc->udp = shim_udp_open(sc, &reply);
+		if (!sc->udp)
+			sc->features &= ~USBIP_FEAT_UDP_INT;
+	}
+	if (sc->features & USBIP_FEAT_RESUME) {
+		sc->link = shim_link_new(&reply);
+		if (!sc->link)
+			sc->features &= ~USBIP_FEAT_RESUME;
+	}
+	return 0;
+}
+
+/*
+ * Whether a PDU from the client goes as a datagram: interrupt URBs whose
+ * payload, or reply, fits, and the unlinks of those that went that way.
+ */
+static int shim_udp_takes(struct shim_conn *sc, const struct usbip_header *pdu)
+{
+	size_t room;
+
+	if (!sc->udp)
+		return 0;
+	if (pdu->base.command == USBIP_CMD_UNLINK)
+		return atomic_load(&sc->udp_sent[pdu->u.cmd_unlink.seqnum %
+						 SHIM_SEQ_SLOTS]);
+
+	room = sc->udp->max - sizeof(struct usbip_udp_header) - sizeof(*pdu);
+	return (pdu->base.ep & 0x0f) && pdu->u.cmd_submit.interval > 0 &&
+	       pdu->u.cmd_submit.number_of_packets <= 0 &&
+	       pdu->u.cmd_submit.transfer_buffer_length >= 0 &&
+	       (size_t)pdu->u.cmd_submit.transfer_buffer_length <= room;
+}
+
+/* CMD_SUBMIT and CMD_UNLINK on their way to the server. */
+static void *shim_up(void *arg)
+{
+	struct shim_conn *sc = arg;
+	struct usbip_lz *lz = malloc(sizeof(*lz));
+	uint8_t *buf = malloc(SHIM_COPY_SIZE);
+	uint8_t *zbuf = malloc(SHIM_COPY_SIZE);
+	struct usbip_header wire, pdu;
+
+	while (lz && buf && zbuf) {
+		int32_t len = 0, np = 0;
+		size_t payload = 0;
+		uint32_t zlen;
+		struct iovec iov[3];
+		int n, udp;
+
+		if (usbip_net_recv(sc->client, &wire, sizeof(wire)) < 0)
+			break;
+		pdu = wire;
+		usbip_net_pack_header(0, &pdu);
+
+		if (pdu.base.command == USBIP_CMD_SUBMIT) {
+			len = pdu.u.cmd_submit.transfer_buffer_length;
+			np = pdu.u.cmd_submit.number_of_packets;
+			atomic_store(&sc->dir[pdu.base.seqnum % SHIM_SEQ_SLOTS],
+				     pdu.base.direction);
+			if (pdu.base.direction == USBIP_DIR_OUT && len > 0)
+				payload = len;
+			if (np > 0)
+				payload += np * sizeof(struct usbip_iso_packet_descriptor);
+		} else if (pdu.base.command != USBIP_CMD_UNLINK) {
+			fprintf(stderr, "%s: unknown pdu %#x\n", sc->busid,
+				pdu.base.command);
+			break;
+		}
+
+		udp = shim_udp_takes(sc, &pdu);
+		if (pdu.base.command == USBIP_CMD_SUBMIT)
+			atomic_store(&sc->udp_sent[pdu.base.seqnum % SHIM_SEQ_SLOTS],
+				     udp);
+		if (udp) {
+			if (usbip_net_recv(sc->client, buf, payload) < 0)
+				break;
+			if (shim_udp_send(sc->udp, &wire, buf, payload,
+					  pdu.base.command == USBIP_CMD_UNLINK) == 0)
+				continue;
+			atomic_store(&sc->udp_sent[pdu.base.seqnum % SHIM_SEQ_SLOTS], 0);
+
+			iov[0].iov_base = &wire;
+			iov[0].iov_len = sizeof(wire);
+			iov[1].iov_base = buf;
+			iov[1].iov_len = payload;
+			if (shim_server_sendv(sc, iov, payload ? 2 : 1) < 0)
+				break;
+			continue;
+		}
+
+		/* not control, not isochronous: the server takes it compressed */
+		if (!(sc->features & USBIP_FEAT_COMPRESS) || !payload ||
+		    (pdu.base.ep & 0x0f) == 0 || np > 0 ||
+		    len < sc->sh->min || (size_t)len > sc->compress_max) {
+			if (shim_server_send(sc, &wire, sizeof(wire)) < 0 ||
+			    shim_copy_up(sc, buf, payload) < 0)
+				break;
+			continue;
+		}
+
+		if (usbip_net_recv(sc->client, buf, len) < 0)
+			break;
+		n = usbip_lz_compress(lz, buf, len, zbuf, len - sizeof(zlen) - 1);
+
+		iov[0].iov_base = &wire;
+		iov[0].iov_len = sizeof(wire);
+		if (n) {
+			wire.base.command = usbip_net_pack_uint32_t(1,
+				USBIP_CMD_SUBMIT | USBIP_COMPRESSED);
+			zlen = usbip_net_pack_uint32_t(1, n);
+			iov[1].iov_base = &zlen;
+			iov[1].iov_len = sizeof(zlen);
+			iov[2].iov_base = zbuf;
+			iov[2].iov_len = n;
+			sc->out_urbs++;
+			sc->out_raw += len;
+			sc->out_wire += sizeof(zlen) + n;
+		} else {
+			iov[1].iov_base = buf;
+			iov[1].iov_len = len;
+		}
+		if (shim_server_sendv(sc, iov, n ? 3 : 2) < 0)
+			break;
+	}
+
+	free(lz);
+	free(buf);
+	free(zbuf);
+	atomic_store(&sc->done, 1);
+	shutdown(sc->client, SHUT_RDWR);
+	shutdown(sc->server, SHUT_RDWR);
+	return NULL;
+}
+
+/*
+ * RET_SUBMIT and RET_UNLINK on their way to the client, each received whole
+ * before it is passed on: the udp thread may not wait for a slow TCP.
+ */
+static void shim_down(struct shim_conn *sc)
+{
+	size_t size = SHIM_COPY_SIZE;
+	uint8_t *buf = malloc(size);
+	uint8_t *zbuf = malloc(SHIM_COPY_SIZE);
+	struct usbip_header wire, pdu;
+
+	while (buf && zbuf) {
+		size_t payload = 0;
+		uint32_t zlen;
+		int32_t actual, np;
+		int dir;
+
+		if (shim_server_recv(sc, &wire, sizeof(wire)) < 0)
+			break;
+		pdu = wire;
+		usbip_net_pack_header(0, &pdu);
+		actual = pdu.u.ret_submit.actual_length;
+		np = pdu.u.ret_submit.number_of_packets;
+
+		if (pdu.base.command == (USBIP_RET_SUBMIT | USBIP_COMPRESSED)) {
+			if (shim_server_recv(sc, &zlen, sizeof(zlen)) < 0)
+				break;
+			zlen = usbip_net_pack_uint32_t(0, zlen);
+			if (zlen > SHIM_COPY_SIZE || actual <= 0 ||
+			    (size_t)actual > size ||
+			    shim_server_recv(sc, zbuf, zlen) < 0 ||
+			    usbip_lz_decompress(zbuf, zlen, buf, actual) != actual) {
+				fprintf(stderr, "%s: bad compressed reply\n",
+					sc->busid);
+				break;
+			}
+			sc->in_urbs++;
+			sc->in_raw += actual;
+			sc->in_wire += sizeof(zlen) + zlen;
+
+			wire.base.command = usbip_net_pack_uint32_t(1,
+							USBIP_RET_SUBMIT);
+			if (shim_to_client(sc, &wire, sizeof(wire), buf, actual) < 0)
+				break;
+			continue;
+		}
+
+		if (pdu.base.command == USBIP_RET_SUBMIT) {
+			dir = atomic_load(&sc->dir[pdu.base.seqnum % SHIM_SEQ_SLOTS]);
+			if (dir == USBIP_DIR_IN && actual > 0)
+				payload = actual;
+			if (np > 0)
+				payload += np * sizeof(struct usbip_iso_packet_descriptor);
+		} else if (pdu.base.command != USBIP_RET_UNLINK) {
+			fprintf(stderr, "%s: unknown pdu %#x\n", sc->busid,
+				pdu.base.command);
+			break;
+		}
+
+		if (payload > SHIM_MAX_PDU) {
+			fprintf(stderr, "%s: reply of %zu bytes\n", sc->busid,
+				payload);
+			break;
+		}
+		if (payload > size) {
+			uint8_t *p = realloc(buf, payload);
+
+			if (!p)
+				break;
+			buf = p;
+			size = payload;
+		}
+		if (shim_server_recv(sc, buf, payload) < 0 ||
+		    shim_to_client(sc, &wire, sizeof(wire), buf, payload) < 0)
+			break;
+	}
+
+	free(buf);
+	free(zbuf);
+	atomic_store(&sc->done, 1);
+	shutdown(sc->client, SHUT_RDWR);
+	shutdown(sc->server, SHUT_RDWR);
+}
+
+static const char *shim_describe(uint32_t features, char *buf, size_t size)
+{
+	static const struct {
+		uint32_t feature;
+		const char *name;
+	} names[] = {
+		{ USBIP_FEAT_COMPRESS, "compressed" },
+		{ USBIP_FEAT_UDP_INT, "interrupt URBs over UDP" },
+		{ USBIP_FEAT_RESUME, "resumable" },
+	};
+	size_t len = 0;
+
+	snprintf(buf, size, "plain USB/IP");
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (!(features & names[i].feature) || len >= size)
+			continue;
+		len += snprintf(buf + len, size - len, "%s%s", len ? ", " : "",
+				names[i].name);
+	}
+	return buf;
+}
+
+/* OP_REQ_IMPORT and the session after it, with what the server grants. */
+static void shim_import(struct shim_conn *sc, struct op_common *op)
+{
+	struct op_import_request req;
+	uint8_t reply[sizeof(struct op_common) + sizeof(struct op_import_reply)];
+	char desc[64];
+	pthread_t up;
+
+	if (usbip_net_recv(sc->client, &req, sizeof(req)) < 0)
+		return;
+	snprintf(sc->busid, sizeof(sc->busid), "%s", req.busid);
+	if (shim_features(sc) < 0)
+		return;
+
+	/* the reply is cut short when the import fails */
+	if (usbip_net_send(sc->server, op, sizeof(*op)) < 0 ||
+	    usbip_net_send(sc->server, &req, sizeof(req)) < 0 ||
+	    usbip_net_recv(sc->server, reply, sizeof(struct op_common)) < 0)
+		return;
+	if (((struct op_common *)reply)->status) {
+		usbip_net_send(sc->client, reply, sizeof(struct op_common));
+		return;
+	}
+	if (usbip_net_recv(sc->server, reply + sizeof(struct op_common),
+			   sizeof(reply) - sizeof(struct op_common)) < 0 ||
+	    usbip_net_send(sc->client, reply, sizeof(reply)) < 0)
+		return;
+
+	fprintf(stderr, "%s: imported, %s\n", sc->busid,
+		shim_describe(sc->features, desc, sizeof(desc)));
+	usbip_net_set_nodelay(sc->client);
+	usbip_net_set_nodelay(sc->server);
+
+	if (sc->udp && pthread_create(&sc->udp->thread, NULL, shim_udp_thread, sc)) {
+		shim_udp_free(sc->udp);
+		sc->udp = NULL;
+	}
+	if (!pthread_create(&up, NULL, shim_up, sc)) {
+		shim_down(sc);
+		if (sc->udp) {
+			pthread_mutex_lock(&sc->udp->lock);
+			sc->udp->stop = 1;
+			pthread_cond_broadcast(&sc->udp->room);
+			pthread_mutex_unlock(&sc->udp->lock);
+		}
+		pthread_join(up, NULL);
+	}
+	if (sc->udp) {
+		sc->udp->stop = 1;
+		pthread_join(sc->udp->thread, NULL);
+	}
+
+	if (sc->features & USBIP_FEAT_COMPRESS)
+		fprintf(stderr,
+			"%s: closed, OUT %u URBs compressed, %llu bytes in %llu; "
+			"IN %u URBs, %llu bytes in %llu\n",
+			sc->busid, sc->out_urbs,
+			(unsigned long long)sc->out_raw,
+			(unsigned long long)sc->out_wire, sc->in_urbs,
+			(unsigned long long)sc->in_raw,
+			(unsigned long long)sc->in_wire);
+	if (sc->udp)
+		fprintf(stderr,
+			"%s: closed, %u PDUs as datagrams, %u sent again, "
+			"%u over TCP; %u replies, %u duplicates\n",
+			sc->busid, sc->udp->urbs, sc->udp->resent, sc->udp->tcp,
+			sc->udp->replies, sc->udp->dups);
+	if (sc->link)
+		fprintf(stderr, "%s: closed, resumed %u times, %llu bytes sent again\n",
+			sc->busid, sc->link->resumed,
+			(unsigned long long)sc->link->replayed);
+}
+
+static void *shim_conn_thread(void *arg)
+{
+	struct shim_conn *sc = arg;
+	uint8_t *buf = malloc(SHIM_COPY_SIZE);
+	struct op_common op;
+	ssize_t n;
+
+	sc->server = shim_connect(sc->sh, 0);
+	if (sc->server < 0 || !buf ||
+	    usbip_net_recv(sc->client, &op, sizeof(op)) < 0)
+		goto out;
+
+	if (usbip_net_pack_uint16_t(0, op.code) == OP_REQ_IMPORT) {
+		shim_import(sc, &op);
+		goto out;
+	}
+
+	/* anything else, like DEVLIST, goes through as it is */
+	if (usbip_net_send(sc->server, &op, sizeof(op)) < 0)
+		goto out;
+	while ((n = recv(sc->server, buf, SHIM_COPY_SIZE, 0)) > 0) {
+		if (usbip_net_send(sc->client, buf, n) < 0)
+			break;
+	}
+
+out:
+	free(buf);
+	shim_udp_free(sc->udp);
+	shim_link_free(sc->link);
+	if (sc->server >= 0)
+		close(sc->server);
+	close(sc->client);
+	pthread_mutex_destroy(&sc->client_lock);
+	free(sc);
+	return NULL;
+}
+
+static int shim_listen(const char *port)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res;
+	int opt = 1;
+	int fd;
+
+	if (getaddrinfo("127.0.0.1", port, &hints, &res)) {
+		fprintf(stderr, "bad port %s\n", port);
+		return -1;
+	}
+	fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (fd < 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+	    bind(fd, res->ai_addr, res->ai_addrlen) < 0 || listen(fd, 4) < 0) {
+		fprintf(stderr, "cannot listen on port %s: %s\n", port,
+			strerror(errno));
+		freeaddrinfo(res);
+		return -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+int main(int argc, char **argv)
+{
+	struct shim sh = {
+		.host = "127.0.0.1",
+		.listen_port = SHIM_PORT,
+		.min = CONFIG_USBIP_COMPRESSION_MIN,
+		.features = USBIP_FEAT_COMPRESS | USBIP_FEAT_UDP_INT |
+			    USBIP_FEAT_RESUME,
+	};
+	char port[8];
+	int fd, opt;
+
+	snprintf(port, sizeof(port), "%d", CONFIG_EXAMPLE_PORT);
+	sh.port = port;
+	usbip_log_level = USBIP_LOG_ERROR;
+
+	while ((opt = getopt(argc, argv, "H:p:l:m:CURh")) != -1) {
+		switch (opt) {
+		case 'H':
+			sh.host = optarg;
+			break;
+		case 'p':
+			sh.port = optarg;
+			break;
+		case 'l':
+			sh.listen_port = optarg;
+			break;
+		case 'm':
+			sh.min = atoi(optarg);
+			break;
+		case 'C':
+			sh.features &= ~USBIP_FEAT_COMPRESS;
+			break;
+		case 'U':
+			sh.features &= ~USBIP_FEAT_UDP_INT;
+			break;
+		case 'R':
+			sh.features &= ~USBIP_FEAT_RESUME;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	/* a failed server connection shows as an error, to be resumed */
+	signal(SIGPIPE, SIG_IGN);
+	fd = shim_listen(sh.listen_port);
+	if (fd < 0)
+		return 1;
+	fprintf(stderr, "attach to 127.0.0.1:%s for %s:%s\n", sh.listen_port,
+		sh.host, sh.port);
+
+	for (;;) {
+		struct shim_conn *sc;
+		pthread_t thread;
+		int client = accept(fd, NULL, NULL);
+
+		if (client < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			return 1;
+		}
+
+		sc = calloc(1, sizeof(*sc));
+		if (!sc) {
+			close(client);
+			continue;
+		}
+		sc->sh = &sh;
+		sc->client = client;
+		pthread_mutex_init(&sc->client_lock, NULL);
+		if (pthread_create(&thread, NULL, shim_conn_thread, sc)) {
+			pthread_mutex_destroy(&sc->client_lock);
+			close(client);
+			free(sc);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+}
@@ -0,0 +1,60 @@
+#!/usr/bin/env python3
+"""TCP relay that freezes both directions for a while, periodically.
+
+    stall_relay.py listen_port server_port [stall_ms] [period_ms]
+
+Every connection to listen_port is relayed to server_port on localhost.
+For the first stall_ms (default 200) of every period_ms (default 500)
+nothing is passed on, the way a TCP connection stands still while it
+retransmits a segment lost on the radio. Used by udp_suite.sh.
+"""
+import socket
+import sys
+import threading
+import time
+
+
+def main():
+    listen_port, server_port = int(sys.argv[1]), int(sys.argv[2])
+    stall = float(sys.argv[3] if len(sys.argv) > 3 else 200) / 1000
+    period = float(sys.argv[4] if len(sys.argv) > 4 else 500) / 1000
+    t0 = time.time()
+
+    def gate():
+        while True:
+            phase = (time.time() - t0) % period
+            if phase >= stall:
+                return
+            time.sleep(stall - phase)
+
+    def pump(src, dst):
+        try:
+            while True:
+                data = src.recv(65536)
+                if not data:
+                    break
+                gate()
+                dst.sendall(data)
+        except OSError:
+            pass
+        for s in (src, dst):
+            try:
+                s.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+
+    ls = socket.socket()
+    ls.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    ls.bind(('127.0.0.1', listen_port))
+    ls.listen(8)
+    while True:
+        client, _ = ls.accept()
+        server = socket.create_connection(('127.0.0.1', server_port))
+        for s in (client, server):
+            s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        threading.Thread(target=pump, args=(client, server), daemon=True).start()
+        threading.Thread(target=pump, args=(server, client), daemon=True).start()
+
+
+if __name__ == '__main__':
+    main()
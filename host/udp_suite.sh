@@ -0,0 +1,71 @@
+#!/bin/sh
+# Interrupt URBs over the datagram channel while TCP stands still.
+#
+#   udp_suite.sh [build dir]
+#
+# usbip_shim reaches usbip_server through stall_relay.py, which freezes the
+# TCP connection for STALL_MS (default 200) of every PERIOD_MS (default
+# 500). A bulk loop keeps that connection busy on one device while
+# usbip_bench measures interrupt IN round trips on an emulated HID device
+# through the shim. Datagrams go around the relay.
+#
+# Fails when an interrupt URB fails or goes missing, or when the p99.9
+# round trip reaches the stall, which is what it is over TCP alone (run
+# with SHIM_FLAGS=-U to see that). With UDPDROP percent of the datagrams
+# lost on both ends they have to be sent again after USBIP_UDP_RTO_MS, and
+# only that every URB completes is checked. The server listens on UDP_PORT
+# (default 3240), the shim on the port after it and the relay on the one
+# after that.
+set -e
+
+BUILD=${1:-build-host}
+PORT=${UDP_PORT:-3240}
+SHIM_PORT=$((PORT + 1))
+RELAY_PORT=$((PORT + 2))
+STALL=${STALL_MS:-200}
+HOST_DIR=$(dirname "$0")
+DROP=$BUILD/host/libudpdrop.so
+URBS=3000
+OUT=$(mktemp)
+PIDS=
+
+cleanup() {
+	for pid in $PIDS; do
+		kill "$pid" 2>/dev/null && wait "$pid" 2>/dev/null || true
+	done
+	rm -f "$OUT"
+}
+trap cleanup EXIT
+
+export UDPDROP=${UDPDROP:-0}
+LD_PRELOAD=$DROP "$BUILD/host/usbip_server" -q -p "$PORT" -d hid -d loopback &
+PIDS="$PIDS $!"
+python3 "$HOST_DIR/stall_relay.py" "$RELAY_PORT" "$PORT" "$STALL" \
+	"${PERIOD_MS:-500}" &
+PIDS="$PIDS $!"
+sleep 0.3
+LD_PRELOAD=$DROP "$BUILD/host/usbip_shim" -p "$RELAY_PORT" -l "$SHIM_PORT" \
+	$SHIM_FLAGS &
+PIDS="$PIDS $!"
+sleep 0.5
+
+"$BUILD/host/usbip_bench" -p "$SHIM_PORT" -B 2-2 -t bulk -d loop -s 16384 \
+	-q 4 -T 10 -w 0 >/dev/null &
+PIDS="$PIDS $!"
+sleep 0.5
+"$BUILD/host/usbip_bench" -p "$SHIM_PORT" -B 2-1 -t int -d in -s 64 -q 1 \
+	-n $URBS -w 0 -f json | tee "$OUT"
+
+# the shim logs how many PDUs went each way and were sent again as it closes
+for pid in $PIDS; do
+	kill "$pid" 2>/dev/null && wait "$pid" 2>/dev/null || true
+done
+PIDS=
+
+sed -e 's/.*"urbs":\([0-9]*\).*"errors":\([0-9]*\).*"p999_us":\([0-9]*\).*/\1 \2 \3/' "$OUT" |
+awk -v urbs=$URBS -v stall=$STALL -v drop=$UDPDROP '
+	$1 != urbs { printf "FAIL %d of %d interrupt URBs\n", $1, urbs; exit 1 }
+	$2 != 0 { printf "FAIL %d interrupt URBs failed\n", $2; exit 1 }
+	drop == 0 && $3 >= stall * 1000 { printf "FAIL p99.9 %d us, TCP stalls %d ms\n", $3, stall; exit 1 }
+	{ printf "ok   p99.9 %d us with TCP stalling %d ms, %d%% of datagrams lost\n", $3, stall, drop }
+'
@@ -0,0 +1,55 @@
+/*
+ * LD_PRELOAD library dropping datagrams, for testing the datagram channel.
+ *
+ *   UDPDROP=10 LD_PRELOAD=build-host/host/libudpdrop.so usbip_server ...
+ *
+ * UDPDROP percent of what the process sends on UDP sockets is reported as
+ * sent but never leaves, as if lost on the radio. TCP is left alone.
+ */
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+static int udpdrop_percent = -1;
+
+static int udpdrop(int fd)
+{
+	int type = 0;
+	socklen_t len = sizeof(type);
+
+	if (udpdrop_percent < 0) {
+		const char *env = getenv("UDPDROP");
+
+		udpdrop_percent = env ? atoi(env) : 0;
+	}
+	if (!udpdrop_percent)
+		return 0;
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 ||
+	    type != SOCK_DGRAM)
+		return 0;
+	return rand() % 100 < udpdrop_percent;
+}
+
+ssize_t sendto(int fd, const void *buf, size_t n, int flags,
+	       const struct sockaddr *addr, socklen_t addrlen)
+{
+	static ssize_t (*real)(int, const void *, size_t, int,
+			       const struct sockaddr *, socklen_t);
+
+	if (!real)
+		real = dlsym(RTLD_NEXT, "sendto");
+	if (udpdrop(fd))
+		return n;
+	return real(fd, buf, n, flags, addr, addrlen);
+}
+
+ssize_t send(int fd, const void *buf, size_t n, int flags)
+{
+	static ssize_t (*real)(int, const void *, size_t, int);
+
+	if (!real)
+		real = dlsym(RTLD_NEXT, "send");
+	if (udpdrop(fd))
+		return n;
+	return real(fd, buf, n, flags);
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+# URB path tests (urb_tests.py) against the emulated devices of usbip_server.
+#
+#   urb_suite.sh [build dir] [test...]
+#
+# Starts usbip_server with the device each test needs and runs the test
+# straight against it, then again through usbip_shim, which asks for
+# compression, interrupt URBs over UDP and resumable sessions. Fails when
+# any run fails. The server listens on URB_PORT (default 3240), the shim
+# on the port after it. Build with -DCONFIG_USBIP_BULK_READAHEAD_ALL=1 or
+# -DCONFIG_USBIP_INT_PREFETCH_ALL=1 in CMAKE_C_FLAGS to test those paths.
+set -e
+
+BUILD=${1:-build-host}
+[ $# -gt 0 ] && shift
+PORT=${URB_PORT:-3240}
+SHIM_PORT=$((PORT + 1))
+HOST_DIR=$(dirname "$0")
+TESTS=${*:-msc split unlink split_unlink hid zrand loop alt}
+SERVER_PID=
+SHIM_PID=
+FAILED=0
+
+stop() {
+	for pid in $SHIM_PID $SERVER_PID; do
+		kill "$pid" 2>/dev/null && wait "$pid" 2>/dev/null || true
+	done
+	SERVER_PID=
+	SHIM_PID=
+}
+trap stop EXIT
+
+for t in $TESTS; do
+	device=$(cd "$HOST_DIR" && python3 -c "import urb_tests; print(urb_tests.TESTS['$t'])")
+	"$BUILD/host/usbip_server" -q -p "$PORT" -d "$device" &
+	SERVER_PID=$!
+	"$BUILD/host/usbip_shim" -p "$PORT" -l "$SHIM_PORT" >/dev/null 2>&1 &
+	SHIM_PID=$!
+	sleep 0.5
+
+	for port in $PORT $SHIM_PORT; do
+		echo "== $t on $device, port $port"
+		python3 "$HOST_DIR/urb_tests.py" -p "$port" "$t" || FAILED=1
+	done
+	stop
+done
+
+exit $FAILED
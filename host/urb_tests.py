@@ -0,0 +1,267 @@
+#!/usr/bin/env python3
+"""URB path tests against the emulated devices of usbip_server.
+
+    urb_tests.py [-H host] [-p port] [-b busid] test...
+
+Each test imports one device, drives its endpoints with raw CMD_SUBMITs
+and CMD_UNLINKs and checks every reply. The device a test expects is given
+in TESTS; urb_suite.sh starts the server with it. Exits non-zero when a
+check fails.
+"""
+import argparse
+import os
+import struct
+import sys
+import time
+
+from usbip_client import (Device, DIR_IN, DIR_OUT, ECONNRESET, EPIPE,
+                          RET_SUBMIT, RET_UNLINK)
+
+
+def check(cond, what):
+    if not cond:
+        raise AssertionError(what)
+
+
+def cbw(tag, length, direction, cb):
+    """Mass storage command block wrapper."""
+    flags = 0x80 if direction == DIR_IN else 0
+    return struct.pack('<IIIBBB', 0x43425355, tag, length, flags, 0,
+                       len(cb)) + cb.ljust(16, b'\0')
+
+
+def scsi(dev, tag, cb, direction=DIR_IN, length=0, data=b'', urb_len=None):
+    """One bulk-only transport command: CBW, data stage, CSW."""
+    dev.submit(1, DIR_OUT, 31, cbw(tag, length, direction, cb))
+    if length:
+        dev.submit(1, direction, urb_len or length, data)
+    dev.submit(1, DIR_IN, 13)
+    replies = dev.replies(3 if length else 2)
+    for r in replies:
+        check(r.status == 0, 'tag %d: %r' % (tag, r))
+    csw = replies[-1].data
+    check(len(csw) == 13 and csw[:4] == b'USBS', 'tag %d: CSW %r' % (tag, csw))
+    tag_back, residue, status = struct.unpack('<IIB', csw[4:13])
+    check(tag_back == tag, 'tag %d: CSW of tag %d' % (tag, tag_back))
+    return replies[1].data if length else b'', residue, status
+
+
+def rw10(op, lba, blocks):
+    return bytes([op, 0]) + struct.pack('>IBHB', lba, 0, blocks, 0)
+
+
+def test_msc(dev):
+    data, _, status = scsi(dev, 1, bytes([0x12, 0, 0, 0, 36, 0]), length=36)
+    check(status == 0 and len(data) == 36, 'INQUIRY')
+    data, _, status = scsi(dev, 2, bytes([0x25] + [0] * 9), length=8)
+    check(status == 0 and len(data) == 8, 'READ CAPACITY')
+    last, block = struct.unpack('>II', data)
+    check(block == 512 and last > 8, 'capacity %d x %d' % (last + 1, block))
+
+    blob = bytes(range(256)) * 4
+    _, _, status = scsi(dev, 3, rw10(0x2a, 4, 2), DIR_OUT, 1024, blob)
+    check(status == 0, 'WRITE(10)')
+    data, _, status = scsi(dev, 4, rw10(0x28, 5, 1), length=512)
+    check(status == 0 and data == blob[512:], 'READ(10) of what was written')
+
+    # an unknown command fails in the CSW, the data stage comes back empty
+    data, residue, status = scsi(dev, 5, bytes([0x99]), length=18)
+    check(status == 1 and residue == 18, 'unknown command: status %d, '
+          'residue %d' % (status, residue))
+
+
+def test_split(dev):
+    """URBs larger than a pooled transfer, in both directions."""
+    n = 48 * 1024
+    blob = os.urandom(n)
+    _, _, status = scsi(dev, 1, rw10(0x2a, 8, n // 512), DIR_OUT, n, blob)
+    check(status == 0, 'WRITE(10) of %d bytes' % n)
+    data, _, status = scsi(dev, 2, rw10(0x28, 8, n // 512), length=n)
+    check(status == 0 and data == blob, 'READ(10) of %d bytes' % n)
+
+    # a short answer into a split URB ends it, the CSW after it survives
+    data, _, status = scsi(dev, 3, bytes([0x12, 0, 0, 0, 36, 0]), length=36,
+                           urb_len=20000)
+    check(status == 0 and len(data) == 36, 'INQUIRY into 20000 bytes')
+
+
+def test_unlink(dev):
+    """Unlinks of queued and of submitted URBs (cdc, 0x83 never completes)."""
+    ins = [dev.submit(3, DIR_IN, 16) for _ in range(6)]
+
+    # the last ones wait in the queue behind the endpoint's depth
+    u = dev.unlink(ins[5])
+    r = dev.reply()
+    check(r.cmd == RET_UNLINK and r.seqnum == u and r.status == -ECONNRESET,
+          'unlink of a queued URB: %r' % r)
+
+    # one on the bus: the endpoint is flushed, its neighbours end too;
+    # with read-ahead it waits for data in the stub and goes alone
+    u = dev.unlink(ins[0])
+    r = dev.reply()
+    check(r.cmd == RET_UNLINK and r.seqnum == u and r.status == -ECONNRESET,
+          'unlink of the first URB: %r' % r)
+    got = dev.drain()
+    check(all(r.cmd == RET_SUBMIT and r.seqnum in ins[1:5] and
+              r.status == -ECONNRESET for r in got), 'flushed with it: %r' % got)
+
+    # an unlink coming too late finds nothing
+    o = dev.submit(2, DIR_OUT, 4, b'abcd')
+    r = dev.reply()
+    check(r.seqnum == o and r.status == 0, 'OUT: %r' % r)
+    u = dev.unlink(o)
+    r = dev.reply()
+    check(r.cmd == RET_UNLINK and r.seqnum == u and r.status == 0,
+          'late unlink: %r' % r)
+
+    # the echo endpoint still works
+    i = dev.submit(2, DIR_IN, 64)
+    r = dev.reply()
+    check(r.seqnum == i and r.status == 0 and r.data == b'abcd',
+          'echo: %r' % r)
+
+
+def test_split_unlink(dev):
+    """Unlinks of split IN URBs that the loopback has no data for."""
+    a = dev.submit(1, DIR_IN, 40000)
+    b = dev.submit(1, DIR_IN, 40000)
+    time.sleep(0.2)
+    ua = dev.unlink(a, 1)
+    ub = dev.unlink(b, 1)
+    got = dev.replies(2)
+    check(sorted(r.seqnum for r in got) == [ua, ub] and
+          all(r.cmd == RET_UNLINK and r.status == -ECONNRESET for r in got),
+          'unlinks: %r' % got)
+
+    # the endpoint still works
+    blob = bytes(range(250)) * 80
+    dev.submit(1, DIR_OUT, len(blob), blob)
+    r = dev.reply()
+    check(r.status == 0, 'OUT after the unlinks: %r' % r)
+    dev.submit(1, DIR_IN, 65536)
+    r = dev.reply()
+    check(r.status == 0 and r.data == blob, 'IN after the unlinks: %r' % r)
+
+
+def test_hid(dev):
+    """Interrupt IN reports at the device's interval, 1 ms by default."""
+    for _ in range(4):
+        dev.submit(1, DIR_IN, 16)
+    start = time.time()
+    for _ in range(200):
+        r = dev.reply()
+        check(r.status == 0 and r.data, 'report: %r' % r)
+        dev.submit(1, DIR_IN, 16)
+    rate = 200 / (time.time() - start)
+    check(rate > 500, '%.0f reports/s' % rate)
+
+
+def test_zrand(dev):
+    """Zero-filled and random payloads through the loopback."""
+    for i in range(50):
+        n = [300, 1000, 4096, 8192, 100, 5000][i % 6]
+        data = os.urandom(n) if i % 2 else bytes([i]) * n
+        dev.submit(1, DIR_OUT, n, data)
+        dev.submit(1, DIR_IN, n)
+        out, back = dev.replies(2)
+        check(out.status == 0 and back.status == 0 and back.data == data,
+              'payload %d of %d bytes: %r %r' % (i, n, out, back))
+
+
+def control(dev, request_type, request, value, index, length):
+    setup = struct.pack('<BBHHH', request_type, request, value, index, length)
+    direction = DIR_IN if request_type & 0x80 else DIR_OUT
+    dev.submit(0, direction, length, setup=setup)
+    return dev.reply()
+
+
+def test_loop(dev):
+    r = control(dev, 0x80, 6, 0x100, 0, 18)
+    check(r.status == 0 and len(r.data) == 18 and r.data[1] == 1,
+          'device descriptor: %r' % r)
+    r = control(dev, 0x80, 6, 0x302, 0x409, 255)
+    check(r.status == 0 and r.data[1] == 3, 'product string: %r' % r)
+    r = control(dev, 0, 9, 1, 0, 0)
+    check(r.status == 0, 'SET_CONFIGURATION: %r' % r)
+
+    # an IN waiting for data is answered by the OUT after it, short
+    i = dev.submit(1, DIR_IN, 512)
+    o = dev.submit(1, DIR_OUT, 1000, bytes(range(250)) * 4)
+    got = {r.seqnum: r for r in dev.replies(2)}
+    check(got[o].status == 0 and got[i].status == 0 and
+          got[i].data == bytes(range(250)) * 2 + bytes(range(12)),
+          'loop: %r' % got)
+    i = dev.submit(1, DIR_IN, 1000)
+    r = dev.reply()
+    check(r.status == 0 and len(r.data) == 488, 'rest of the loop: %r' % r)
+
+    start = time.time()
+    for _ in range(2000):
+        dev.submit(1, DIR_OUT, 16384, b'x' * 16384)
+        dev.submit(1, DIR_IN, 16384)
+        for r in dev.replies(2):
+            check(r.status == 0, 'bulk: %r' % r)
+    print('  %.0f MB/s' % (2000 * 16384 / (time.time() - start) / 1e6))
+
+
+def test_alt(dev):
+    """The bulk endpoints of setting 0 are gone while setting 1 is active."""
+    i = dev.submit(1, DIR_IN, 512)
+    time.sleep(0.1)
+    dev.submit(0, DIR_OUT, 0, setup=struct.pack('<BBHHH', 1, 11, 1, 0, 0))
+    got = {r.seqnum: r for r in dev.replies(2)}
+    check(got[i].status in (-ECONNRESET, -EPIPE) and not got[i].data,
+          'IN waiting across SET_INTERFACE: %r' % got[i])
+    check(all(r.status == 0 for s, r in got.items() if s != i),
+          'SET_INTERFACE 1: %r' % got)
+
+    for direction in (DIR_OUT, DIR_IN):
+        dev.submit(1, direction, 4, b'abcd')
+        r = dev.reply()
+        check(r.status == -EPIPE, 'URB to a removed endpoint: %r' % r)
+
+    r = control(dev, 1, 11, 0, 0, 0)
+    check(r.status == 0, 'SET_INTERFACE 0: %r' % r)
+    dev.submit(1, DIR_OUT, 4, b'abcd')
+    dev.submit(1, DIR_IN, 64)
+    out, back = dev.replies(2)
+    check(out.status == 0 and back.data == b'abcd', 'loop: %r %r' % (out, back))
+
+
+# test: the emulated device it runs against
+TESTS = {
+    'msc': 'msc',
+    'split': 'msc',
+    'unlink': 'cdc',
+    'split_unlink': 'loopback',
+    'hid': 'hid',
+    'zrand': 'loopback',
+    'loop': 'loopback',
+    'alt': 'loopback',
+}
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    ap.add_argument('-H', '--host', default='127.0.0.1')
+    ap.add_argument('-p', '--port', type=int, default=3240)
+    ap.add_argument('-b', '--busid', default='2-1')
+    ap.add_argument('tests', nargs='+', choices=sorted(TESTS))
+    args = ap.parse_args()
+
+    failed = 0
+    for name in args.tests:
+        dev = Device(args.busid, args.host, args.port)
+        try:
+            globals()['test_' + name](dev)
+            print('ok   %s' % name)
+        except (AssertionError, EOFError, OSError) as e:
+            print('FAIL %s: %s' % (name, e))
+            failed += 1
+        finally:
+            dev.close()
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,161 @@
+#pragma once
+/*
+ * The subset of the ESP-IDF USB host types (usb/usb_types_ch9.h and
+ * usb/usb_host.h) the USB/IP core uses, laid out the same way so the core
+ * builds unchanged on the host.
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+/* ---------------------------------------------------------------------- */
+/* Chapter 9 */
+
+typedef union {
+	struct {
+		uint8_t bmRequestType;
+		uint8_t bRequest;
+		uint16_t wValue;
+		uint16_t wIndex;
+		uint16_t wLength;
+	} __attribute__((packed));
+	uint32_t val[2];
+} usb_setup_packet_t;
+
+#define USB_BM_REQUEST_TYPE_DIR_IN		(1 << 7)
+#define USB_BM_REQUEST_TYPE_TYPE_MASK		(3 << 5)
+#define USB_BM_REQUEST_TYPE_TYPE_STANDARD	(0 << 5)
+#define USB_BM_REQUEST_TYPE_TYPE_CLASS		(1 << 5)
+#define USB_BM_REQUEST_TYPE_RECIP_MASK		0x1f
+#define USB_BM_REQUEST_TYPE_RECIP_DEVICE	0x00
+#define USB_BM_REQUEST_TYPE_RECIP_INTERFACE	0x01
+#define USB_BM_REQUEST_TYPE_RECIP_ENDPOINT	0x02
+
+#define USB_B_REQUEST_GET_STATUS		0x00
+#define USB_B_REQUEST_CLEAR_FEATURE		0x01
+#define USB_B_REQUEST_SET_FEATURE		0x03
+#define USB_B_REQUEST_SET_ADDRESS		0x05
+#define USB_B_REQUEST_GET_DESCRIPTOR		0x06
+#define USB_B_REQUEST_SET_DESCRIPTOR		0x07
+#define USB_B_REQUEST_GET_CONFIGURATION		0x08
+#define USB_B_REQUEST_SET_CONFIGURATION		0x09
+#define USB_B_REQUEST_GET_INTERFACE		0x0A
+#define USB_B_REQUEST_SET_INTERFACE		0x0B
+
+#define USB_B_DESCRIPTOR_TYPE_DEVICE		0x01
+#define USB_B_DESCRIPTOR_TYPE_CONFIGURATION	0x02
+#define USB_B_DESCRIPTOR_TYPE_STRING		0x03
+#define USB_B_DESCRIPTOR_TYPE_INTERFACE		0x04
+#define USB_B_DESCRIPTOR_TYPE_ENDPOINT		0x05
+
+#define USB_DEVICE_DESC_SIZE	18
+#define USB_CONFIG_DESC_SIZE	9
+#define USB_INTF_DESC_SIZE	9
+#define USB_EP_DESC_SIZE	7
+
+typedef union {
+	struct {
+		uint8_t bLength;
+		uint8_t bDescriptorType;
+		uint16_t bcdUSB;
+		uint8_t bDeviceClass;
+		uint8_t bDeviceSubClass;
+		uint8_t bDeviceProtocol;
+		uint8_t bMaxPacketSize0;
+		uint16_t idVendor;
+		uint16_t idProduct;
+		uint16_t bcdDevice;
+		uint8_t iManufacturer;
+		uint8_t iProduct;
+		uint8_t iSerialNumber;
+		uint8_t bNumConfigurations;
+	} __attribute__((packed));
+	uint8_t val[USB_DEVICE_DESC_SIZE];
+} usb_device_desc_t;
+
+typedef union {
+	struct {
+		uint8_t bLength;
+		uint8_t bDescriptorType;
+		uint16_t wTotalLength;
+		uint8_t bNumInterfaces;
+		uint8_t bConfigurationValue;
+		uint8_t iConfiguration;
+		uint8_t bmAttributes;
+		uint8_t bMaxPower;
+	} __attribute__((packed));
+	uint8_t val[USB_CONFIG_DESC_SIZE];
+} usb_config_desc_t;
+
+typedef union {
+	struct {
+		uint8_t bLength;
+		uint8_t bDescriptorType;
+		uint8_t bInterfaceNumber;
+		uint8_t bAlternateSetting;
+		uint8_t bNumEndpoints;
+		uint8_t bInterfaceClass;
+		uint8_t bInterfaceSubClass;
+		uint8_t bInterfaceProtocol;
+		uint8_t iInterface;
+	} __attribute__((packed));
+	uint8_t val[USB_INTF_DESC_SIZE];
+} usb_intf_desc_t;
+
+#define USB_BM_ATTRIBUTES_XFERTYPE_MASK		0x03
+#define USB_BM_ATTRIBUTES_XFER_CONTROL		(0 << 0)
+#define USB_BM_ATTRIBUTES_XFER_ISOC		(1 << 0)
+#define USB_BM_ATTRIBUTES_XFER_BULK		(2 << 0)
+#define USB_BM_ATTRIBUTES_XFER_INT		(3 << 0)
+
+typedef union {
+	struct {
+		uint8_t bLength;
+		uint8_t bDescriptorType;
+		uint8_t bEndpointAddress;
+		uint8_t bmAttributes;
+		uint16_t wMaxPacketSize;
+		uint8_t bInterval;
+	} __attribute__((packed));
+	uint8_t val[USB_EP_DESC_SIZE];
+} usb_ep_desc_t;
+
+/* ---------------------------------------------------------------------- */
+/* Transfers */
+
+typedef enum {
+	USB_TRANSFER_STATUS_COMPLETED,
+	USB_TRANSFER_STATUS_ERROR,
+	USB_TRANSFER_STATUS_TIMED_OUT,
+	USB_TRANSFER_STATUS_CANCELED,
+	USB_TRANSFER_STATUS_STALL,
+	USB_TRANSFER_STATUS_OVERFLOW,
+	USB_TRANSFER_STATUS_SKIPPED,
+	USB_TRANSFER_STATUS_NO_DEVICE,
+} usb_transfer_status_t;
+
+typedef struct {
+	int num_bytes;
+	int actual_num_bytes;
+	usb_transfer_status_t status;
+} usb_isoc_packet_desc_t;
+
+typedef struct usb_transfer_s usb_transfer_t;
+typedef void (*usb_transfer_cb_t)(usb_transfer_t *transfer);
+
+#define USB_TRANSFER_FLAG_ZERO_PACK	0x01
+
+struct usb_transfer_s {
+	uint8_t *const data_buffer;
+	const size_t data_buffer_size;
+	int num_bytes;
+	int actual_num_bytes;
+	uint32_t flags;
+	void *device_handle;
+	uint8_t bEndpointAddress;
+	usb_transfer_status_t status;
+	uint32_t timeout_ms;
+	usb_transfer_cb_t callback;
+	void *context;
+	const int num_isoc_packets;
+	usb_isoc_packet_desc_t isoc_packet_desc[];
+};
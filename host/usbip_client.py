@@ -0,0 +1,104 @@
+"""Minimal USB/IP client for the URB tests (urb_tests.py).
+
+Imports one device and speaks CMD_SUBMIT/CMD_UNLINK on it directly, with
+no kernel in between, so every reply can be checked as it arrives.
+"""
+import socket
+import struct
+
+USBIP_VERSION = 0x0111
+OP_REQ_IMPORT = 0x8003
+CMD_SUBMIT, CMD_UNLINK, RET_SUBMIT, RET_UNLINK = 1, 2, 3, 4
+DIR_OUT, DIR_IN = 0, 1
+ECONNRESET = 104
+EPIPE = 32
+
+
+def recvall(sock, n):
+    buf = b''
+    while len(buf) < n:
+        chunk = sock.recv(n - len(buf))
+        if not chunk:
+            raise EOFError('connection closed')
+        buf += chunk
+    return buf
+
+
+class Reply:
+    """A RET_SUBMIT or RET_UNLINK."""
+
+    def __init__(self, cmd, seqnum, status, data=b''):
+        self.cmd = cmd
+        self.seqnum = seqnum
+        self.status = status
+        self.data = data
+
+    def __repr__(self):
+        kind = 'RET_SUBMIT' if self.cmd == RET_SUBMIT else 'RET_UNLINK'
+        return '%s(seq %d, status %d, %d bytes)' % (
+            kind, self.seqnum, self.status, len(self.data))
+
+
+class Device:
+    def __init__(self, busid, host='127.0.0.1', port=3240, timeout=10):
+        self.sock = socket.create_connection((host, port), timeout=timeout)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        self.sock.sendall(struct.pack('>HHI', USBIP_VERSION, OP_REQ_IMPORT, 0) +
+                          busid.encode().ljust(32, b'\0'))
+        _, _, status = struct.unpack('>HHI', recvall(self.sock, 8))
+        if status:
+            raise RuntimeError('import of %s refused: %d' % (busid, status))
+        udev = recvall(self.sock, 312)
+        busnum, devnum = struct.unpack('>II', udev[288:296])
+        self.devid = busnum << 16 | devnum
+        self.seqnum = 0
+        self.dirs = {}
+
+    def close(self):
+        self.sock.close()
+
+    def submit(self, ep, direction, length, data=b'', setup=b'\0' * 8):
+        """Queue a CMD_SUBMIT, returns its seqnum."""
+        self.seqnum += 1
+        hdr = struct.pack('>IIIII', CMD_SUBMIT, self.seqnum, self.devid,
+                          direction, ep)
+        hdr += struct.pack('>IiiII', 0, length, 0, 0, 0) + setup
+        self.sock.sendall(hdr + (data if direction == DIR_OUT else b''))
+        self.dirs[self.seqnum] = direction
+        return self.seqnum
+
+    def unlink(self, seqnum, ep=0):
+        """Queue a CMD_UNLINK of an earlier submit, returns its seqnum."""
+        self.seqnum += 1
+        hdr = struct.pack('>IIIII', CMD_UNLINK, self.seqnum, self.devid,
+                          DIR_OUT, ep)
+        self.sock.sendall(hdr + struct.pack('>I', seqnum) + b'\0' * 24)
+        self.dirs[self.seqnum] = None
+        return self.seqnum
+
+    def reply(self):
+        hdr = recvall(self.sock, 48)
+        cmd, seqnum = struct.unpack('>II', hdr[:8])
+        status, actual = struct.unpack('>ii', hdr[20:28])
+        direction = self.dirs.pop(seqnum)
+        data = b''
+        if cmd == RET_SUBMIT and direction == DIR_IN and actual > 0:
+            data = recvall(self.sock, actual)
+        return Reply(cmd, seqnum, status, data)
+
+    def replies(self, n):
+        return [self.reply() for _ in range(n)]
+
+    def drain(self, wait=0.2):
+        """Replies arriving within wait seconds of each other."""
+        got = []
+        timeout = self.sock.gettimeout()
+        self.sock.settimeout(wait)
+        try:
+            while True:
+                got.append(self.reply())
+        except socket.timeout:
+            pass
+        finally:
+            self.sock.settimeout(timeout)
+        return got
@@ -0,0 +1,44 @@
+#pragma once
+/* Linux/POSIX port of the USB/IP core, see usbip_port.h */
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/select.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "sdkconfig.h"
+#include "usb_host_compat.h"
+
+#ifndef __packed
+#define __packed __attribute__((packed))
+#endif
+
+typedef struct usbip_mutex *usbip_mutex_t;
+typedef struct usbip_sem *usbip_sem_t;
+typedef struct usbip_queue *usbip_queue_t;
+
+#define USBIP_LOG_NONE		0
+#define USBIP_LOG_ERROR		1
+#define USBIP_LOG_WARN		2
+#define USBIP_LOG_INFO		3
+#define USBIP_LOG_DEBUG		4
+
+/* same meaning as in ESP-IDF: the most verbose level compiled in */
+#ifndef LOG_LOCAL_LEVEL
+#define LOG_LOCAL_LEVEL		CONFIG_LOG_MAXIMUM_LEVEL
+#endif
+
+extern int usbip_log_level;
+
+void usbip_log_write(int level, const char *tag, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+#define USBIP_PORT_LOG(level, tag, ...) do {				\
+		if (LOG_LOCAL_LEVEL >= (level) && usbip_log_level >= (level))	\
+			usbip_log_write(level, tag, __VA_ARGS__);		\
+	} while (0)
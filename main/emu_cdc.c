@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "emu_device.h"
+
+#define CDC_REQ_SET_LINE_CODING		0x20
+#define CDC_REQ_GET_LINE_CODING		0x21
+#define CDC_REQ_SET_CONTROL_LINE_STATE	0x22
+#define CDC_REQ_SEND_BREAK		0x23
+
+#define EMU_CDC_MPS		512
+
+struct emu_cdc {
+	struct emu_device dev;
+	struct emu_ring ring;
+	uint8_t line_coding[7];
+	uint16_t line_state;
+};
+
+static const uint8_t device_desc[] = {
+	18, USB_B_DESCRIPTOR_TYPE_DEVICE,
+	0x00, 0x02,		/* bcdUSB 2.00 */
+	0x02, 0x00, 0x00,	/* communications device */
+	64,			/* bMaxPacketSize0 */
+	0x09, 0x12,		/* idVendor 0x1209 (pid.codes) */
+	0x03, 0x00,		/* idProduct 0x0003 (test PID) */
+	0x00, 0x01,		/* bcdDevice 1.00 */
+	1, 2, 3,		/* iManufacturer, iProduct, iSerialNumber */
+	1,			/* bNumConfigurations */
+};
+
+static const uint8_t config_desc[] = {
+	9, USB_B_DESCRIPTOR_TYPE_CONFIGURATION,
+	67, 0,			/* wTotalLength */
+	2, 1, 0,		/* bNumInterfaces, bConfigurationValue, iConfiguration */
+	0x80, 50,		/* bus powered, 100 mA */
+
+	/* communication interface: ACM, AT commands */
+	9, USB_B_DESCRIPTOR_TYPE_INTERFACE,
+	0, 0, 1,
+	0x02, 0x02, 0x01, 0,
+
+	5, 0x24, 0x00, 0x10, 0x01,	/* header, CDC 1.10 */
+	5, 0x24, 0x01, 0x00, 1,		/* call management, data interface 1 */
+	4, 0x24, 0x02, 0x02,		/* ACM: line coding and serial state */
+	5, 0x24, 0x06, 0, 1,		/* union: master 0, slave 1 */
+
+	7, USB_B_DESCRIPTOR_TYPE_ENDPOINT,
+	0x83, USB_BM_ATTRIBUTES_XFER_INT,
+	16, 0,
+	8,			/* bInterval: 2^(8-1) microframes = 16 ms */
+
+	/* data interface */
+	9, USB_B_DESCRIPTOR_TYPE_INTERFACE,
+	1, 0, 2,
+	0x0a, 0x00, 0x00, 0,
+
+	7, USB_B_DESCRIPTOR_TYPE_ENDPOINT,
+	0x02, USB_BM_ATTRIBUTES_XFER_BULK,
+	EMU_CDC_MPS & 0xff, EMU_CDC_MPS >> 8, 0,
+
+	7, USB_B_DESCRIPTOR_TYPE_ENDPOINT,
+	0x82, USB_BM_ATTRIBUTES_XFER_BULK,
+	EMU_CDC_MPS & 0xff, EMU_CDC_MPS >> 8, 0,
+};
+
+static const char *const strings[] = {
+	"esp32_usbip",
+	"Emulated CDC-ACM",
+	"0003",
+};
+
+static int emu_cdc_control(struct emu_device *dev, const usb_setup_packet_t *setup,
+			   uint8_t *data, int *len)
+{
+	struct emu_cdc *cdc = dev->priv;
+
+	if ((setup->bmRequestType & USB_BM_REQUEST_TYPE_TYPE_MASK) !=
+	    USB_BM_REQUEST_TYPE_TYPE_CLASS)
+		return EMU_UNHANDLED;
+
+	switch (setup->bRequest) {
+	case CDC_REQ_SET_LINE_CODING:
+		if (*len > sizeof(cdc->line_coding))
+			*len = sizeof(cdc->line_coding);
+		memcpy(cdc->line_coding, data, *len);
+		return 0;
+	case CDC_REQ_GET_LINE_CODING:
+		if (*len > sizeof(cdc->line_coding))
+			*len = sizeof(cdc->line_coding);
+		memcpy(data, cdc->line_coding, *len);
+		return 0;
+	case CDC_REQ_SET_CONTROL_LINE_STATE:
+		cdc->line_state = setup->wValue;
+		*len = 0;
+		return 0;
+	case CDC_REQ_SEND_BREAK:
+		*len = 0;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static int emu_cdc_transfer(struct emu_device *dev, usb_transfer_t *transfer)
+{
+	struct emu_cdc *cdc = dev->priv;
+	size_t len = transfer->num_bytes;
+
+	switch (transfer->bEndpointAddress) {
+	case 0x83:
+		/* no serial state notifications, the host keeps polling */
+		return EMU_AGAIN;
+	case 0x02:
+		if (cdc->ring.size - cdc->ring.count < len && cdc->ring.count)
+			return EMU_AGAIN;
+		emu_ring_write(&cdc->ring, transfer->data_buffer, len);
+		break;
+	case 0x82:
+		if (!cdc->ring.count)
+			return EMU_AGAIN;
+		len = emu_ring_read(&cdc->ring, transfer->data_buffer, len);
+		break;
+	default:
+		transfer->status = USB_TRANSFER_STATUS_STALL;
+		return 0;
+	}
+
+	transfer->actual_num_bytes = len;
+	transfer->status = USB_TRANSFER_STATUS_COMPLETED;
+	return 0;
+}
+
+static const struct emu_class emu_cdc_class = {
+	.name		= "cdc-acm",
+	.device_desc	= device_desc,
+	.config_desc	= config_desc,
+	.strings	= strings,
+	.num_strings	= 3,
+	.control	= emu_cdc_control,
+	.transfer	= emu_cdc_transfer,
+};
+
+int emu_cdc_create(const char *busid, const struct emu_cdc_config *cfg)
+{
+	/* 115200 8N1 */
+	static const uint8_t line_coding[7] = { 0x00, 0xc2, 0x01, 0x00, 0, 0, 8 };
+	struct emu_cdc *cdc = calloc(1, sizeof(*cdc));
+
+	if (!cdc)
+		return -1;
+
+	cdc->dev.cls = &emu_cdc_class;
+	cdc->dev.priv = cdc;
+	cdc->dev.latency_us = cfg->latency_us;
+	cdc->dev.bandwidth = cfg->bandwidth;
+	memcpy(cdc->line_coding, line_coding, sizeof(line_coding));
+	if (emu_ring_init(&cdc->ring, cfg->buffer_size ? cfg->buffer_size : 16 * 1024) < 0) {
+		free(cdc);
+		return -1;
+	}
+
+	return emu_device_register(&cdc->dev, busid);
+}
@@ -0,0 +1,497 @@
+#define LOG_LOCAL_LEVEL	CONFIG_USBIP_LOG_LEVEL_EMU
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emu_device.h"
+
+#define err(...)    USBIP_LOGE(TAG, __VA_ARGS__)
+#define info(...)   USBIP_LOGI(TAG, __VA_ARGS__)
+#define dbg(...)    USBIP_LOGD(TAG, __VA_ARGS__)
+
+static const char *TAG = "emu";
+
+/* ---------------------------------------------------------------------- */
+/* Byte ring used by the classes to stage data between endpoints */
+
+int emu_ring_init(struct emu_ring *ring, size_t size)
+{
+	ring->buf = malloc(size);
+	ring->size = size;
+	ring->head = 0;
+	ring->count = 0;
+	return ring->buf ? 0 : -1;
+}
+
+size_t emu_ring_write(struct emu_ring *ring, const uint8_t *data, size_t len)
+{
+	size_t n = 0;
+
+	while (n < len && ring->count < ring->size) {
+		size_t tail = (ring->head + ring->count) % ring->size;
+		size_t chunk = ring->size - tail;
+
+		if (chunk > ring->size - ring->count)
+			chunk = ring->size - ring->count;
+		if (chunk > len - n)
+			chunk = len - n;
+		memcpy(ring->buf + tail, data + n, chunk);
+		ring->count += chunk;
+		n += chunk;
+	}
+
+	return n;
+}
+
+size_t emu_ring_read(struct emu_ring *ring, uint8_t *data, size_t len)
+{
+	size_t n = 0;
+
+	while (n < len && ring->count) {
+		size_t chunk = ring->size - ring->head;
+
+		if (chunk > ring->count)
+			chunk = ring->count;
+		if (chunk > len - n)
+			chunk = len - n;
+		memcpy(data + n, ring->buf + ring->head, chunk);
+		ring->head = (ring->head + chunk) % ring->size;
+		ring->count -= chunk;
+		n += chunk;
+	}
+
+	return n;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Standard requests, answered from the class descriptors */
+
+static const usb_config_desc_t *emu_config_desc(struct emu_device *dev)
+{
+	return (const usb_config_desc_t *)dev->cls->config_desc;
+}
+
+static int emu_has_alt_setting(struct emu_device *dev, int intf, int alt)
+{
+	const usb_config_desc_t *config = emu_config_desc(dev);
+	const uint8_t *p = dev->cls->config_desc;
+	const uint8_t *end = p + config->wTotalLength;
+
+	for (; p + 2 <= end && p[0] >= 2; p += p[0]) {
+		if (p[1] == USB_B_DESCRIPTOR_TYPE_INTERFACE && p[2] == intf && p[3] == alt)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int emu_string_descriptor(struct emu_device *dev, int index,
+				 uint8_t *data, int *len)
+{
+	const char *s;
+	int n = 0;
+
+	if (index == 0) {
+		/* LANGID: English (United States) */
+		static const uint8_t langid[] = { 4, USB_B_DESCRIPTOR_TYPE_STRING, 0x09, 0x04 };
+
+		n = sizeof(langid) < *len ? sizeof(langid) : *len;
+		memcpy(data, langid, n);
+		*len = n;
+		return 0;
+	}
+	if (index > dev->cls->num_strings)
+		return -1;
+
+	s = dev->cls->strings[index - 1];
+	uint8_t desc[2 + 2 * 126];
+	int slen = strlen(s);
+
+	if (slen > 126)
+		slen = 126;
+	desc[0] = 2 + 2 * slen;
+	desc[1] = USB_B_DESCRIPTOR_TYPE_STRING;
+	for (int i = 0; i < slen; i++) {
+		desc[2 + 2 * i] = s[i];
+		desc[3 + 2 * i] = 0;
+	}
+
+	n = desc[0] < *len ? desc[0] : *len;
+	memcpy(data, desc, n);
+	*len = n;
+	return 0;
+}
+
+static int emu_standard_request(struct emu_device *dev,
+				const usb_setup_packet_t *setup,
+				uint8_t *data, int *len)
+{
+	int type = setup->wValue >> 8;
+	int index = setup->wValue & 0xff;
+	const uint8_t *desc = NULL;
+	int desc_len = 0;
+
+	if ((setup->bmRequestType & USB_BM_REQUEST_TYPE_TYPE_MASK) !=
+	    USB_BM_REQUEST_TYPE_TYPE_STANDARD)
+		return -1;
+
+	switch (setup->bRequest) {
+	case USB_B_REQUEST_GET_DESCRIPTOR:
+		if (type == USB_B_DESCRIPTOR_TYPE_STRING)
+			return emu_string_descriptor(dev, index, data, len);
+		if (type == USB_B_DESCRIPTOR_TYPE_DEVICE) {
+			desc = dev->cls->device_desc;
+			desc_len = USB_DEVICE_DESC_SIZE;
+		} else if (type == USB_B_DESCRIPTOR_TYPE_CONFIGURATION && index == 0) {
+			desc = dev->cls->config_desc;
+			desc_len = emu_config_desc(dev)->wTotalLength;
+		} else {
+			return -1;
+		}
+		if (desc_len > *len)
+			desc_len = *len;
+		memcpy(data, desc, desc_len);
+		*len = desc_len;
+		return 0;
+	case USB_B_REQUEST_GET_CONFIGURATION:
+		data[0] = dev->configuration;
+		*len = 1;
+		return 0;
+	case USB_B_REQUEST_SET_CONFIGURATION:
+		if (setup->wValue != 0 &&
+		    setup->wValue != emu_config_desc(dev)->bConfigurationValue)
+			return -1;
+		dev->configuration = setup->wValue;
+		*len = 0;
+		return 0;
+	case USB_B_REQUEST_GET_INTERFACE:
+		data[0] = dev->alt_setting[setup->wIndex & 0x1f];
+		*len = 1;
+		return 0;
+	case USB_B_REQUEST_SET_INTERFACE:
+		if (!emu_has_alt_setting(dev, setup->wIndex, setup->wValue))
+			return -1;
+		dev->alt_setting[setup->wIndex & 0x1f] = setup->wValue;
+		*len = 0;
+		return 0;
+	case USB_B_REQUEST_GET_STATUS:
+		data[0] = 0;
+		data[1] = 0;
+		if ((setup->bmRequestType & USB_BM_REQUEST_TYPE_RECIP_MASK) ==
+		    USB_BM_REQUEST_TYPE_RECIP_ENDPOINT)
+			data[0] = dev->eps[EMU_EP_INDEX(setup->wIndex)].halted;
+		*len = 2;
+		return 0;
+	case USB_B_REQUEST_CLEAR_FEATURE:
+	case USB_B_REQUEST_SET_FEATURE:
+	case USB_B_REQUEST_SET_ADDRESS:
+		*len = 0;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static int emu_control(struct emu_device *dev, usb_transfer_t *transfer)
+{
+	const usb_setup_packet_t *setup = (const usb_setup_packet_t *)transfer->data_buffer;
+	uint8_t *data = transfer->data_buffer + sizeof(usb_setup_packet_t);
+	int dir_in = setup->bmRequestType & USB_BM_REQUEST_TYPE_DIR_IN;
+	int len = transfer->num_bytes - sizeof(usb_setup_packet_t);
+	int ret = EMU_UNHANDLED;
+
+	if (len > setup->wLength)
+		len = setup->wLength;
+
+	if (dev->cls->control)
+		ret = dev->cls->control(dev, setup, data, &len);
+	if (ret == EMU_UNHANDLED)
+		ret = emu_standard_request(dev, setup, data, &len);
+	if (ret == EMU_AGAIN)
+		return EMU_AGAIN;
+
+	if (ret < 0) {
+		dbg("stall request %02x %02x %04x", setup->bmRequestType,
+		    setup->bRequest, setup->wValue);
+		transfer->status = USB_TRANSFER_STATUS_STALL;
+		transfer->actual_num_bytes = sizeof(usb_setup_packet_t);
+		return 0;
+	}
+
+	transfer->status = USB_TRANSFER_STATUS_COMPLETED;
+	transfer->actual_num_bytes = sizeof(usb_setup_packet_t) +
+				     (dir_in ? len : setup->wLength);
+	return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Worker: completes transfers once they are due */
+
+static int emu_process(struct emu_device *dev, usb_transfer_t *transfer)
+{
+	if ((transfer->bEndpointAddress & 0x0f) == 0)
+		return emu_control(dev, transfer);
+
+	return dev->cls->transfer(dev, transfer);
+}
+
+static void emu_worker(void *arg)
+{
+	struct emu_device *dev = arg;
+	usb_transfer_t *done[EMU_MAX_PENDING];
+
+	for (;;) {
+		int64_t now = usbip_time_us();
+		int64_t next = INT64_MAX;
+		int ndone = 0;
+
+		usbip_mutex_lock(dev->lock);
+		for (int i = 0; i < 32; i++) {
+			struct emu_endpoint *ep = &dev->eps[i];
+
+			while (ep->head) {
+				struct emu_pending *p = ep->head;
+
+				if (p->transfer->status != USB_TRANSFER_STATUS_CANCELED) {
+					if (ep->halted)
+						break;
+					if (p->due > now) {
+						if (p->due < next)
+							next = p->due;
+						break;
+					}
+					if (emu_process(dev, p->transfer) == EMU_AGAIN)
+						break;
+				}
+
+				ep->head = p->next;
+				if (!ep->head)
+					ep->tail = NULL;
+				done[ndone++] = p->transfer;
+				p->next = dev->free_list;
+				dev->free_list = p;
+			}
+		}
+		usbip_mutex_unlock(dev->lock);
+
+		for (int i = 0; i < ndone; i++)
+			done[i]->callback(done[i]);
+		if (ndone)
+			continue;
+
+		if (next == INT64_MAX)
+			usbip_sem_take(dev->wakeup);
+		else if (next > now)
+			usbip_sem_take_timeout(dev->wakeup, next - now);
+	}
+}
+
+/* ---------------------------------------------------------------------- */
+/* struct usbip_host_ops */
+
+static int emu_get_device_descriptor(void *ctx, const usb_device_desc_t **desc)
+{
+	struct emu_device *dev = ctx;
+
+	*desc = (const usb_device_desc_t *)dev->cls->device_desc;
+	return 0;
+}
+
+static int emu_get_config_descriptor(void *ctx, const usb_config_desc_t **desc)
+{
+	struct emu_device *dev = ctx;
+
+	*desc = emu_config_desc(dev);
+	return 0;
+}
+
+static int emu_get_string_descriptor(void *ctx, uint8_t index, uint16_t langid,
+				     uint8_t *data, int *len)
+{
+	struct emu_device *dev = ctx;
+
+	if (index && langid != 0x0409)
+		return -1;
+	return emu_string_descriptor(dev, index, data, len);
+}
+
+static int emu_interface_claim(void *ctx, uint8_t intf, uint8_t alt)
+{
+	struct emu_device *dev = ctx;
+
+	if (!emu_has_alt_setting(dev, intf, alt))
+		return -1;
+	dev->alt_setting[intf & 0x1f] = alt;
+	return 0;
+}
+
+static int emu_interface_release(void *ctx, uint8_t intf)
+{
+	return 0;
+}
+
+/*
+ * Isochronous packets go over the bus one per microframe, whatever else the
+ * device does, and a transfer completes after its last packet.
+ */
+#define EMU_MICROFRAME_US	125
+
+static int64_t emu_isoc_model(struct emu_endpoint *ep, usb_transfer_t *transfer,
+			      int64_t now)
+{
+	int64_t start = now > ep->isoc_until ? now : ep->isoc_until;
+
+	ep->isoc_until = start + (int64_t)transfer->num_isoc_packets * EMU_MICROFRAME_US;
+	return ep->isoc_until;
+}
+
+/* when a transfer would finish on a link with the device's latency and bandwidth */
+static int64_t emu_model(struct emu_device *dev, usb_transfer_t *transfer,
+			 int64_t now)
+{
+	int64_t start = now > dev->busy_until ? now : dev->busy_until;
+
+	if (dev->bandwidth)
+		dev->busy_until = start +
+				  (int64_t)transfer->num_bytes * 1000000 / dev->bandwidth;
+	else
+		dev->busy_until = start;
+
+	return dev->busy_until + dev->latency_us;
+}
+
+static int emu_transfer_submit(void *ctx, usb_transfer_t *transfer)
+{
+	struct emu_device *dev = ctx;
+	struct emu_endpoint *ep = &dev->eps[EMU_EP_INDEX(transfer->bEndpointAddress)];
+	int64_t now = usbip_time_us();
+	struct emu_pending *p;
+
+	usbip_mutex_lock(dev->lock);
+	p = dev->free_list;
+	if (ep->halted || !p) {
+		usbip_mutex_unlock(dev->lock);
+		return -1;
+	}
+	dev->free_list = p->next;
+
+	transfer->status = USB_TRANSFER_STATUS_COMPLETED;
+	transfer->actual_num_bytes = 0;
+	p->transfer = transfer;
+	p->next = NULL;
+	if ((transfer->bEndpointAddress & 0x0f) == 0)
+		p->due = now;
+	else if (transfer->num_isoc_packets)
+		p->due = emu_isoc_model(ep, transfer, now);
+	else if (dev->cls->schedule)
+		p->due = dev->cls->schedule(dev, transfer, now);
+	else
+		p->due = emu_model(dev, transfer, now);
+
+	if (ep->tail)
+		ep->tail->next = p;
+	else
+		ep->head = p;
+	ep->tail = p;
+	usbip_mutex_unlock(dev->lock);
+
+	usbip_sem_give(dev->wakeup);
+	return 0;
+}
+
+static int emu_endpoint_halt(void *ctx, uint8_t addr)
+{
+	struct emu_device *dev = ctx;
+
+	usbip_mutex_lock(dev->lock);
+	dev->eps[EMU_EP_INDEX(addr)].halted = 1;
+	usbip_mutex_unlock(dev->lock);
+	return 0;
+}
+
+/* Canceled transfers are given back by the worker, like the host library does. */
+static int emu_endpoint_flush(void *ctx, uint8_t addr)
+{
+	struct emu_device *dev = ctx;
+	struct emu_pending *p;
+
+	usbip_mutex_lock(dev->lock);
+	for (p = dev->eps[EMU_EP_INDEX(addr)].head; p; p = p->next) {
+		p->transfer->status = USB_TRANSFER_STATUS_CANCELED;
+		p->transfer->actual_num_bytes = 0;
+	}
+	usbip_mutex_unlock(dev->lock);
+
+	usbip_sem_give(dev->wakeup);
+	return 0;
+}
+
+static int emu_endpoint_clear(void *ctx, uint8_t addr)
+{
+	struct emu_device *dev = ctx;
+
+	usbip_mutex_lock(dev->lock);
+	dev->eps[EMU_EP_INDEX(addr)].halted = 0;
+	usbip_mutex_unlock(dev->lock);
+
+	usbip_sem_give(dev->wakeup);
+	return 0;
+}
+
+const struct usbip_host_ops emu_host_ops = {
+	.get_device_descriptor	= emu_get_device_descriptor,
+	.get_config_descriptor	= emu_get_config_descriptor,
+	.get_string_descriptor	= emu_get_string_descriptor,
+	.interface_claim	= emu_interface_claim,
+	.interface_release	= emu_interface_release,
+	.transfer_submit	= emu_transfer_submit,
+	.endpoint_halt		= emu_endpoint_halt,
+	.endpoint_flush		= emu_endpoint_flush,
+	.endpoint_clear		= emu_endpoint_clear,
+};
+
+int emu_device_register(struct emu_device *dev, const char *busid)
+{
+	const usb_device_desc_t *device_desc = (const usb_device_desc_t *)dev->cls->device_desc;
+	const usb_config_desc_t *config_desc = emu_config_desc(dev);
+	struct usbip_usb_device udev;
+	unsigned busnum = 0, devnum = 0;
+
+	dev->lock = usbip_mutex_create();
+	dev->wakeup = usbip_sem_create(1, 0);
+	if (!dev->lock || !dev->wakeup)
+		return -1;
+
+	for (int i = EMU_MAX_PENDING - 1; i >= 0; i--) {
+		dev->pending[i].next = dev->free_list;
+		dev->free_list = &dev->pending[i];
+	}
+	dev->configuration = config_desc->bConfigurationValue;
+
+	if (usbip_task_create(emu_worker, "emu", 4096, dev, 5) < 0) {
+		err("could not start worker for %s", busid);
+		return -1;
+	}
+
+	sscanf(busid, "%u-%u", &busnum, &devnum);
+
+	memset(&udev, 0, sizeof(udev));
+	snprintf(udev.path, sizeof(udev.path), "/sys/devices/emu/%s", busid);
+	snprintf(udev.busid, sizeof(udev.busid), "%s", busid);
+	udev.busnum = busnum;
+	udev.devnum = devnum;
+	udev.speed = 3;		/* USB_SPEED_HIGH */
+	udev.idVendor = device_desc->idVendor;
+	udev.idProduct = device_desc->idProduct;
+	udev.bcdDevice = device_desc->bcdDevice;
+	udev.bDeviceClass = device_desc->bDeviceClass;
+	udev.bDeviceSubClass = device_desc->bDeviceSubClass;
+	udev.bDeviceProtocol = device_desc->bDeviceProtocol;
+	udev.bConfigurationValue = config_desc->bConfigurationValue;
+	udev.bNumConfigurations = device_desc->bNumConfigurations;
+	udev.bNumInterfaces = config_desc->bNumInterfaces;
+
+	info("%s device on %s", dev->cls->name, busid);
+	return usbip_add_device(&udev, &emu_host_ops, dev);
+}
@@ -0,0 +1,140 @@
+#pragma once
+/*
+ * Emulated USB devices.
+ *
+ * An emulated device implements struct usbip_host_ops in software and is
+ * exported through usbip_add_device() like a device found by the USB host
+ * library, so the whole server can be loaded without USB hardware.
+ *
+ * The framework answers the standard control requests from the descriptors
+ * and runs a worker task that completes transfers in order per endpoint,
+ * optionally delayed by a latency/bandwidth model. The classes below only
+ * implement what happens to the data.
+ */
+#include <stdint.h>
+#include "usbip_port.h"
+#include "usbip.h"
+
+/* return value of the class handlers: not ready yet, retry later (NAK) */
+#define EMU_AGAIN		1
+/* control handler: let the framework answer the request */
+#define EMU_UNHANDLED		2
+
+#define EMU_MAX_PENDING		(CONFIG_USBIP_MAX_URBS * 2)
+#define EMU_EP_INDEX(addr)	(((addr) & 0x0f) | (((addr) & 0x80) >> 3))
+
+struct emu_device;
+
+struct emu_pending {
+	usb_transfer_t *transfer;
+	int64_t due;
+	struct emu_pending *next;
+};
+
+struct emu_endpoint {
+	struct emu_pending *head;
+	struct emu_pending *tail;
+	int halted;
+	/* isochronous: when the last packet queued goes over the bus */
+	int64_t isoc_until;
+};
+
+struct emu_class {
+	const char *name;
+	const uint8_t *device_desc;
+	const uint8_t *config_desc;
+	/* ASCII strings for string descriptor indices 1..num_strings */
+	const char *const *strings;
+	int num_strings;
+
+	/*
+	 * Class/vendor control requests, and standard ones the class wants to
+	 * see first. Returns 0 with *len set to the IN data length, -1 to
+	 * stall or EMU_UNHANDLED.
+	 */
+	int (*control)(struct emu_device *dev, const usb_setup_packet_t *setup,
+		       uint8_t *data, int *len);
+	/*
+	 * Non-control transfers. Sets actual_num_bytes and status and returns
+	 * 0, or EMU_AGAIN to keep the transfer at the head of its endpoint.
+	 */
+	int (*transfer)(struct emu_device *dev, usb_transfer_t *transfer);
+	/* optional: when a transfer may complete at the earliest */
+	int64_t (*schedule)(struct emu_device *dev, usb_transfer_t *transfer,
+			    int64_t now);
+};
+
+struct emu_device {
+	const struct emu_class *cls;
+	void *priv;
+
+	/* latency/bandwidth model applied to every non-control transfer */
+	uint32_t latency_us;
+	uint32_t bandwidth;	/* bytes per second, 0 for unlimited */
+	int64_t busy_until;
+
+	usbip_mutex_t lock;
+	usbip_sem_t wakeup;
+	struct emu_endpoint eps[32];
+	struct emu_pending *free_list;
+	struct emu_pending pending[EMU_MAX_PENDING];
+	uint8_t configuration;
+	uint8_t alt_setting[32];
+};
+
+extern const struct usbip_host_ops emu_host_ops;
+
+/* Start the worker of a device and export it under busid. */
+int emu_device_register(struct emu_device *dev, const char *busid);
+
+/* ---------------------------------------------------------------------- */
+/* Device classes */
+
+/*
+ * Vendor specific bulk device. In loopback mode data written to EP 1 OUT is
+ * read back from EP 1 IN, otherwise OUT data is discarded and IN returns a
+ * pattern (gadget zero style source/sink). Alternate setting 1 adds
+ * isochronous EP 2 OUT and IN, a sink and a pattern source in both modes.
+ */
+struct emu_loopback_config {
+	int loopback;
+	uint32_t latency_us;
+	uint32_t bandwidth;
+	size_t buffer_size;
+};
+
+/* HID device with one vendor-defined input report, sent at a fixed rate */
+struct emu_hid_config {
+	uint32_t report_interval_us;
+};
+
+/* CDC-ACM serial port that echoes everything written to it */
+struct emu_cdc_config {
+	uint32_t latency_us;
+	uint32_t bandwidth;
+	size_t buffer_size;
+};
+
+/* Bulk-only mass storage with a RAM disk */
+struct emu_msc_config {
+	uint32_t latency_us;
+	uint32_t bandwidth;
+	size_t disk_size;
+};
+
+int emu_loopback_create(const char *busid, const struct emu_loopback_config *cfg);
+int emu_hid_create(const char *busid, const struct emu_hid_config *cfg);
+int emu_cdc_create(const char *busid, const struct emu_cdc_config *cfg);
+int emu_msc_create(const char *busid, const struct emu_msc_config *cfg);
+
+/* helpers for the classes */
+struct emu_ring {
+	uint8_t *buf;
+	size_t size;
+	size_t head;
+	size_t count;
+};
+
+int emu_ring_init(struct emu_ring *ring, size_t size);
+size_t emu_ring_write(struct emu_ring *ring, const uint8_t *data, size_t len);
+size_t emu_ring_read(struct emu_ring *ring, uint8_t *data, size_t len);
@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "emu_device.h"
+
+#define HID_DESCRIPTOR_TYPE_HID		0x21
+#define HID_DESCRIPTOR_TYPE_REPORT	0x22
+
+#define HID_REQ_GET_REPORT		0x01
+#define HID_REQ_GET_IDLE		0x02
+#define HID_REQ_GET_PROTOCOL		0x03
+#define HID_REQ_SET_IDLE		0x0a
+#define HID_REQ_SET_PROTOCOL		0x0b
+
+#define EMU_HID_REPORT_SIZE		16
+
+struct emu_hid {
+	struct emu_device dev;
+	uint32_t interval_us;
+	int64_t next_report;
+	uint32_t seq;
+	uint8_t idle;
+	uint8_t protocol;
+};
+
+static const uint8_t report_desc[] = {
+	0x06, 0x00, 0xff,	/* Usage Page (Vendor Defined 0xFF00) */
+	0x09, 0x01,		/* Usage (0x01) */
+	0xa1, 0x01,		/* Collection (Application) */
+	0x09, 0x02,		/*   Usage (0x02) */
+	0x15, 0x00,		/*   Logical Minimum (0) */
+	0x26, 0xff, 0x00,	/*   Logical Maximum (255) */
+	0x75, 0x08,		/*   Report Size (8) */
+	0x95, EMU_HID_REPORT_SIZE, /* Report Count */
+	0x81, 0x02,		/*   Input (Data,Var,Abs) */
+	0xc0,			/* End Collection */
+};
+
+static const uint8_t device_desc[] = {
+	18, USB_B_DESCRIPTOR_TYPE_DEVICE,
+	0x00, 0x02,		/* bcdUSB 2.00 */
+	0x00, 0x00, 0x00,	/* class per interface */
+	64,			/* bMaxPacketSize0 */
+	0x09, 0x12,		/* idVendor 0x1209 (pid.codes) */
+	0x02, 0x00,		/* idProduct 0x0002 (test PID) */
+	0x00, 0x01,		/* bcdDevice 1.00 */
+	1, 2, 3,		/* iManufacturer, iProduct, iSerialNumber */
+	1,			/* bNumConfigurations */
+};
+
+#define HID_DESC_OFFSET	(9 + 9)
+
+static const uint8_t config_desc[] = {
+	9, USB_B_DESCRIPTOR_TYPE_CONFIGURATION,
+	34, 0,			/* wTotalLength */
+	1, 1, 0,		/* bNumInterfaces, bConfigurationValue, iConfiguration */
+	0x80, 50,		/* bus powered, 100 mA */
+
+	9, USB_B_DESCRIPTOR_TYPE_INTERFACE,
+	0, 0, 1,		/* bInterfaceNumber, bAlternateSetting, bNumEndpoints */
+	0x03, 0x00, 0x00, 0,	/* HID, no boot protocol */
+
+	9, HID_DESCRIPTOR_TYPE_HID,
+	0x11, 0x01,		/* bcdHID 1.11 */
+	0, 1,			/* bCountryCode, bNumDescriptors */
+	HID_DESCRIPTOR_TYPE_REPORT, sizeof(report_desc), 0,
+
+	7, USB_B_DESCRIPTOR_TYPE_ENDPOINT,
+	0x81, USB_BM_ATTRIBUTES_XFER_INT,
+	EMU_HID_REPORT_SIZE, 0,
+	4,			/* bInterval: 2^(4-1) microframes = 1 ms */
+};
+
+static const char *const strings[] = {
+	"esp32_usbip",
+	"Emulated HID",
+	"0002",
+};
+
+static void emu_hid_report(struct emu_hid *hid, uint8_t *report)
+{
+	uint32_t now = (uint32_t)usbip_time_us();
+
+	memset(report, 0, EMU_HID_REPORT_SIZE);
+	memcpy(report, &hid->seq, sizeof(hid->seq));
+	memcpy(report + 4, &now, sizeof(now));
+}
+
+static int emu_hid_control(struct emu_device *dev, const usb_setup_packet_t *setup,
+			   uint8_t *data, int *len)
+{
+	struct emu_hid *hid = dev->priv;
+	uint8_t report[EMU_HID_REPORT_SIZE];
+	const uint8_t *desc = NULL;
+	int desc_len = 0;
+
+	if (setup->bmRequestType == (USB_BM_REQUEST_TYPE_DIR_IN |
+				     USB_BM_REQUEST_TYPE_RECIP_INTERFACE) &&
+	    setup->bRequest == USB_B_REQUEST_GET_DESCRIPTOR) {
+		switch (setup->wValue >> 8) {
+		case HID_DESCRIPTOR_TYPE_HID:
+			desc = dev->cls->config_desc + HID_DESC_OFFSET;
+			desc_len = 9;
+			break;
+		case HID_DESCRIPTOR_TYPE_REPORT:
+			desc = report_desc;
+			desc_len = sizeof(report_desc);
+			break;
+		default:
+			return -1;
+		}
+		if (desc_len > *len)
+			desc_len = *len;
+		memcpy(data, desc, desc_len);
+		*len = desc_len;
+		return 0;
+	}
+
+	if ((setup->bmRequestType & USB_BM_REQUEST_TYPE_TYPE_MASK) !=
+	    USB_BM_REQUEST_TYPE_TYPE_CLASS)
+		return EMU_UNHANDLED;
+
+	switch (setup->bRequest) {
+	case HID_REQ_GET_REPORT:
+		if (*len > EMU_HID_REPORT_SIZE)
+			*len = EMU_HID_REPORT_SIZE;
+		emu_hid_report(hid, report);
+		memcpy(data, report, *len);
+		return 0;
+	case HID_REQ_GET_IDLE:
+		data[0] = hid->idle;
+		*len = 1;
+		return 0;
+	case HID_REQ_GET_PROTOCOL:
+		data[0] = hid->protocol;
+		*len = 1;
+		return 0;
+	case HID_REQ_SET_IDLE:
+		hid->idle = setup->wValue >> 8;
+		*len = 0;
+		return 0;
+	case HID_REQ_SET_PROTOCOL:
+		hid->protocol = setup->wValue & 0xff;
+		*len = 0;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/* one report per interval, whatever the host's polling looks like */
+static int64_t emu_hid_schedule(struct emu_device *dev, usb_transfer_t *transfer,
+				int64_t now)
+{
+	struct emu_hid *hid = dev->priv;
+	int64_t due = now > hid->next_report ? now : hid->next_report;
+
+	hid->next_report = due + hid->interval_us;
+	return due;
+}
+
+static int emu_hid_transfer(struct emu_device *dev, usb_transfer_t *transfer)
+{
+	struct emu_hid *hid = dev->priv;
+	uint8_t report[EMU_HID_REPORT_SIZE];
+	int len = transfer->num_bytes;
+
+	if (!(transfer->bEndpointAddress & 0x80)) {
+		transfer->status = USB_TRANSFER_STATUS_STALL;
+		return 0;
+	}
+
+	if (len > EMU_HID_REPORT_SIZE)
+		len = EMU_HID_REPORT_SIZE;
+	emu_hid_report(hid, report);
+	memcpy(transfer->data_buffer, report, len);
+	hid->seq++;
+
+	transfer->actual_num_bytes = len;
+	transfer->status = USB_TRANSFER_STATUS_COMPLETED;
+	return 0;
+}
+
+static const struct emu_class emu_hid_class = {
+	.name		= "hid",
+	.device_desc	= device_desc,
+	.config_desc	= config_desc,
+	.strings	= strings,
+	.num_strings	= 3,
+	.control	= emu_hid_control,
+	.transfer	= emu_hid_transfer,
+	.schedule	= emu_hid_schedule,
+};
+
+int emu_hid_create(const char *busid, const struct emu_hid_config *cfg)
+{
+	struct emu_hid *hid = calloc(1, sizeof(*hid));
+
+	if (!hid)
+		return -1;
+
+	hid->dev.cls = &emu_hid_class;
+	hid->dev.priv = hid;
+	hid->interval_us = cfg->report_interval_us ? cfg->report_interval_us : 1000;
+	hid->protocol = 1;	/* report protocol */
+
+	return emu_device_register(&hid->dev, busid);
+}
@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "emu_device.h"
+
+#define EMU_LOOPBACK_MPS	512
+#define EMU_LOOPBACK_ISO_MPS	1024
+
+struct emu_loopback {
+	struct emu_device dev;
+	int loopback;
+	struct emu_ring ring;
+	uint32_t pattern;
+	uint32_t isoc_pattern;
+};
+
+static const uint8_t device_desc[] = {
+	18, USB_B_DESCRIPTOR_TYPE_DEVICE,
+	0x00, 0x02,		/* bcdUSB 2.00 */
+	0xff, 0x00, 0x00,	/* vendor specific */
+	64,			/* bMaxPacketSize0 */
+	0x09, 0x12,		/* idVendor 0x1209 (pid.codes) */
+	0x01, 0x00,		/* idProduct 0x0001 (test PID) */
+	0x00, 0x01,		/* bcdDevice 1.00 */
+	1, 2, 3,		/* iManufacturer, iProduct, iSerialNumber */
+	1,			/* bNumConfigurations */
+};
+
+static const uint8_t config_desc[] = {
+	9, USB_B_DESCRIPTOR_TYPE_CONFIGURATION,
+	55, 0,			/* wTotalLength */
+	1, 1, 0,		/* bNumInterfaces, bConfigurationValue, iConfiguration */
+	0x80, 50,		/* bus powered, 100 mA */
+
+	9, USB_B_DESCRIPTOR_TYPE_INTERFACE,
+	0, 0, 2,		/* bInterfaceNumber, bAlternateSetting, bNumEndpoints */
+	0xff, 0x00, 0x00, 0,
+
+	7, USB_B_DESCRIPTOR_TYPE_ENDPOINT,
+	0x01, USB_BM_ATTRIBUTES_XFER_BULK,
+	EMU_LOOPBACK_MPS & 0xff, EMU_LOOPBACK_MPS >> 8, 0,
+
+	7, USB_B_DESCRIPTOR_TYPE_ENDPOINT,
+	0x81, USB_BM_ATTRIBUTES_XFER_BULK,
+	EMU_LOOPBACK_MPS & 0xff, EMU_LOOPBACK_MPS >> 8, 0,
+
+	9, USB_B_DESCRIPTOR_TYPE_INTERFACE,
+	0, 1, 2,		/* alternate setting 1, isochronous */
+	0xff, 0x00, 0x00, 0,
+
+	7, USB_B_DESCRIPTOR_TYPE_ENDPOINT,
+	0x02, USB_BM_ATTRIBUTES_XFER_ISOC,
+	EMU_LOOPBACK_ISO_MPS & 0xff, EMU_LOOPBACK_ISO_MPS >> 8, 1,
+
+	7, USB_B_DESCRIPTOR_TYPE_ENDPOINT,
+	0x82, USB_BM_ATTRIBUTES_XFER_ISOC,
+	EMU_LOOPBACK_ISO_MPS & 0xff, EMU_LOOPBACK_ISO_MPS >> 8, 1,
+};
+
+static const char *const strings[] = {
+	"esp32_usbip",
+	"Emulated Loopback",
+	"0001",
+};
+
+/* every packet is accepted in full, IN packets carry the pattern */
+static int emu_loopback_isoc(struct emu_loopback *lb, usb_transfer_t *transfer)
+{
+	uint8_t *p = transfer->data_buffer;
+
+	for (int i = 0; i < transfer->num_isoc_packets; i++) {
+		usb_isoc_packet_desc_t *desc = &transfer->isoc_packet_desc[i];
+
+		if (transfer->bEndpointAddress & 0x80) {
+			for (int j = 0; j < desc->num_bytes; j++)
+				p[j] = (lb->isoc_pattern + j) % 63;
+			lb->isoc_pattern = (lb->isoc_pattern + desc->num_bytes) % 63;
+		}
+		desc->actual_num_bytes = desc->num_bytes;
+		desc->status = USB_TRANSFER_STATUS_COMPLETED;
+		p += desc->num_bytes;
+	}
+
+	transfer->actual_num_bytes = transfer->num_bytes;
+	transfer->status = USB_TRANSFER_STATUS_COMPLETED;
+	return 0;
+}
+
+static int emu_loopback_transfer(struct emu_device *dev, usb_transfer_t *transfer)
+{
+	struct emu_loopback *lb = dev->priv;
+	size_t len = transfer->num_bytes;
+
+	if (transfer->num_isoc_packets)
+		return emu_loopback_isoc(lb, transfer);
+
+	if (!(transfer->bEndpointAddress & 0x80)) {
+		if (lb->loopback) {
+			/* an OUT transfer completes as a whole or waits (NAK) */
+			if (lb->ring.size - lb->ring.count < len &&
+			    lb->ring.count)
+				return EMU_AGAIN;
+			emu_ring_write(&lb->ring, transfer->data_buffer, len);
+		}
+		transfer->actual_num_bytes = len;
+		transfer->status = USB_TRANSFER_STATUS_COMPLETED;
+		return 0;
+	}
+
+	if (lb->loopback) {
+		if (!lb->ring.count)
+			return EMU_AGAIN;
+		len = emu_ring_read(&lb->ring, transfer->data_buffer, len);
+	} else {
+		/* gadget zero pattern: byte i of the stream is i % 63 */
+		for (size_t i = 0; i < len; i++)
+			transfer->data_buffer[i] = (lb->pattern + i) % 63;
+		lb->pattern = (lb->pattern + len) % 63;
+	}
+
+	transfer->actual_num_bytes = len;
+	transfer->status = USB_TRANSFER_STATUS_COMPLETED;
+	return 0;
+}
+
+static const struct emu_class emu_loopback_class = {
+	.name		= "loopback",
+	.device_desc	= device_desc,
+	.config_desc	= config_desc,
+	.strings	= strings,
+	.num_strings	= 3,
+	.transfer	= emu_loopback_transfer,
+};
+
+int emu_loopback_create(const char *busid, const struct emu_loopback_config *cfg)
+{
+	struct emu_loopback *lb = calloc(1, sizeof(*lb));
+
+	if (!lb)
+		return -1;
+
+	lb->dev.cls = &emu_loopback_class;
+	lb->dev.priv = lb;
+	lb->dev.latency_us = cfg->latency_us;
+	lb->dev.bandwidth = cfg->bandwidth;
+	lb->loopback = cfg->loopback;
+	if (lb->loopback &&
+	    emu_ring_init(&lb->ring, cfg->buffer_size ? cfg->buffer_size : 64 * 1024) < 0) {
+		free(lb);
+		return -1;
+	}
+
+	return emu_device_register(&lb->dev, busid);
+}
@@ -0,0 +1,370 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "emu_device.h"
+
+#define MSC_REQ_GET_MAX_LUN	0xfe
+#define MSC_REQ_RESET		0xff
+
+#define MSC_CBW_SIGNATURE	0x43425355
+#define MSC_CSW_SIGNATURE	0x53425355
+#define MSC_CBW_SIZE		31
+#define MSC_CSW_SIZE		13
+
+#define SCSI_TEST_UNIT_READY	0x00
+#define SCSI_REQUEST_SENSE	0x03
+#define SCSI_INQUIRY		0x12
+#define SCSI_MODE_SENSE6	0x1a
+#define SCSI_START_STOP		0x1b
+#define SCSI_PREVENT_ALLOW	0x1e
+#define SCSI_READ_FORMAT_CAPS	0x23
+#define SCSI_READ_CAPACITY10	0x25
+#define SCSI_READ10		0x28
+#define SCSI_WRITE10		0x2a
+#define SCSI_VERIFY10		0x2f
+#define SCSI_SYNC_CACHE10	0x35
+#define SCSI_MODE_SENSE10	0x5a
+
+#define SENSE_ILLEGAL_REQUEST	0x05
+#define ASC_INVALID_COMMAND	0x20
+#define ASC_LBA_OUT_OF_RANGE	0x21
+
+#define EMU_MSC_BLOCK_SIZE	512
+#define EMU_MSC_MPS		512
+
+enum msc_state {
+	MSC_CBW,
+	MSC_DATA_IN,
+	MSC_DATA_OUT,
+	MSC_CSW,
+};
+
+struct emu_msc {
+	struct emu_device dev;
+	uint8_t *disk;
+	uint32_t blocks;
+
+	enum msc_state state;
+	uint32_t tag;
+	uint32_t residue;
+	uint8_t status;
+	/* data phase: from/to the disk or the reply buffer */
+	uint8_t *data;
+	uint32_t remaining;
+	int discard;
+	uint8_t reply[36];
+
+	uint8_t sense_key;
+	uint8_t asc;
+};
+
+static const uint8_t device_desc[] = {
+	18, USB_B_DESCRIPTOR_TYPE_DEVICE,
+	0x00, 0x02,		/* bcdUSB 2.00 */
+	0x00, 0x00, 0x00,	/* class per interface */
+	64,			/* bMaxPacketSize0 */
+	0x09, 0x12,		/* idVendor 0x1209 (pid.codes) */
+	0x04, 0x00,		/* idProduct 0x0004 (test PID) */
+	0x00, 0x01,		/* bcdDevice 1.00 */
+	1, 2, 3,		/* iManufacturer, iProduct, iSerialNumber */
+	1,			/* bNumConfigurations */
+};
+
+static const uint8_t config_desc[] = {
+	9, USB_B_DESCRIPTOR_TYPE_CONFIGURATION,
+	32, 0,			/* wTotalLength */
+	1, 1, 0,		/* bNumInterfaces, bConfigurationValue, iConfiguration */
+	0x80, 50,		/* bus powered, 100 mA */
+
+	9, USB_B_DESCRIPTOR_TYPE_INTERFACE,
+	0, 0, 2,
+	0x08, 0x06, 0x50, 0,	/* mass storage, SCSI, bulk-only */
+
+	7, USB_B_DESCRIPTOR_TYPE_ENDPOINT,
+	0x01, USB_BM_ATTRIBUTES_XFER_BULK,
+	EMU_MSC_MPS & 0xff, EMU_MSC_MPS >> 8, 0,
+
+	7, USB_B_DESCRIPTOR_TYPE_ENDPOINT,
+	0x81, USB_BM_ATTRIBUTES_XFER_BULK,
+	EMU_MSC_MPS & 0xff, EMU_MSC_MPS >> 8, 0,
+};
+
+static const char *const strings[] = {
+	"esp32_usbip",
+	"Emulated RAM Disk",
+	"000000000004",		/* BOT wants at least 12 hex digits */
+};
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | p[1] << 8 | p[0];
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void emu_msc_fail(struct emu_msc *msc, uint8_t asc)
+{
+	msc->status = 1;
+	msc->sense_key = SENSE_ILLEGAL_REQUEST;
+	msc->asc = asc;
+}
+
+/* Set up the data phase of a command, at most 'expected' bytes long. */
+static void emu_msc_command(struct emu_msc *msc, const uint8_t *cb,
+			    uint32_t expected, int dir_in)
+{
+	uint8_t *reply = msc->reply;
+	uint32_t len = 0;
+	uint32_t lba, count;
+
+	msc->status = 0;
+	msc->data = reply;
+	msc->discard = 0;
+	memset(reply, 0, sizeof(msc->reply));
+
+	switch (cb[0]) {
+	case SCSI_TEST_UNIT_READY:
+	case SCSI_START_STOP:
+	case SCSI_PREVENT_ALLOW:
+	case SCSI_VERIFY10:
+	case SCSI_SYNC_CACHE10:
+		break;
+	case SCSI_REQUEST_SENSE:
+		reply[0] = 0x70;
+		reply[2] = msc->sense_key;
+		reply[7] = 10;
+		reply[12] = msc->asc;
+		len = 18;
+		msc->sense_key = 0;
+		msc->asc = 0;
+		break;
+	case SCSI_INQUIRY:
+		if (cb[1] & 0x01) {	/* no vital product data */
+			emu_msc_fail(msc, ASC_INVALID_COMMAND);
+			break;
+		}
+		reply[0] = 0x00;	/* direct access block device */
+		reply[1] = 0x80;	/* removable */
+		reply[2] = 0x04;	/* SPC-2 */
+		reply[3] = 0x02;
+		reply[4] = 31;
+		memcpy(reply + 8, "ESP32   ", 8);
+		memcpy(reply + 16, "USB/IP RAM Disk ", 16);
+		memcpy(reply + 32, "1.00", 4);
+		len = 36;
+		break;
+	case SCSI_MODE_SENSE6:
+		reply[0] = 3;
+		len = 4;
+		break;
+	case SCSI_MODE_SENSE10:
+		reply[1] = 6;
+		len = 8;
+		break;
+	case SCSI_READ_FORMAT_CAPS:
+		reply[3] = 8;
+		put_be32(reply + 4, msc->blocks);
+		reply[8] = 0x02;	/* formatted media */
+		reply[10] = EMU_MSC_BLOCK_SIZE >> 8;
+		reply[11] = EMU_MSC_BLOCK_SIZE & 0xff;
+		len = 12;
+		break;
+	case SCSI_READ_CAPACITY10:
+		put_be32(reply, msc->blocks - 1);
+		put_be32(reply + 4, EMU_MSC_BLOCK_SIZE);
+		len = 8;
+		break;
+	case SCSI_READ10:
+	case SCSI_WRITE10:
+		lba = get_be32(cb + 2);
+		count = cb[7] << 8 | cb[8];
+		if (lba > msc->blocks || count > msc->blocks - lba) {
+			emu_msc_fail(msc, ASC_LBA_OUT_OF_RANGE);
+			break;
+		}
+		msc->data = msc->disk + (size_t)lba * EMU_MSC_BLOCK_SIZE;
+		len = count * EMU_MSC_BLOCK_SIZE;
+		break;
+	default:
+		emu_msc_fail(msc, ASC_INVALID_COMMAND);
+		break;
+	}
+
+	if (len > expected)
+		len = expected;
+	msc->residue = expected - len;
+
+	/*
+	 * Failed commands still run the data phase the host announced, with
+	 * zeroes or discarding the data, instead of stalling the endpoints.
+	 */
+	if (msc->status) {
+		msc->data = reply;
+		msc->discard = 1;
+		memset(reply, 0, sizeof(msc->reply));
+		msc->residue = expected;
+		len = expected;
+	}
+
+	msc->remaining = len;
+	if (!len)
+		msc->state = MSC_CSW;
+	else
+		msc->state = dir_in ? MSC_DATA_IN : MSC_DATA_OUT;
+}
+
+static int emu_msc_out(struct emu_msc *msc, usb_transfer_t *transfer)
+{
+	const uint8_t *buf = transfer->data_buffer;
+	uint32_t len = transfer->num_bytes;
+
+	switch (msc->state) {
+	case MSC_CBW:
+		if (len != MSC_CBW_SIZE || get_le32(buf) != MSC_CBW_SIGNATURE) {
+			transfer->status = USB_TRANSFER_STATUS_STALL;
+			return 0;
+		}
+		msc->tag = get_le32(buf + 4);
+		emu_msc_command(msc, buf + 15, get_le32(buf + 8), buf[12] & 0x80);
+		break;
+	case MSC_DATA_OUT:
+		if (len > msc->remaining)
+			len = msc->remaining;
+		if (!msc->discard) {
+			memcpy(msc->data, buf, len);
+			msc->data += len;
+		}
+		msc->remaining -= len;
+		if (!msc->remaining)
+			msc->state = MSC_CSW;
+		break;
+	default:
+		/* wait for the IN side to finish the current phase */
+		return EMU_AGAIN;
+	}
+
+	transfer->actual_num_bytes = len;
+	transfer->status = USB_TRANSFER_STATUS_COMPLETED;
+	return 0;
+}
+
+static int emu_msc_in(struct emu_msc *msc, usb_transfer_t *transfer)
+{
+	uint8_t *buf = transfer->data_buffer;
+	uint32_t len = transfer->num_bytes;
+
+	switch (msc->state) {
+	case MSC_DATA_IN:
+		if (len > msc->remaining)
+			len = msc->remaining;
+		if (msc->discard)
+			memset(buf, 0, len);
+		else
+			memcpy(buf, msc->data, len);
+		msc->data += len;
+		msc->remaining -= len;
+		if (!msc->remaining)
+			msc->state = MSC_CSW;
+		break;
+	case MSC_CSW:
+		put_le32(buf, MSC_CSW_SIGNATURE);
+		put_le32(buf + 4, msc->tag);
+		put_le32(buf + 8, msc->residue);
+		buf[12] = msc->status;
+		len = MSC_CSW_SIZE;
+		msc->state = MSC_CBW;
+		break;
+	default:
+		return EMU_AGAIN;
+	}
+
+	transfer->actual_num_bytes = len;
+	transfer->status = USB_TRANSFER_STATUS_COMPLETED;
+	return 0;
+}
+
+static int emu_msc_transfer(struct emu_device *dev, usb_transfer_t *transfer)
+{
+	struct emu_msc *msc = dev->priv;
+
+	if (transfer->bEndpointAddress & 0x80)
+		return emu_msc_in(msc, transfer);
+	return emu_msc_out(msc, transfer);
+}
+
+static int emu_msc_control(struct emu_device *dev, const usb_setup_packet_t *setup,
+			   uint8_t *data, int *len)
+{
+	struct emu_msc *msc = dev->priv;
+
+	if ((setup->bmRequestType & USB_BM_REQUEST_TYPE_TYPE_MASK) !=
+	    USB_BM_REQUEST_TYPE_TYPE_CLASS)
+		return EMU_UNHANDLED;
+
+	switch (setup->bRequest) {
+	case MSC_REQ_GET_MAX_LUN:
+		data[0] = 0;
+		*len = 1;
+		return 0;
+	case MSC_REQ_RESET:
+		msc->state = MSC_CBW;
+		msc->remaining = 0;
+		*len = 0;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static const struct emu_class emu_msc_class = {
+	.name		= "msc",
+	.device_desc	= device_desc,
+	.config_desc	= config_desc,
+	.strings	= strings,
+	.num_strings	= 3,
+	.control	= emu_msc_control,
+	.transfer	= emu_msc_transfer,
+};
+
+int emu_msc_create(const char *busid, const struct emu_msc_config *cfg)
+{
+	size_t size = cfg->disk_size ? cfg->disk_size : 64 * 1024;
+	struct emu_msc *msc = calloc(1, sizeof(*msc));
+
+	if (!msc)
+		return -1;
+
+	msc->blocks = size / EMU_MSC_BLOCK_SIZE;
+	msc->disk = calloc(msc->blocks, EMU_MSC_BLOCK_SIZE);
+	if (!msc->blocks || !msc->disk) {
+		free(msc->disk);
+		free(msc);
+		return -1;
+	}
+
+	msc->dev.cls = &emu_msc_class;
+	msc->dev.priv = msc;
+	msc->dev.latency_us = cfg->latency_us;
+	msc->dev.bandwidth = cfg->bandwidth;
+
+	return emu_device_register(&msc->dev, busid);
+}
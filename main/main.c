@@ -14,82 +14,161 @@
 #include "nvs_flash.h"
 #include "wifi.h"
 #include "usbip.h"
+#include "emu_device.h"
+#include "usbip_trace.h"
+#include "driver/uart.h"
 
 #include "lwip/sockets.h"
 
 
 static usb_host_client_handle_t client_hdl;
-static usb_device_handle_t dev_hdl;
-
-void usb_host_client_loop() {
+/* one slot per attached device, including those behind a hub */
+static struct usbip_esp_device usbip_devs[CONFIG_USBIP_MAX_DEVICES];
+
+/*
+ * Library and client events are handled by tasks of their own, each blocked
+ * until it has work, so a transfer completion never waits for a timeout on
+ * the other side. The client task runs the transfer callbacks and sits above
+ * the sessions' tx tasks it feeds; the library task above it.
+ */
+static void usb_host_lib_task(void *arg) {
     while (1) {
         uint32_t event_flags_ret;
-        esp_err_t retval = usb_host_lib_handle_events(pdMS_TO_TICKS(100), &event_flags_ret);
+        esp_err_t retval = usb_host_lib_handle_events(portMAX_DELAY, &event_flags_ret);
         if(retval != ESP_OK && retval != ESP_ERR_TIMEOUT) {
             printf("host lib handle events error %s\n", esp_err_to_name(retval));
         };
-        retval = usb_host_client_handle_events(client_hdl, pdMS_TO_TICKS(100));
+    }
+}
+
+static void usb_host_client_task(void *arg) {
+    while (1) {
+        esp_err_t retval = usb_host_client_handle_events(client_hdl, portMAX_DELAY);
         if(retval != ESP_OK && retval != ESP_ERR_TIMEOUT) {
             printf("host client handle events error %s\n", esp_err_to_name(retval));
         };
     }
 }
 
-void usb_write_callback(usb_transfer_t *transfer) {
-    ESP_LOGI("", "write transfer, length %d", transfer->actual_num_bytes); 
-    for (int i=0;i<transfer->actual_num_bytes;i++) {
-        printf("%02x ", transfer->data_buffer[i]);
+/*
+ * Keys on the console: 't' prints the trace of the URB path, 'h' the latency
+ * histograms and 'r' resets them.
+ */
+static void usbip_console_task(void *arg) {
+    uint8_t c;
+
+    if (uart_driver_install(CONFIG_ESP_CONSOLE_UART_NUM, 256, 0, 0, NULL, 0) != ESP_OK) {
+        vTaskDelete(NULL);
+        return;
+    }
+    while (1) {
+        if (uart_read_bytes(CONFIG_ESP_CONSOLE_UART_NUM, &c, 1, portMAX_DELAY) != 1)
+            continue;
+        if (c == 't')
+            usbip_trace_dump();
+        else if (c == 'h')
+            usbip_hist_dump();
+        else if (c == 'r')
+            usbip_hist_reset();
+    }
+}
+
+static void usb_host_new_device(uint8_t address) {
+    struct usbip_esp_device *usbip_dev = NULL;
+    usb_device_handle_t dev_hdl;
+    const usb_device_desc_t *device_desc;
+    usb_device_info_t dev_info;
+
+    /* a slot stays taken until the session of a removed device lets go */
+    for (int i = 0; i < CONFIG_USBIP_MAX_DEVICES; i++) {
+        if (!__atomic_load_n(&usbip_devs[i].dev_hdl, __ATOMIC_ACQUIRE)) {
+            usbip_dev = &usbip_devs[i];
+            break;
+        }
+    }
+    if (!usbip_dev) {
+        ESP_LOGW("", "no room for device %d", address);
+        return;
+    }
+
+    if (usb_host_device_open(client_hdl, address, &dev_hdl) != ESP_OK)
+        return;
+    if (usb_host_get_device_descriptor(dev_hdl, &device_desc) != ESP_OK ||
+        usb_host_device_info(dev_hdl, &dev_info) != ESP_OK) {
+        usb_host_device_close(client_hdl, dev_hdl);
+        return;
+    }
+    ESP_LOGI("", "PID 0x%x, VID 0x%x", device_desc->idProduct, device_desc->idVendor);
+
+    struct usbip_usb_device usbipdev = {
+        .busnum = 1,
+        .devnum = address,
+        .speed = dev_info.speed == USB_SPEED_LOW ? 1 : 2,
+        .idVendor = device_desc->idVendor,
+        .idProduct = device_desc->idProduct,
+        .bcdDevice = device_desc->bcdDevice,
+        .bDeviceClass = device_desc->bDeviceClass,
+        .bDeviceSubClass = device_desc->bDeviceSubClass,
+        .bDeviceProtocol = device_desc->bDeviceProtocol,
+        .bNumConfigurations = device_desc->bNumConfigurations,
+    };
+    snprintf(usbipdev.path, sizeof(usbipdev.path), "/sys/devices/usb1/1-%d", address);
+    snprintf(usbipdev.busid, sizeof(usbipdev.busid), "1-%d", address);
+
+    usbip_dev->client_hdl = client_hdl;
+    usbip_dev->dev_hdl = dev_hdl;
+
+    /* cached so that a client attaching does not go to the bus for them */
+    usbip_dev->device_desc = device_desc;
+    if (usb_host_get_active_config_descriptor(dev_hdl, &usbip_dev->config_desc) != ESP_OK)
+        usbip_dev->config_desc = NULL;
+    usbip_dev->str_desc[0] = dev_info.str_desc_manufacturer;
+    usbip_dev->str_index[0] = device_desc->iManufacturer;
+    usbip_dev->str_desc[1] = dev_info.str_desc_product;
+    usbip_dev->str_index[1] = device_desc->iProduct;
+    usbip_dev->str_desc[2] = dev_info.str_desc_serial_num;
+    usbip_dev->str_index[2] = device_desc->iSerialNumber;
+
+    if (usbip_add_device(&usbipdev, &usbip_esp_host_ops, usbip_dev) < 0) {
+        usb_host_device_close(client_hdl, dev_hdl);
+        memset(usbip_dev, 0, sizeof(*usbip_dev));
+    }
+}
+
+static void usb_host_device_gone(usb_device_handle_t dev_hdl) {
+    uint8_t address;
+
+    for (int i = 0; i < CONFIG_USBIP_MAX_DEVICES; i++) {
+        if (usbip_devs[i].dev_hdl != dev_hdl)
+            continue;
+        if (usb_host_device_addr(dev_hdl, &address) == ESP_OK) {
+            char busid[SYSFS_BUS_ID_SIZE];
+
+            /* closed and the slot freed once no session uses it */
+            snprintf(busid, sizeof(busid), "1-%d", address);
+            usbip_del_device(busid);
+        } else {
+            usbip_esp_host_ops.device_free(&usbip_devs[i]);
+        }
+        return;
     }
-    printf("\n");
-    usb_host_transfer_free(transfer);
 }
 
 void usb_host_client_event_cb(const usb_host_client_event_msg_t *event_msg, void *arg) {
     ESP_LOGI("", "host client callback %d", event_msg->event);
     if(event_msg->event == USB_HOST_CLIENT_EVENT_NEW_DEV) {
         ESP_LOGI("", "new dev %d", event_msg->new_dev.address);
-        if(usb_host_device_open(client_hdl, event_msg->new_dev.address, &dev_hdl) == ESP_OK) {
-            const usb_device_desc_t *device_desc;
-            if(usb_host_get_device_descriptor(dev_hdl, &device_desc) == ESP_OK) {
-                ESP_LOGI("", "PID 0x%x, VID 0x%x", device_desc->idProduct, device_desc->idVendor);
-                struct usbip_usb_device usbipdev = {
-                    .path = "1",
-                    .busid = "1-1",
-                    .busnum = 1,
-                    .devnum = 1,
-                    .speed = 1,
-                    .idVendor = device_desc->idVendor,
-                    .idProduct = device_desc->idProduct,
-                    .bcdDevice=device_desc->bcdUSB,
-                    .bDeviceClass = device_desc->bDeviceClass,
-                    .bDeviceSubClass = device_desc->bDeviceSubClass,
-                    .bDeviceProtocol = device_desc->bDeviceProtocol,
-                    .bConfigurationValue = 1,
-                    .bNumConfigurations = device_desc->bNumConfigurations,
-                    .bNumInterfaces = 1,
-                    };
-                usbip_add_device(&usbipdev);
-                // if (device_desc->idVendor == 0x3293 && device_desc->idProduct == 0x100) {
-                //     ESP_LOGI("", "Unhuman motor controller");
-                //     // note skipping parsing of configuration descriptor, this device is already known
-                //     if (usb_host_interface_claim(client_hdl, dev_hdl, 0, 0) == ESP_OK) {
-                //         ESP_LOGI("", "Claimed interface");
-                //         interface_claimed = true;
-                //     }
-                // }
-            }
-        }
+        usb_host_new_device(event_msg->new_dev.address);
     } else if (event_msg->event == USB_HOST_CLIENT_EVENT_DEV_GONE) {
-        ESP_LOGI("", "device gone %d", event_msg->new_dev.address);
-        if(usb_host_device_close(client_hdl, dev_hdl) == ESP_OK) {
-            ESP_LOGI("", "device closed");
-        }
+        ESP_LOGI("", "device gone");
+        usb_host_device_gone(event_msg->dev_gone.dev_hdl);
     }
 }
 
-
 void app_main(void)
 {
+    usbip_init();
+
     //usb
 
     usb_host_config_t host_config = {.intr_flags = ESP_INTR_FLAG_LEVEL1};
@@ -105,7 +184,8 @@ void app_main(void)
          printf("usb_host_client_register ok\n");
     }
 
-    xTaskCreate(usb_host_client_loop, "usb_host_client_loop", 4*1024, NULL, 10, NULL);
+    xTaskCreate(usb_host_lib_task, "usb_host_lib", 4*1024, NULL, 11, NULL);
+    xTaskCreate(usb_host_client_task, "usb_host_client", 4*1024, NULL, 10, NULL);
 
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -127,14 +207,30 @@ void app_main(void)
      */
    // ESP_ERROR_CHECK(example_connect());
 
-#ifdef CONFIG_EXAMPLE_IPV4
-    xTaskCreate(tcp_server_task, "tcp_server", 4096, (void*)AF_INET, 5, NULL);
+#if defined(CONFIG_USBIP_EMULATED_LOOPBACK) || defined(CONFIG_USBIP_EMULATED_SOURCESINK)
+    struct emu_loopback_config emu_cfg = {
+#ifdef CONFIG_USBIP_EMULATED_LOOPBACK
+        .loopback = 1,
 #endif
-#ifdef CONFIG_EXAMPLE_IPV6
-    xTaskCreate(tcp_server_task, "tcp_server", 4096, (void*)AF_INET6, 5, NULL);
+        .buffer_size = 16 * 1024,
+    };
+    emu_loopback_create("2-1", &emu_cfg);
+#elif defined(CONFIG_USBIP_EMULATED_HID)
+    struct emu_hid_config emu_cfg = { .report_interval_us = 1000 };
+    emu_hid_create("2-1", &emu_cfg);
+#elif defined(CONFIG_USBIP_EMULATED_CDC)
+    struct emu_cdc_config emu_cfg = { .buffer_size = 4 * 1024 };
+    emu_cdc_create("2-1", &emu_cfg);
+#elif defined(CONFIG_USBIP_EMULATED_MSC)
+    struct emu_msc_config emu_cfg = { .disk_size = CONFIG_USBIP_EMULATED_MSC_SIZE_KB * 1024 };
+    emu_msc_create("2-1", &emu_cfg);
 #endif
 
-    esp_log_level_set("*", ESP_LOG_DEBUG);  
+    // listens on IPv4 and IPv6 as configured
+    xTaskCreate(tcp_server_task, "tcp_server", 4096, NULL, 5, NULL);
+
+    xTaskCreate(usbip_console_task, "usbip_console", 3072, NULL, 1, NULL);
+
     for (unsigned int i=0;;i++) {
 
         vTaskDelay(1000 / portTICK_PERIOD_MS);
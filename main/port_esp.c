@@ -0,0 +1,262 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+
+#include "usbip_port.h"
+
+int usbip_task_create(void (*fn)(void *), const char *name,
+		      uint32_t stack_size, void *arg, int prio)
+{
+	return xTaskCreate(fn, name, stack_size, arg, prio, NULL) == pdPASS ? 0 : -1;
+}
+
+void usbip_task_exit(void)
+{
+	vTaskDelete(NULL);
+}
+
+void usbip_delay_ms(uint32_t ms)
+{
+	TickType_t ticks = pdMS_TO_TICKS(ms);
+
+	/* at least a tick, so tasks of lower priority get to run meanwhile */
+	vTaskDelay(ms && !ticks ? 1 : ticks);
+}
+
+int64_t usbip_time_us(void)
+{
+	return esp_timer_get_time();
+}
+
+uint32_t usbip_random(void)
+{
+	return esp_random();
+}
+
+usbip_mutex_t usbip_mutex_create(void)
+{
+	return xSemaphoreCreateMutex();
+}
+
+void usbip_mutex_lock(usbip_mutex_t mutex)
+{
+	xSemaphoreTake(mutex, portMAX_DELAY);
+}
+
+void usbip_mutex_unlock(usbip_mutex_t mutex)
+{
+	xSemaphoreGive(mutex);
+}
+
+void usbip_mutex_delete(usbip_mutex_t mutex)
+{
+	vSemaphoreDelete(mutex);
+}
+
+usbip_sem_t usbip_sem_create(unsigned max, unsigned initial)
+{
+	return xSemaphoreCreateCounting(max, initial);
+}
+
+void usbip_sem_take(usbip_sem_t sem)
+{
+	xSemaphoreTake(sem, portMAX_DELAY);
+}
+
+int usbip_sem_take_timeout(usbip_sem_t sem, uint32_t timeout_us)
+{
+	TickType_t ticks = (timeout_us + portTICK_PERIOD_MS * 1000 - 1) /
+			   (portTICK_PERIOD_MS * 1000);
+
+	return xSemaphoreTake(sem, ticks) == pdTRUE ? 0 : -1;
+}
+
+void usbip_sem_give(usbip_sem_t sem)
+{
+	xSemaphoreGive(sem);
+}
+
+void usbip_sem_delete(usbip_sem_t sem)
+{
+	vSemaphoreDelete(sem);
+}
+
+usbip_queue_t usbip_queue_create(unsigned len)
+{
+	return xQueueCreate(len, sizeof(void *));
+}
+
+void usbip_queue_send(usbip_queue_t queue, void *item)
+{
+	xQueueSend(queue, &item, portMAX_DELAY);
+}
+
+void *usbip_queue_recv(usbip_queue_t queue)
+{
+	void *item = NULL;
+
+	while (xQueueReceive(queue, &item, portMAX_DELAY) != pdTRUE)
+		;
+	return item;
+}
+
+int usbip_queue_recv_timeout(usbip_queue_t queue, uint32_t timeout_us,
+			     void **item)
+{
+	TickType_t ticks = timeout_us / (portTICK_PERIOD_MS * 1000);
+
+	return xQueueReceive(queue, item, ticks) == pdTRUE ? 0 : -1;
+}
+
+void usbip_queue_delete(usbip_queue_t queue)
+{
+	vQueueDelete(queue);
+}
+
+int usbip_transfer_alloc(size_t data_buffer_size, int num_isoc_packets,
+			 usb_transfer_t **transfer)
+{
+	return usb_host_transfer_alloc(data_buffer_size, num_isoc_packets,
+				       transfer) == ESP_OK ? 0 : -1;
+}
+
+void usbip_transfer_free(usb_transfer_t *transfer)
+{
+	usb_host_transfer_free(transfer);
+}
+
+/* ---------------------------------------------------------------------- */
+/* USB host operations backed by the ESP-IDF USB host library */
+
+static int esp_get_device_descriptor(void *ctx, const usb_device_desc_t **desc)
+{
+	struct usbip_esp_device *dev = ctx;
+
+	if (dev->device_desc) {
+		*desc = dev->device_desc;
+		return 0;
+	}
+	return usb_host_get_device_descriptor(dev->dev_hdl, desc) == ESP_OK ? 0 : -1;
+}
+
+static int esp_get_config_descriptor(void *ctx, const usb_config_desc_t **desc)
+{
+	struct usbip_esp_device *dev = ctx;
+
+	if (dev->config_desc) {
+		*desc = dev->config_desc;
+		return 0;
+	}
+	return usb_host_get_active_config_descriptor(dev->dev_hdl, desc) == ESP_OK ?
+	       0 : -1;
+}
+
+static int esp_get_string_descriptor(void *ctx, uint8_t index, uint16_t langid,
+				     uint8_t *data, int *len)
+{
+	/* LANGID: English (United States), what the host library asked for */
+	static const uint8_t langids[] = { 4, USB_B_DESCRIPTOR_TYPE_STRING, 0x09, 0x04 };
+	struct usbip_esp_device *dev = ctx;
+	const uint8_t *desc = NULL;
+	int n;
+
+	if (index == 0) {
+		for (int i = 0; i < 3; i++) {
+			if (dev->str_desc[i])
+				desc = langids;
+		}
+	} else if (langid == 0x0409) {
+		for (int i = 0; i < 3; i++) {
+			if (dev->str_desc[i] && dev->str_index[i] == index)
+				desc = (const uint8_t *)dev->str_desc[i];
+		}
+	}
+	if (!desc)
+		return -1;
+
+	n = desc[0] < *len ? desc[0] : *len;
+	memcpy(data, desc, n);
+	*len = n;
+	return 0;
+}
+
+static int esp_interface_claim(void *ctx, uint8_t intf, uint8_t alt)
+{
+	struct usbip_esp_device *dev = ctx;
+
+	return usb_host_interface_claim(dev->client_hdl, dev->dev_hdl, intf, alt) ==
+	       ESP_OK ? 0 : -1;
+}
+
+static int esp_interface_release(void *ctx, uint8_t intf)
+{
+	struct usbip_esp_device *dev = ctx;
+
+	return usb_host_interface_release(dev->client_hdl, dev->dev_hdl, intf) ==
+	       ESP_OK ? 0 : -1;
+}
+
+static int esp_transfer_submit(void *ctx, usb_transfer_t *transfer)
+{
+	struct usbip_esp_device *dev = ctx;
+	esp_err_t ret;
+
+	transfer->device_handle = dev->dev_hdl;
+	if ((transfer->bEndpointAddress & 0x0f) == 0)
+		ret = usb_host_transfer_submit_control(dev->client_hdl, transfer);
+	else
+		ret = usb_host_transfer_submit(transfer);
+
+	return ret == ESP_OK ? 0 : -1;
+}
+
+static int esp_endpoint_halt(void *ctx, uint8_t addr)
+{
+	struct usbip_esp_device *dev = ctx;
+
+	return usb_host_endpoint_halt(dev->dev_hdl, addr) == ESP_OK ? 0 : -1;
+}
+
+static int esp_endpoint_flush(void *ctx, uint8_t addr)
+{
+	struct usbip_esp_device *dev = ctx;
+
+	return usb_host_endpoint_flush(dev->dev_hdl, addr) == ESP_OK ? 0 : -1;
+}
+
+static int esp_endpoint_clear(void *ctx, uint8_t addr)
+{
+	struct usbip_esp_device *dev = ctx;
+
+	return usb_host_endpoint_clear(dev->dev_hdl, addr) == ESP_OK ? 0 : -1;
+}
+
+/* the slot is free again once dev_hdl reads NULL, see usb_host_new_device() */
+static void esp_device_free(void *ctx)
+{
+	struct usbip_esp_device *dev = ctx;
+	usb_device_handle_t dev_hdl = dev->dev_hdl;
+
+	usb_host_device_close(dev->client_hdl, dev_hdl);
+	dev->client_hdl = NULL;
+	dev->device_desc = NULL;
+	dev->config_desc = NULL;
+	memset(dev->str_desc, 0, sizeof(dev->str_desc));
+	memset(dev->str_index, 0, sizeof(dev->str_index));
+	__atomic_store_n(&dev->dev_hdl, NULL, __ATOMIC_RELEASE);
+}
+
+const struct usbip_host_ops usbip_esp_host_ops = {
+	.get_device_descriptor	= esp_get_device_descriptor,
+	.get_config_descriptor	= esp_get_config_descriptor,
+	.get_string_descriptor	= esp_get_string_descriptor,
+	.interface_claim	= esp_interface_claim,
+	.interface_release	= esp_interface_release,
+	.transfer_submit	= esp_transfer_submit,
+	.endpoint_halt		= esp_endpoint_halt,
+	.endpoint_flush		= esp_endpoint_flush,
+	.endpoint_clear		= esp_endpoint_clear,
+	.device_free		= esp_device_free,
+};
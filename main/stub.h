@@ -0,0 +1,503 @@
+#pragma once
+#include <stdint.h>
+#include "usbip_port.h"
+#include "usbip.h"
+#include "usbip_network.h"
+#include "usbip_lz.h"
+
+#define STUB_MAX_URBS		CONFIG_USBIP_MAX_URBS
+#define STUB_URBS_PER_EP	CONFIG_USBIP_URBS_PER_EP
+#define STUB_ISO_URBS_PER_EP	CONFIG_USBIP_ISO_URBS_PER_EP
+
+/* interrupt IN prefetch, see CONFIG_USBIP_INT_PREFETCH */
+#if defined(CONFIG_USBIP_INT_PREFETCH_HID) || defined(CONFIG_USBIP_INT_PREFETCH_ALL)
+#define STUB_PREFETCH		1
+#define STUB_PREFETCH_REPORTS	CONFIG_USBIP_INT_PREFETCH_REPORTS
+#else
+#define STUB_PREFETCH		0
+#define STUB_PREFETCH_REPORTS	0
+#endif
+#ifdef CONFIG_USBIP_INT_PREFETCH_ALL
+#define STUB_PREFETCH_ALL	1
+#else
+#define STUB_PREFETCH_ALL	0
+#endif
+#ifdef CONFIG_USBIP_INT_PREFETCH_DROP_OLDEST
+#define STUB_PREFETCH_DROP_OLDEST	1
+#else
+#define STUB_PREFETCH_DROP_OLDEST	0
+#endif
+/* transfers kept on the bus, one polled while the next waits behind it */
+#define STUB_PREFETCH_ARMED	2
+
+/* bulk IN read-ahead, see CONFIG_USBIP_BULK_READAHEAD */
+#if defined(CONFIG_USBIP_BULK_READAHEAD_STREAMING) || defined(CONFIG_USBIP_BULK_READAHEAD_ALL)
+#define STUB_READAHEAD		1
+#define STUB_READAHEAD_TRANSFERS	CONFIG_USBIP_BULK_READAHEAD_TRANSFERS
+#define STUB_READAHEAD_SIZE		CONFIG_USBIP_BULK_READAHEAD_SIZE
+#else
+#define STUB_READAHEAD		0
+#define STUB_READAHEAD_TRANSFERS	0
+#define STUB_READAHEAD_SIZE		0
+#endif
+#ifdef CONFIG_USBIP_BULK_READAHEAD_ALL
+#define STUB_READAHEAD_ALL	1
+#else
+#define STUB_READAHEAD_ALL	0
+#endif
+
+/* bulk reply coalescing, see CONFIG_USBIP_TX_COALESCE_BYTES */
+#define STUB_TX_COALESCE_BYTES	CONFIG_USBIP_TX_COALESCE_BYTES
+#define STUB_TX_COALESCE_US	CONFIG_USBIP_TX_COALESCE_US
+#define STUB_TX_BATCH		16
+
+/* payload compression, see CONFIG_USBIP_COMPRESSION */
+#ifdef CONFIG_USBIP_COMPRESSION
+#define STUB_COMPRESS		1
+#define STUB_COMPRESS_MIN	CONFIG_USBIP_COMPRESSION_MIN
+#else
+#define STUB_COMPRESS		0
+#define STUB_COMPRESS_MIN	0
+#endif
+
+/* interrupt URBs over UDP, see CONFIG_USBIP_UDP_INT */
+#ifdef CONFIG_USBIP_UDP_INT
+#define STUB_UDP		1
+#define STUB_UDP_WINDOW		CONFIG_USBIP_UDP_WINDOW
+#define STUB_UDP_RTO_US		(CONFIG_USBIP_UDP_RTO_MS * 1000)
+#else
+#define STUB_UDP		0
+#define STUB_UDP_WINDOW		1
+#define STUB_UDP_RTO_US		0
+#endif
+
+/* sessions outliving their connection, see CONFIG_USBIP_RESUME */
+#ifdef CONFIG_USBIP_RESUME
+#define STUB_RESUME		1
+#define STUB_RESUME_GRACE_US	((int64_t)CONFIG_USBIP_RESUME_GRACE_MS * 1000)
+#define STUB_RESUME_BUFFER	CONFIG_USBIP_RESUME_BUFFER
+#else
+#define STUB_RESUME		0
+#define STUB_RESUME_GRACE_US	0
+#define STUB_RESUME_BUFFER	0
+#endif
+
+/* seqnum hash: at least twice as many buckets as URBs in flight */
+#if STUB_MAX_URBS <= 32
+#define STUB_HASH_SIZE		64
+#elif STUB_MAX_URBS <= 64
+#define STUB_HASH_SIZE		128
+#elif STUB_MAX_URBS <= 128
+#define STUB_HASH_SIZE		256
+#else
+#define STUB_HASH_SIZE		512
+#endif
+#define STUB_HASH(seqnum)	((seqnum) & (STUB_HASH_SIZE - 1))
+
+/* endpoint table index: number in the low nibble, IN endpoints above OUT */
+#define STUB_EP_INDEX(addr)	(((addr) & 0x0f) | (((addr) & 0x80) >> 3))
+#define STUB_NUM_EPS		32
+
+/*
+ * One in-flight USBIP_CMD_SUBMIT, the counterpart of the Linux stub_priv.
+ * It lives on the pending list of its endpoint until a slot is free, is
+ * owned by the USB host stack while submitted, and is handed to the tx
+ * task on completion. Until then it can be found by seqnum for
+ * USBIP_CMD_UNLINK. A stub_priv with command USBIP_RET_UNLINK carries just
+ * the answer to an unlink.
+ */
+struct stub_priv {
+	uint32_t command;	/* reply to send, USBIP_RET_SUBMIT/UNLINK */
+	uint32_t seqnum;
+	uint32_t transfer_flags;
+	int32_t transfer_buffer_length;
+	uint8_t direction;
+	int32_t status;		/* used when no transfer was submitted */
+	/*
+	 * Isochronous URBs: the packet descriptors of the client, in network
+	 * order, kept in the transfer buffer behind the data.
+	 */
+	int number_of_packets;
+	struct usbip_iso_packet_descriptor *iso;
+	/* for the latency histograms, see usbip_hist.h */
+	int64_t received_us;	/* CMD_SUBMIT parsed */
+	int64_t submitted_us;	/* handed to the host stack */
+	int64_t completed_us;	/* given back by the host stack */
+
+	struct stub_device *sdev;
+	struct stub_endpoint *sep;
+	usb_transfer_t *transfer;
+	struct stub_split *split;	/* instead of transfer */
+	int submitted;
+	/* size of the compressed IN payload, network order, 0 if sent as is */
+	uint32_t zlen;
+	/* came in a datagram, the reply goes back in one if it can */
+	int udp;
+	/* answered by a RET_UNLINK for seqnum_unlink instead of RET_SUBMIT */
+	int unlinking;
+	uint32_t seqnum_unlink;
+
+	struct stub_priv *next;
+	struct stub_priv *prev;		/* on the pending list */
+	struct stub_priv *hash_next;
+};
+
+/*
+ * A bulk URB larger than a pooled transfer goes to the device as a chain of
+ * pooled transfers, chunk i starting at byte i * chunk_size. OUT payload is
+ * received chunk by chunk, each one submitted as soon as it is in, several
+ * on the bus at once. IN chunks are submitted one after the other, so a
+ * short packet ends the URB where the device meant it to and the data after
+ * it is left for the next URB. They are taken all at once when the URB goes
+ * to the bus and held until the RET_SUBMIT is sent.
+ */
+struct stub_split {
+	int nchunks;
+	int chunk_size;
+	int ready;		/* chunks the rx side is done with */
+	int next;		/* next chunk to submit */
+	int inflight;
+	int done;		/* chunks given back by the host stack */
+	int ended;		/* no further chunk goes to the bus */
+	int32_t status;		/* of the URB, set when a chunk failed */
+	int32_t actual;
+	usb_transfer_t *chunk[];
+};
+
+/*
+ * An IN endpoint read ahead by the server itself: interrupt endpoints with
+ * CONFIG_USBIP_INT_PREFETCH, bulk ones with CONFIG_USBIP_BULK_READAHEAD. Its
+ * transfers stay armed on the device and complete into a queue that the
+ * CMD_SUBMITs of the client are answered from, the way the device would
+ * answer them: a URB takes data until it is full or a short transfer ends.
+ * Until then it waits on the pending list of the endpoint. Nothing of the
+ * client goes to the device.
+ */
+struct stub_readahead {
+	struct stub_device *sdev;
+	struct stub_endpoint *sep;
+	size_t size;		/* of each transfer */
+	int ntransfers;
+	int max_armed;
+	int drop_oldest;	/* else no transfer is armed while all hold data */
+	int disabled;		/* the endpoint changed with an alternate setting */
+	int armed;
+
+	/* transfers off the bus: spare ones, and ones holding data in order */
+	usb_transfer_t **spare;
+	int nspare;
+	usb_transfer_t **full;
+	unsigned head;
+	unsigned count;
+	int offset;		/* data of full[head] already taken */
+
+	uint32_t fetched;	/* transfers completed by the device */
+	uint64_t bytes;
+	uint32_t served;	/* URBs answered from the queue */
+	uint32_t waited;	/* URBs answered as data came in */
+	uint32_t dropped;	/* transfers dropped unread */
+	usb_transfer_t *transfers[];
+};
+
+struct stub_endpoint {
+	uint8_t addr;		/* bEndpointAddress */
+	uint8_t type;		/* USB_BM_ATTRIBUTES_XFER_* */
+	uint8_t intf;		/* bInterfaceNumber */
+	uint16_t mps;		/* 0 while the endpoint does not exist */
+	int inflight;
+	int depth;		/* maximum transfers submitted at once */
+
+	struct stub_priv *pending_head;
+	struct stub_priv *pending_tail;
+	/* split URB partly on the bus, the pending ones wait behind it */
+	struct stub_priv *active;
+	struct stub_readahead *readahead;
+	/* the next URB waits for a pooled IN transfer */
+	int starved;
+	/* isochronous transfers kept for the next URBs, chained by context */
+	usb_transfer_t *iso_free;
+	int iso_nfree;
+};
+
+/*
+ * OUT payload accounting of a session, kept by the rx side and logged when
+ * the session closes. Payload normally goes from the socket straight into
+ * the transfer buffer; anything staged in another buffer first is counted
+ * as copied, so a nonzero value points at a bounce copy on the OUT path.
+ */
+struct stub_stats {
+	uint32_t out_urbs;
+	uint64_t out_direct;	/* bytes received into transfer buffers */
+	uint64_t out_copied;	/* bytes copied from an intermediate buffer */
+	uint64_t out_dropped;	/* bytes drained for URBs never submitted */
+};
+
+/*
+ * Payload compression of a session that negotiated USBIP_FEAT_COMPRESS.
+ * Compressed OUT payload is received into rx_buf and decompressed into the
+ * transfer; IN payload is compressed into tx_buf and copied back over the
+ * transfer buffer, so held replies need no buffer of their own.
+ */
+struct stub_compress {
+	size_t max;		/* largest payload compressed */
+	struct usbip_lz lz;	/* of the tx task */
+	uint8_t *rx_buf;
+	uint8_t *tx_buf;
+
+	uint32_t out_urbs;	/* received compressed */
+	uint64_t out_raw;
+	uint64_t out_wire;
+	uint32_t in_urbs;	/* sent compressed */
+	uint64_t in_raw;
+	uint64_t in_wire;
+	uint32_t in_raw_urbs;	/* tried, and sent as they were */
+};
+
+/*
+ * Datagram channel of a session that negotiated USBIP_FEAT_UDP_INT. Its rx
+ * task takes the client's datagrams and acknowledges them; replies to
+ * their URBs go to its tx task rather than the session's, so none of them
+ * waits behind a bulk reply stuck on TCP. A reply is copied into a free
+ * slot of the window and stays there until the client acknowledges it,
+ * sent again every STUB_UDP_RTO_US.
+ */
+struct stub_udp_slot {
+	uint32_t seq;		/* 0 when free */
+	int64_t sent_us;
+	size_t len;
+	uint8_t *buf;		/* usbip_udp_header and PDU */
+};
+
+struct stub_udp {
+	int sockfd;
+	uint32_t token;
+	size_t max;		/* largest datagram either way */
+	struct sockaddr_storage peer;
+	socklen_t peer_len;	/* 0 until the first datagram of the client */
+	uint8_t *rx_buf;
+	/* replies to datagram URBs, NULL stops the tx task */
+	usbip_queue_t tx_queue;
+	/* released by the tasks when they exit */
+	usbip_sem_t rx_done;
+	usbip_sem_t tx_done;
+
+	/* protects what follows, taken by both tasks */
+	usbip_mutex_t lock;
+	uint32_t next_seq;
+	struct stub_udp_slot slot[STUB_UDP_WINDOW];
+	/* the client's datagrams: all below recv_next, bit i for recv_next + i */
+	uint32_t recv_next;
+	uint32_t recv_bits;
+
+	uint32_t rx_pdus;	/* taken from datagrams */
+	uint32_t rx_dups;
+	uint32_t rx_deferred;	/* left for the client to send again */
+	uint32_t tx_pdus;	/* replies sent as datagrams */
+	uint32_t tx_resent;
+	uint32_t tx_tcp;	/* replies to datagram URBs that went over TCP */
+};
+
+/*
+ * Connection of a session that negotiated USBIP_FEAT_RESUME, see
+ * OP_REQ_RESUME. When it fails the session is parked: the rx task and the
+ * tx task wait for a new one instead of ending the session, the URBs on
+ * the bus complete and their replies queue up. stub_resume() hands the new
+ * connection over from the server loop, and the tx task takes it up: it
+ * answers the client and sends what it missed, which may block. Whatever the
+ * rx task receives from an old connection after that is dropped for the
+ * client to send again, and the rx task closes the old socket the next time
+ * it reads.
+ */
+struct stub_resume {
+	struct stub_device *sdev;
+	uint8_t token[8];
+	struct stub_resume *next;	/* of the sessions that can be resumed */
+
+	/* held by the tx task while sending, and to replace the connection */
+	usbip_mutex_t tx_lock;
+	uint32_t tx_bytes;	/* sent, modulo 2^32 */
+	size_t ring_head;	/* where the next byte sent is kept */
+	size_t ring_kept;	/* bytes kept, at most STUB_RESUME_BUFFER */
+	uint8_t *ring;
+
+	/* protects what follows, never held while blocking */
+	usbip_mutex_t lock;
+	unsigned gen;		/* connections replaced */
+	int stale_fd;		/* replaced, closed once the rx task is off it */
+	int new_fd;		/* handed over, for the tx task to take up */
+	uint32_t new_received;	/* what the client got on the old one */
+	int in_recv;		/* the rx task is in recv() */
+	uint32_t rx_bytes;	/* received, modulo 2^32 */
+	int parked;
+	int ended;		/* not resumed in time, or the session is over */
+	int64_t deadline_us;
+	/* given when a connection comes or the session ends */
+	usbip_sem_t rx_wake;
+	usbip_sem_t tx_wake;
+
+	uint32_t resumed;
+	uint32_t replayed;	/* bytes sent again */
+};
+
+/* extensions negotiated with OP_REQ_FEATURES, for stub_run() */
+struct stub_features {
+	uint32_t features;
+	int udp_sockfd;		/* USBIP_FEAT_UDP_INT, owned by the caller */
+	uint32_t udp_token;
+	uint8_t resume_token[8];	/* USBIP_FEAT_RESUME */
+};
+
+/* bulk RET_SUBMITs held back by the tx task to go out in one send */
+struct stub_tx_batch {
+	int count;
+	int iovcnt;
+	size_t bytes;
+	int64_t first_us;
+	struct stub_priv *priv[STUB_TX_BATCH];
+	struct usbip_header pdu[STUB_TX_BATCH];
+	struct iovec iov[3 * STUB_TX_BATCH];
+};
+
+struct stub_device {
+	int sockfd;
+	struct usbip_rx *rx;
+	struct usbip_exported_device *edev;
+	const struct usbip_host_ops *ops;
+	void *ctx;
+
+	/* protects endpoints, free list and the counters below */
+	usbip_mutex_t lock;
+	/* counts free stub_priv, the rx side blocks on it */
+	usbip_sem_t free_sem;
+	/* released by the tx task when it exits */
+	usbip_sem_t tx_done;
+	/* completed stub_priv waiting for RET_SUBMIT, NULL stops the tx task */
+	usbip_queue_t tx_queue;
+
+	int inflight;
+	volatile int shutdown;
+	/*
+	 * Endpoints are starved. The tx task kicks them as transfers go back
+	 * to the pool, woken up by queueing the kick marker once, which also
+	 * has it take up a resumed connection.
+	 */
+	volatile int starved;
+	int kick_queued;
+	struct stub_priv kick;
+
+	struct stub_stats stats;
+	/* time from transfer completion to the tx task taking it up */
+	uint32_t dispatch_count;
+	uint32_t dispatch_max_us;
+	uint64_t dispatch_total_us;
+	uint32_t desc_cached;	/* GET_DESCRIPTOR answered without the bus */
+	uint32_t split_urbs;
+	uint32_t split_chunks;	/* transfers submitted for them */
+	uint32_t iso_urbs;
+	uint32_t iso_allocs;	/* transfers allocated for them */
+
+	struct stub_tx_batch batch;
+	uint32_t tx_immediate;	/* replies sent on their own */
+	uint32_t tx_coalesced;	/* bulk replies held back */
+	uint32_t tx_batches;	/* sends they took */
+
+	struct stub_compress *z;	/* NULL unless negotiated */
+	struct stub_udp *udp;		/* NULL unless negotiated */
+	struct stub_resume *resume;	/* NULL unless negotiated */
+
+	uint32_t claimed_intf;	/* bitmap of claimed interface numbers */
+	uint8_t bConfigurationValue;
+
+	struct stub_endpoint eps[STUB_NUM_EPS];
+	/* URBs not completed yet, by seqnum */
+	struct stub_priv *hash[STUB_HASH_SIZE];
+	struct stub_priv *free_list;
+	struct stub_priv priv_pool[STUB_MAX_URBS];
+};
+
+/* stub_dev.c */
+/* rx->sockfd is the connection the session ended on */
+int stub_run(struct usbip_exported_device *edev, struct usbip_rx *rx,
+	     const struct stub_features *features);
+struct stub_endpoint *stub_get_endpoint(struct stub_device *sdev, uint8_t addr);
+struct stub_priv *stub_priv_alloc(struct stub_device *sdev);
+/* NULL instead of waiting when none is free */
+struct stub_priv *stub_priv_try_alloc(struct stub_device *sdev);
+void stub_priv_free(struct stub_device *sdev, struct stub_priv *priv);
+/* An isochronous transfer of at least size bytes for np packets on sep. */
+int stub_iso_get(struct stub_device *sdev, struct stub_endpoint *sep,
+		 size_t size, int np, usb_transfer_t **transfer);
+/* Give back the transfer of priv, not holding sdev->lock. */
+void stub_transfer_put(struct stub_device *sdev, struct stub_priv *priv);
+void stub_transfer_put_locked(struct stub_device *sdev, struct stub_priv *priv);
+int stub_set_interface(struct stub_device *sdev, int intf, int alt);
+
+/* stub_rx.c */
+void stub_rx_loop(struct stub_device *sdev);
+void stub_complete(usb_transfer_t *transfer);
+void stub_readahead_complete(usb_transfer_t *transfer);
+/* Submit what starved endpoints can now that transfers went back. */
+void stub_kick_starved(struct stub_device *sdev);
+/* Submit the URBs queued on sep, or fail them once sep->mps is 0. */
+void stub_kick_endpoint_locked(struct stub_device *sdev,
+			       struct stub_endpoint *sep);
+/*
+ * A PDU from a datagram, in host order, with its payload. in_order when
+ * every datagram of the client before it was received. Returns -1 to leave
+ * it for the client to send again.
+ */
+int stub_rx_datagram(struct stub_device *sdev, struct usbip_header *pdu,
+		     const uint8_t *data, size_t len, int in_order);
+
+/* stub_tx.c */
+void stub_tx_loop(void *arg);
+int32_t stub_transfer_status(const usb_transfer_t *transfer);
+/*
+ * Fill in the reply to priv and the iovecs to send it, pdu first. Returns
+ * their number; the IN data of a split URB, *actual bytes, is not in them.
+ */
+int stub_reply_iov(struct stub_device *sdev, struct stub_priv *priv,
+		   struct usbip_header *pdu, struct iovec *iov,
+		   int32_t *actual);
+void stub_account_latency(struct stub_device *sdev, struct stub_priv *priv);
+/* Have the tx task look for work other than replies, with sdev->lock held. */
+void stub_tx_wake_locked(struct stub_device *sdev);
+
+/* stub_udp.c */
+/* a UDP socket next to the TCP one, bound to a free port */
+int stub_udp_open(int tcp_sockfd, uint16_t *port);
+/* largest datagram of the channel */
+size_t stub_udp_max(void);
+int stub_udp_start(struct stub_device *sdev, const struct stub_features *feat);
+/* wait for the rx task, once sdev->shutdown is set */
+void stub_udp_stop_rx(struct stub_device *sdev);
+/* stop the tx task, once nothing is on the bus */
+void stub_udp_stop_tx(struct stub_device *sdev);
+void stub_udp_free(struct stub_device *sdev);
+void stub_udp_log_stats(struct stub_device *sdev);
+/* the client may come back from another address */
+void stub_udp_unlatch(struct stub_device *sdev);
+
+/* stub_resume.c */
+int stub_resume_init(void);
+int stub_resume_start(struct stub_device *sdev, const struct stub_features *feat);
+/* the session is over, wake up a tx task waiting for a connection */
+void stub_resume_end(struct stub_device *sdev);
+void stub_resume_free(struct stub_device *sdev);
+void stub_resume_log_stats(struct stub_device *sdev);
+/*
+ * Send a reply, or part of one, on the connection of the session. With
+ * USBIP_FEAT_RESUME a failed connection does not fail it: the bytes are
+ * kept for the client. -1 ends the session.
+ */
+int stub_send(struct stub_device *sdev, struct iovec *iov, int iovcnt);
+/*
+ * OP_REQ_RESUME on sockfd, a blocking socket. Returns ST_OK with the
+ * connection handed over to the session, which sends the reply, otherwise
+ * the status to answer with. Never blocks on the client.
+ */
+int stub_resume(const struct op_resume_request *req, int sockfd);
+/* Take up a connection handed over, from the tx task. */
+void stub_resume_take_over(struct stub_device *sdev);
+/* park every session that can be resumed, their connections are gone */
+void stub_resume_park_all(void);
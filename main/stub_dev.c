@@ -0,0 +1,652 @@
+#define LOG_LOCAL_LEVEL	CONFIG_USBIP_LOG_LEVEL_STUB
+
+#include <stdlib.h>
+#include <string.h>
+#include "stub.h"
+#include "usbip_pool.h"
+
+#define err(...)    USBIP_LOGE(TAG, __VA_ARGS__)
+#define info(...)   USBIP_LOGI(TAG, __VA_ARGS__)
+#define dbg(...)    USBIP_LOGD(TAG, __VA_ARGS__)
+
+static const char *TAG = "stub";
+
+struct stub_endpoint *stub_get_endpoint(struct stub_device *sdev, uint8_t addr)
+{
+	struct stub_endpoint *sep;
+
+	/* the default pipe is shared by both directions */
+	if ((addr & 0x0f) == 0)
+		return &sdev->eps[0];
+
+	sep = &sdev->eps[STUB_EP_INDEX(addr)];
+	if (!sep->mps)
+		return NULL;
+
+	return sep;
+}
+
+static struct stub_priv *stub_priv_take(struct stub_device *sdev)
+{
+	struct stub_priv *priv;
+
+	usbip_mutex_lock(sdev->lock);
+	priv = sdev->free_list;
+	sdev->free_list = priv->next;
+	usbip_mutex_unlock(sdev->lock);
+
+	memset(priv, 0, sizeof(*priv));
+	priv->sdev = sdev;
+
+	return priv;
+}
+
+struct stub_priv *stub_priv_alloc(struct stub_device *sdev)
+{
+	/* blocks the rx side until a completion is sent: our backpressure */
+	usbip_sem_take(sdev->free_sem);
+	return stub_priv_take(sdev);
+}
+
+struct stub_priv *stub_priv_try_alloc(struct stub_device *sdev)
+{
+	if (usbip_sem_take_timeout(sdev->free_sem, 0) < 0)
+		return NULL;
+	return stub_priv_take(sdev);
+}
+
+/*
+ * Isochronous transfers stay with their endpoint, up to its depth, and are
+ * taken again by the next URBs: a stream keeps the same number of packets,
+ * so they are only allocated anew when the client changes it. Each one is
+ * sized for full packets.
+ */
+int stub_iso_get(struct stub_device *sdev, struct stub_endpoint *sep,
+		 size_t size, int np, usb_transfer_t **transfer)
+{
+	size_t full = ((np * sep->mps + 3) & ~3) +
+		      np * sizeof(struct usbip_iso_packet_descriptor);
+	usb_transfer_t *t;
+
+	usbip_mutex_lock(sdev->lock);
+	t = sep->iso_free;
+	if (t) {
+		sep->iso_free = t->context;
+		sep->iso_nfree--;
+	}
+	sdev->iso_urbs++;
+	usbip_mutex_unlock(sdev->lock);
+
+	if (t && (t->num_isoc_packets != np || t->data_buffer_size < size)) {
+		usbip_transfer_free(t);
+		t = NULL;
+	}
+	if (!t) {
+		if (usbip_transfer_alloc(size > full ? size : full, np, &t) < 0)
+			return -1;
+		sdev->iso_allocs++;
+	}
+
+	t->flags = 0;
+	t->num_bytes = 0;
+	t->actual_num_bytes = 0;
+	t->timeout_ms = 0;
+	t->callback = NULL;
+	t->context = NULL;
+	*transfer = t;
+	return 0;
+}
+
+void stub_transfer_put_locked(struct stub_device *sdev, struct stub_priv *priv)
+{
+	usb_transfer_t *transfer = priv->transfer;
+	struct stub_endpoint *sep = priv->sep;
+
+	priv->transfer = NULL;
+	if (!transfer || !transfer->num_isoc_packets) {
+		usbip_pool_put(transfer);
+		return;
+	}
+
+	if (sep && sep->iso_nfree < sep->depth) {
+		transfer->context = sep->iso_free;
+		sep->iso_free = transfer;
+		sep->iso_nfree++;
+		return;
+	}
+	usbip_transfer_free(transfer);
+}
+
+void stub_transfer_put(struct stub_device *sdev, struct stub_priv *priv)
+{
+	if (!priv->transfer || !priv->transfer->num_isoc_packets) {
+		usbip_pool_put(priv->transfer);
+		priv->transfer = NULL;
+		return;
+	}
+
+	usbip_mutex_lock(sdev->lock);
+	stub_transfer_put_locked(sdev, priv);
+	usbip_mutex_unlock(sdev->lock);
+}
+
+/* called when nothing is on the bus any more */
+static void stub_iso_free(struct stub_device *sdev)
+{
+	for (int i = 0; i < STUB_NUM_EPS; i++) {
+		struct stub_endpoint *sep = &sdev->eps[i];
+
+		while (sep->iso_free) {
+			usb_transfer_t *transfer = sep->iso_free;
+
+			sep->iso_free = transfer->context;
+			usbip_transfer_free(transfer);
+		}
+		sep->iso_nfree = 0;
+	}
+}
+
+void stub_priv_free(struct stub_device *sdev, struct stub_priv *priv)
+{
+	stub_transfer_put(sdev, priv);
+	if (priv->split) {
+		for (int i = 0; i < priv->split->nchunks; i++)
+			usbip_pool_put(priv->split->chunk[i]);
+		free(priv->split);
+	}
+
+	usbip_mutex_lock(sdev->lock);
+	priv->next = sdev->free_list;
+	sdev->free_list = priv;
+	usbip_mutex_unlock(sdev->lock);
+
+	usbip_sem_give(sdev->free_sem);
+}
+
+#define USB_CLASS_HID		0x03
+#define USB_CLASS_CDC_DATA	0x0a
+#define USB_CLASS_VENDOR_SPEC	0xff
+
+/*
+ * Interrupt IN endpoints of HID interfaces and bulk IN endpoints of streaming
+ * interfaces, or all of them, are read ahead by the server when configured.
+ * The state outlives a change of the alternate setting, whose old transfers
+ * may still be on the bus.
+ */
+static void stub_readahead_setup(struct stub_device *sdev,
+				 struct stub_endpoint *sep, uint8_t intf_class)
+{
+	struct stub_readahead *ra = sep->readahead;
+	int ntransfers = 0, max_armed = 0, drop_oldest = 0;
+	size_t size = 0;
+
+	if (!(sep->addr & 0x80)) {
+		/* OUT endpoints are never read ahead */
+	} else if (sep->type == USB_BM_ATTRIBUTES_XFER_INT && STUB_PREFETCH &&
+		   (STUB_PREFETCH_ALL || intf_class == USB_CLASS_HID)) {
+		ntransfers = STUB_PREFETCH_REPORTS + STUB_PREFETCH_ARMED;
+		max_armed = STUB_PREFETCH_ARMED;
+		drop_oldest = STUB_PREFETCH_DROP_OLDEST;
+		size = sep->mps;
+	} else if (sep->type == USB_BM_ATTRIBUTES_XFER_BULK && STUB_READAHEAD &&
+		   (STUB_READAHEAD_ALL || intf_class == USB_CLASS_CDC_DATA ||
+		    intf_class == USB_CLASS_VENDOR_SPEC)) {
+		ntransfers = STUB_READAHEAD_TRANSFERS;
+		max_armed = ntransfers;
+		size = (STUB_READAHEAD_SIZE + sep->mps - 1) / sep->mps * sep->mps;
+	}
+
+	if (ra) {
+		ra->disabled = !ntransfers || ra->size != size;
+		return;
+	}
+	if (!ntransfers)
+		return;
+
+	ra = calloc(1, sizeof(*ra) + 3 * ntransfers * sizeof(ra->transfers[0]));
+	if (!ra) {
+		err("ep %#02x: no memory for read-ahead", sep->addr);
+		return;
+	}
+	ra->sdev = sdev;
+	ra->sep = sep;
+	ra->size = size;
+	ra->ntransfers = ntransfers;
+	ra->max_armed = max_armed;
+	ra->drop_oldest = drop_oldest;
+	ra->spare = ra->transfers + ntransfers;
+	ra->full = ra->spare + ntransfers;
+
+	for (int i = 0; i < ntransfers; i++) {
+		usb_transfer_t *transfer;
+
+		if (usbip_transfer_alloc(size, 0, &transfer) < 0) {
+			err("ep %#02x: no memory for read-ahead", sep->addr);
+			while (i)
+				usbip_transfer_free(ra->transfers[--i]);
+			free(ra);
+			return;
+		}
+		transfer->bEndpointAddress = sep->addr;
+		transfer->num_bytes = size;
+		transfer->callback = stub_readahead_complete;
+		transfer->context = ra;
+		ra->transfers[i] = transfer;
+		ra->spare[ra->nspare++] = transfer;
+	}
+
+	sep->readahead = ra;
+	info("ep %#02x: reading ahead %d x %u bytes", sep->addr, ntransfers,
+	     (unsigned)size);
+}
+
+/* called when nothing is on the bus any more */
+static void stub_readahead_free(struct stub_device *sdev)
+{
+	for (int i = 0; i < STUB_NUM_EPS; i++) {
+		struct stub_readahead *ra = sdev->eps[i].readahead;
+
+		if (!ra)
+			continue;
+		info("ep %#02x read-ahead: %u transfers, %llu bytes, %u URBs "
+		     "answered at once, %u after a wait, %u transfers dropped",
+		     ra->sep->addr, (unsigned)ra->fetched,
+		     (unsigned long long)ra->bytes, (unsigned)ra->served,
+		     (unsigned)ra->waited, (unsigned)ra->dropped);
+		for (int j = 0; j < ra->ntransfers; j++)
+			usbip_transfer_free(ra->transfers[j]);
+		free(ra);
+		sdev->eps[i].readahead = NULL;
+	}
+}
+
+static void stub_init_endpoint(struct stub_device *sdev,
+			       const usb_ep_desc_t *ep_desc, uint8_t intf,
+			       uint8_t intf_class)
+{
+	struct stub_endpoint *sep;
+
+	sep = &sdev->eps[STUB_EP_INDEX(ep_desc->bEndpointAddress)];
+	sep->addr = ep_desc->bEndpointAddress;
+	sep->intf = intf;
+	sep->type = ep_desc->bmAttributes & USB_BM_ATTRIBUTES_XFERTYPE_MASK;
+	sep->mps = ep_desc->wMaxPacketSize & 0x7ff;
+	/* a stream needs URBs queued on the bus to survive network jitter */
+	sep->depth = sep->type == USB_BM_ATTRIBUTES_XFER_ISOC ?
+		     STUB_ISO_URBS_PER_EP : STUB_URBS_PER_EP;
+
+	dbg("ep %#02x type %d mps %d", sep->addr, sep->type, sep->mps);
+	stub_readahead_setup(sdev, sep, intf_class);
+}
+
+/*
+ * Walk the active configuration and set up the endpoints of the given
+ * interface/alternate setting. With intf < 0 every interface is claimed in
+ * its default alternate setting.
+ */
+static int stub_setup_interfaces(struct stub_device *sdev, int intf, int alt)
+{
+	const usb_config_desc_t *config_desc;
+	const uint8_t *p, *end;
+	int cur_intf = -1, cur_alt = -1;
+	uint8_t cur_class = 0;
+
+	if (sdev->ops->get_config_descriptor(sdev->ctx, &config_desc) < 0) {
+		err("no active configuration");
+		return -1;
+	}
+	sdev->bConfigurationValue = config_desc->bConfigurationValue;
+
+	p = (const uint8_t *)config_desc;
+	end = p + config_desc->wTotalLength;
+	for (; p + 2 <= end && p[0] >= 2; p += p[0]) {
+		if (p[1] == USB_B_DESCRIPTOR_TYPE_INTERFACE) {
+			const usb_intf_desc_t *intf_desc = (const usb_intf_desc_t *)p;
+
+			cur_intf = intf_desc->bInterfaceNumber;
+			cur_alt = intf_desc->bAlternateSetting;
+			cur_class = intf_desc->bInterfaceClass;
+			if (cur_alt != (intf < 0 ? 0 : alt))
+				continue;
+			if (intf >= 0 && cur_intf != intf)
+				continue;
+
+			if (sdev->ops->interface_claim(sdev->ctx, cur_intf, cur_alt) < 0) {
+				err("claim interface %d.%d failed", cur_intf, cur_alt);
+				continue;
+			}
+			sdev->claimed_intf |= 1u << cur_intf;
+		} else if (p[1] == USB_B_DESCRIPTOR_TYPE_ENDPOINT) {
+			if (cur_intf < 0 || !(sdev->claimed_intf & (1u << cur_intf)))
+				continue;
+			if (cur_alt != (intf < 0 ? 0 : alt))
+				continue;
+			if (intf >= 0 && cur_intf != intf)
+				continue;
+
+			stub_init_endpoint(sdev, (const usb_ep_desc_t *)p,
+					   cur_intf, cur_class);
+		}
+	}
+
+	return 0;
+}
+
+static void stub_release_interfaces(struct stub_device *sdev)
+{
+	for (int i = 0; i < 32; i++) {
+		if (!(sdev->claimed_intf & (1u << i)))
+			continue;
+		sdev->ops->interface_release(sdev->ctx, i);
+	}
+	sdev->claimed_intf = 0;
+}
+
+/*
+ * Move an interface to another alternate setting. The endpoints of the old
+ * setting go first: URBs to them fail with -EPIPE from then on, those
+ * queued right away, those on the bus when the host stack gives them back.
+ * Linux drains them before it sends SET_INTERFACE, so normally none are.
+ */
+int stub_set_interface(struct stub_device *sdev, int intf, int alt)
+{
+	uint8_t gone[STUB_NUM_EPS];
+	int ngone = 0;
+	int ret = -1;
+
+	if (intf < 0 || intf >= 32)
+		return -1;
+
+	usbip_mutex_lock(sdev->lock);
+	for (int i = 1; i < STUB_NUM_EPS; i++) {
+		struct stub_endpoint *sep = &sdev->eps[i];
+
+		if (!sep->mps || sep->intf != intf)
+			continue;
+		sep->mps = 0;
+		if (sep->readahead)
+			sep->readahead->disabled = 1;
+		stub_kick_endpoint_locked(sdev, sep);
+		gone[ngone++] = sep->addr;
+	}
+	usbip_mutex_unlock(sdev->lock);
+
+	/* the completions of what this cancels take the lock */
+	for (int i = 0; i < ngone; i++) {
+		sdev->ops->endpoint_halt(sdev->ctx, gone[i]);
+		sdev->ops->endpoint_flush(sdev->ctx, gone[i]);
+		sdev->ops->endpoint_clear(sdev->ctx, gone[i]);
+	}
+
+	usbip_mutex_lock(sdev->lock);
+	if (sdev->claimed_intf & (1u << intf)) {
+		if (sdev->ops->interface_release(sdev->ctx, intf) < 0) {
+			err("release interface %d failed", intf);
+			goto out;
+		}
+		sdev->claimed_intf &= ~(1u << intf);
+	}
+
+	ret = stub_setup_interfaces(sdev, intf, alt);
+out:
+	usbip_mutex_unlock(sdev->lock);
+	return ret;
+}
+
+/* Cancel everything the USB host stack still holds for this session. */
+static void stub_flush_endpoints(struct stub_device *sdev)
+{
+	for (int i = 1; i < STUB_NUM_EPS; i++) {
+		struct stub_endpoint *sep = &sdev->eps[i];
+
+		if (!sep->mps || !sep->inflight)
+			continue;
+		sdev->ops->endpoint_halt(sdev->ctx, sep->addr);
+		sdev->ops->endpoint_flush(sdev->ctx, sep->addr);
+	}
+}
+
+static void stub_clear_endpoints(struct stub_device *sdev)
+{
+	for (int i = 1; i < STUB_NUM_EPS; i++) {
+		struct stub_endpoint *sep = &sdev->eps[i];
+
+		if (sep->mps)
+			sdev->ops->endpoint_clear(sdev->ctx, sep->addr);
+	}
+}
+
+static void stub_drop_pending(struct stub_device *sdev)
+{
+	for (int i = 0; i < STUB_NUM_EPS; i++) {
+		struct stub_endpoint *sep = &sdev->eps[i];
+		struct stub_priv *priv, *active = NULL;
+
+		usbip_mutex_lock(sdev->lock);
+		priv = sep->pending_head;
+		sep->pending_head = sep->pending_tail = NULL;
+		/* a split URB with chunks on the bus is answered by them */
+		if (sep->active && !sep->active->split->inflight) {
+			active = sep->active;
+			sep->active = NULL;
+		}
+		usbip_mutex_unlock(sdev->lock);
+
+		if (active)
+			stub_priv_free(sdev, active);
+		while (priv) {
+			struct stub_priv *next = priv->next;
+
+			stub_priv_free(sdev, priv);
+			priv = next;
+		}
+	}
+}
+
+static struct stub_device *stub_device_new(struct usbip_exported_device *edev,
+					   struct usbip_rx *rx)
+{
+	struct stub_device *sdev;
+	const usb_device_desc_t *device_desc;
+
+	sdev = calloc(1, sizeof(*sdev));
+	if (!sdev)
+		return NULL;
+
+	sdev->sockfd = rx->sockfd;
+	sdev->rx = rx;
+	sdev->edev = edev;
+	sdev->ops = edev->ops;
+	sdev->ctx = edev->ctx;
+
+	sdev->lock = usbip_mutex_create();
+	sdev->free_sem = usbip_sem_create(STUB_MAX_URBS, STUB_MAX_URBS);
+	sdev->tx_done = usbip_sem_create(1, 0);
+	/* every stub_priv, the kick marker and the NULL stopping the task */
+	sdev->tx_queue = usbip_queue_create(STUB_MAX_URBS + 2);
+	if (!sdev->lock || !sdev->free_sem || !sdev->tx_done || !sdev->tx_queue)
+		goto err;
+
+	for (int i = STUB_MAX_URBS - 1; i >= 0; i--) {
+		sdev->priv_pool[i].next = sdev->free_list;
+		sdev->free_list = &sdev->priv_pool[i];
+	}
+
+	sdev->eps[0].addr = 0;
+	sdev->eps[0].type = USB_BM_ATTRIBUTES_XFER_CONTROL;
+	sdev->eps[0].mps = 64;
+	sdev->eps[0].depth = STUB_URBS_PER_EP;
+	if (sdev->ops->get_device_descriptor(sdev->ctx, &device_desc) == 0)
+		sdev->eps[0].mps = device_desc->bMaxPacketSize0;
+
+	return sdev;
+err:
+	err("out of memory for session");
+	if (sdev->lock)
+		usbip_mutex_delete(sdev->lock);
+	if (sdev->free_sem)
+		usbip_sem_delete(sdev->free_sem);
+	if (sdev->tx_done)
+		usbip_sem_delete(sdev->tx_done);
+	if (sdev->tx_queue)
+		usbip_queue_delete(sdev->tx_queue);
+	free(sdev);
+	return NULL;
+}
+
+/* compression buffers of a session that negotiated it */
+static int stub_compress_init(struct stub_device *sdev)
+{
+	struct stub_compress *z;
+
+	z = calloc(1, sizeof(*z));
+	if (!z)
+		return -1;
+	sdev->z = z;
+
+	z->max = usbip_pool_size(USB_BM_ATTRIBUTES_XFER_BULK);
+	z->rx_buf = malloc(z->max);
+	z->tx_buf = malloc(z->max);
+	return z->rx_buf && z->tx_buf ? 0 : -1;
+}
+
+static void stub_compress_free(struct stub_device *sdev)
+{
+	struct stub_compress *z = sdev->z;
+
+	if (!z)
+		return;
+	free(z->rx_buf);
+	free(z->tx_buf);
+	free(z);
+}
+
+static void stub_device_free(struct stub_device *sdev)
+{
+	stub_compress_free(sdev);
+	stub_udp_free(sdev);
+	stub_resume_free(sdev);
+	usbip_mutex_delete(sdev->lock);
+	usbip_sem_delete(sdev->free_sem);
+	usbip_sem_delete(sdev->tx_done);
+	usbip_queue_delete(sdev->tx_queue);
+	free(sdev);
+}
+
+/*
+ * Serve USBIP_CMD_SUBMIT/USBIP_RET_SUBMIT on an imported connection until
+ * the peer goes away, or with USBIP_FEAT_RESUME until it is not back in
+ * time. The calling task becomes the rx side, completions are sent by a
+ * dedicated tx task.
+ */
+int stub_run(struct usbip_exported_device *edev, struct usbip_rx *rx,
+	     const struct stub_features *features)
+{
+	struct stub_device *sdev;
+	int inflight;
+
+	sdev = stub_device_new(edev, rx);
+	if (!sdev)
+		return -1;
+
+	if ((features->features & USBIP_FEAT_COMPRESS) &&
+	    stub_compress_init(sdev) < 0) {
+		err("out of memory for compression");
+		stub_device_free(sdev);
+		return -1;
+	}
+
+	if ((features->features & USBIP_FEAT_RESUME) &&
+	    stub_resume_start(sdev, features) < 0) {
+		err("out of memory for resume");
+		stub_device_free(sdev);
+		return -1;
+	}
+
+	if (stub_setup_interfaces(sdev, -1, 0) < 0) {
+		stub_device_free(sdev);
+		return -1;
+	}
+
+	if (usbip_task_create(stub_tx_loop, "usbip_tx", 4096, sdev, 6) < 0) {
+		err("could not start tx task");
+		stub_release_interfaces(sdev);
+		stub_device_free(sdev);
+		return -1;
+	}
+
+	/* a client granted the channel counts on it, the session ends without */
+	if ((features->features & USBIP_FEAT_UDP_INT) &&
+	    stub_udp_start(sdev, features) < 0) {
+		err("could not start the datagram channel");
+	} else {
+		info("session started: %s", edev->busid);
+		stub_rx_loop(sdev);
+	}
+
+	sdev->shutdown = 1;
+	stub_resume_end(sdev);
+	stub_udp_stop_rx(sdev);
+	stub_drop_pending(sdev);
+
+	usbip_mutex_lock(sdev->lock);
+	stub_flush_endpoints(sdev);
+	usbip_mutex_unlock(sdev->lock);
+
+	do {
+		usbip_mutex_lock(sdev->lock);
+		inflight = sdev->inflight;
+		usbip_mutex_unlock(sdev->lock);
+		if (inflight)
+			usbip_delay_ms(10);
+	} while (inflight);
+
+	/* it hands replies over to the tx task */
+	stub_udp_stop_tx(sdev);
+	usbip_queue_send(sdev->tx_queue, NULL);
+	usbip_sem_take(sdev->tx_done);
+
+	stub_clear_endpoints(sdev);
+	stub_release_interfaces(sdev);
+	stub_readahead_free(sdev);
+	stub_iso_free(sdev);
+
+	info("session closed: %s", edev->busid);
+	info("OUT: %u URBs, %llu bytes zero-copy, %llu copied, %llu dropped",
+	     (unsigned)sdev->stats.out_urbs,
+	     (unsigned long long)sdev->stats.out_direct,
+	     (unsigned long long)sdev->stats.out_copied,
+	     (unsigned long long)sdev->stats.out_dropped);
+	if (sdev->dispatch_count)
+		info("completion to dispatch: avg %u us, max %u us, %u URBs",
+		     (unsigned)(sdev->dispatch_total_us / sdev->dispatch_count),
+		     (unsigned)sdev->dispatch_max_us,
+		     (unsigned)sdev->dispatch_count);
+	info("%u descriptor requests answered from the cache",
+	     (unsigned)sdev->desc_cached);
+	info("TX: %u replies sent at once, %u bulk replies in %u sends",
+	     (unsigned)sdev->tx_immediate, (unsigned)sdev->tx_coalesced,
+	     (unsigned)sdev->tx_batches);
+	if (sdev->split_urbs)
+		info("%u URBs split into %u transfers",
+		     (unsigned)sdev->split_urbs, (unsigned)sdev->split_chunks);
+	if (sdev->iso_urbs)
+		info("%u isochronous URBs in %u transfers allocated",
+		     (unsigned)sdev->iso_urbs, (unsigned)sdev->iso_allocs);
+	if (sdev->z) {
+		info("compressed OUT: %u URBs, %llu bytes in %llu",
+		     (unsigned)sdev->z->out_urbs,
+		     (unsigned long long)sdev->z->out_raw,
+		     (unsigned long long)sdev->z->out_wire);
+		info("compressed IN: %u URBs, %llu bytes in %llu, %u sent as they were",
+		     (unsigned)sdev->z->in_urbs,
+		     (unsigned long long)sdev->z->in_raw,
+		     (unsigned long long)sdev->z->in_wire,
+		     (unsigned)sdev->z->in_raw_urbs);
+	}
+	stub_udp_log_stats(sdev);
+	stub_resume_log_stats(sdev);
+	usbip_pool_log_stats();
+	stub_device_free(sdev);
+	return 0;
+}
@@ -0,0 +1,459 @@
+#define LOG_LOCAL_LEVEL	CONFIG_USBIP_LOG_LEVEL_STUB
+
+#include <stdlib.h>
+#include <string.h>
+#include "stub.h"
+
+#define err(...)    USBIP_LOGE(TAG, __VA_ARGS__)
+#define info(...)   USBIP_LOGI(TAG, __VA_ARGS__)
+#define dbg(...)    USBIP_LOGD(TAG, __VA_ARGS__)
+
+static const char *TAG = "stub_resume";
+
+/* sessions that can be resumed; one held here is not freed meanwhile */
+static usbip_mutex_t resume_lock;
+static struct stub_resume *resumable;
+
+int stub_resume_init(void)
+{
+	resume_lock = usbip_mutex_create();
+	return resume_lock ? 0 : -1;
+}
+
+/*
+ * Bytes the stack holds unacknowledged are lost with the connection; keep
+ * them within what is kept to be sent again. Linux doubles the value, lwIP
+ * does not take it and has a smaller buffer anyway.
+ */
+static void stub_resume_bound(int sockfd)
+{
+	int size = STUB_RESUME_BUFFER / 2;
+
+	setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+}
+
+/* called with res->lock held */
+static void stub_resume_park_locked(struct stub_resume *res)
+{
+	struct stub_device *sdev = res->sdev;
+
+	if (res->parked || res->ended)
+		return;
+	res->parked = 1;
+	res->deadline_us = usbip_time_us() + STUB_RESUME_GRACE_US;
+	/* whichever task is still on the connection lets go of it */
+	shutdown(sdev->sockfd, SHUT_RDWR);
+	info("%s: connection lost, held for %u ms", sdev->edev->busid,
+	     (unsigned)(STUB_RESUME_GRACE_US / 1000));
+}
+
+/*
+ * Wait while parked, for the tx task until a connection is handed over;
+ * -1 when the session ends instead.
+ */
+static int stub_resume_wait(struct stub_resume *res, usbip_sem_t wake)
+{
+	int ret;
+
+	usbip_mutex_lock(res->lock);
+	while (res->parked && !res->ended &&
+	       (wake != res->tx_wake || res->new_fd < 0)) {
+		int64_t left = res->deadline_us - usbip_time_us();
+
+		if (left <= 0) {
+			res->ended = 1;
+			info("%s: not resumed in time", res->sdev->edev->busid);
+			break;
+		}
+		usbip_mutex_unlock(res->lock);
+		usbip_sem_take_timeout(wake, left);
+		usbip_mutex_lock(res->lock);
+	}
+	ret = res->ended ? -1 : 0;
+	usbip_mutex_unlock(res->lock);
+
+	return ret;
+}
+
+/*
+ * recv() of the rx task. Bytes count once taken from the current
+ * connection; a failed one parks the session, and the wait for the next
+ * one happens right here, so the rx task carries on in the middle of a PDU.
+ */
+static ssize_t stub_resume_recv(struct usbip_rx *rx, void *buff, size_t len)
+{
+	struct stub_device *sdev = rx->ctx;
+	struct stub_resume *res = sdev->resume;
+
+	for (;;) {
+		unsigned gen;
+		int sockfd, parked;
+		ssize_t n;
+
+		usbip_mutex_lock(res->lock);
+		if (res->stale_fd >= 0) {
+			close(res->stale_fd);
+			res->stale_fd = -1;
+		}
+		gen = res->gen;
+		sockfd = sdev->sockfd;
+		parked = res->parked;
+		res->in_recv = !parked;
+		usbip_mutex_unlock(res->lock);
+
+		if (parked) {
+			if (stub_resume_wait(res, res->rx_wake) < 0)
+				return -1;
+			continue;
+		}
+
+		n = recv(sockfd, buff, len, 0);
+
+		usbip_mutex_lock(res->lock);
+		res->in_recv = 0;
+		if (gen != res->gen) {
+			/* the old connection, the client sends it again */
+			n = -1;
+		} else if (n > 0) {
+			res->rx_bytes += n;
+		} else if (n == 0 && !res->parked) {
+			/* closed by the client, the session is over */
+			usbip_mutex_unlock(res->lock);
+			return 0;
+		} else {
+			stub_resume_park_locked(res);
+		}
+		usbip_mutex_unlock(res->lock);
+
+		if (n > 0)
+			return n;
+	}
+}
+
+/* Keep what is sent, the tail of it when it is larger than the buffer. */
+static void stub_resume_keep(struct stub_resume *res, const struct iovec *iov,
+			     int iovcnt)
+{
+	for (int i = 0; i < iovcnt; i++) {
+		const uint8_t *p = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+
+		res->tx_bytes += len;
+		if (len > STUB_RESUME_BUFFER) {
+			p += len - STUB_RESUME_BUFFER;
+			len = STUB_RESUME_BUFFER;
+		}
+		res->ring_kept += len;
+		while (len > 0) {
+			size_t n = STUB_RESUME_BUFFER - res->ring_head;
+
+			if (n > len)
+				n = len;
+			memcpy(res->ring + res->ring_head, p, n);
+			res->ring_head = (res->ring_head + n) % STUB_RESUME_BUFFER;
+			p += n;
+			len -= n;
+		}
+	}
+	if (res->ring_kept > STUB_RESUME_BUFFER)
+		res->ring_kept = STUB_RESUME_BUFFER;
+}
+
+/* called with res->tx_lock held: the reply, then what the client missed */
+static int stub_resume_reply(struct stub_resume *res, int sockfd,
+			     uint32_t received, uint32_t missed)
+{
+	struct op_resume_reply reply;
+	struct iovec iov[3];
+	size_t start = (res->ring_head + STUB_RESUME_BUFFER - missed) %
+		       STUB_RESUME_BUFFER;
+	size_t n = STUB_RESUME_BUFFER - start;
+
+	if (n > missed)
+		n = missed;
+
+	reply.received = received;
+	PACK_OP_RESUME_REPLY(1, &reply);
+	iov[0].iov_base = &reply;
+	iov[0].iov_len = sizeof(reply);
+	iov[1].iov_base = res->ring + start;
+	iov[1].iov_len = n;
+	iov[2].iov_base = res->ring;
+	iov[2].iov_len = missed - n;
+
+	if (usbip_net_send_op_common(sockfd, OP_REP_RESUME, ST_OK) < 0 ||
+	    usbip_net_sendv(sockfd, iov, 3) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ * Take up the connection stub_resume() handed over, with res->tx_lock held,
+ * so nothing else is sent meanwhile: answer the client, and send it what it
+ * missed unless that is no longer kept.
+ */
+static void stub_resume_switch(struct stub_resume *res)
+{
+	struct stub_device *sdev = res->sdev;
+	uint32_t received = 0, missed = 0;
+	int status = ST_OK;
+	int sockfd;
+
+	usbip_mutex_lock(res->lock);
+	sockfd = res->new_fd;
+	if (sockfd < 0) {
+		usbip_mutex_unlock(res->lock);
+		return;
+	}
+	res->new_fd = -1;
+	missed = res->tx_bytes - res->new_received;
+	if (res->ended) {
+		status = ST_NA;
+	} else if (missed > res->ring_kept) {
+		err("%s: %u bytes lost, %u kept, the session ends",
+		    sdev->edev->busid, (unsigned)missed,
+		    (unsigned)res->ring_kept);
+		res->ended = 1;
+		status = ST_NA;
+	} else {
+		res->stale_fd = sdev->sockfd;
+		sdev->sockfd = sockfd;
+		sdev->rx->sockfd = sockfd;
+		res->gen++;
+		res->parked = 0;
+		received = res->rx_bytes;
+		res->resumed++;
+		res->replayed += missed;
+	}
+	usbip_mutex_unlock(res->lock);
+
+	if (status != ST_OK) {
+		usbip_net_send_op_common(sockfd, OP_REP_RESUME, status);
+		close(sockfd);
+		usbip_sem_give(res->rx_wake);
+		return;
+	}
+
+	usbip_net_set_nodelay(sockfd);
+	stub_resume_bound(sockfd);
+	if (stub_resume_reply(res, sockfd, received, missed) < 0) {
+		/* gone again, the client may try once more */
+		usbip_mutex_lock(res->lock);
+		stub_resume_park_locked(res);
+		usbip_mutex_unlock(res->lock);
+	}
+	stub_udp_unlatch(sdev);
+	info("%s: resumed, %u bytes sent again", sdev->edev->busid,
+	     (unsigned)missed);
+	usbip_sem_give(res->rx_wake);
+}
+
+void stub_resume_take_over(struct stub_device *sdev)
+{
+	struct stub_resume *res = sdev->resume;
+	int pending;
+
+	if (!res)
+		return;
+
+	usbip_mutex_lock(res->lock);
+	pending = res->new_fd >= 0;
+	usbip_mutex_unlock(res->lock);
+	if (!pending)
+		return;
+
+	usbip_mutex_lock(res->tx_lock);
+	stub_resume_switch(res);
+	usbip_mutex_unlock(res->tx_lock);
+}
+
+int stub_send(struct stub_device *sdev, struct iovec *iov, int iovcnt)
+{
+	struct stub_resume *res = sdev->resume;
+	int parked;
+
+	if (!res)
+		return usbip_net_sendv(sdev->sockfd, iov, iovcnt) < 0 ? -1 : 0;
+
+	/* parked, replies wait here and those behind them in the queue */
+	for (;;) {
+		if (stub_resume_wait(res, res->tx_wake) < 0)
+			return -1;
+		usbip_mutex_lock(res->tx_lock);
+		stub_resume_switch(res);
+		usbip_mutex_lock(res->lock);
+		parked = res->parked;
+		usbip_mutex_unlock(res->lock);
+		if (!parked)
+			break;
+		usbip_mutex_unlock(res->tx_lock);
+	}
+
+	stub_resume_keep(res, iov, iovcnt);
+	if (usbip_net_sendv(sdev->sockfd, iov, iovcnt) < 0) {
+		usbip_mutex_lock(res->lock);
+		stub_resume_park_locked(res);
+		usbip_mutex_unlock(res->lock);
+	}
+	usbip_mutex_unlock(res->tx_lock);
+
+	return 0;
+}
+
+int stub_resume(const struct op_resume_request *req, int sockfd)
+{
+	struct stub_resume *res;
+	struct stub_device *sdev;
+	int status = ST_OK;
+
+	usbip_mutex_lock(resume_lock);
+	for (res = resumable; res; res = res->next) {
+		if (!memcmp(res->token, req->token, sizeof(res->token)))
+			break;
+	}
+	if (!res) {
+		usbip_mutex_unlock(resume_lock);
+		return ST_NA;
+	}
+	sdev = res->sdev;
+
+	/* the client knows better than a connection that still looks fine */
+	usbip_mutex_lock(res->lock);
+	if (res->stale_fd >= 0 && !res->in_recv) {
+		close(res->stale_fd);
+		res->stale_fd = -1;
+	}
+	if (res->ended) {
+		status = ST_NA;
+	} else if (res->stale_fd >= 0 || res->new_fd >= 0) {
+		/* the rx task is still on the one before, or the tx task */
+		status = ST_DEV_BUSY;
+	} else {
+		res->new_fd = sockfd;
+		res->new_received = req->received;
+		stub_resume_park_locked(res);
+	}
+	usbip_mutex_unlock(res->lock);
+
+	if (status == ST_OK) {
+		/* the tx task is off the old connection when it takes this up */
+		usbip_sem_give(res->tx_wake);
+		usbip_mutex_lock(sdev->lock);
+		stub_tx_wake_locked(sdev);
+		usbip_mutex_unlock(sdev->lock);
+	}
+	usbip_mutex_unlock(resume_lock);
+
+	return status;
+}
+
+void stub_resume_park_all(void)
+{
+	if (!resume_lock)
+		return;
+
+	usbip_mutex_lock(resume_lock);
+	for (struct stub_resume *res = resumable; res; res = res->next) {
+		usbip_mutex_lock(res->lock);
+		stub_resume_park_locked(res);
+		usbip_mutex_unlock(res->lock);
+	}
+	usbip_mutex_unlock(resume_lock);
+}
+
+int stub_resume_start(struct stub_device *sdev, const struct stub_features *feat)
+{
+	struct stub_resume *res;
+
+	res = calloc(1, sizeof(*res));
+	if (!res)
+		return -1;
+	sdev->resume = res;
+
+	res->sdev = sdev;
+	memcpy(res->token, feat->resume_token, sizeof(res->token));
+	res->stale_fd = -1;
+	res->new_fd = -1;
+	res->ring = malloc(STUB_RESUME_BUFFER);
+	res->tx_lock = usbip_mutex_create();
+	res->lock = usbip_mutex_create();
+	res->rx_wake = usbip_sem_create(1, 0);
+	res->tx_wake = usbip_sem_create(1, 0);
+	if (!res->ring || !res->tx_lock || !res->lock || !res->rx_wake ||
+	    !res->tx_wake) {
+		stub_resume_free(sdev);
+		return -1;
+	}
+
+	sdev->rx->recv = stub_resume_recv;
+	sdev->rx->ctx = sdev;
+	stub_resume_bound(sdev->sockfd);
+
+	usbip_mutex_lock(resume_lock);
+	res->next = resumable;
+	resumable = res;
+	usbip_mutex_unlock(resume_lock);
+
+	return 0;
+}
+
+static void stub_resume_unlist(struct stub_resume *res)
+{
+	usbip_mutex_lock(resume_lock);
+	for (struct stub_resume **p = &resumable; *p; p = &(*p)->next) {
+		if (*p == res) {
+			*p = res->next;
+			break;
+		}
+	}
+	usbip_mutex_unlock(resume_lock);
+}
+
+void stub_resume_end(struct stub_device *sdev)
+{
+	struct stub_resume *res = sdev->resume;
+
+	if (!res)
+		return;
+
+	stub_resume_unlist(res);
+	usbip_mutex_lock(res->lock);
+	res->ended = 1;
+	usbip_mutex_unlock(res->lock);
+	usbip_sem_give(res->tx_wake);
+}
+
+void stub_resume_free(struct stub_device *sdev)
+{
+	struct stub_resume *res = sdev->resume;
+
+	if (!res)
+		return;
+
+	stub_resume_unlist(res);
+	if (res->stale_fd >= 0)
+		close(res->stale_fd);
+	if (res->new_fd >= 0)
+		close(res->new_fd);
+	free(res->ring);
+	if (res->tx_lock)
+		usbip_mutex_delete(res->tx_lock);
+	if (res->lock)
+		usbip_mutex_delete(res->lock);
+	if (res->rx_wake)
+		usbip_sem_delete(res->rx_wake);
+	if (res->tx_wake)
+		usbip_sem_delete(res->tx_wake);
+	free(res);
+	sdev->resume = NULL;
+}
+
+void stub_resume_log_stats(struct stub_device *sdev)
+{
+	struct stub_resume *res = sdev->resume;
+
+	if (!res)
+		return;
+	info("resumed %u times, %u bytes sent again", (unsigned)res->resumed,
+	     (unsigned)res->replayed);
+}
@@ -0,0 +1,1310 @@
+#define LOG_LOCAL_LEVEL	CONFIG_USBIP_LOG_LEVEL_STUB
+
+#include <stdlib.h>
+#include <string.h>
+#include "stub.h"
+#include "usbip_pool.h"
+#include "usbip_trace.h"
+
+#define err(...)    USBIP_LOGE(TAG, __VA_ARGS__)
+#define info(...)   USBIP_LOGI(TAG, __VA_ARGS__)
+#define dbg(...)    USBIP_LOGD(TAG, __VA_ARGS__)
+
+static const char *TAG = "stub_rx";
+
+/* URB transfer_flags as sent by Linux vhci */
+#define URB_SHORT_NOT_OK	0x0001
+#define URB_ISO_ASAP		0x0002
+#define URB_ZERO_PACKET		0x0040
+
+/* standard requests the stub has to look at, see tweak_special_requests() */
+#define USB_REQ_CLEAR_FEATURE		0x01
+#define USB_REQ_GET_DESCRIPTOR		0x06
+#define USB_REQ_SET_CONFIGURATION	0x09
+#define USB_REQ_SET_INTERFACE		0x0b
+#define USB_ENDPOINT_HALT		0x00
+
+static inline int stub_round_up(int len, int mps)
+{
+	return mps ? ((len + mps - 1) / mps) * mps : len;
+}
+
+static void stub_hash_add_locked(struct stub_device *sdev,
+				 struct stub_priv *priv)
+{
+	struct stub_priv **head = &sdev->hash[STUB_HASH(priv->seqnum)];
+
+	priv->hash_next = *head;
+	*head = priv;
+}
+
+static void stub_hash_del_locked(struct stub_device *sdev,
+				 struct stub_priv *priv)
+{
+	struct stub_priv **p = &sdev->hash[STUB_HASH(priv->seqnum)];
+
+	for (; *p; p = &(*p)->hash_next) {
+		if (*p == priv) {
+			*p = priv->hash_next;
+			break;
+		}
+	}
+	priv->hash_next = NULL;
+}
+
+static struct stub_priv *stub_hash_find_locked(struct stub_device *sdev,
+					       uint32_t seqnum)
+{
+	struct stub_priv *priv = sdev->hash[STUB_HASH(seqnum)];
+
+	while (priv && priv->seqnum != seqnum)
+		priv = priv->hash_next;
+
+	return priv;
+}
+
+static void stub_pending_del_locked(struct stub_endpoint *sep,
+				    struct stub_priv *priv)
+{
+	if (priv->prev)
+		priv->prev->next = priv->next;
+	else
+		sep->pending_head = priv->next;
+	if (priv->next)
+		priv->next->prev = priv->prev;
+	else
+		sep->pending_tail = priv->prev;
+	priv->next = priv->prev = NULL;
+}
+
+/* Hand priv to the task sending its reply, that of its datagram channel. */
+static void stub_reply(struct stub_device *sdev, struct stub_priv *priv)
+{
+	usbip_queue_send(priv->udp ? sdev->udp->tx_queue : sdev->tx_queue, priv);
+}
+
+/* Answer priv with status and no data, its transfer given back already. */
+static void stub_reply_status(struct stub_device *sdev,
+			      struct stub_priv *priv, int32_t status)
+{
+	/* the chunks of a split one go with priv, their data is dropped */
+	if (priv->split) {
+		priv->split->status = status;
+		priv->split->actual = 0;
+	}
+	priv->status = status;
+	stub_reply(sdev, priv);
+}
+
+/* Hand a stub_priv that never reached the bus to the tx task. */
+static void stub_complete_local(struct stub_device *sdev,
+				struct stub_priv *priv, int32_t status)
+{
+	stub_transfer_put(sdev, priv);
+	stub_reply_status(sdev, priv, status);
+}
+
+static void stub_complete_local_locked(struct stub_device *sdev,
+				       struct stub_priv *priv, int32_t status)
+{
+	stub_transfer_put_locked(sdev, priv);
+	stub_reply_status(sdev, priv, status);
+}
+
+static int stub_submit_locked(struct stub_device *sdev, struct stub_priv *priv)
+{
+	struct stub_endpoint *sep = priv->sep;
+
+	if (sdev->ops->transfer_submit(sdev->ctx, priv->transfer) < 0) {
+		dbg("submit seqnum %u failed", priv->seqnum);
+		return -1;
+	}
+
+	usbip_trace(USBIP_TRACE_SUBMIT, sdev->sockfd, priv->seqnum,
+		    priv->transfer->num_bytes);
+	priv->submitted = 1;
+	priv->submitted_us = usbip_time_us();
+	sep->inflight++;
+	sdev->inflight++;
+	return 0;
+}
+
+/*
+ * Leave sep waiting for a pooled transfer. The tx task is woken up when the
+ * session is not starved already, it kicks the endpoint again.
+ */
+static void stub_starve_locked(struct stub_device *sdev,
+			       struct stub_endpoint *sep)
+{
+	sep->starved = 1;
+	if (!sdev->starved)
+		stub_tx_wake_locked(sdev);
+	sdev->starved = 1;
+}
+
+static void stub_split_complete(usb_transfer_t *transfer);
+
+/*
+ * An IN URB of an interrupt or bulk endpoint takes its transfer when it goes
+ * to the bus, see usbip_pool.h, a split one all of its chunks at once: one
+ * holding some while waiting for more could wait for another such URB.
+ * Returns -1 with the endpoint starved.
+ */
+static int stub_take_transfer_locked(struct stub_device *sdev,
+				     struct stub_priv *priv)
+{
+	struct stub_endpoint *sep = priv->sep;
+	struct stub_split *split = priv->split;
+	int32_t len = priv->transfer_buffer_length;
+	usb_transfer_t *transfer;
+	int num_bytes;
+
+	if (split) {
+		if (priv->direction != USBIP_DIR_IN || split->chunk[0])
+			return 0;
+		if (usbip_pool_try_get_n(sep->type, split->chunk_size, 1,
+					 split->chunk, split->nchunks) < 0) {
+			stub_starve_locked(sdev, sep);
+			return -1;
+		}
+		for (int i = 0; i < split->nchunks; i++) {
+			int32_t left = len - i * split->chunk_size;
+
+			transfer = split->chunk[i];
+			transfer->bEndpointAddress = sep->addr;
+			transfer->num_bytes = left < split->chunk_size ?
+					      stub_round_up(left, sep->mps) :
+					      split->chunk_size;
+			transfer->callback = stub_split_complete;
+			transfer->context = priv;
+		}
+		return 0;
+	}
+
+	if (priv->transfer)
+		return 0;
+	num_bytes = stub_round_up(len, sep->mps);
+	if (usbip_pool_try_get(sep->type, num_bytes, 1, &transfer) < 0) {
+		stub_starve_locked(sdev, sep);
+		return -1;
+	}
+	transfer->bEndpointAddress = sep->addr;
+	transfer->num_bytes = num_bytes;
+	transfer->callback = stub_complete;
+	transfer->context = priv;
+	priv->transfer = transfer;
+	return 0;
+}
+
+/*
+ * Submit the chunks of a split URB that may go to the bus. Returns 1 once no
+ * further chunk will, so the URBs queued behind it may follow.
+ */
+static int stub_split_kick_locked(struct stub_device *sdev,
+				  struct stub_priv *priv)
+{
+	struct stub_endpoint *sep = priv->sep;
+	struct stub_split *split = priv->split;
+	int dir_in = priv->direction == USBIP_DIR_IN;
+
+	while (!split->ended && split->next < split->ready &&
+	       sep->inflight < sep->depth && !(dir_in && split->inflight)) {
+		usb_transfer_t *transfer = split->chunk[split->next];
+
+		if (sdev->ops->transfer_submit(sdev->ctx, transfer) < 0) {
+			dbg("submit seqnum %u chunk %d failed", priv->seqnum,
+			    split->next);
+			split->ended = 1;
+			split->status = -USBIP_EPIPE;
+			break;
+		}
+		usbip_trace(USBIP_TRACE_SUBMIT, sdev->sockfd, priv->seqnum,
+			    transfer->num_bytes);
+		split->next++;
+		split->inflight++;
+		sep->inflight++;
+		sdev->inflight++;
+		sdev->split_chunks++;
+	}
+
+	return split->ended || split->next == split->nchunks;
+}
+
+/*
+ * Answer a split URB once neither the host stack nor the rx side holds any
+ * of it. Returns 1 if it has been handed to the tx task.
+ */
+static int stub_split_finish_locked(struct stub_device *sdev,
+				    struct stub_priv *priv)
+{
+	struct stub_endpoint *sep = priv->sep;
+	struct stub_split *split = priv->split;
+
+	if (split->inflight || split->ready < split->nchunks ||
+	    (!split->ended && split->done < split->nchunks))
+		return 0;
+
+	if (sep->active == priv)
+		sep->active = NULL;
+	else if (!priv->submitted)
+		stub_pending_del_locked(sep, priv);
+	stub_hash_del_locked(sdev, priv);
+
+	priv->completed_us = usbip_time_us();
+	stub_reply(sdev, priv);
+	return 1;
+}
+
+/* Hand the oldest queued transfer back to the spare ones. */
+static void stub_readahead_pop(struct stub_readahead *ra)
+{
+	ra->spare[ra->nspare++] = ra->full[ra->head];
+	ra->head = (ra->head + 1) % ra->ntransfers;
+	ra->count--;
+	ra->offset = 0;
+}
+
+static void stub_readahead_answer_locked(struct stub_device *sdev,
+					 struct stub_readahead *ra,
+					 struct stub_priv *priv, int waited)
+{
+	stub_pending_del_locked(ra->sep, priv);
+	stub_hash_del_locked(sdev, priv);
+
+	/* the wait for data counts as time on the bus */
+	priv->submitted_us = priv->received_us;
+	priv->completed_us = usbip_time_us();
+	if (waited)
+		ra->waited++;
+	else
+		ra->served++;
+	stub_reply(sdev, priv);
+}
+
+/* A URB served by read-ahead ended by the failed transfer in, with no data. */
+static void stub_readahead_fail(struct stub_priv *priv, usb_transfer_t *in)
+{
+	if (priv->split)
+		priv->split->status = stub_transfer_status(in);
+	else
+		priv->transfer->status = in->status;
+}
+
+/*
+ * Move queued data into the waiting URBs, oldest first. A URB is answered
+ * when it is full or a short transfer ends; a failed transfer ends the URB
+ * before it, or is the answer of the next one. A split URB is filled chunk
+ * after chunk.
+ */
+static void stub_readahead_serve_locked(struct stub_device *sdev,
+					struct stub_readahead *ra, int waited)
+{
+	struct stub_endpoint *sep = ra->sep;
+
+	while (sep->pending_head) {
+		struct stub_priv *priv = sep->pending_head;
+		struct stub_split *split = priv->split;
+		usb_transfer_t *out = priv->transfer;
+		usb_transfer_t *in;
+		int32_t filled;
+		int done = 0;
+
+		/* the URB takes its transfer once there is data for it */
+		if (split ? !split->chunk[0] : !out) {
+			if (!ra->count || stub_take_transfer_locked(sdev, priv) < 0)
+				break;
+			out = priv->transfer;
+		}
+		if (out)
+			out->status = USB_TRANSFER_STATUS_COMPLETED;
+
+		filled = split ? split->actual : out->actual_num_bytes;
+		if (filled == priv->transfer_buffer_length) {
+			stub_readahead_answer_locked(sdev, ra, priv, waited);
+			continue;
+		}
+		if (!ra->count)
+			break;
+
+		in = ra->full[ra->head];
+		if (in->status != USB_TRANSFER_STATUS_COMPLETED) {
+			if (!filled) {
+				stub_readahead_fail(priv, in);
+				stub_readahead_pop(ra);
+			}
+			done = 1;
+		} else {
+			int n = in->actual_num_bytes - ra->offset;
+			int room = priv->transfer_buffer_length - filled;
+			int at = filled;
+
+			if (split) {
+				out = split->chunk[filled / split->chunk_size];
+				at = filled % split->chunk_size;
+				if (room > split->chunk_size - at)
+					room = split->chunk_size - at;
+			}
+			if (n > room)
+				n = room;
+			memcpy(out->data_buffer + at, in->data_buffer + ra->offset, n);
+			out->actual_num_bytes += n;
+			if (split)
+				split->actual += n;
+			ra->offset += n;
+			if (ra->offset == in->actual_num_bytes) {
+				done = in->actual_num_bytes < in->num_bytes;
+				stub_readahead_pop(ra);
+			}
+		}
+
+		if (done)
+			stub_readahead_answer_locked(sdev, ra, priv, waited);
+	}
+}
+
+/*
+ * Keep transfers on the bus. Unless old data may be dropped, a transfer is
+ * only armed when there is room for its data, so a device whose data is not
+ * picked up is left alone and keeps it.
+ */
+static void stub_readahead_arm_locked(struct stub_device *sdev,
+				      struct stub_readahead *ra)
+{
+	struct stub_endpoint *sep = ra->sep;
+
+	while (ra->armed < ra->max_armed) {
+		usb_transfer_t *transfer;
+
+		if (!ra->nspare && ra->drop_oldest && ra->count) {
+			stub_readahead_pop(ra);
+			ra->dropped++;
+		}
+		if (!ra->nspare)
+			break;
+
+		transfer = ra->spare[--ra->nspare];
+		if (sdev->ops->transfer_submit(sdev->ctx, transfer) < 0) {
+			ra->spare[ra->nspare++] = transfer;
+			break;
+		}
+		ra->armed++;
+		sep->inflight++;
+		sdev->inflight++;
+	}
+}
+
+static void stub_readahead_kick_locked(struct stub_device *sdev,
+				       struct stub_readahead *ra)
+{
+	struct stub_endpoint *sep = ra->sep;
+
+	stub_readahead_serve_locked(sdev, ra, 0);
+	stub_readahead_arm_locked(sdev, ra);
+
+	/* nothing queued and the device refuses transfers: halted or gone */
+	if (!ra->armed && !ra->count) {
+		while (sep->pending_head) {
+			struct stub_priv *priv = sep->pending_head;
+
+			stub_pending_del_locked(sep, priv);
+			stub_hash_del_locked(sdev, priv);
+			stub_complete_local_locked(sdev, priv, -USBIP_EPIPE);
+		}
+	}
+}
+
+void stub_readahead_complete(usb_transfer_t *transfer)
+{
+	struct stub_readahead *ra = transfer->context;
+	struct stub_device *sdev = ra->sdev;
+	struct stub_endpoint *sep = ra->sep;
+
+	usbip_mutex_lock(sdev->lock);
+	ra->armed--;
+	sep->inflight--;
+	sdev->inflight--;
+
+	/* flushed: armed again by the next CMD_SUBMIT; or the endpoint is gone */
+	if (sdev->shutdown || !sep->mps ||
+	    transfer->status == USB_TRANSFER_STATUS_CANCELED) {
+		ra->spare[ra->nspare++] = transfer;
+		usbip_mutex_unlock(sdev->lock);
+		return;
+	}
+
+	ra->full[(ra->head + ra->count) % ra->ntransfers] = transfer;
+	ra->count++;
+	ra->fetched++;
+	ra->bytes += transfer->actual_num_bytes;
+
+	stub_readahead_serve_locked(sdev, ra, 1);
+	/* an error goes to the client, which clears it before reading on */
+	if (transfer->status == USB_TRANSFER_STATUS_COMPLETED)
+		stub_readahead_arm_locked(sdev, ra);
+	usbip_mutex_unlock(sdev->lock);
+}
+
+/*
+ * An endpoint of the alternate setting its interface left: the URBs queued
+ * on it fail, a split one on the bus once its chunks are back, and what was
+ * read ahead from it is dropped.
+ */
+static void stub_drop_endpoint_locked(struct stub_device *sdev,
+				      struct stub_endpoint *sep)
+{
+	struct stub_readahead *ra = sep->readahead;
+	struct stub_priv *priv = sep->active;
+
+	if (priv) {
+		if (!priv->split->ended) {
+			priv->split->ended = 1;
+			priv->split->status = -USBIP_EPIPE;
+		}
+		stub_split_finish_locked(sdev, priv);
+	}
+
+	while (sep->pending_head) {
+		priv = sep->pending_head;
+		stub_pending_del_locked(sep, priv);
+		stub_hash_del_locked(sdev, priv);
+		stub_complete_local_locked(sdev, priv, -USBIP_EPIPE);
+	}
+
+	while (ra && ra->count)
+		stub_readahead_pop(ra);
+}
+
+/* Submit queued URBs of an endpoint while it has free slots. */
+void stub_kick_endpoint_locked(struct stub_device *sdev,
+			       struct stub_endpoint *sep)
+{
+	if (!sep->mps) {
+		stub_drop_endpoint_locked(sdev, sep);
+		return;
+	}
+	if (sep->readahead && !sep->readahead->disabled) {
+		stub_readahead_kick_locked(sdev, sep->readahead);
+		return;
+	}
+
+	for (;;) {
+		struct stub_priv *priv = sep->active;
+
+		if (!priv) {
+			priv = sep->pending_head;
+			if (!priv || sep->inflight >= sep->depth)
+				break;
+			if (stub_take_transfer_locked(sdev, priv) < 0)
+				break;
+
+			stub_pending_del_locked(sep, priv);
+			if (!priv->split) {
+				if (stub_submit_locked(sdev, priv) < 0) {
+					stub_hash_del_locked(sdev, priv);
+					stub_complete_local_locked(sdev, priv,
+								   -USBIP_EPIPE);
+				}
+				continue;
+			}
+			priv->submitted = 1;
+			priv->submitted_us = usbip_time_us();
+			sep->active = priv;
+		}
+
+		if (!stub_split_kick_locked(sdev, priv))
+			break;
+		sep->active = NULL;
+		stub_split_finish_locked(sdev, priv);
+	}
+}
+
+static void stub_kick_starved_locked(struct stub_device *sdev)
+{
+	int starved = 0;
+
+	if (!sdev->starved)
+		return;
+
+	for (int i = 0; i < STUB_NUM_EPS && !sdev->shutdown; i++) {
+		struct stub_endpoint *sep = &sdev->eps[i];
+
+		if (!sep->starved)
+			continue;
+		sep->starved = 0;
+		stub_kick_endpoint_locked(sdev, sep);
+		starved |= sep->starved;
+	}
+	sdev->starved = starved;
+}
+
+void stub_kick_starved(struct stub_device *sdev)
+{
+	if (!sdev->starved)
+		return;
+
+	usbip_mutex_lock(sdev->lock);
+	stub_kick_starved_locked(sdev);
+	usbip_mutex_unlock(sdev->lock);
+}
+
+static void stub_split_complete(usb_transfer_t *transfer)
+{
+	struct stub_priv *priv = transfer->context;
+	struct stub_device *sdev = priv->sdev;
+	struct stub_endpoint *sep = priv->sep;
+	struct stub_split *split = priv->split;
+	int dir_in = priv->direction == USBIP_DIR_IN;
+
+	usbip_trace(USBIP_TRACE_COMPLETE, sdev->sockfd, priv->seqnum,
+		    transfer->actual_num_bytes);
+
+	usbip_mutex_lock(sdev->lock);
+	split->inflight--;
+	sep->inflight--;
+	sdev->inflight--;
+	split->done++;
+	split->actual += transfer->actual_num_bytes;
+	if (transfer->status != USB_TRANSFER_STATUS_COMPLETED) {
+		split->ended = 1;
+		split->status = stub_transfer_status(transfer);
+	} else if (dir_in &&
+		   transfer->actual_num_bytes < transfer->num_bytes) {
+		split->ended = 1;
+	}
+	if (sdev->shutdown)
+		split->ended = 1;
+
+	/* OUT chunks go back to the pool for the rx side right away */
+	if (!dir_in) {
+		split->chunk[split->done - 1] = NULL;
+		usbip_pool_put(transfer);
+	}
+
+	stub_split_finish_locked(sdev, priv);
+	if (!sdev->shutdown) {
+		stub_kick_endpoint_locked(sdev, sep);
+		/* and to the endpoints starved of one */
+		if (!dir_in)
+			stub_kick_starved_locked(sdev);
+	}
+	usbip_mutex_unlock(sdev->lock);
+}
+
+void stub_complete(usb_transfer_t *transfer)
+{
+	struct stub_priv *priv = transfer->context;
+	struct stub_device *sdev = priv->sdev;
+	struct stub_endpoint *sep = priv->sep;
+
+	priv->completed_us = usbip_time_us();
+	usbip_trace(USBIP_TRACE_COMPLETE, sdev->sockfd, priv->seqnum,
+		    transfer->actual_num_bytes);
+
+	usbip_mutex_lock(sdev->lock);
+	stub_hash_del_locked(sdev, priv);
+	sep->inflight--;
+	sdev->inflight--;
+	if (!sdev->shutdown)
+		stub_kick_endpoint_locked(sdev, sep);
+	usbip_mutex_unlock(sdev->lock);
+
+	stub_reply(sdev, priv);
+}
+
+static void stub_enqueue(struct stub_device *sdev, struct stub_priv *priv)
+{
+	struct stub_endpoint *sep = priv->sep;
+
+	usbip_mutex_lock(sdev->lock);
+	stub_hash_add_locked(sdev, priv);
+	priv->prev = sep->pending_tail;
+	if (sep->pending_tail)
+		sep->pending_tail->next = priv;
+	else
+		sep->pending_head = priv;
+	sep->pending_tail = priv;
+	stub_kick_endpoint_locked(sdev, sep);
+	usbip_mutex_unlock(sdev->lock);
+}
+
+/* Throw away a payload we cannot use to keep the stream in sync. */
+static int stub_drain(struct stub_device *sdev, int32_t len)
+{
+	uint8_t buf[64];
+
+	if (len > 0)
+		sdev->stats.out_dropped += len;
+
+	while (len > 0) {
+		int n = len < sizeof(buf) ? len : sizeof(buf);
+
+		if (usbip_rx_recv(sdev->rx, buf, n) < 0)
+			return -1;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * The device, active configuration and string descriptors are kept by the
+ * host side since attach. Returns -1 for anything not cached.
+ */
+static int stub_cached_descriptor(struct stub_device *sdev,
+				  const usb_setup_packet_t *setup,
+				  uint8_t *data, int *len)
+{
+	const usb_device_desc_t *device_desc;
+	const usb_config_desc_t *config_desc;
+	const void *desc;
+	int type = setup->wValue >> 8;
+	int index = setup->wValue & 0xff;
+	int desc_len;
+
+	if (sdev->ops->get_device_descriptor(sdev->ctx, &device_desc) < 0)
+		return -1;
+
+	switch (type) {
+	case USB_B_DESCRIPTOR_TYPE_DEVICE:
+		desc = device_desc;
+		desc_len = USB_DEVICE_DESC_SIZE;
+		break;
+	case USB_B_DESCRIPTOR_TYPE_CONFIGURATION:
+		/* only the active configuration is known */
+		if (index != 0 || device_desc->bNumConfigurations != 1 ||
+		    sdev->ops->get_config_descriptor(sdev->ctx, &config_desc) < 0)
+			return -1;
+		desc = config_desc;
+		desc_len = config_desc->wTotalLength;
+		break;
+	case USB_B_DESCRIPTOR_TYPE_STRING:
+		if (!sdev->ops->get_string_descriptor)
+			return -1;
+		return sdev->ops->get_string_descriptor(sdev->ctx, index,
+							setup->wIndex, data, len);
+	default:
+		return -1;
+	}
+
+	if (desc_len > *len)
+		desc_len = *len;
+	memcpy(data, desc, desc_len);
+	*len = desc_len;
+	return 0;
+}
+
+/*
+ * Some standard requests change state the USB host library keeps for us,
+ * so they cannot simply be forwarded, and descriptors need not go to the
+ * device at all. Returns 1 if the request has been answered locally.
+ */
+static int stub_tweak_special_requests(struct stub_device *sdev,
+				       struct stub_priv *priv,
+				       const usb_setup_packet_t *setup)
+{
+	if (setup->bmRequestType == 0x80 &&
+	    setup->bRequest == USB_REQ_GET_DESCRIPTOR) {
+		usb_transfer_t *transfer = priv->transfer;
+		int len = setup->wLength;
+
+		if (len > priv->transfer_buffer_length)
+			len = priv->transfer_buffer_length;
+		if (stub_cached_descriptor(sdev, setup, transfer->data_buffer +
+					   sizeof(usb_setup_packet_t), &len) < 0)
+			return 0;
+
+		/* complete it as if it had been on the bus */
+		transfer->actual_num_bytes = sizeof(usb_setup_packet_t) + len;
+		transfer->status = USB_TRANSFER_STATUS_COMPLETED;
+		sdev->desc_cached++;
+		stub_reply(sdev, priv);
+		return 1;
+	}
+
+	if (setup->bmRequestType == 0x00 &&
+	    setup->bRequest == USB_REQ_SET_CONFIGURATION) {
+		if (setup->wValue == sdev->bConfigurationValue) {
+			/* the host library configured the device on enumeration */
+			stub_complete_local(sdev, priv, 0);
+			return 1;
+		}
+		err("set configuration %d not supported", setup->wValue);
+		return 0;
+	}
+
+	if (setup->bmRequestType == 0x01 &&
+	    setup->bRequest == USB_REQ_SET_INTERFACE) {
+		info("set interface %d alt %d", setup->wIndex, setup->wValue);
+		if (stub_set_interface(sdev, setup->wIndex, setup->wValue) < 0)
+			err("could not switch interface %d", setup->wIndex);
+		return 0;
+	}
+
+	if (setup->bmRequestType == 0x02 &&
+	    setup->bRequest == USB_REQ_CLEAR_FEATURE &&
+	    setup->wValue == USB_ENDPOINT_HALT) {
+		uint8_t addr = setup->wIndex & 0xff;
+
+		/* a stalled pipe stays halted until the host library is told */
+		if (addr & 0x0f) {
+			sdev->ops->endpoint_halt(sdev->ctx, addr);
+			sdev->ops->endpoint_flush(sdev->ctx, addr);
+			sdev->ops->endpoint_clear(sdev->ctx, addr);
+		}
+		return 0;
+	}
+
+	return 0;
+}
+
+/*
+ * An isochronous URB carries its packet descriptors behind the OUT payload,
+ * in both directions. The host library wants the packets back to back, so
+ * OUT data the client spread out is moved together; the descriptors stay
+ * behind the data, in network order, for the answer. Returns -1 when the
+ * stream is lost.
+ */
+static int stub_recv_isoc(struct stub_device *sdev, struct stub_priv *priv,
+			  const struct usbip_header_cmd_submit *cmd, int dir_in)
+{
+	struct stub_endpoint *sep = priv->sep;
+	int32_t len = priv->transfer_buffer_length;
+	int32_t out_len = dir_in ? 0 : len;
+	int np = cmd->number_of_packets;
+	size_t desc_offset = (len + 3) & ~3;
+	size_t desc_len = np * sizeof(struct usbip_iso_packet_descriptor);
+	usb_transfer_t *transfer;
+	uint32_t num_bytes = 0;
+	ssize_t copied;
+
+	if (np <= 0 || np > USBIP_MAX_ISO_PACKETS) {
+		err("seqnum %u: %d isochronous packets", priv->seqnum, np);
+		return -1;
+	}
+
+	if (stub_iso_get(sdev, sep, desc_offset + desc_len, np, &transfer) < 0) {
+		err("seqnum %u: no memory for %d packets", priv->seqnum, np);
+		if (stub_drain(sdev, out_len + desc_len) < 0)
+			return -1;
+		stub_complete_local(sdev, priv, -USBIP_ENOMEM);
+		return 0;
+	}
+	priv->transfer = transfer;
+	priv->number_of_packets = np;
+	priv->iso = (struct usbip_iso_packet_descriptor *)
+		    (transfer->data_buffer + desc_offset);
+
+	if (out_len > 0) {
+		copied = usbip_rx_recv(sdev->rx, transfer->data_buffer, out_len);
+		if (copied < 0)
+			return -1;
+		sdev->stats.out_urbs++;
+		sdev->stats.out_copied += copied;
+		sdev->stats.out_direct += out_len - copied;
+	}
+	if (usbip_rx_recv(sdev->rx, priv->iso, desc_len) < 0)
+		return -1;
+
+	for (int i = 0; i < np; i++) {
+		uint32_t offset = usbip_net_pack_uint32_t(0, priv->iso[i].offset);
+		uint32_t length = usbip_net_pack_uint32_t(0, priv->iso[i].length);
+
+		/* packets must not overlap nor leave the client's buffer */
+		if (offset < num_bytes || offset > len || length > len - offset) {
+			err("seqnum %u: bad packet %d at %u+%u", priv->seqnum, i,
+			    (unsigned)offset, (unsigned)length);
+			stub_complete_local(sdev, priv, -USBIP_EINVAL);
+			return 0;
+		}
+		if (!dir_in && offset != num_bytes)
+			memmove(transfer->data_buffer + num_bytes,
+				transfer->data_buffer + offset, length);
+		transfer->isoc_packet_desc[i].num_bytes = length;
+		num_bytes += length;
+	}
+
+	transfer->bEndpointAddress = sep->addr;
+	transfer->num_bytes = num_bytes;
+	transfer->callback = stub_complete;
+	transfer->context = priv;
+
+	stub_enqueue(sdev, priv);
+	return 0;
+}
+
+/*
+ * A bulk URB larger than a pooled transfer. It is queued before its OUT
+ * payload is received, which then goes to the bus chunk by chunk as it
+ * comes in, so the payload never sits in one buffer and a device keeping
+ * up cycles it through a few pooled transfers. The stub_priv is owned by
+ * the session once this returns; -1 means the stream is lost.
+ */
+static int stub_recv_split(struct stub_device *sdev, struct stub_priv *priv,
+			   int dir_in, int chunk_size)
+{
+	struct stub_endpoint *sep = priv->sep;
+	int32_t len = priv->transfer_buffer_length;
+	int nchunks = (len + chunk_size - 1) / chunk_size;
+	struct stub_split *split;
+
+	split = calloc(1, sizeof(*split) + nchunks * sizeof(split->chunk[0]));
+	if (!split) {
+		err("seqnum %u: no memory for %d chunks", priv->seqnum, nchunks);
+		if (stub_drain(sdev, dir_in ? 0 : len) < 0) {
+			stub_priv_free(sdev, priv);
+			return -1;
+		}
+		stub_complete_local(sdev, priv, -USBIP_ENOMEM);
+		return 0;
+	}
+	split->nchunks = nchunks;
+	split->chunk_size = chunk_size;
+	split->ready = dir_in ? nchunks : 0;
+	priv->split = split;
+	sdev->split_urbs++;
+
+	stub_enqueue(sdev, priv);
+	if (dir_in)
+		return 0;
+
+	sdev->stats.out_urbs++;
+	for (int i = 0; i < nchunks; i++) {
+		int32_t n = len - i * chunk_size;
+		usb_transfer_t *transfer = NULL;
+
+		if (n > chunk_size)
+			n = chunk_size;
+
+		if (usbip_pool_get(sep->type, chunk_size, &transfer,
+				   &sdev->shutdown) == 0) {
+			ssize_t copied = usbip_rx_recv(sdev->rx,
+						       transfer->data_buffer, n);
+
+			if (copied < 0) {
+				usbip_pool_put(transfer);
+				goto err_recv;
+			}
+			sdev->stats.out_copied += copied;
+			sdev->stats.out_direct += n - copied;
+
+			transfer->bEndpointAddress = sep->addr;
+			transfer->num_bytes = n;
+			transfer->callback = stub_split_complete;
+			transfer->context = priv;
+			if (i == nchunks - 1 &&
+			    (priv->transfer_flags & URB_ZERO_PACKET))
+				transfer->flags |= USB_TRANSFER_FLAG_ZERO_PACK;
+		} else if (sdev->shutdown) {
+			goto err_recv;
+		} else if (stub_drain(sdev, n) < 0) {
+			goto err_recv;
+		}
+
+		usbip_mutex_lock(sdev->lock);
+		if (!transfer && !split->ended) {
+			err("seqnum %u: no memory for chunk %d", priv->seqnum, i);
+			split->ended = 1;
+			split->status = -USBIP_ENOMEM;
+		}
+		/* after a failed chunk the rest of the payload is dropped */
+		if (split->ended)
+			usbip_pool_put(transfer);
+		else
+			split->chunk[i] = transfer;
+		split->ready++;
+		if (!stub_split_finish_locked(sdev, priv) && !sdev->shutdown)
+			stub_kick_endpoint_locked(sdev, sep);
+		usbip_mutex_unlock(sdev->lock);
+	}
+
+	return 0;
+
+err_recv:
+	dbg("recv failed: seqnum %u payload", priv->seqnum);
+	usbip_mutex_lock(sdev->lock);
+	if (!split->ended) {
+		split->ended = 1;
+		split->status = -USBIP_ECONNRESET;
+	}
+	split->ready = nchunks;
+	stub_split_finish_locked(sdev, priv);
+	usbip_mutex_unlock(sdev->lock);
+	return -1;
+}
+
+/*
+ * Receive an OUT payload compressed into zlen bytes, decompressing it into
+ * buf, where it has to come to len bytes exactly. -1 ends the session.
+ */
+static int stub_recv_compressed(struct stub_device *sdev,
+				struct stub_priv *priv, uint8_t *buf,
+				int32_t len, uint32_t zlen)
+{
+	struct stub_compress *z = sdev->z;
+
+	if (usbip_rx_recv(sdev->rx, z->rx_buf, zlen) < 0)
+		return -1;
+	if (usbip_lz_decompress(z->rx_buf, zlen, buf, len) != len) {
+		err("seqnum %u: bad compressed payload", priv->seqnum);
+		return -1;
+	}
+
+	sdev->stats.out_urbs++;
+	sdev->stats.out_copied += len;
+	z->out_urbs++;
+	z->out_raw += len;
+	z->out_wire += sizeof(zlen) + zlen;
+	return 0;
+}
+
+static int stub_recv_cmd_submit(struct stub_device *sdev,
+				struct usbip_header *pdu)
+{
+	struct usbip_header_cmd_submit *cmd = &pdu->u.cmd_submit;
+	struct stub_priv *priv;
+	struct stub_endpoint *sep;
+	usb_transfer_t *transfer;
+	uint8_t addr = pdu->base.ep & 0x0f;
+	int dir_in = pdu->base.direction == USBIP_DIR_IN;
+	int32_t len = cmd->transfer_buffer_length;
+	int32_t out_len = dir_in ? 0 : len;
+	/* payload bytes on the wire, fewer when compressed */
+	int32_t wire_len = out_len;
+	uint32_t zlen = 0;
+	size_t size, offset = 0;
+	int num_bytes;
+
+	if (dir_in && addr)
+		addr |= 0x80;
+
+	priv = stub_priv_alloc(sdev);
+	priv->received_us = usbip_time_us();
+	priv->command = USBIP_RET_SUBMIT;
+	priv->seqnum = pdu->base.seqnum;
+	priv->transfer_flags = cmd->transfer_flags;
+	priv->transfer_buffer_length = len;
+	priv->direction = pdu->base.direction;
+	usbip_trace(USBIP_TRACE_CMD_SUBMIT, sdev->sockfd, priv->seqnum, len);
+
+	if (pdu->base.command & USBIP_COMPRESSED) {
+		if (usbip_rx_recv(sdev->rx, &zlen, sizeof(zlen)) < 0)
+			goto err_recv;
+		zlen = usbip_net_pack_uint32_t(0, zlen);
+		if (!sdev->z || dir_in || len <= 0 || !zlen ||
+		    (size_t)len > sdev->z->max || zlen > sdev->z->max) {
+			err("seqnum %u: unexpected compressed payload", priv->seqnum);
+			goto err_recv;
+		}
+		wire_len = zlen;
+	}
+
+	sep = stub_get_endpoint(sdev, addr);
+	if (!sep || len < 0) {
+		dbg("seqnum %u: bad endpoint %#02x or length %d",
+		    priv->seqnum, addr, (int)len);
+		if (stub_drain(sdev, wire_len) < 0)
+			goto err_recv;
+		priv->sep = NULL;
+		stub_complete_local(sdev, priv, -USBIP_EPIPE);
+		return 0;
+	}
+	priv->sep = sep;
+
+	/* a client may not know the type of an endpoint, just not control */
+	if (zlen && (sep->type == USB_BM_ATTRIBUTES_XFER_CONTROL ||
+		     sep->type == USB_BM_ATTRIBUTES_XFER_ISOC)) {
+		err("seqnum %u: compressed payload on ep %#02x", priv->seqnum, addr);
+		goto err_recv;
+	}
+
+	/* like Linux, number_of_packets only counts on isochronous endpoints */
+	if (sep->type == USB_BM_ATTRIBUTES_XFER_ISOC) {
+		if (stub_recv_isoc(sdev, priv, cmd, dir_in) < 0)
+			goto err_recv;
+		return 0;
+	}
+
+	/*
+	 * The chunks of an IN URB are held until it is answered: one needing
+	 * more than the pool lends IN URBs is too large for it.
+	 */
+	if (sep->type == USB_BM_ATTRIBUTES_XFER_BULK &&
+	    len > usbip_pool_size(sep->type)) {
+		int chunk_size;
+
+		size = usbip_pool_size(sep->type);
+		chunk_size = size - size % sep->mps;
+		if (!dir_in || (len + chunk_size - 1) / chunk_size <=
+			       usbip_pool_in_count(sep->type))
+			return stub_recv_split(sdev, priv, dir_in, chunk_size);
+	}
+
+	if (sep->type == USB_BM_ATTRIBUTES_XFER_CONTROL) {
+		offset = sizeof(usb_setup_packet_t);
+		num_bytes = offset + (dir_in ? stub_round_up(len, sep->mps) : len);
+	} else {
+		num_bytes = dir_in ? stub_round_up(len, sep->mps) : len;
+	}
+	size = num_bytes;
+
+	/* see stub_take_transfer_locked(), a URB too large for the pool cannot */
+	if (dir_in && sep->type != USB_BM_ATTRIBUTES_XFER_CONTROL &&
+	    size <= usbip_pool_size(USB_BM_ATTRIBUTES_XFER_BULK)) {
+		stub_enqueue(sdev, priv);
+		return 0;
+	}
+
+	if (usbip_pool_get(sep->type, size, &transfer, &sdev->shutdown) < 0) {
+		if (sdev->shutdown)
+			goto err_recv;
+		err("seqnum %u: no transfer for %u bytes", priv->seqnum,
+		    (unsigned)size);
+		if (stub_drain(sdev, wire_len) < 0)
+			goto err_recv;
+		stub_complete_local(sdev, priv, -USBIP_ENOMEM);
+		return 0;
+	}
+	priv->transfer = transfer;
+
+	transfer->bEndpointAddress = sep->type == USB_BM_ATTRIBUTES_XFER_CONTROL ?
+				     0 : addr;
+	transfer->num_bytes = num_bytes;
+	transfer->callback = stub_complete;
+	transfer->context = priv;
+	if (!dir_in && (priv->transfer_flags & URB_ZERO_PACKET))
+		transfer->flags |= USB_TRANSFER_FLAG_ZERO_PACK;
+
+	if (offset)
+		memcpy(transfer->data_buffer, cmd->setup, offset);
+
+	/*
+	 * OUT payload goes into the transfer buffer; only the part that came
+	 * in with the headers before it is copied from the receive buffer.
+	 */
+	if (zlen) {
+		if (stub_recv_compressed(sdev, priv, transfer->data_buffer, len,
+					 zlen) < 0)
+			goto err_recv;
+	} else if (out_len > 0) {
+		ssize_t copied = usbip_rx_recv(sdev->rx,
+					       transfer->data_buffer + offset,
+					       out_len);
+
+		if (copied < 0)
+			goto err_recv;
+		sdev->stats.out_urbs++;
+		sdev->stats.out_copied += copied;
+		sdev->stats.out_direct += out_len - copied;
+	}
+
+	if (offset && stub_tweak_special_requests(sdev, priv,
+			(const usb_setup_packet_t *)transfer->data_buffer))
+		return 0;
+
+	stub_enqueue(sdev, priv);
+	return 0;
+
+err_recv:
+	dbg("recv failed: seqnum %u payload", priv->seqnum);
+	stub_priv_free(sdev, priv);
+	return -1;
+}
+
+/*
+ * Like the Linux stub: a URB still queued is dropped and answered right away,
+ * one on the bus is cancelled and answered when the host stack gives it
+ * back, with its RET_SUBMIT dropped. A URB that completed already has its
+ * RET_SUBMIT queued; the unlink then gets status 0 and comes after it.
+ */
+static int stub_recv_cmd_unlink(struct stub_device *sdev,
+				struct usbip_header *pdu, int udp)
+{
+	uint32_t seqnum = pdu->u.cmd_unlink.seqnum;
+	struct stub_priv *priv;
+	struct stub_endpoint *sep;
+
+	usbip_trace(USBIP_TRACE_CMD_UNLINK, sdev->sockfd, pdu->base.seqnum,
+		    seqnum);
+
+	usbip_mutex_lock(sdev->lock);
+	priv = stub_hash_find_locked(sdev, seqnum);
+	/*
+	 * A datagram only unlinks what came in one: a URB of the TCP stream
+	 * may still be taking in the chunks of its payload.
+	 */
+	if (priv && udp && !priv->udp)
+		priv = NULL;
+	if (!priv) {
+		usbip_mutex_unlock(sdev->lock);
+		/* the datagram is sent again, by then a URB may have completed */
+		priv = udp ? stub_priv_try_alloc(sdev) : stub_priv_alloc(sdev);
+		if (!priv)
+			return -1;
+		dbg("unlink seqnum %u: already completed", seqnum);
+		priv->udp = udp;
+		priv->command = USBIP_RET_UNLINK;
+		priv->seqnum = pdu->base.seqnum;
+		priv->status = 0;
+		stub_reply(sdev, priv);
+		return 0;
+	}
+
+	sep = priv->sep;
+	if (!priv->submitted) {
+		stub_pending_del_locked(sep, priv);
+		stub_hash_del_locked(sdev, priv);
+		usbip_mutex_unlock(sdev->lock);
+
+		/* the stub_priv of the URB carries the answer */
+		dbg("unlink seqnum %u: dropped from queue", seqnum);
+		stub_transfer_put(sdev, priv);
+		priv->command = USBIP_RET_UNLINK;
+		priv->seqnum = pdu->base.seqnum;
+		priv->status = -USBIP_ECONNRESET;
+		stub_reply(sdev, priv);
+		return 0;
+	}
+
+	priv->unlinking = 1;
+	priv->seqnum_unlink = pdu->base.seqnum;
+	/*
+	 * The host library cancels whole endpoints only, other transfers on
+	 * it come back as cancelled too. Control transfers cannot be
+	 * cancelled and are answered when they finish.
+	 */
+	if (sep->addr & 0x0f) {
+		dbg("unlink seqnum %u: flushing ep %#02x", seqnum, sep->addr);
+		sdev->ops->endpoint_halt(sdev->ctx, sep->addr);
+		sdev->ops->endpoint_flush(sdev->ctx, sep->addr);
+		sdev->ops->endpoint_clear(sdev->ctx, sep->addr);
+	}
+	usbip_mutex_unlock(sdev->lock);
+
+	return 0;
+}
+
+/*
+ * An interrupt CMD_SUBMIT of the UDP channel, its OUT payload in data.
+ * Unlike the rx task this one may not wait: -1 when no stub_priv or OUT
+ * transfer is free, for the client to send it again.
+ */
+static int stub_recv_datagram_submit(struct stub_device *sdev,
+				     struct usbip_header *pdu,
+				     const uint8_t *data, size_t len)
+{
+	struct usbip_header_cmd_submit *cmd = &pdu->u.cmd_submit;
+	struct stub_priv *priv;
+	struct stub_endpoint *sep;
+	usb_transfer_t *transfer;
+	uint8_t addr = pdu->base.ep & 0x0f;
+	int dir_in = pdu->base.direction == USBIP_DIR_IN;
+	int32_t tlen = cmd->transfer_buffer_length;
+	int type = -1;
+
+	if (dir_in && addr)
+		addr |= 0x80;
+
+	priv = stub_priv_try_alloc(sdev);
+	if (!priv)
+		return -1;
+	priv->received_us = usbip_time_us();
+	priv->command = USBIP_RET_SUBMIT;
+	priv->seqnum = pdu->base.seqnum;
+	priv->transfer_flags = cmd->transfer_flags;
+	priv->transfer_buffer_length = tlen;
+	priv->direction = pdu->base.direction;
+	priv->udp = 1;
+	usbip_trace(USBIP_TRACE_CMD_SUBMIT, sdev->sockfd, priv->seqnum, tlen);
+
+	/* the rx task may be changing the alternate setting */
+	usbip_mutex_lock(sdev->lock);
+	sep = stub_get_endpoint(sdev, addr);
+	if (sep)
+		type = sep->type;
+	usbip_mutex_unlock(sdev->lock);
+
+	/* and the reply has to fit in a datagram */
+	if (type != USB_BM_ATTRIBUTES_XFER_INT || tlen < 0 ||
+	    tlen > usbip_pool_size(type) ||
+	    (dir_in ? len != 0 : len != (size_t)tlen)) {
+		dbg("seqnum %u: not for the datagram channel, ep %#02x length %d",
+		    priv->seqnum, addr, (int)tlen);
+		priv->sep = NULL;
+		stub_complete_local(sdev, priv, -USBIP_EPIPE);
+		return 0;
+	}
+	priv->sep = sep;
+
+	/* see stub_take_transfer_locked() */
+	if (dir_in) {
+		stub_enqueue(sdev, priv);
+		return 0;
+	}
+
+	if (usbip_pool_try_get(type, tlen, 0, &transfer) < 0) {
+		stub_priv_free(sdev, priv);
+		return -1;
+	}
+	priv->transfer = transfer;
+
+	transfer->bEndpointAddress = addr;
+	transfer->num_bytes = tlen;
+	transfer->callback = stub_complete;
+	transfer->context = priv;
+	if (priv->transfer_flags & URB_ZERO_PACKET)
+		transfer->flags |= USB_TRANSFER_FLAG_ZERO_PACK;
+	memcpy(transfer->data_buffer, data, len);
+
+	stub_enqueue(sdev, priv);
+	return 0;
+}
+
+int stub_rx_datagram(struct stub_device *sdev, struct usbip_header *pdu,
+		     const uint8_t *data, size_t len, int in_order)
+{
+	switch (pdu->base.command) {
+	case USBIP_CMD_SUBMIT:
+		return stub_recv_datagram_submit(sdev, pdu, data, len);
+	case USBIP_CMD_UNLINK:
+		/* never ahead of the URB it unlinks */
+		if (!in_order)
+			return -1;
+		return stub_recv_cmd_unlink(sdev, pdu, 1);
+	default:
+		/* taken, so it is not sent again */
+		err("unknown pdu %#0x in a datagram", pdu->base.command);
+		return 0;
+	}
+}
+
+void stub_rx_loop(struct stub_device *sdev)
+{
+	struct usbip_header pdu;
+	int ret;
+
+	while (!sdev->shutdown) {
+		memset(&pdu, 0, sizeof(pdu));
+		if (usbip_rx_recv(sdev->rx, &pdu, sizeof(pdu)) < 0) {
+			dbg("recv failed: header");
+			break;
+		}
+		usbip_net_pack_header(0, &pdu);
+
+		switch (pdu.base.command) {
+		case USBIP_CMD_SUBMIT:
+		case USBIP_CMD_SUBMIT | USBIP_COMPRESSED:
+			ret = stub_recv_cmd_submit(sdev, &pdu);
+			break;
+		case USBIP_CMD_UNLINK:
+			ret = stub_recv_cmd_unlink(sdev, &pdu, 0);
+			break;
+		default:
+			err("unknown pdu %#0x", pdu.base.command);
+			ret = -1;
+			break;
+		}
+
+		if (ret < 0)
+			break;
+	}
+}
@@ -0,0 +1,457 @@
+#define LOG_LOCAL_LEVEL	CONFIG_USBIP_LOG_LEVEL_STUB
+
+#include <string.h>
+#include "stub.h"
+#include "usbip_pool.h"
+#include "usbip_trace.h"
+
+#define err(...)    USBIP_LOGE(TAG, __VA_ARGS__)
+#define info(...)   USBIP_LOGI(TAG, __VA_ARGS__)
+#define dbg(...)    USBIP_LOGD(TAG, __VA_ARGS__)
+
+static const char *TAG = "stub_tx";
+
+static int32_t stub_usb_status(usb_transfer_status_t status)
+{
+	switch (status) {
+	case USB_TRANSFER_STATUS_COMPLETED:
+		return 0;
+	case USB_TRANSFER_STATUS_STALL:
+		return -USBIP_EPIPE;
+	case USB_TRANSFER_STATUS_TIMED_OUT:
+		return -USBIP_ETIMEDOUT;
+	case USB_TRANSFER_STATUS_CANCELED:
+		return -USBIP_ECONNRESET;
+	case USB_TRANSFER_STATUS_NO_DEVICE:
+		return -USBIP_ENODEV;
+	case USB_TRANSFER_STATUS_OVERFLOW:
+		return -USBIP_EOVERFLOW;
+	case USB_TRANSFER_STATUS_SKIPPED:
+		return -USBIP_EXDEV;
+	case USB_TRANSFER_STATUS_ERROR:
+	default:
+		return -USBIP_EPROTO;
+	}
+}
+
+int32_t stub_transfer_status(const usb_transfer_t *transfer)
+{
+	return stub_usb_status(transfer->status);
+}
+
+/*
+ * Fill in the results of the packets of an isochronous URB. Like the Linux
+ * stub, IN data goes out without the gaps of short packets, so it is packed
+ * in place; the client spreads it out again by the descriptors. Returns the
+ * number of bytes transferred.
+ */
+static int32_t stub_isoc_results(struct stub_priv *priv, int32_t *error_count)
+{
+	usb_transfer_t *transfer = priv->transfer;
+	int32_t actual = 0;
+	int offset = 0;
+
+	*error_count = 0;
+	for (int i = 0; i < priv->number_of_packets; i++) {
+		usb_isoc_packet_desc_t *desc = &transfer->isoc_packet_desc[i];
+		int n = desc->actual_num_bytes;
+		int32_t status = stub_usb_status(desc->status);
+
+		if (n < 0 || n > desc->num_bytes)
+			n = n < 0 ? 0 : desc->num_bytes;
+		if (priv->direction == USBIP_DIR_IN && offset != actual)
+			memmove(transfer->data_buffer + actual,
+				transfer->data_buffer + offset, n);
+		if (status)
+			(*error_count)++;
+
+		priv->iso[i].actual_length = usbip_net_pack_uint32_t(1, n);
+		priv->iso[i].status = usbip_net_pack_uint32_t(1, status);
+		offset += desc->num_bytes;
+		actual += n;
+	}
+
+	return actual;
+}
+
+/* chunks of a split URB per call, behind the header of the first one */
+#define STUB_SPLIT_IOV		16
+
+/* IN data of a split URB goes out of the chunks it came in. */
+static int stub_send_split(struct stub_device *sdev, struct usbip_header *pdu,
+			   struct stub_priv *priv, int32_t actual)
+{
+	struct iovec iov[STUB_SPLIT_IOV];
+	int iovcnt = 1;
+
+	iov[0].iov_base = pdu;
+	iov[0].iov_len = sizeof(*pdu);
+	for (int i = 0; actual > 0; i++) {
+		usb_transfer_t *chunk = priv->split->chunk[i];
+		int32_t n = chunk->actual_num_bytes;
+
+		if (n > actual)
+			n = actual;
+		iov[iovcnt].iov_base = chunk->data_buffer;
+		iov[iovcnt].iov_len = n;
+		iovcnt++;
+		actual -= n;
+
+		if (iovcnt == STUB_SPLIT_IOV || !actual) {
+			if (stub_send(sdev, iov, iovcnt) < 0) {
+				dbg("send failed: ret submit");
+				return -1;
+			}
+			iovcnt = 0;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Compress the IN payload of a bulk URB over itself, when that makes the
+ * reply smaller. Returns the number of payload bytes to send.
+ */
+static int32_t stub_compress_in(struct stub_compress *z, struct stub_priv *priv,
+				uint8_t *data, int32_t actual)
+{
+	int n = usbip_lz_compress(&z->lz, data, actual, z->tx_buf,
+				  actual - sizeof(priv->zlen) - 1);
+
+	if (!n) {
+		z->in_raw_urbs++;
+		return actual;
+	}
+
+	memcpy(data, z->tx_buf, n);
+	priv->zlen = usbip_net_pack_uint32_t(1, n);
+	z->in_urbs++;
+	z->in_raw += actual;
+	z->in_wire += sizeof(priv->zlen) + n;
+	return n;
+}
+
+/*
+ * Fill in the RET_SUBMIT of priv and the iovecs to send it, pdu first.
+ * Returns their number; the IN data of a split URB is left to
+ * stub_send_split().
+ */
+static int stub_ret_submit_iov(struct stub_device *sdev, struct stub_priv *priv,
+			       struct usbip_header *pdu, struct iovec *iov,
+			       int32_t *actual_length)
+{
+	usb_transfer_t *transfer = priv->transfer;
+	int iovcnt = 1;
+	uint8_t *data = NULL;
+	int32_t actual = 0;
+	int32_t error_count;
+
+	memset(pdu, 0, sizeof(*pdu));
+	pdu->base.command = USBIP_RET_SUBMIT;
+	pdu->base.seqnum = priv->seqnum;
+
+	if (transfer && priv->iso) {
+		pdu->u.ret_submit.status = stub_transfer_status(transfer);
+		pdu->u.ret_submit.number_of_packets = priv->number_of_packets;
+		actual = stub_isoc_results(priv, &error_count);
+		pdu->u.ret_submit.error_count = error_count;
+		data = transfer->data_buffer;
+	} else if (transfer) {
+		pdu->u.ret_submit.status = stub_transfer_status(transfer);
+		actual = transfer->actual_num_bytes;
+		data = transfer->data_buffer;
+		if (priv->sep->type == USB_BM_ATTRIBUTES_XFER_CONTROL) {
+			/* actual_num_bytes counts the setup packet */
+			actual -= sizeof(usb_setup_packet_t);
+			data += sizeof(usb_setup_packet_t);
+			if (actual < 0)
+				actual = 0;
+		}
+		if (actual > priv->transfer_buffer_length) {
+			actual = priv->transfer_buffer_length;
+			if (!pdu->u.ret_submit.status)
+				pdu->u.ret_submit.status = -USBIP_EOVERFLOW;
+		}
+	} else if (priv->split) {
+		pdu->u.ret_submit.status = priv->split->status;
+		actual = priv->split->actual;
+		if (actual > priv->transfer_buffer_length) {
+			actual = priv->transfer_buffer_length;
+			if (!pdu->u.ret_submit.status)
+				pdu->u.ret_submit.status = -USBIP_EOVERFLOW;
+		}
+	} else {
+		pdu->u.ret_submit.status = priv->status;
+	}
+	pdu->u.ret_submit.actual_length = actual;
+	*actual_length = actual;
+
+	dbg("ret submit seqnum %u status %d actual %d", priv->seqnum,
+	    (int)pdu->u.ret_submit.status, (int)actual);
+	usbip_trace(USBIP_TRACE_RET_SUBMIT, sdev->sockfd, priv->seqnum, actual);
+
+	if (sdev->z && transfer && !priv->iso && data &&
+	    priv->direction == USBIP_DIR_IN &&
+	    priv->sep->type == USB_BM_ATTRIBUTES_XFER_BULK &&
+	    actual >= STUB_COMPRESS_MIN && actual <= sdev->z->max) {
+		actual = stub_compress_in(sdev->z, priv, data, actual);
+		if (priv->zlen)
+			pdu->base.command |= USBIP_COMPRESSED;
+	}
+
+	usbip_net_pack_header(1, pdu);
+
+	/* header and IN payload leave in one call, the payload is not copied */
+	iov[0].iov_base = pdu;
+	iov[0].iov_len = sizeof(*pdu);
+	if (priv->zlen) {
+		iov[iovcnt].iov_base = &priv->zlen;
+		iov[iovcnt].iov_len = sizeof(priv->zlen);
+		iovcnt++;
+	}
+	if (priv->direction == USBIP_DIR_IN && actual > 0 && data) {
+		iov[iovcnt].iov_base = data;
+		iov[iovcnt].iov_len = actual;
+		iovcnt++;
+	}
+	/* the packet descriptors follow in both directions */
+	if (transfer && priv->iso) {
+		iov[iovcnt].iov_base = priv->iso;
+		iov[iovcnt].iov_len = priv->number_of_packets * sizeof(*priv->iso);
+		iovcnt++;
+	}
+
+	return iovcnt;
+}
+
+static int stub_ret_unlink_iov(struct stub_device *sdev,
+			       struct usbip_header *pdu, struct iovec *iov,
+			       uint32_t seqnum, int32_t status)
+{
+	memset(pdu, 0, sizeof(*pdu));
+	pdu->base.command = USBIP_RET_UNLINK;
+	pdu->base.seqnum = seqnum;
+	pdu->u.ret_unlink.status = status;
+
+	dbg("ret unlink seqnum %u status %d", seqnum, (int)status);
+	usbip_trace(USBIP_TRACE_RET_UNLINK, sdev->sockfd, seqnum, status);
+
+	usbip_net_pack_header(1, pdu);
+	iov[0].iov_base = pdu;
+	iov[0].iov_len = sizeof(*pdu);
+	return 1;
+}
+
+int stub_reply_iov(struct stub_device *sdev, struct stub_priv *priv,
+		   struct usbip_header *pdu, struct iovec *iov,
+		   int32_t *actual)
+{
+	*actual = 0;
+
+	/* an unlinked URB is answered by the RET_UNLINK only */
+	if (priv->unlinking)
+		return stub_ret_unlink_iov(sdev, pdu, iov, priv->seqnum_unlink,
+					   priv->split ? priv->split->status :
+					   stub_transfer_status(priv->transfer));
+
+	if (priv->command == USBIP_RET_UNLINK)
+		return stub_ret_unlink_iov(sdev, pdu, iov, priv->seqnum,
+					   priv->status);
+
+	return stub_ret_submit_iov(sdev, priv, pdu, iov, actual);
+}
+
+void stub_account_latency(struct stub_device *sdev, struct stub_priv *priv)
+{
+	struct usbip_hist *hist = &sdev->edev->hist;
+	int64_t sent_us = usbip_time_us();
+	int type = priv->sep->type;
+
+	usbip_hist_add(hist, type, USBIP_HIST_QUEUE,
+		       priv->submitted_us - priv->received_us);
+	usbip_hist_add(hist, type, USBIP_HIST_USB,
+		       priv->completed_us - priv->submitted_us);
+	usbip_hist_add(hist, type, USBIP_HIST_REPLY,
+		       sent_us - priv->completed_us);
+	usbip_hist_add(hist, type, USBIP_HIST_TOTAL,
+		       sent_us - priv->received_us);
+}
+
+static int stub_send_reply(struct stub_device *sdev, struct stub_priv *priv)
+{
+	struct usbip_header pdu;
+	struct iovec iov[3];
+	int32_t actual;
+	int iovcnt;
+
+	iovcnt = stub_reply_iov(sdev, priv, &pdu, iov, &actual);
+	if (priv->split && priv->direction == USBIP_DIR_IN && actual > 0)
+		return stub_send_split(sdev, &pdu, priv, actual);
+
+	if (stub_send(sdev, iov, iovcnt) < 0) {
+		dbg("send failed: reply to seqnum %u", priv->seqnum);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* wake up the rx side, it tears the session down */
+static void stub_tx_fail(struct stub_device *sdev)
+{
+	sdev->shutdown = 1;
+	shutdown(sdev->sockfd, SHUT_RDWR);
+}
+
+/* Send the held bulk replies, or drop them once the session is over. */
+static void stub_tx_flush(struct stub_device *sdev)
+{
+	struct stub_tx_batch *batch = &sdev->batch;
+
+	if (!batch->count)
+		return;
+
+	if (sdev->shutdown) {
+		/* dropped */
+	} else if (stub_send(sdev, batch->iov, batch->iovcnt) < 0) {
+		dbg("send failed: %d coalesced replies", batch->count);
+		stub_tx_fail(sdev);
+	} else {
+		sdev->tx_coalesced += batch->count;
+		sdev->tx_batches++;
+		for (int i = 0; i < batch->count; i++) {
+			if (batch->priv[i]->completed_us)
+				stub_account_latency(sdev, batch->priv[i]);
+		}
+	}
+
+	for (int i = 0; i < batch->count; i++)
+		stub_priv_free(sdev, batch->priv[i]);
+	batch->count = 0;
+	batch->iovcnt = 0;
+	batch->bytes = 0;
+}
+
+/*
+ * Hold back the RET_SUBMIT of a bulk URB, to go out with those completing
+ * behind it. Returns 0 for replies that are sent at once.
+ */
+static int stub_tx_coalesce(struct stub_device *sdev, struct stub_priv *priv)
+{
+	struct stub_tx_batch *batch = &sdev->batch;
+	int n = batch->count;
+	int32_t actual;
+	int iovcnt;
+
+	if (!STUB_TX_COALESCE_BYTES || priv->command != USBIP_RET_SUBMIT ||
+	    priv->unlinking || !priv->sep || priv->split ||
+	    priv->sep->type != USB_BM_ATTRIBUTES_XFER_BULK)
+		return 0;
+
+	iovcnt = stub_ret_submit_iov(sdev, priv, &batch->pdu[n],
+				     &batch->iov[batch->iovcnt], &actual);
+	if (!n)
+		batch->first_us = usbip_time_us();
+	batch->priv[n] = priv;
+	batch->count++;
+	for (int i = 0; i < iovcnt; i++)
+		batch->bytes += batch->iov[batch->iovcnt + i].iov_len;
+	batch->iovcnt += iovcnt;
+
+	if (batch->bytes >= STUB_TX_COALESCE_BYTES ||
+	    batch->count == STUB_TX_BATCH)
+		stub_tx_flush(sdev);
+	return 1;
+}
+
+void stub_tx_wake_locked(struct stub_device *sdev)
+{
+	if (sdev->kick_queued || sdev->shutdown)
+		return;
+	sdev->kick_queued = 1;
+	usbip_queue_send(sdev->tx_queue, &sdev->kick);
+}
+
+/* how often a starved session looks for transfers other ones gave back */
+#define STUB_TX_STARVED_US	10000
+
+/*
+ * Control and interrupt replies go out as they come, bulk ones are held
+ * while further completions are waiting, or for CONFIG_USBIP_TX_COALESCE_US,
+ * and sent in one go. Either way the replies leave in completion order.
+ * The transfers of sent replies go back to the pool, so starved endpoints
+ * are kicked from here too.
+ */
+void stub_tx_loop(void *arg)
+{
+	struct stub_device *sdev = arg;
+	struct stub_tx_batch *batch = &sdev->batch;
+	struct stub_priv *priv;
+
+	for (;;) {
+		int64_t wait_us = -1;
+
+		stub_resume_take_over(sdev);
+		stub_kick_starved(sdev);
+		if (batch->count) {
+			wait_us = STUB_TX_COALESCE_US -
+				  (usbip_time_us() - batch->first_us);
+			if (wait_us < 0)
+				wait_us = 0;
+		}
+		if (sdev->starved && (wait_us < 0 || wait_us > STUB_TX_STARVED_US))
+			wait_us = STUB_TX_STARVED_US;
+
+		if (wait_us < 0) {
+			priv = usbip_queue_recv(sdev->tx_queue);
+		} else if (usbip_queue_recv_timeout(sdev->tx_queue, wait_us,
+						    (void **)&priv) < 0) {
+			if (batch->count && usbip_time_us() - batch->first_us >=
+					    STUB_TX_COALESCE_US)
+				stub_tx_flush(sdev);
+			continue;
+		}
+		if (!priv)
+			break;
+		if (priv == &sdev->kick) {
+			usbip_mutex_lock(sdev->lock);
+			sdev->kick_queued = 0;
+			usbip_mutex_unlock(sdev->lock);
+			continue;
+		}
+
+		if (priv->completed_us) {
+			uint32_t us = usbip_time_us() - priv->completed_us;
+
+			sdev->dispatch_count++;
+			sdev->dispatch_total_us += us;
+			if (us > sdev->dispatch_max_us)
+				sdev->dispatch_max_us = us;
+		}
+
+		if (sdev->shutdown) {
+			/* dropped */
+		} else if (stub_tx_coalesce(sdev, priv)) {
+			continue;
+		} else {
+			stub_tx_flush(sdev);
+			if (sdev->shutdown) {
+				/* the held replies could not be sent */
+			} else if (stub_send_reply(sdev, priv) < 0) {
+				stub_tx_fail(sdev);
+			} else {
+				sdev->tx_immediate++;
+				if (priv->completed_us && !priv->unlinking)
+					stub_account_latency(sdev, priv);
+			}
+		}
+
+		stub_priv_free(sdev, priv);
+	}
+
+	/* the session is over, anything held is dropped */
+	stub_tx_flush(sdev);
+	usbip_sem_give(sdev->tx_done);
+	usbip_task_exit();
+}
@@ -0,0 +1,420 @@
+#define LOG_LOCAL_LEVEL	CONFIG_USBIP_LOG_LEVEL_STUB
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stub.h"
+#include "usbip_pool.h"
+
+#define err(...)    USBIP_LOGE(TAG, __VA_ARGS__)
+#define info(...)   USBIP_LOGI(TAG, __VA_ARGS__)
+#define dbg(...)    USBIP_LOGD(TAG, __VA_ARGS__)
+
+static const char *TAG = "stub_udp";
+
+/* how often the rx task looks at sdev->shutdown */
+#define STUB_UDP_POLL_US	20000
+/* wait of the tx task with nothing to send again */
+#define STUB_UDP_IDLE_US	1000000
+
+int stub_udp_open(int tcp_sockfd, uint16_t *port)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	int sockfd;
+
+	/* the address the client reached us at, on a port of its own */
+	if (getsockname(tcp_sockfd, (struct sockaddr *)&addr, &len) < 0)
+		return -1;
+	if (addr.ss_family == AF_INET)
+		((struct sockaddr_in *)&addr)->sin_port = 0;
+#ifdef CONFIG_EXAMPLE_IPV6
+	else if (addr.ss_family == AF_INET6)
+		((struct sockaddr_in6 *)&addr)->sin6_port = 0;
+#endif
+	else
+		return -1;
+
+	sockfd = socket(addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+	if (sockfd < 0)
+		return -1;
+	if (bind(sockfd, (struct sockaddr *)&addr, len) < 0 ||
+	    getsockname(sockfd, (struct sockaddr *)&addr, &len) < 0) {
+		close(sockfd);
+		return -1;
+	}
+
+#ifdef CONFIG_EXAMPLE_IPV6
+	if (addr.ss_family == AF_INET6)
+		*port = ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+	else
+#endif
+		*port = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+	return sockfd;
+}
+
+size_t stub_udp_max(void)
+{
+	return sizeof(struct usbip_udp_header) + sizeof(struct usbip_header) +
+	       usbip_pool_size(USB_BM_ATTRIBUTES_XFER_INT);
+}
+
+/* the header of a datagram, acknowledging what came from the client */
+static void stub_udp_header_locked(struct stub_udp *udp, uint8_t *buf,
+				   uint32_t seq)
+{
+	struct usbip_udp_header hdr;
+
+	hdr.token = htonl(udp->token);
+	hdr.seq = htonl(seq);
+	hdr.ack = htonl(udp->recv_next - 1);
+	hdr.ack_bits = htonl(udp->recv_bits >> 1);
+	memcpy(buf, &hdr, sizeof(hdr));
+}
+
+static void stub_udp_xmit_locked(struct stub_udp *udp, const uint8_t *buf,
+				 size_t len)
+{
+	/* a datagram lost here is one lost on the way */
+	if (sendto(udp->sockfd, buf, len, 0, (struct sockaddr *)&udp->peer,
+		   udp->peer_len) < 0)
+		dbg("sendto failed: errno %d", errno);
+}
+
+static void stub_udp_ack_locked(struct stub_udp *udp)
+{
+	uint8_t buf[sizeof(struct usbip_udp_header)];
+
+	stub_udp_header_locked(udp, buf, 0);
+	stub_udp_xmit_locked(udp, buf, sizeof(buf));
+}
+
+/* Free the slots of the datagrams the client has. */
+static void stub_udp_acked_locked(struct stub_udp *udp, uint32_t ack,
+				  uint32_t bits)
+{
+	for (int i = 0; i < STUB_UDP_WINDOW; i++) {
+		struct stub_udp_slot *slot = &udp->slot[i];
+		uint32_t d = slot->seq - ack - 2;
+
+		if (!slot->seq)
+			continue;
+		if ((int32_t)(slot->seq - ack) <= 0 || (d < 32 && (bits >> d) & 1))
+			slot->seq = 0;
+	}
+}
+
+/*
+ * A free slot for the next datagram, NULL when there is none or the client
+ * could not take it yet: it keeps track of 32 datagrams from the oldest one
+ * it misses.
+ */
+static struct stub_udp_slot *stub_udp_slot_locked(struct stub_udp *udp)
+{
+	struct stub_udp_slot *free_slot = NULL;
+
+	for (int i = 0; i < STUB_UDP_WINDOW; i++) {
+		struct stub_udp_slot *slot = &udp->slot[i];
+
+		if (!slot->seq)
+			free_slot = slot;
+		else if (udp->next_seq - slot->seq >= STUB_UDP_WINDOW)
+			return NULL;
+	}
+
+	return free_slot;
+}
+
+static void stub_udp_input(struct stub_device *sdev)
+{
+	struct stub_udp *udp = sdev->udp;
+	struct usbip_udp_header hdr;
+	struct usbip_header pdu;
+	struct sockaddr_storage from;
+	socklen_t from_len = sizeof(from);
+	size_t head = sizeof(hdr) + sizeof(pdu);
+	uint32_t seq, d;
+	ssize_t n;
+	int ret;
+
+	n = recvfrom(udp->sockfd, udp->rx_buf, udp->max, 0,
+		     (struct sockaddr *)&from, &from_len);
+	if (n < (ssize_t)sizeof(hdr))
+		return;
+	memcpy(&hdr, udp->rx_buf, sizeof(hdr));
+	if (ntohl(hdr.token) != udp->token)
+		return;
+
+	usbip_mutex_lock(udp->lock);
+	/* replies go where the first datagram came from */
+	if (!udp->peer_len) {
+		memcpy(&udp->peer, &from, from_len);
+		udp->peer_len = from_len;
+	} else if (from_len != udp->peer_len ||
+		   memcmp(&from, &udp->peer, from_len)) {
+		usbip_mutex_unlock(udp->lock);
+		return;
+	}
+
+	stub_udp_acked_locked(udp, ntohl(hdr.ack), ntohl(hdr.ack_bits));
+
+	seq = ntohl(hdr.seq);
+	d = seq - udp->recv_next;
+	if (!seq || (size_t)n < head || ((int32_t)d >= 32)) {
+		/* an acknowledgement only, or nothing we can take */
+		usbip_mutex_unlock(udp->lock);
+		return;
+	}
+	if ((int32_t)d < 0 || (udp->recv_bits >> d) & 1) {
+		/* our acknowledgement was lost */
+		udp->rx_dups++;
+		stub_udp_ack_locked(udp);
+		usbip_mutex_unlock(udp->lock);
+		return;
+	}
+	usbip_mutex_unlock(udp->lock);
+
+	memcpy(&pdu, udp->rx_buf + sizeof(hdr), sizeof(pdu));
+	usbip_net_pack_header(0, &pdu);
+	ret = stub_rx_datagram(sdev, &pdu, udp->rx_buf + head, n - head, !d);
+
+	usbip_mutex_lock(udp->lock);
+	if (ret < 0) {
+		udp->rx_deferred++;
+	} else {
+		udp->rx_pdus++;
+		udp->recv_bits |= 1u << d;
+		while (udp->recv_bits & 1) {
+			udp->recv_bits >>= 1;
+			udp->recv_next++;
+		}
+		stub_udp_ack_locked(udp);
+	}
+	usbip_mutex_unlock(udp->lock);
+}
+
+static void stub_udp_rx_loop(void *arg)
+{
+	struct stub_device *sdev = arg;
+	struct stub_udp *udp = sdev->udp;
+
+	while (!sdev->shutdown) {
+		struct timeval tv = { .tv_sec = 0, .tv_usec = STUB_UDP_POLL_US };
+		fd_set rfds;
+
+		FD_ZERO(&rfds);
+		FD_SET(udp->sockfd, &rfds);
+		if (select(udp->sockfd + 1, &rfds, NULL, NULL, &tv) > 0)
+			stub_udp_input(sdev);
+	}
+
+	usbip_sem_give(udp->rx_done);
+	usbip_task_exit();
+}
+
+/*
+ * Copy the reply to priv into a free slot of the window and send it.
+ * Returns -1 when there is none, the reply then goes over TCP.
+ */
+static int stub_udp_send(struct stub_device *sdev, struct stub_priv *priv)
+{
+	struct stub_udp *udp = sdev->udp;
+	struct stub_udp_slot *slot;
+	struct usbip_header pdu;
+	struct iovec iov[3];
+	int32_t actual;
+	size_t len;
+	int iovcnt;
+
+	/* only the rx task frees slots meanwhile */
+	usbip_mutex_lock(udp->lock);
+	slot = udp->peer_len ? stub_udp_slot_locked(udp) : NULL;
+	usbip_mutex_unlock(udp->lock);
+	if (!slot)
+		return -1;
+
+	iovcnt = stub_reply_iov(sdev, priv, &pdu, iov, &actual);
+
+	usbip_mutex_lock(udp->lock);
+	len = sizeof(struct usbip_udp_header);
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(slot->buf + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	slot->seq = udp->next_seq++;
+	slot->len = len;
+	slot->sent_us = usbip_time_us();
+	stub_udp_header_locked(udp, slot->buf, slot->seq);
+	stub_udp_xmit_locked(udp, slot->buf, slot->len);
+	udp->tx_pdus++;
+	usbip_mutex_unlock(udp->lock);
+
+	return 0;
+}
+
+/* Send the datagrams due again; returns how long until the next one is. */
+static uint32_t stub_udp_resend(struct stub_udp *udp)
+{
+	int64_t now = usbip_time_us();
+	int64_t wait = STUB_UDP_IDLE_US;
+
+	usbip_mutex_lock(udp->lock);
+	for (int i = 0; i < STUB_UDP_WINDOW; i++) {
+		struct stub_udp_slot *slot = &udp->slot[i];
+
+		if (!slot->seq)
+			continue;
+		if (now - slot->sent_us >= STUB_UDP_RTO_US) {
+			stub_udp_header_locked(udp, slot->buf, slot->seq);
+			stub_udp_xmit_locked(udp, slot->buf, slot->len);
+			slot->sent_us = now;
+			udp->tx_resent++;
+		}
+		if (slot->sent_us + STUB_UDP_RTO_US - now < wait)
+			wait = slot->sent_us + STUB_UDP_RTO_US - now;
+	}
+	usbip_mutex_unlock(udp->lock);
+
+	/* the queue rounds its timeout down to a tick, that must not spin */
+	return wait < STUB_UDP_RTO_US / 2 ? STUB_UDP_RTO_US / 2 : wait;
+}
+
+static void stub_udp_tx_loop(void *arg)
+{
+	struct stub_device *sdev = arg;
+	struct stub_udp *udp = sdev->udp;
+	struct stub_priv *priv;
+
+	for (;;) {
+		if (usbip_queue_recv_timeout(udp->tx_queue, stub_udp_resend(udp),
+					     (void **)&priv) < 0)
+			continue;
+		if (!priv)
+			break;
+
+		if (sdev->shutdown) {
+			/* dropped */
+		} else if (stub_udp_send(sdev, priv) == 0) {
+			if (priv->completed_us && !priv->unlinking)
+				stub_account_latency(sdev, priv);
+		} else {
+			/* the tx task of the session sends it */
+			usbip_mutex_lock(udp->lock);
+			udp->tx_tcp++;
+			usbip_mutex_unlock(udp->lock);
+			usbip_queue_send(sdev->tx_queue, priv);
+			continue;
+		}
+
+		stub_priv_free(sdev, priv);
+	}
+
+	usbip_sem_give(udp->tx_done);
+	usbip_task_exit();
+}
+
+int stub_udp_start(struct stub_device *sdev, const struct stub_features *feat)
+{
+	struct stub_udp *udp;
+
+	udp = calloc(1, sizeof(*udp));
+	if (!udp)
+		return -1;
+	sdev->udp = udp;
+
+	udp->sockfd = feat->udp_sockfd;
+	udp->token = feat->udp_token;
+	udp->max = stub_udp_max();
+	udp->next_seq = 1;
+	udp->recv_next = 1;
+	udp->rx_buf = malloc(udp->max);
+	udp->tx_queue = usbip_queue_create(STUB_MAX_URBS + 1);
+	udp->rx_done = usbip_sem_create(1, 0);
+	udp->tx_done = usbip_sem_create(1, 0);
+	udp->lock = usbip_mutex_create();
+	if (!udp->rx_buf || !udp->tx_queue || !udp->rx_done || !udp->tx_done ||
+	    !udp->lock)
+		goto err;
+	for (int i = 0; i < STUB_UDP_WINDOW; i++) {
+		udp->slot[i].buf = malloc(udp->max);
+		if (!udp->slot[i].buf)
+			goto err;
+	}
+
+	if (usbip_task_create(stub_udp_tx_loop, "usbip_udp_tx", 4096, sdev, 6) < 0)
+		goto err;
+	if (usbip_task_create(stub_udp_rx_loop, "usbip_udp_rx", 4096, sdev, 6) < 0) {
+		usbip_queue_send(udp->tx_queue, NULL);
+		usbip_sem_take(udp->tx_done);
+		goto err;
+	}
+
+	info("datagram channel: %d x %u bytes in flight",
+	     STUB_UDP_WINDOW, (unsigned)udp->max);
+	return 0;
+err:
+	stub_udp_free(sdev);
+	return -1;
+}
+
+void stub_udp_stop_rx(struct stub_device *sdev)
+{
+	if (sdev->udp)
+		usbip_sem_take(sdev->udp->rx_done);
+}
+
+void stub_udp_stop_tx(struct stub_device *sdev)
+{
+	if (!sdev->udp)
+		return;
+	usbip_queue_send(sdev->udp->tx_queue, NULL);
+	usbip_sem_take(sdev->udp->tx_done);
+}
+
+/* the socket is the caller's */
+void stub_udp_free(struct stub_device *sdev)
+{
+	struct stub_udp *udp = sdev->udp;
+
+	if (!udp)
+		return;
+	for (int i = 0; i < STUB_UDP_WINDOW; i++)
+		free(udp->slot[i].buf);
+	free(udp->rx_buf);
+	if (udp->tx_queue)
+		usbip_queue_delete(udp->tx_queue);
+	if (udp->rx_done)
+		usbip_sem_delete(udp->rx_done);
+	if (udp->tx_done)
+		usbip_sem_delete(udp->tx_done);
+	if (udp->lock)
+		usbip_mutex_delete(udp->lock);
+	free(udp);
+	sdev->udp = NULL;
+}
+
+void stub_udp_log_stats(struct stub_device *sdev)
+{
+	struct stub_udp *udp = sdev->udp;
+
+	if (!udp)
+		return;
+	info("datagrams in: %u PDUs, %u duplicates, %u left to be sent again",
+	     (unsigned)udp->rx_pdus, (unsigned)udp->rx_dups,
+	     (unsigned)udp->rx_deferred);
+	info("datagrams out: %u replies, %u sent again, %u replies over TCP",
+	     (unsigned)udp->tx_pdus, (unsigned)udp->tx_resent,
+	     (unsigned)udp->tx_tcp);
+}
+
+void stub_udp_unlatch(struct stub_device *sdev)
+{
+	struct stub_udp *udp = sdev->udp;
+
+	if (!udp)
+		return;
+	/* replies go over TCP until the next datagram of the client */
+	usbip_mutex_lock(udp->lock);
+	udp->peer_len = 0;
+	usbip_mutex_unlock(udp->lock);
+}
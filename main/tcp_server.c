@@ -5,27 +5,12 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 #include <string.h>
+#include <errno.h>
 #include <sys/param.h>
-#include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
-#include "esp_system.h"
-#include "esp_wifi.h"
-#include "esp_event.h"
-#include "esp_log.h"
-#include "nvs_flash.h"
-#include "esp_netif.h"
-#include "protocol_examples_common.h"
-
-#include "lwip/err.h"
-#include "lwip/sockets.h"
-#include "lwip/sys.h"
-#include <lwip/netdb.h>
 
+#include "usbip_port.h"
 #include "usbip.h"
 
-void do_tcp_task(const int sock);
-
-
 #define PORT                        CONFIG_EXAMPLE_PORT
 #define KEEPALIVE_IDLE              CONFIG_EXAMPLE_KEEPALIVE_IDLE
 #define KEEPALIVE_INTERVAL          CONFIG_EXAMPLE_KEEPALIVE_INTERVAL
@@ -33,99 +18,227 @@ void do_tcp_task(const int sock);
 
 static const char *TAG = "tcp server";
 
-void tcp_server_task(void *pvParameters)
+// connections in the handshake at once, and how long they may stay idle in it
+#define MAX_PENDING                 CONFIG_USBIP_MAX_SESSIONS
+#define PENDING_TIMEOUT_US          (10 * 1000000LL)
+
+struct pending {
+    struct usbip_conn *conn;
+    int want;
+    int64_t since_us;   // last accepted, read from or written to
+};
+
+static int tcp_server_listen(int addr_family, int port)
 {
-    char addr_str[128];
-    int addr_family = (int)pvParameters;
     int ip_protocol = 0;
-    int keepAlive = 1;
-    int keepIdle = KEEPALIVE_IDLE;
-    int keepInterval = KEEPALIVE_INTERVAL;
-    int keepCount = KEEPALIVE_COUNT;
     struct sockaddr_storage dest_addr;
 
+    memset(&dest_addr, 0, sizeof(dest_addr));
     if (addr_family == AF_INET) {
         struct sockaddr_in *dest_addr_ip4 = (struct sockaddr_in *)&dest_addr;
         dest_addr_ip4->sin_addr.s_addr = htonl(INADDR_ANY);
         dest_addr_ip4->sin_family = AF_INET;
-        dest_addr_ip4->sin_port = htons(PORT);
+        dest_addr_ip4->sin_port = htons(port);
         ip_protocol = IPPROTO_IP;
     }
 #ifdef CONFIG_EXAMPLE_IPV6
     else if (addr_family == AF_INET6) {
         struct sockaddr_in6 *dest_addr_ip6 = (struct sockaddr_in6 *)&dest_addr;
-        bzero(&dest_addr_ip6->sin6_addr.un, sizeof(dest_addr_ip6->sin6_addr.un));
+        memset(&dest_addr_ip6->sin6_addr, 0, sizeof(dest_addr_ip6->sin6_addr));
         dest_addr_ip6->sin6_family = AF_INET6;
-        dest_addr_ip6->sin6_port = htons(PORT);
-        ip_protocol = IPPROTO_IPV6;
+        dest_addr_ip6->sin6_port = htons(port);
+        ip_protocol = IPPROTO_TCP;
     }
 #endif
 
     int listen_sock = socket(addr_family, SOCK_STREAM, ip_protocol);
     if (listen_sock < 0) {
-        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
-        vTaskDelete(NULL);
-        return;
+        USBIP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        return -1;
     }
     int opt = 1;
     setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 #if defined(CONFIG_EXAMPLE_IPV4) && defined(CONFIG_EXAMPLE_IPV6)
     // Note that by default IPV6 binds to both protocols, it is must be disabled
     // if both protocols used at the same time (used in CI)
-    setsockopt(listen_sock, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
+    if (addr_family == AF_INET6) {
+        setsockopt(listen_sock, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
+    }
 #endif
 
-    ESP_LOGI(TAG, "Socket created");
+    USBIP_LOGI(TAG, "Socket created");
 
     int err = bind(listen_sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
     if (err != 0) {
-        ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
-        ESP_LOGE(TAG, "IPPROTO: %d", addr_family);
+        USBIP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+        USBIP_LOGE(TAG, "IPPROTO: %d", addr_family);
         goto CLEAN_UP;
     }
-    ESP_LOGI(TAG, "Socket bound, port %d", PORT);
+    USBIP_LOGI(TAG, "Socket bound, port %d", port);
 
-    err = listen(listen_sock, 1);
+    err = listen(listen_sock, MAX_PENDING);
     if (err != 0) {
-        ESP_LOGE(TAG, "Error occurred during listen: errno %d", errno);
+        USBIP_LOGE(TAG, "Error occurred during listen: errno %d", errno);
         goto CLEAN_UP;
     }
 
-    while (1) {
+    return listen_sock;
+
+CLEAN_UP:
+    close(listen_sock);
+    return -1;
+}
 
-        ESP_LOGI(TAG, "Socket listening");
+static void tcp_server_accept(int listen_sock, struct pending *pending)
+{
+    char addr_str[128];
+    int keepAlive = 1;
+    int keepIdle = KEEPALIVE_IDLE;
+    int keepInterval = KEEPALIVE_INTERVAL;
+    int keepCount = KEEPALIVE_COUNT;
+    struct sockaddr_storage source_addr; // Large enough for both IPv4 or IPv6
+    socklen_t addr_len = sizeof(source_addr);
+    struct pending *slot = NULL;
 
-        struct sockaddr_storage source_addr; // Large enough for both IPv4 or IPv6
-        socklen_t addr_len = sizeof(source_addr);
-        int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
-        if (sock < 0) {
-            ESP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
-            break;
-        }
+    int sock = accept(listen_sock, (struct sockaddr *)&source_addr, &addr_len);
+    if (sock < 0) {
+        USBIP_LOGE(TAG, "Unable to accept connection: errno %d", errno);
+        return;
+    }
 
-        // Set tcp keepalive option
-        setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(int));
-        setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepIdle, sizeof(int));
-        setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(int));
-        setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(int));
-        // Convert ip address to string
-        if (source_addr.ss_family == PF_INET) {
-            inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr, addr_str, sizeof(addr_str) - 1);
-        }
+    // Set tcp keepalive option
+    setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(int));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &keepIdle, sizeof(int));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &keepInterval, sizeof(int));
+    setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &keepCount, sizeof(int));
+    // Convert ip address to string
+    addr_str[0] = '\0';
+    if (source_addr.ss_family == PF_INET) {
+        inet_ntop(AF_INET, &((struct sockaddr_in *)&source_addr)->sin_addr, addr_str, sizeof(addr_str) - 1);
+    }
 #ifdef CONFIG_EXAMPLE_IPV6
-        else if (source_addr.ss_family == PF_INET6) {
-            inet6_ntoa_r(((struct sockaddr_in6 *)&source_addr)->sin6_addr, addr_str, sizeof(addr_str) - 1);
-        }
+    else if (source_addr.ss_family == PF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&source_addr)->sin6_addr, addr_str, sizeof(addr_str) - 1);
+    }
 #endif
-        ESP_LOGI(TAG, "Socket accepted ip address: %s", addr_str);
+    USBIP_LOGD(TAG, "Socket accepted ip address: %s", addr_str);
 
-        do_tcp_task(sock);
+    for (int i = 0; i < MAX_PENDING && !slot; i++) {
+        if (!pending[i].conn) {
+            slot = &pending[i];
+        }
+    }
+    if (!slot) {
+        USBIP_LOGE(TAG, "%d connections in the handshake, %s refused", MAX_PENDING, addr_str);
+        close(sock);
+        return;
+    }
 
-        shutdown(sock, 0);
+    slot->conn = usbip_conn_new(sock);
+    if (!slot->conn) {
+        USBIP_LOGE(TAG, "no memory for connection");
         close(sock);
+        return;
     }
+    slot->want = USBIP_CONN_READ;
+    slot->since_us = usbip_time_us();
+}
 
-CLEAN_UP:
-    close(listen_sock);
-    vTaskDelete(NULL);
+/*
+ * One task serves every listening socket and every connection until it has
+ * imported a device, waiting for all of them in select(). Imported devices
+ * get a session task of their own, see usbip_conn_input().
+ */
+void tcp_server_task(void *pvParameters)
+{
+    int listen_socks[2];
+    int num_listen = 0;
+    struct pending pending[MAX_PENDING];
+    int port = pvParameters ? *(int *)pvParameters : PORT;
+
+    memset(pending, 0, sizeof(pending));
+#ifdef CONFIG_EXAMPLE_IPV4
+    listen_socks[num_listen] = tcp_server_listen(AF_INET, port);
+    if (listen_socks[num_listen] >= 0) {
+        num_listen++;
+    }
+#endif
+#ifdef CONFIG_EXAMPLE_IPV6
+    listen_socks[num_listen] = tcp_server_listen(AF_INET6, port);
+    if (listen_socks[num_listen] >= 0) {
+        num_listen++;
+    }
+#endif
+    if (!num_listen) {
+        usbip_task_exit();
+        return;
+    }
+
+    while (1) {
+        fd_set readfds, writefds;
+        struct timeval timeout = { .tv_sec = 1 };
+        int maxfd = -1;
+
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        for (int i = 0; i < num_listen; i++) {
+            FD_SET(listen_socks[i], &readfds);
+            maxfd = MAX(maxfd, listen_socks[i]);
+        }
+        for (int i = 0; i < MAX_PENDING; i++) {
+            if (!pending[i].conn) {
+                continue;
+            }
+            int fd = usbip_conn_fd(pending[i].conn);
+            FD_SET(fd, pending[i].want == USBIP_CONN_WRITE ? &writefds : &readfds);
+            maxfd = MAX(maxfd, fd);
+        }
+
+        int ready = select(maxfd + 1, &readfds, &writefds, NULL, &timeout);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            USBIP_LOGE(TAG, "select failed: errno %d", errno);
+            break;
+        }
+
+        int64_t now = usbip_time_us();
+        for (int i = 0; i < MAX_PENDING; i++) {
+            struct pending *p = &pending[i];
+
+            if (!p->conn) {
+                continue;
+            }
+            int fd = usbip_conn_fd(p->conn);
+            if (FD_ISSET(fd, &readfds)) {
+                p->want = usbip_conn_input(p->conn);
+                p->since_us = now;
+            } else if (FD_ISSET(fd, &writefds)) {
+                p->want = usbip_conn_output(p->conn);
+                p->since_us = now;
+            } else if (now - p->since_us > PENDING_TIMEOUT_US) {
+                USBIP_LOGD(TAG, "connection %d timed out", fd);
+                p->want = USBIP_CONN_CLOSE;
+            }
+
+            if (p->want == USBIP_CONN_CLOSE) {
+                usbip_conn_free(p->conn);
+            }
+            if (p->want == USBIP_CONN_CLOSE || p->want == USBIP_CONN_DETACHED) {
+                p->conn = NULL;
+            }
+        }
+
+        for (int i = 0; i < num_listen; i++) {
+            if (FD_ISSET(listen_socks[i], &readfds)) {
+                tcp_server_accept(listen_socks[i], pending);
+            }
+        }
+    }
+
+    for (int i = 0; i < num_listen; i++) {
+        close(listen_socks[i]);
+    }
+    usbip_task_exit();
 }
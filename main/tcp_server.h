@@ -1,3 +1,4 @@
 #pragma once
 
+// pvParameters: the port to listen on as an int *, NULL for CONFIG_EXAMPLE_PORT
 void tcp_server_task(void *pvParameters);
\ No newline at end of file
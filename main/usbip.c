@@ -1,278 +1,45 @@
+#define LOG_LOCAL_LEVEL	CONFIG_USBIP_LOG_LEVEL_CORE
+
 #include "usbip.h"
+#include "usbip_network.h"
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include "lwip/sockets.h"
-#include "esp_log.h"
-
-static struct usbip_exported_device edevg = {};
-
-#define __u32 uint32_t
-#define __s32 int32_t
-//#define __packed __attribute__((packed))
-
-#define USBIP_VERSION 0x111
-
-#define err(...)    ESP_LOGE(TAG, __VA_ARGS__)
-#define info(...)   ESP_LOGI(TAG, __VA_ARGS__)
-#define dbg(...)    ESP_LOGW(TAG, __VA_ARGS__)
-
-static const char *TAG = "usbip";
-
-
-
-/* Defines for op_code status in server/client op_common PDUs */
-#define ST_OK	0x00
-#define ST_NA	0x01
-	/* Device requested for import is not available */
-#define ST_DEV_BUSY	0x02
-	/* Device requested for import is in error state */
-#define ST_DEV_ERR	0x03
-#define ST_NODEV	0x04
-#define ST_ERROR	0x05
-
-/* ---------------------------------------------------------------------- */
-/* Common header for all the kinds of PDUs. */
-struct op_common {
-	uint16_t version;
-
-#define OP_REQUEST	(0x80 << 8)
-#define OP_REPLY	(0x00 << 8)
-	uint16_t code;
-
-	/* status codes defined in usbip_common.h */
-	uint32_t status; /* op_code status (for reply) */
-
-} __attribute__((packed));
-
-/* ---------------------------------------------------------------------- */
-/* Dummy Code */
-#define OP_UNSPEC	0x00
-#define OP_REQ_UNSPEC	OP_UNSPEC
-#define OP_REP_UNSPEC	OP_UNSPEC
-
-/* ---------------------------------------------------------------------- */
-/* Retrieve USB device information. (still not used) */
-#define OP_DEVINFO	0x02
-#define OP_REQ_DEVINFO	(OP_REQUEST | OP_DEVINFO)
-#define OP_REP_DEVINFO	(OP_REPLY   | OP_DEVINFO)
-
-struct op_devinfo_request {
-	char busid[SYSFS_BUS_ID_SIZE];
-} __attribute__((packed));
-
-struct op_devinfo_reply {
-	struct usbip_usb_device udev;
-	struct usbip_usb_interface uinf[];
-} __attribute__((packed));
-
-/* ---------------------------------------------------------------------- */
-/* Import a remote USB device. */
-#define OP_IMPORT	0x03
-#define OP_REQ_IMPORT	(OP_REQUEST | OP_IMPORT)
-#define OP_REP_IMPORT   (OP_REPLY   | OP_IMPORT)
-
-struct op_import_request {
-	char busid[SYSFS_BUS_ID_SIZE];
-} __attribute__((packed));
-
-struct op_import_reply {
-	struct usbip_usb_device udev;
-//	struct usbip_usb_interface uinf[];
-} __attribute__((packed));
-
-#define PACK_OP_IMPORT_REQUEST(pack, request)  do {\
-} while (0)
-
-#define PACK_OP_IMPORT_REPLY(pack, reply)  do {\
-	usbip_net_pack_usb_device(pack, &(reply)->udev);\
-} while (0)
-
-/* ---------------------------------------------------------------------- */
-/* Export a USB device to a remote host. */
-#define OP_EXPORT	0x06
-#define OP_REQ_EXPORT	(OP_REQUEST | OP_EXPORT)
-#define OP_REP_EXPORT	(OP_REPLY   | OP_EXPORT)
-
-struct op_export_request {
-	struct usbip_usb_device udev;
-} __attribute__((packed));
-
-struct op_export_reply {
-	int returncode;
-} __attribute__((packed));
-
-
-#define PACK_OP_EXPORT_REQUEST(pack, request)  do {\
-	usbip_net_pack_usb_device(pack, &(request)->udev);\
-} while (0)
-
-#define PACK_OP_EXPORT_REPLY(pack, reply)  do {\
-} while (0)
-
-/* ---------------------------------------------------------------------- */
-/* un-Export a USB device from a remote host. */
-#define OP_UNEXPORT	0x07
-#define OP_REQ_UNEXPORT	(OP_REQUEST | OP_UNEXPORT)
-#define OP_REP_UNEXPORT	(OP_REPLY   | OP_UNEXPORT)
-
-struct op_unexport_request {
-	struct usbip_usb_device udev;
-} __attribute__((packed));
-
-struct op_unexport_reply {
-	int returncode;
-} __attribute__((packed));
-
-#define PACK_OP_UNEXPORT_REQUEST(pack, request)  do {\
-	usbip_net_pack_usb_device(pack, &(request)->udev);\
-} while (0)
-
-#define PACK_OP_UNEXPORT_REPLY(pack, reply)  do {\
-} while (0)
-
-
-/* ---------------------------------------------------------------------- */
-/* Retrieve the list of exported USB devices. */
-#define OP_DEVLIST	0x05
-#define OP_REQ_DEVLIST	(OP_REQUEST | OP_DEVLIST)
-#define OP_REP_DEVLIST	(OP_REPLY   | OP_DEVLIST)
-
-struct op_devlist_request {
-} __attribute__((packed));
-
-struct op_devlist_reply {
-	uint32_t ndev;
-	/* followed by reply_extra[] */
-} __attribute__((packed));
-
-struct op_devlist_reply_extra {
-	struct usbip_usb_device    udev;
-	struct usbip_usb_interface uinf[];
-} __attribute__((packed));
-
-#define PACK_OP_DEVLIST_REQUEST(pack, request)  do {\
-} while (0)
-
-#define PACK_OP_DEVLIST_REPLY(pack, reply)  do {\
-	(reply)->ndev = usbip_net_pack_uint32_t(pack, (reply)->ndev);\
-} while (0)
+#include <errno.h>
+#include <fcntl.h>
+#include "usbip_port.h"
+#include "stub.h"
+#include "usbip_pool.h"
+
+/* exported devices, looked up by busid; status and contents under edev_lock */
+static struct usbip_exported_device edev_table[CONFIG_USBIP_MAX_DEVICES];
+static usbip_mutex_t edev_lock;
+/* bumped under edev_lock whenever the devices listed by DEVLIST change */
+static uint32_t edev_generation;
+/* free session slots, CONFIG_USBIP_MAX_SESSIONS at most */
+static usbip_sem_t session_slots;
 
 /*
- * USB/IP request headers
- *
- * Each request is transferred across the network to its counterpart, which
- * facilitates the normal USB communication. The values contained in the headers
- * are basically the same as in a URB. Currently, four request types are
- * defined:
- *
- *  - USBIP_CMD_SUBMIT: a USB request block, corresponds to usb_submit_urb()
- *    (client to server)
- *
- *  - USBIP_RET_SUBMIT: the result of USBIP_CMD_SUBMIT
- *    (server to client)
- *
- *  - USBIP_CMD_UNLINK: an unlink request of a pending USBIP_CMD_SUBMIT,
- *    corresponds to usb_unlink_urb()
- *    (client to server)
- *
- *  - USBIP_RET_UNLINK: the result of USBIP_CMD_UNLINK
- *    (server to client)
- *
- */
-#define USBIP_CMD_SUBMIT	0x0001
-#define USBIP_CMD_UNLINK	0x0002
-#define USBIP_RET_SUBMIT	0x0003
-#define USBIP_RET_UNLINK	0x0004
-
-#define USBIP_DIR_OUT	0x00
-#define USBIP_DIR_IN	0x01
-
-/**
- * struct usbip_header_basic - data pertinent to every request
- * @command: the usbip request type
- * @seqnum: sequential number that identifies requests; incremented per
- *	    connection
- * @devid: specifies a remote USB device uniquely instead of busnum and devnum;
- *	   in the stub driver, this value is ((busnum << 16) | devnum)
- * @direction: direction of the transfer
- * @ep: endpoint number
- */
-struct usbip_header_basic {
-	__u32 command;
-	__u32 seqnum;
-	__u32 devid;
-	__u32 direction;
-	__u32 ep;
-} __packed;
-
-/**
- * struct usbip_header_cmd_submit - USBIP_CMD_SUBMIT packet header
- * @transfer_flags: URB flags
- * @transfer_buffer_length: the data size for (in) or (out) transfer
- * @start_frame: initial frame for isochronous or interrupt transfers
- * @number_of_packets: number of isochronous packets
- * @interval: maximum time for the request on the server-side host controller
- * @setup: setup data for a control request
- */
-struct usbip_header_cmd_submit {
-	__u32 transfer_flags;
-	__s32 transfer_buffer_length;
-
-	/* it is difficult for usbip to sync frames (reserved only?) */
-	__s32 start_frame;
-	__s32 number_of_packets;
-	__s32 interval;
-
-	unsigned char setup[8];
-} __packed;
-
-/**
- * struct usbip_header_ret_submit - USBIP_RET_SUBMIT packet header
- * @status: return status of a non-iso request
- * @actual_length: number of bytes transferred
- * @start_frame: initial frame for isochronous or interrupt transfers
- * @number_of_packets: number of isochronous packets
- * @error_count: number of errors for isochronous transfers
- */
-struct usbip_header_ret_submit {
-	__s32 status;
-	__s32 actual_length;
-	__s32 start_frame;
-	__s32 number_of_packets;
-	__s32 error_count;
-} __packed;
-
-/**
- * struct usbip_header_cmd_unlink - USBIP_CMD_UNLINK packet header
- * @seqnum: the URB seqnum to unlink
+ * OP_REP_DEVLIST as sent, rebuilt for every generation of the device table.
+ * Each sender holds a reference, so the table may change meanwhile.
  */
-struct usbip_header_cmd_unlink {
-	__u32 seqnum;
-} __packed;
+struct usbip_devlist_image {
+	atomic_int refs;
+	uint32_t generation;
+	size_t len;
+	uint8_t data[];
+};
+static struct usbip_devlist_image *devlist_image;
+/* the op_common of a successful OP_REP_IMPORT, network order */
+static struct op_common import_ok;
+
+#define err(...)    USBIP_LOGE(TAG, __VA_ARGS__)
+#define info(...)   USBIP_LOGI(TAG, __VA_ARGS__)
+#define dbg(...)    USBIP_LOGD(TAG, __VA_ARGS__)
 
-/**
- * struct usbip_header_ret_unlink - USBIP_RET_UNLINK packet header
- * @status: return status of the request
- */
-struct usbip_header_ret_unlink {
-	__s32 status;
-} __packed;
-
-/**
- * struct usbip_header - common header for all usbip packets
- * @base: the basic header
- * @u: packet type dependent header
- */
-struct usbip_header {
-	struct usbip_header_basic base;
-
-	union {
-		struct usbip_header_cmd_submit	cmd_submit;
-		struct usbip_header_ret_submit	ret_submit;
-		struct usbip_header_cmd_unlink	cmd_unlink;
-		struct usbip_header_ret_unlink	ret_unlink;
-	} u;
-} __packed;
+static const char *TAG = "usbip";
 
 uint32_t usbip_net_pack_uint32_t(int pack, uint32_t num)
 {
@@ -316,6 +83,68 @@ void usbip_net_pack_usb_interface(int pack __attribute__((unused)),
 	/* uint8_t members need nothing */
 }
 
+static void usbip_net_pack_header_basic(int pack,
+					struct usbip_header_basic *base)
+{
+	base->command	= usbip_net_pack_uint32_t(pack, base->command);
+	base->seqnum	= usbip_net_pack_uint32_t(pack, base->seqnum);
+	base->devid	= usbip_net_pack_uint32_t(pack, base->devid);
+	base->direction	= usbip_net_pack_uint32_t(pack, base->direction);
+	base->ep	= usbip_net_pack_uint32_t(pack, base->ep);
+}
+
+void usbip_net_pack_header(int pack, struct usbip_header *pdu)
+{
+	uint32_t cmd = 0;
+
+	/* the command has to be read in host order on both ways */
+	if (pack)
+		cmd = pdu->base.command;
+
+	usbip_net_pack_header_basic(pack, &pdu->base);
+
+	if (!pack)
+		cmd = pdu->base.command;
+
+	switch (cmd & ~USBIP_COMPRESSED) {
+	case USBIP_CMD_SUBMIT:
+		pdu->u.cmd_submit.transfer_flags =
+			usbip_net_pack_uint32_t(pack, pdu->u.cmd_submit.transfer_flags);
+		pdu->u.cmd_submit.transfer_buffer_length =
+			usbip_net_pack_uint32_t(pack, pdu->u.cmd_submit.transfer_buffer_length);
+		pdu->u.cmd_submit.start_frame =
+			usbip_net_pack_uint32_t(pack, pdu->u.cmd_submit.start_frame);
+		pdu->u.cmd_submit.number_of_packets =
+			usbip_net_pack_uint32_t(pack, pdu->u.cmd_submit.number_of_packets);
+		pdu->u.cmd_submit.interval =
+			usbip_net_pack_uint32_t(pack, pdu->u.cmd_submit.interval);
+		/* setup is raw USB data, little endian by definition */
+		break;
+	case USBIP_RET_SUBMIT:
+		pdu->u.ret_submit.status =
+			usbip_net_pack_uint32_t(pack, pdu->u.ret_submit.status);
+		pdu->u.ret_submit.actual_length =
+			usbip_net_pack_uint32_t(pack, pdu->u.ret_submit.actual_length);
+		pdu->u.ret_submit.start_frame =
+			usbip_net_pack_uint32_t(pack, pdu->u.ret_submit.start_frame);
+		pdu->u.ret_submit.number_of_packets =
+			usbip_net_pack_uint32_t(pack, pdu->u.ret_submit.number_of_packets);
+		pdu->u.ret_submit.error_count =
+			usbip_net_pack_uint32_t(pack, pdu->u.ret_submit.error_count);
+		break;
+	case USBIP_CMD_UNLINK:
+		pdu->u.cmd_unlink.seqnum =
+			usbip_net_pack_uint32_t(pack, pdu->u.cmd_unlink.seqnum);
+		break;
+	case USBIP_RET_UNLINK:
+		pdu->u.ret_unlink.status =
+			usbip_net_pack_uint32_t(pack, pdu->u.ret_unlink.status);
+		break;
+	default:
+		break;
+	}
+}
+
 
 static inline void usbip_net_pack_op_common(int pack,
 					    struct op_common *op_common)
@@ -362,138 +191,267 @@ ssize_t usbip_net_send(int sockfd, void *buff, size_t bufflen)
 	return usbip_net_xmit(sockfd, buff, bufflen, 1);
 }
 
-int usbip_net_send_op_common(int sockfd, uint32_t code, uint32_t status)
+int usbip_rx_init(struct usbip_rx *rx, int sockfd, size_t size)
 {
-	struct op_common op_common;
-	int rc;
+	rx->sockfd = sockfd;
+	rx->recv = NULL;
+	rx->ctx = NULL;
+	rx->size = size;
+	rx->head = rx->tail = 0;
+	rx->buf = malloc(size);
+
+	return rx->buf ? 0 : -1;
+}
 
-	memset(&op_common, 0, sizeof(op_common));
+void usbip_rx_free(struct usbip_rx *rx)
+{
+	free(rx->buf);
+	rx->buf = NULL;
+}
 
-	op_common.version = USBIP_VERSION;
-	op_common.code    = code;
-	op_common.status  = status;
+static ssize_t usbip_rx_read(struct usbip_rx *rx, void *buff, size_t len)
+{
+	if (rx->recv)
+		return rx->recv(rx, buff, len);
+	return recv(rx->sockfd, buff, len, 0);
+}
 
-	usbip_net_pack_op_common(1, &op_common);
+/* Read until at least len bytes are buffered, taking whatever is available. */
+static int usbip_rx_fill(struct usbip_rx *rx, size_t len)
+{
+	ssize_t nbytes;
 
-	rc = usbip_net_send(sockfd, &op_common, sizeof(op_common));
-	if (rc < 0) {
-		dbg("usbip_net_send failed: %d", rc);
-		return -1;
+	if (rx->tail - rx->head >= len)
+		return 0;
+
+	if (rx->head + len > rx->size) {
+		memmove(rx->buf, rx->buf + rx->head, rx->tail - rx->head);
+		rx->tail -= rx->head;
+		rx->head = 0;
+	}
+
+	while (rx->tail - rx->head < len) {
+		nbytes = usbip_rx_read(rx, rx->buf + rx->tail, rx->size - rx->tail);
+		if (nbytes <= 0)
+			return -1;
+		rx->tail += nbytes;
 	}
 
 	return 0;
 }
 
-static int send_reply_devlist(int connfd)
-{
-	struct usbip_exported_device *edev = &edevg;
-	struct usbip_usb_device pdu_udev;
-	struct usbip_usb_interface pdu_uinf = {1,2,3,4};
-	struct op_devlist_reply reply;
-	//struct list_head *j;
-	int rc, i;
-
-	/*
-	 * Exclude devices that are already exported to a client from
-	 * the exportable device list to avoid:
-	 *	- import requests for devices that are exported only to
-	 *	  fail the request.
-	 *	- revealing devices that are imported by a client to
-	 *	  another client.
-	 */
-
-	reply.ndev = 1;
-	/* number of exported devices */
-	// list_for_each(j, &driver->edev_list) {
-	// 	edev = list_entry(j, struct usbip_exported_device, node);
-	// 	if (edev->status != SDEV_ST_USED)
-	// 		reply.ndev += 1;
-	// }
-	info("exportable devices: %d", reply.ndev);
-
-	rc = usbip_net_send_op_common(connfd, OP_REP_DEVLIST, ST_OK);
-	if (rc < 0) {
-		dbg("usbip_net_send_op_common failed: %#0x", OP_REP_DEVLIST);
-		return -1;
+/*
+ * Take len bytes of the stream. What is buffered is copied, a remainder
+ * larger than half the buffer is received straight into buff. Returns the
+ * number of bytes copied from the buffer, or -1 when the connection fails.
+ */
+ssize_t usbip_rx_recv(struct usbip_rx *rx, void *buff, size_t len)
+{
+	size_t copied = rx->tail - rx->head;
+	size_t left = len;
+
+	if (copied >= len || len - copied <= rx->size / 2) {
+		while (left > 0) {
+			size_t n = left < rx->size ? left : rx->size;
+
+			if (usbip_rx_fill(rx, n) < 0)
+				return -1;
+			memcpy(buff, rx->buf + rx->head, n);
+			rx->head += n;
+			buff = (uint8_t *)buff + n;
+			left -= n;
+		}
+		return len;
 	}
-	PACK_OP_DEVLIST_REPLY(1, &reply);
 
-	rc = usbip_net_send(connfd, &reply, sizeof(reply));
-	if (rc < 0) {
-		dbg("usbip_net_send failed: %#0x", OP_REP_DEVLIST);
-		return -1;
+	memcpy(buff, rx->buf + rx->head, copied);
+	rx->head = rx->tail = 0;
+	if (!rx->recv) {
+		if (usbip_net_recv(rx->sockfd, (uint8_t *)buff + copied,
+				   len - copied) < 0)
+			return -1;
+		return copied;
 	}
 
-	// list_for_each(j, &driver->edev_list) {
-	// 	edev = list_entry(j, struct usbip_exported_device, node);
-	// 	if (edev->status == SDEV_ST_USED)
-	// 		continue;
+	for (left = len - copied; left > 0; ) {
+		ssize_t nbytes = rx->recv(rx, (uint8_t *)buff + len - left, left);
 
-	//	dump_usb_device(&edev->udev);
-		memcpy(&pdu_udev, &edev->udev, sizeof(pdu_udev));
-		usbip_net_pack_usb_device(1, &pdu_udev);
+		if (nbytes <= 0)
+			return -1;
+		left -= nbytes;
+	}
+
+	return copied;
+}
 
-		rc = usbip_net_send(connfd, &pdu_udev, sizeof(pdu_udev));
-		if (rc < 0) {
-			dbg("usbip_net_send failed: pdu_udev");
+/*
+ * Send a whole reply with as few calls as possible, so that with TCP_NODELAY
+ * its parts do not leave in separate segments. iov is consumed.
+ */
+ssize_t usbip_net_sendv(int sockfd, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	ssize_t nbytes;
+	ssize_t total = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	while (msg.msg_iovlen > 0) {
+		if (!msg.msg_iov->iov_len) {
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+			continue;
+		}
+
+		nbytes = sendmsg(sockfd, &msg, 0);
+		if (nbytes <= 0)
 			return -1;
+		total += nbytes;
+
+		/* short send: skip what went out and retry with the rest */
+		while (nbytes > 0) {
+			size_t n = (size_t)nbytes < msg.msg_iov->iov_len ?
+				   (size_t)nbytes : msg.msg_iov->iov_len;
+
+			msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + n;
+			msg.msg_iov->iov_len -= n;
+			nbytes -= n;
+			if (!msg.msg_iov->iov_len) {
+				msg.msg_iov++;
+				msg.msg_iovlen--;
+			}
 		}
+	}
 
-	// 	for (i = 0; i < edev->udev.bNumInterfaces; i++) {
-	// //		dump_usb_interface(&edev->uinf[i]);
-	// 		memcpy(&pdu_uinf, &edev->uinf[i], sizeof(pdu_uinf));
-	 		usbip_net_pack_usb_interface(1, &pdu_uinf);
+	return total;
+}
 
-	 		rc = usbip_net_send(connfd, &pdu_uinf,
-	 				sizeof(pdu_uinf));
-			if (rc < 0) {
-				err("usbip_net_send failed: pdu_uinf");
-				return -1;
-	 		}
-            dbg("complete send %d", rc);
-//		}
-//	}
+static void usbip_net_fill_op_common(struct op_common *op_common,
+				     uint32_t code, uint32_t status)
+{
+	memset(op_common, 0, sizeof(*op_common));
 
-	return 0;
-}
+	op_common->version = USBIP_VERSION;
+	op_common->code    = code;
+	op_common->status  = status;
 
+	usbip_net_pack_op_common(1, op_common);
+}
 
-static int recv_request_devlist(int connfd)
+int usbip_net_send_op_common(int sockfd, uint32_t code, uint32_t status)
 {
-	struct op_devlist_request req;
+	struct op_common op_common;
 	int rc;
 
-	memset(&req, 0, sizeof(req));
-
-	rc = usbip_net_recv(connfd, &req, sizeof(req));
-	if (rc < 0) {
-		dbg("usbip_net_recv failed: devlist request");
-		return -1;
-	}
+	usbip_net_fill_op_common(&op_common, code, status);
 
-	rc = send_reply_devlist(connfd);
+	rc = usbip_net_send(sockfd, &op_common, sizeof(op_common));
 	if (rc < 0) {
-		dbg("send_reply_devlist failed");
+		dbg("usbip_net_send failed: %d", rc);
 		return -1;
 	}
 
 	return 0;
 }
 
+static void usbip_devlist_put(struct usbip_devlist_image *image)
+{
+	if (image && atomic_fetch_sub(&image->refs, 1) == 1)
+		free(image);
+}
 
-int usbip_net_recv_op_common(int sockfd, uint16_t *code, int *status)
+/*
+ * Build the reply for the current generation, called with edev_lock held.
+ * Devices that are already exported to a client are left out to avoid:
+ *	- import requests for devices that are exported only to
+ *	  fail the request.
+ *	- revealing devices that are imported by a client to
+ *	  another client.
+ */
+static void usbip_devlist_rebuild_locked(void)
 {
-	struct op_common op_common;
-	int rc;
+	struct usbip_devlist_image *image;
+	struct usbip_exported_device *edev;
+	struct op_devlist_reply *reply;
+	uint8_t *p;
+	size_t len;
+	int ndev = 0;
+	int i;
+
+	len = sizeof(struct op_common) + sizeof(*reply);
+	for (i = 0; i < CONFIG_USBIP_MAX_DEVICES; i++) {
+		edev = &edev_table[i];
+		if (edev->status != SDEV_ST_AVAILABLE)
+			continue;
+		len += sizeof(edev->wire_udev) +
+		       edev->num_interfaces * sizeof(edev->uinf[0]);
+		ndev++;
+	}
 
-	memset(&op_common, 0, sizeof(op_common));
+	usbip_devlist_put(devlist_image);
+	devlist_image = NULL;
 
-	rc = usbip_net_recv(sockfd, &op_common, sizeof(op_common));
-	if (rc < 0) {
-		dbg("usbip_net_recv failed: %d, %d", rc, errno);
-		goto err;
+	image = malloc(sizeof(*image) + len);
+	if (!image) {
+		err("no memory for the device list");
+		return;
+	}
+	atomic_init(&image->refs, 1);
+	image->generation = edev_generation;
+	image->len = len;
+
+	usbip_net_fill_op_common((struct op_common *)image->data, OP_REP_DEVLIST, ST_OK);
+	p = image->data + sizeof(struct op_common);
+
+	reply = (struct op_devlist_reply *)p;
+	reply->ndev = ndev;
+	PACK_OP_DEVLIST_REPLY(1, reply);
+	p += sizeof(*reply);
+
+	for (i = 0; i < CONFIG_USBIP_MAX_DEVICES; i++) {
+		edev = &edev_table[i];
+		if (edev->status != SDEV_ST_AVAILABLE)
+			continue;
+		memcpy(p, &edev->wire_udev, sizeof(edev->wire_udev));
+		p += sizeof(edev->wire_udev);
+		memcpy(p, edev->uinf, edev->num_interfaces * sizeof(edev->uinf[0]));
+		p += edev->num_interfaces * sizeof(edev->uinf[0]);
 	}
 
+	devlist_image = image;
+	dbg("device list generation %u: %d devices, %u bytes",
+	    (unsigned)edev_generation, ndev, (unsigned)len);
+}
+
+/* called with edev_lock held after the devices listed by DEVLIST changed */
+static void usbip_table_changed_locked(void)
+{
+	edev_generation++;
+	usbip_devlist_rebuild_locked();
+}
+
+/* the current device list, referenced; NULL when out of memory */
+static struct usbip_devlist_image *usbip_devlist_get(void)
+{
+	struct usbip_devlist_image *image;
+
+	usbip_mutex_lock(edev_lock);
+	/* a rebuild that ran out of memory is retried */
+	if (!devlist_image || devlist_image->generation != edev_generation)
+		usbip_devlist_rebuild_locked();
+	image = devlist_image;
+	if (image)
+		atomic_fetch_add(&image->refs, 1);
+	usbip_mutex_unlock(edev_lock);
+
+	return image;
+}
+
+static int usbip_net_check_op_common(struct op_common op_common,
+				     uint16_t *code, int *status)
+{
 	usbip_net_pack_op_common(0, &op_common);
 
 	if (op_common.version != USBIP_VERSION) {
@@ -529,6 +487,22 @@ err:
 	return -1;
 }
 
+int usbip_net_recv_op_common(int sockfd, uint16_t *code, int *status)
+{
+	struct op_common op_common;
+	int rc;
+
+	memset(&op_common, 0, sizeof(op_common));
+
+	rc = usbip_net_recv(sockfd, &op_common, sizeof(op_common));
+	if (rc < 0) {
+		dbg("usbip_net_recv failed: %d, %d", rc, errno);
+		return -1;
+	}
+
+	return usbip_net_check_op_common(op_common, code, status);
+}
+
 int usbip_net_set_nodelay(int sockfd)
 {
 	const int val = 1;
@@ -541,192 +515,561 @@ int usbip_net_set_nodelay(int sockfd)
 	return ret;
 }
 
+/* called with edev_lock held */
 int usbip_export_device(struct usbip_exported_device *edev, int sockfd)
 {
-	char attr_name[] = "usbip_sockfd";
-	char sockfd_attr_path[SYSFS_PATH_MAX];
-	int size;
-	char sockfd_buff[30];
 	int ret = 0;
 
-	// if (edev->status != SDEV_ST_AVAILABLE) {
-	// 	dbg("device not available: %s", edev->udev.busid);
-	// 	switch (edev->status) {
-	// 	case SDEV_ST_ERROR:
-	// 		dbg("status SDEV_ST_ERROR");
-	// 		ret = ST_DEV_ERR;
-	// 		break;
-	// 	case SDEV_ST_USED:
-	// 		dbg("status SDEV_ST_USED");
-	// 		ret = ST_DEV_BUSY;
-	// 		break;
-	// 	default:
-	// 		dbg("status unknown: 0x%x", edev->status);
-	// 		ret = -1;
-	// 	}
-	// 	return ret;
-	// }
-
-	/* only the first interface is true */
-	// size = snprintf(sockfd_attr_path, sizeof(sockfd_attr_path), "%s/%s",
-	// 		edev->udev.path, attr_name);
-	// if (size < 0 || (unsigned int)size >= sizeof(sockfd_attr_path)) {
-	// 	err("exported device path length %i >= %lu or < 0", size,
-	// 	    (long unsigned)sizeof(sockfd_attr_path));
-	// 	return -1;
-	// }
-
-	// size = snprintf(sockfd_buff, sizeof(sockfd_buff), "%d\n", sockfd);
-	// if (size < 0 || (unsigned int)size >= sizeof(sockfd_buff)) {
-	// 	err("socket length %i >= %lu or < 0", size,
-	// 	    (long unsigned)sizeof(sockfd_buff));
-	// 	return -1;
-	// }
-
-	 info("connect: %s", edev->udev.busid);
+	if (edev->status != SDEV_ST_AVAILABLE) {
+		dbg("device not available: %s", edev->busid);
+		switch (edev->status) {
+		case SDEV_ST_ERROR:
+			dbg("status SDEV_ST_ERROR");
+			ret = ST_DEV_ERR;
+			break;
+		case SDEV_ST_USED:
+			dbg("status SDEV_ST_USED");
+			ret = ST_DEV_BUSY;
+			break;
+		default:
+			dbg("status unknown: 0x%x", edev->status);
+			ret = -1;
+		}
+		return ret;
+	}
+
+	edev->status = SDEV_ST_USED;
+	usbip_table_changed_locked();
+	info("connect: %s", edev->busid);
 
 	return ret;
 }
 
+/* the port's context of a device no longer in the table, nor in use */
+static void usbip_free_ctx(const struct usbip_host_ops *ops, void *ctx)
+{
+	if (ops && ops->device_free)
+		ops->device_free(ctx);
+}
 
-static int recv_request_import(int sockfd)
+/* hand a device back after its session, freeing it if it went away meanwhile */
+static void usbip_release_device(struct usbip_exported_device *edev)
 {
-	struct op_import_request req;
-	struct usbip_exported_device *edev = &edevg;
-	struct usbip_usb_device pdu_udev;
-	//struct list_head *i;
-	int found = 0;
-	int status = ST_OK;
-	int rc;
+	const struct usbip_host_ops *gone = NULL;
+	void *ctx = NULL;
+
+	usbip_mutex_lock(edev_lock);
+	if (edev->status == SDEV_ST_USED) {
+		edev->status = SDEV_ST_AVAILABLE;
+		usbip_table_changed_locked();
+	} else if (edev->status == SDEV_ST_ERROR) {
+		edev->status = SDEV_ST_UNUSED;
+		gone = edev->ops;
+		ctx = edev->ctx;
+	}
+	usbip_mutex_unlock(edev_lock);
 
-	memset(&req, 0, sizeof(req));
-info("stoff");
-	rc = usbip_net_recv(sockfd, &req, sizeof(req));
-    info("stuff");
-	if (rc < 0) {
-		dbg("usbip_net_recv failed: import request");
+	usbip_free_ctx(gone, ctx);
+}
+
+/* called with edev_lock held */
+static struct usbip_exported_device *usbip_find_device(const char *busid)
+{
+	int i;
+
+	for (i = 0; i < CONFIG_USBIP_MAX_DEVICES; i++) {
+		if (edev_table[i].status != SDEV_ST_UNUSED &&
+		    !strncmp(busid, edev_table[i].busid, SYSFS_BUS_ID_SIZE))
+			return &edev_table[i];
+	}
+
+	return NULL;
+}
+
+
+void usbip_init(void)
+{
+	edev_lock = usbip_mutex_create();
+	usbip_net_fill_op_common(&import_ok, OP_REP_IMPORT, ST_OK);
+	session_slots = usbip_sem_create(CONFIG_USBIP_MAX_SESSIONS,
+					 CONFIG_USBIP_MAX_SESSIONS);
+	if (usbip_pool_init() < 0)
+		err("transfer pool incomplete");
+	if (stub_resume_init() < 0)
+		err("no sessions can be resumed");
+}
+
+/*
+ * Alternate setting 0 of every interface in the active configuration, the
+ * configuration value and interface count go into udev.
+ */
+static void usbip_fill_interfaces(struct usbip_exported_device *edev,
+				  struct usbip_usb_device *udev)
+{
+	const usb_config_desc_t *config;
+	const uint8_t *p, *end;
+	int n = 0;
+
+	if (!edev->ops->get_config_descriptor ||
+	    edev->ops->get_config_descriptor(edev->ctx, &config) < 0) {
+		err("no configuration descriptor: %s", edev->busid);
+		return;
+	}
+
+	p = (const uint8_t *)config;
+	end = p + config->wTotalLength;
+	for (; p + 2 <= end && p[0] >= 2; p += p[0]) {
+		const usb_intf_desc_t *intf = (const usb_intf_desc_t *)p;
+
+		if (p[1] != USB_B_DESCRIPTOR_TYPE_INTERFACE || intf->bAlternateSetting)
+			continue;
+		if (n == USBIP_MAX_INTERFACES) {
+			err("%s: only %d interfaces reported", edev->busid, n);
+			break;
+		}
+		edev->uinf[n].bInterfaceClass = intf->bInterfaceClass;
+		edev->uinf[n].bInterfaceSubClass = intf->bInterfaceSubClass;
+		edev->uinf[n].bInterfaceProtocol = intf->bInterfaceProtocol;
+		edev->uinf[n].padding = 0;
+		n++;
+	}
+
+	udev->bConfigurationValue = config->bConfigurationValue;
+	udev->bNumInterfaces = n;
+	edev->num_interfaces = n;
+}
+
+int usbip_add_device(const struct usbip_usb_device *udev,
+		     const struct usbip_host_ops *ops, void *ctx)
+{
+	const struct usbip_host_ops *replaced = NULL;
+	struct usbip_exported_device *edev;
+	void *replaced_ctx = NULL;
+	int i;
+
+	usbip_mutex_lock(edev_lock);
+	edev = usbip_find_device(udev->busid);
+	if (edev && edev->status != SDEV_ST_AVAILABLE) {
+		usbip_mutex_unlock(edev_lock);
+		err("%s is still imported, not replaced", udev->busid);
 		return -1;
 	}
+	for (i = 0; !edev && i < CONFIG_USBIP_MAX_DEVICES; i++) {
+		if (edev_table[i].status == SDEV_ST_UNUSED)
+			edev = &edev_table[i];
+	}
+	if (!edev) {
+		usbip_mutex_unlock(edev_lock);
+		err("no room to export %s, %d devices exported", udev->busid,
+		    CONFIG_USBIP_MAX_DEVICES);
+		return -1;
+	}
+
+	if (edev->status == SDEV_ST_AVAILABLE) {
+		replaced = edev->ops;
+		replaced_ctx = edev->ctx;
+	}
+	memset(edev, 0, sizeof(*edev));
+	snprintf(edev->busid, sizeof(edev->busid), "%s", udev->busid);
+	edev->ops = ops;
+	edev->ctx = ctx;
+	edev->wire_udev = *udev;
+	usbip_fill_interfaces(edev, &edev->wire_udev);
+	usbip_net_pack_usb_device(1, &edev->wire_udev);
+	edev->status = SDEV_ST_AVAILABLE;
+	usbip_table_changed_locked();
+	usbip_mutex_unlock(edev_lock);
+
+	if (replaced_ctx != ctx)
+		usbip_free_ctx(replaced, replaced_ctx);
+	info("exported %s: %04x:%04x, %d interfaces", udev->busid,
+	     udev->idVendor, udev->idProduct, edev->num_interfaces);
+	return 0;
+}
+
+void usbip_hist_dump(void)
+{
+	for (int i = 0; i < CONFIG_USBIP_MAX_DEVICES; i++) {
+		if (edev_table[i].status != SDEV_ST_UNUSED)
+			usbip_hist_print(edev_table[i].busid,
+					 &edev_table[i].hist);
+	}
+}
+
+void usbip_hist_reset(void)
+{
+	for (int i = 0; i < CONFIG_USBIP_MAX_DEVICES; i++)
+		atomic_fetch_add(&edev_table[i].hist.gen, 1);
+}
+
+void usbip_link_down(void)
+{
+	stub_resume_park_all();
+}
+
+void usbip_del_device(const char *busid)
+{
+	const struct usbip_host_ops *gone = NULL;
+	struct usbip_exported_device *edev;
+	void *ctx = NULL;
+
+	usbip_mutex_lock(edev_lock);
+	edev = usbip_find_device(busid);
+	if (edev && edev->status == SDEV_ST_USED) {
+		/* the session still submits through ctx, freed on release */
+		edev->status = SDEV_ST_ERROR;
+	} else if (edev) {
+		edev->status = SDEV_ST_UNUSED;
+		usbip_table_changed_locked();
+		gone = edev->ops;
+		ctx = edev->ctx;
+	}
+	usbip_mutex_unlock(edev_lock);
+
+	usbip_free_ctx(gone, ctx);
+	if (edev)
+		info("removed %s", busid);
+}
+
+
+/*
+ * A connection in the handshake. The request is received without blocking,
+ * no further than its own end, so anything the client sends after an
+ * import is left on the socket for the session.
+ */
+struct usbip_conn {
+	int sockfd;
+	size_t len;
+	uint8_t req[sizeof(struct op_common) + sizeof(struct op_import_request)];
+	/* reply being sent, out of the OP_REP_DEVLIST image or rep */
+	const uint8_t *out;
+	size_t out_len;
+	size_t sent;
+	struct usbip_devlist_image *reply;
+	uint8_t rep[sizeof(struct op_common) + sizeof(struct op_features_reply)];
+	/* extensions granted by OP_REP_FEATURES, the socket closed with ours */
+	struct stub_features feat;
+	struct usbip_exported_device *imported;
+};
+
+struct usbip_conn *usbip_conn_new(int sockfd)
+{
+	struct usbip_conn *conn = calloc(1, sizeof(*conn));
+	int flags = fcntl(sockfd, F_GETFL, 0);
+
+	if (!conn || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		free(conn);
+		return NULL;
+	}
+	conn->sockfd = sockfd;
+	conn->feat.udp_sockfd = -1;
+
+	return conn;
+}
+
+int usbip_conn_fd(const struct usbip_conn *conn)
+{
+	return conn->sockfd;
+}
+
+void usbip_conn_free(struct usbip_conn *conn)
+{
+	if (conn->sockfd >= 0) {
+		shutdown(conn->sockfd, SHUT_RDWR);
+		close(conn->sockfd);
+	}
+	if (conn->feat.udp_sockfd >= 0)
+		close(conn->feat.udp_sockfd);
+	usbip_devlist_put(conn->reply);
+	free(conn);
+}
+
+/* answer a request with its status only, without blocking */
+static int usbip_conn_refuse(struct usbip_conn *conn, uint16_t code,
+			     int status)
+{
+	usbip_net_fill_op_common((struct op_common *)conn->rep, code, status);
+	conn->out = conn->rep;
+	conn->out_len = sizeof(struct op_common);
+	return usbip_conn_output(conn);
+}
+
+/*
+ * Session of an imported device, on a task of its own. It answers the
+ * import first, the socket blocks from here on: the session relies on it
+ * for backpressure.
+ */
+static void usbip_session_task(void *arg)
+{
+	struct usbip_conn *conn = arg;
+	struct usbip_exported_device *edev = conn->imported;
+	int flags = fcntl(conn->sockfd, F_GETFL, 0);
+	struct usbip_rx rx;
+	struct iovec iov[2];
+
+	/* should set TCP_NODELAY for usbip */
+	usbip_net_set_nodelay(conn->sockfd);
+
+	/* the device is ours now, its record stays put until released */
+	iov[0].iov_base = &import_ok;
+	iov[0].iov_len = sizeof(import_ok);
+	iov[1].iov_base = &edev->wire_udev;
+	iov[1].iov_len = sizeof(edev->wire_udev);
+
+	if (fcntl(conn->sockfd, F_SETFL, flags & ~O_NONBLOCK) < 0 ||
+	    usbip_net_sendv(conn->sockfd, iov, 2) < 0) {
+		dbg("usbip_net_sendv failed: %#0x", OP_REP_IMPORT);
+	} else {
+		if (usbip_rx_init(&rx, conn->sockfd,
+				  CONFIG_USBIP_RX_BUFFER_SIZE) < 0)
+			err("no memory for receive buffer");
+		else
+			stub_run(edev, &rx, &conn->feat);
+		usbip_rx_free(&rx);
+		/* a resumed session ends on a connection of its own */
+		conn->sockfd = rx.sockfd;
+	}
+
+	usbip_release_device(edev);
+	usbip_conn_free(conn);
+	usbip_sem_give(session_slots);
+	usbip_task_exit();
+}
+
+/*
+ * Hand OP_REQ_IMPORT to a session task, which answers it. A refusal is
+ * answered from here, without blocking.
+ */
+static int usbip_conn_import(struct usbip_conn *conn)
+{
+	struct op_import_request req;
+	struct usbip_exported_device *edev;
+	int status = ST_OK;
+
+	memcpy(&req, conn->req + sizeof(struct op_common), sizeof(req));
 	PACK_OP_IMPORT_REQUEST(0, &req);
+	req.busid[SYSFS_BUS_ID_SIZE - 1] = '\0';
 
-	//list_for_each(i, &driver->edev_list) {
-	//	edev = list_entry(i, struct usbip_exported_device, node);
-	//	if (!strncmp(req.busid, edev->udev.busid, SYSFS_BUS_ID_SIZE)) {
-			info("found requested device: %s", req.busid);
-			found = 1;
-	//		break;
-	//	}
-//	}
+	if (usbip_sem_take_timeout(session_slots, 0) < 0) {
+		err("%d sessions open, import of %s refused",
+		    CONFIG_USBIP_MAX_SESSIONS, req.busid);
+		return usbip_conn_refuse(conn, OP_REP_IMPORT, ST_NA);
+	}
 
-	if (found) {
-		/* should set TCP_NODELAY for usbip */
-		usbip_net_set_nodelay(sockfd);
+	usbip_mutex_lock(edev_lock);
+	edev = usbip_find_device(req.busid);
+	if (edev) {
+		info("found requested device: %s", req.busid);
 
 		/* export device needs a TCP/IP socket descriptor */
-		status = usbip_export_device(edev, sockfd);
+		status = usbip_export_device(edev, conn->sockfd);
 		if (status < 0)
 			status = ST_NA;
 	} else {
 		info("requested device not found: %s", req.busid);
 		status = ST_NODEV;
 	}
-
-	rc = usbip_net_send_op_common(sockfd, OP_REP_IMPORT, status);
-	if (rc < 0) {
-		dbg("usbip_net_send_op_common failed: %#0x", OP_REP_IMPORT);
-		return -1;
-	}
+	usbip_mutex_unlock(edev_lock);
 
 	if (status) {
 		dbg("import request busid %s: failed", req.busid);
-		return -1;
+		usbip_sem_give(session_slots);
+		return usbip_conn_refuse(conn, OP_REP_IMPORT, status);
 	}
 
-	memcpy(&pdu_udev, &edev->udev, sizeof(pdu_udev));
-	usbip_net_pack_usb_device(1, &pdu_udev);
+	conn->imported = edev;
+	if (usbip_task_create(usbip_session_task, "usbip_session", 4096,
+			      conn, 5) < 0) {
+		err("could not start session task");
+		usbip_release_device(edev);
+		usbip_sem_give(session_slots);
+		return USBIP_CONN_CLOSE;
+	}
 
-	rc = usbip_net_send(sockfd, &pdu_udev, sizeof(pdu_udev));
-	if (rc < 0) {
-		dbg("usbip_net_send failed: devinfo");
-		return -1;
+	dbg("import request busid %s: handed to its session", req.busid);
+	return USBIP_CONN_DETACHED;
+}
+
+int usbip_conn_output(struct usbip_conn *conn)
+{
+	while (conn->sent < conn->out_len) {
+		ssize_t n = send(conn->sockfd, conn->out + conn->sent,
+				 conn->out_len - conn->sent, 0);
+
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return USBIP_CONN_WRITE;
+		if (n <= 0) {
+			dbg("send failed: reply of %d bytes", (int)conn->out_len);
+			return USBIP_CONN_CLOSE;
+		}
+		conn->sent += n;
 	}
 
-	dbg("import request busid %s: complete", req.busid);
+	usbip_devlist_put(conn->reply);
+	conn->reply = NULL;
+	conn->out_len = 0;
+	conn->sent = 0;
 
-	return 0;
+	/* a client ends by closing after the list, or asks again */
+	return USBIP_CONN_READ;
 }
 
-static int recv_pdu(int connfd)
+/*
+ * Grant the extensions asked for and built in. They take effect with the
+ * import on this connection.
+ */
+static int usbip_conn_features(struct usbip_conn *conn)
 {
-	uint16_t code = OP_UNSPEC;
-	int ret;
-	int status;
+	struct op_features_request req;
+	struct op_features_reply reply;
+	uint16_t port;
 
-	ret = usbip_net_recv_op_common(connfd, &code, &status);
-	if (ret < 0) {
-		dbg("could not receive opcode: %#0x", code);
-		return -1;
-	}
+	memcpy(&req, conn->req + sizeof(struct op_common), sizeof(req));
+	PACK_OP_FEATURES_REQUEST(0, &req);
 
-	//ret = usbip_refresh_device_list(driver);
-	if (ret < 0) {
-		dbg("could not refresh device list: %d", ret);
-		return -1;
+	memset(&reply, 0, sizeof(reply));
+	if (STUB_COMPRESS && (req.features & USBIP_FEAT_COMPRESS)) {
+		reply.features |= USBIP_FEAT_COMPRESS;
+		reply.compress_max = usbip_pool_size(USB_BM_ATTRIBUTES_XFER_BULK);
 	}
+	/* asked again, the new socket and token replace the old ones */
+	if (conn->feat.udp_sockfd >= 0) {
+		close(conn->feat.udp_sockfd);
+		conn->feat.udp_sockfd = -1;
+	}
+	if (STUB_UDP && (req.features & USBIP_FEAT_UDP_INT)) {
+		conn->feat.udp_sockfd = stub_udp_open(conn->sockfd, &port);
+		if (conn->feat.udp_sockfd < 0) {
+			err("no socket for the datagram channel");
+		} else {
+			conn->feat.udp_token = usbip_random();
+			reply.features |= USBIP_FEAT_UDP_INT;
+			reply.udp_port = port;
+			reply.udp_window = STUB_UDP_WINDOW;
+			reply.udp_token = conn->feat.udp_token;
+			reply.udp_max = stub_udp_max();
+		}
+	}
+	if (STUB_RESUME && (req.features & USBIP_FEAT_RESUME)) {
+		for (size_t i = 0; i < sizeof(conn->feat.resume_token); i += 4) {
+			uint32_t r = usbip_random();
 
-	info("received request: %#0x(%d)", code, connfd);
-	switch (code) {
-	case OP_REQ_DEVLIST:
-		ret = recv_request_devlist(connfd);
-		break;
-	case OP_REQ_IMPORT:
-		ret = recv_request_import(connfd);
-		break;
-	case OP_REQ_DEVINFO:
-	default:
-		err("received an unknown opcode: %#0x", code);
-		ret = -1;
+			memcpy(conn->feat.resume_token + i, &r, sizeof(r));
+		}
+		reply.features |= USBIP_FEAT_RESUME;
+		reply.resume_ms = STUB_RESUME_GRACE_US / 1000;
+		memcpy(reply.resume_token, conn->feat.resume_token,
+		       sizeof(reply.resume_token));
 	}
+	conn->feat.features = reply.features;
+	info("features %#x asked for, %#x granted", (unsigned)req.features,
+	     (unsigned)reply.features);
+
+	PACK_OP_FEATURES_REPLY(1, &reply);
+	usbip_net_fill_op_common((struct op_common *)conn->rep, OP_REP_FEATURES,
+				 ST_OK);
+	memcpy(conn->rep + sizeof(struct op_common), &reply, sizeof(reply));
+	conn->out = conn->rep;
+	conn->out_len = sizeof(conn->rep);
+	return usbip_conn_output(conn);
+}
 
-	if (ret == 0)
-		info("request %#0x(%d): complete", code, connfd);
-	else
-		info("request %#0x(%d): failed", code, connfd);
+/*
+ * Hand the connection over to the session it resumes, whose tx task sends
+ * the reply. Like an import, the socket blocks from there on; a refusal is
+ * answered from here.
+ */
+static int usbip_conn_resume(struct usbip_conn *conn)
+{
+	struct op_resume_request req;
+	int flags = fcntl(conn->sockfd, F_GETFL, 0);
+	int status;
 
-	return ret;
-}
+	memcpy(&req, conn->req + sizeof(struct op_common), sizeof(req));
+	PACK_OP_RESUME_REQUEST(0, &req);
 
+	/* the tx task may take it up before stub_resume() returns */
+	if (fcntl(conn->sockfd, F_SETFL, flags & ~O_NONBLOCK) < 0)
+		return USBIP_CONN_CLOSE;
 
-void usbip_add_device(const struct usbip_usb_device * dev) {
-    edevg.udev = *dev;
-}
+	status = stub_resume(&req, conn->sockfd);
+	if (status != ST_OK) {
+		info("resume refused: %d", status);
+		if (fcntl(conn->sockfd, F_SETFL, flags) < 0)
+			return USBIP_CONN_CLOSE;
+		return usbip_conn_refuse(conn, OP_REP_RESUME, status);
+	}
 
+	/* the socket is the session's now */
+	conn->sockfd = -1;
+	usbip_conn_free(conn);
+	return USBIP_CONN_DETACHED;
+}
 
-void do_tcp_task(const int sock)
+int usbip_conn_input(struct usbip_conn *conn)
 {
-    int rc;
-   // char rx_buffer[128];
+	struct op_common op_common;
+	size_t want = sizeof(op_common);
+	uint16_t code = OP_UNSPEC;
+	int status;
 
-    do {
-        rc = recv_pdu(sock);
-        if (rc < 0) {
-            ESP_LOGE(TAG, "Error occurred during receiving: errno %d", rc);
-        } else if (rc == 0) {
-            ESP_LOGW(TAG, "good");
-        } else {
-          //  rx_buffer[len] = 0; // Null-terminate whatever is received and treat it like a string
-         //   ESP_LOGI(TAG, "Received %d bytes: %s", len, rx_buffer);
+	for (;;) {
+		ssize_t n;
+
+		if (conn->len >= sizeof(op_common)) {
+			memcpy(&op_common, conn->req, sizeof(op_common));
+			if (usbip_net_check_op_common(op_common, &code, &status) < 0)
+				return USBIP_CONN_CLOSE;
+
+			switch (code) {
+			case OP_REQ_DEVLIST:
+				want = sizeof(op_common) +
+				       sizeof(struct op_devlist_request);
+				break;
+			case OP_REQ_IMPORT:
+				want = sizeof(op_common) +
+				       sizeof(struct op_import_request);
+				break;
+			case OP_REQ_FEATURES:
+				want = sizeof(op_common) +
+				       sizeof(struct op_features_request);
+				break;
+			case OP_REQ_RESUME:
+				want = sizeof(op_common) +
+				       sizeof(struct op_resume_request);
+				break;
+			case OP_REQ_DEVINFO:
+			default:
+				err("received an unknown opcode: %#0x", code);
+				return USBIP_CONN_CLOSE;
+			}
+		}
+		if (conn->len == want)
+			break;
+
+		n = recv(conn->sockfd, conn->req + conn->len, want - conn->len, 0);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return USBIP_CONN_READ;
+		/* also how a client ends after DEVLIST */
+		if (n <= 0)
+			return USBIP_CONN_CLOSE;
+		conn->len += n;
+	}
 
-            // send() can return less bytes than supplied length.
-            // Walk-around for robust implementation.
-            // int to_write = len;
-            // while (to_write > 0) {
-            //     int written = send(sock, rx_buffer + (len - to_write), to_write, 0);
-            //     if (written < 0) {
-            //         ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
-            //     }
-            //     to_write -= written;
-            // }
-        }
-    } while (rc >= 0);
-}
\ No newline at end of file
+	/* DEVLIST is polled, so requests log at debug level */
+	dbg("received request: %#0x(%d)", code, conn->sockfd);
+	conn->len = 0;
+	if (code == OP_REQ_IMPORT)
+		return usbip_conn_import(conn);
+	if (code == OP_REQ_FEATURES)
+		return usbip_conn_features(conn);
+	if (code == OP_REQ_RESUME)
+		return usbip_conn_resume(conn);
+
+	conn->reply = usbip_devlist_get();
+	if (!conn->reply)
+		return USBIP_CONN_CLOSE;
+	conn->out = conn->reply->data;
+	conn->out_len = conn->reply->len;
+	return usbip_conn_output(conn);
+}
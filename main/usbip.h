@@ -1,5 +1,7 @@
 #pragma once
 #include <stdint.h>
+#include "usbip_port.h"
+#include "usbip_hist.h"
 
 struct usbip_usb_interface {
 	uint8_t bInterfaceClass;
@@ -31,11 +33,80 @@ struct usbip_usb_device {
 	uint8_t bNumInterfaces;
 } __attribute__((packed));
 
+/* interfaces reported per device, alternate setting 0 of each */
+#define USBIP_MAX_INTERFACES	16
+
+enum usbip_device_status {
+	SDEV_ST_UNUSED = 0,	/* free slot in the device table */
+	SDEV_ST_AVAILABLE,	/* can be imported */
+	SDEV_ST_USED,		/* imported by a client */
+	SDEV_ST_ERROR,		/* removed while imported, freed when released */
+};
+
+/*
+ * The server only looks at busid and status of a device, the rest is kept as
+ * it goes on the wire: the record of OP_REP_IMPORT and DEVLIST in network
+ * order, built once when the device is added, and its interfaces.
+ */
 struct usbip_exported_device {
 	int32_t status;
-	struct usbip_usb_device udev;
-	struct usbip_usb_interface uinf[];
+	char busid[SYSFS_BUS_ID_SIZE];
+	uint8_t num_interfaces;
+	const struct usbip_host_ops *ops;
+	void *ctx;
+	struct usbip_usb_device wire_udev;
+	struct usbip_usb_interface uinf[USBIP_MAX_INTERFACES];
+	struct usbip_hist hist;
 };
 
+void usbip_init(void);
+
+/*
+ * A connection until it imports a device, driven by the server loop without
+ * blocking: usbip_conn_input() when the socket is readable,
+ * usbip_conn_output() when writable. Both return what to wait for next.
+ * DEVLIST and FEATURES are answered right there; an import gets a session
+ * task of its own, which takes the socket over and answers it, so listing
+ * and other imports go on while a device is imported. Nothing here blocks
+ * on a client. CONFIG_USBIP_MAX_SESSIONS imports are served at once. A
+ * resume hands the socket to the session it takes up.
+ */
+enum {
+	USBIP_CONN_READ,
+	USBIP_CONN_WRITE,
+	USBIP_CONN_CLOSE,	/* done, free it */
+	USBIP_CONN_DETACHED,	/* owned by a session now, forget it */
+};
+
+struct usbip_conn;
+
+/* makes sockfd non-blocking; NULL when out of memory */
+struct usbip_conn *usbip_conn_new(int sockfd);
+int usbip_conn_fd(const struct usbip_conn *conn);
+int usbip_conn_input(struct usbip_conn *conn);
+int usbip_conn_output(struct usbip_conn *conn);
+/* closes the socket */
+void usbip_conn_free(struct usbip_conn *conn);
+
+/*
+ * The network is gone, sessions that can be resumed let go of their
+ * connections now rather than when TCP notices, and wait for the client.
+ */
+void usbip_link_down(void);
 
-void usbip_add_device(const struct usbip_usb_device *);
+/*
+ * Export a device under udev->busid, replacing an available device with the
+ * same busid. bConfigurationValue, bNumInterfaces and the interface list are
+ * taken from the active configuration descriptor. Returns -1 when the table
+ * of CONFIG_USBIP_MAX_DEVICES is full or the busid is imported.
+ *
+ * DEVLIST and IMPORT replies are served from images built here and on
+ * removal, so requests cost a send and no copying.
+ */
+int usbip_add_device(const struct usbip_usb_device *udev,
+		     const struct usbip_host_ops *ops, void *ctx);
+/*
+ * Stop exporting busid. ops->device_free runs once its session, if any,
+ * has let go of the device: right here, or when the session ends.
+ */
+void usbip_del_device(const char *busid);
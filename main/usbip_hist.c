@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <string.h>
+#include "usbip_hist.h"
+
+static const char *const usbip_hist_types[4] = {
+	"ctrl", "isoc", "bulk", "int",
+};
+
+static const char *const usbip_hist_stages[USBIP_HIST_NUM_STAGES] = {
+	[USBIP_HIST_QUEUE]	= "queue",
+	[USBIP_HIST_USB]	= "usb",
+	[USBIP_HIST_REPLY]	= "reply",
+	[USBIP_HIST_TOTAL]	= "total",
+};
+
+/* upper bound of a bucket in us, the last one is open */
+static uint32_t usbip_hist_bound(int bucket)
+{
+	return bucket ? 1u << bucket : 1;
+}
+
+/* smallest bucket bound below which a fraction of the samples lies */
+static uint32_t usbip_hist_percentile(const uint32_t *count, uint32_t total,
+				      uint32_t permille)
+{
+	uint64_t want = ((uint64_t)total * permille + 999) / 1000;
+	uint64_t seen = 0;
+
+	for (int i = 0; i < USBIP_HIST_BUCKETS; i++) {
+		seen += count[i];
+		if (seen >= want)
+			return usbip_hist_bound(i);
+	}
+	return usbip_hist_bound(USBIP_HIST_BUCKETS - 1);
+}
+
+void usbip_hist_restart(struct usbip_hist *hist, unsigned gen)
+{
+	memset(hist->count, 0, sizeof(hist->count));
+	hist->counted_gen = gen;
+}
+
+void usbip_hist_print(const char *busid, const struct usbip_hist *hist)
+{
+	/* reset, and nothing counted since */
+	if (hist->counted_gen != atomic_load(&hist->gen))
+		return;
+
+	for (int type = 0; type < 4; type++) {
+		for (int stage = 0; stage < USBIP_HIST_NUM_STAGES; stage++) {
+			const uint32_t *count = hist->count[type][stage];
+			uint32_t total = 0;
+
+			for (int i = 0; i < USBIP_HIST_BUCKETS; i++)
+				total += count[i];
+			if (!total)
+				continue;
+
+			printf("%s %-4s %-5s n %-8u p50 <%u p99 <%u us |", busid,
+			       usbip_hist_types[type], usbip_hist_stages[stage],
+			       (unsigned)total,
+			       (unsigned)usbip_hist_percentile(count, total, 500),
+			       (unsigned)usbip_hist_percentile(count, total, 990));
+			for (int i = 0; i < USBIP_HIST_BUCKETS; i++) {
+				if (count[i])
+					printf(" <%u:%u", (unsigned)usbip_hist_bound(i),
+					       (unsigned)count[i]);
+			}
+			printf("\n");
+		}
+	}
+}
@@ -0,0 +1,57 @@
+#pragma once
+/*
+ * URB latency histograms, one set per exported device.
+ *
+ * Every URB is timestamped when its CMD_SUBMIT is parsed, when it is handed
+ * to the host stack, when it comes back and when its RET_SUBMIT has been
+ * sent. The time between them is counted per endpoint type in log2 buckets:
+ * bucket 0 holds 0 us, bucket i holds [2^(i-1), 2^i) us and the last one
+ * everything above. Only the session's tx tasks write them, the one of the
+ * datagram channel for interrupt URBs alone, so they are kept without
+ * locks; the other task may race with a count and lose it. A reset only
+ * bumps the generation, a task clears the counts when it next sees it.
+ */
+#include <stdatomic.h>
+#include <stdint.h>
+
+enum usbip_hist_stage {
+	USBIP_HIST_QUEUE,	/* CMD_SUBMIT parsed to submitted */
+	USBIP_HIST_USB,		/* submitted to completed */
+	USBIP_HIST_REPLY,	/* completed to RET_SUBMIT sent */
+	USBIP_HIST_TOTAL,	/* CMD_SUBMIT parsed to RET_SUBMIT sent */
+	USBIP_HIST_NUM_STAGES,
+};
+
+#define USBIP_HIST_BUCKETS	22	/* up to 2^20 us, about a second */
+
+struct usbip_hist {
+	atomic_uint gen;	/* bumped by usbip_hist_reset() */
+	unsigned counted_gen;	/* the one count is of */
+	/* [endpoint type, USB_BM_ATTRIBUTES_XFER_*][stage][bucket] */
+	uint32_t count[4][USBIP_HIST_NUM_STAGES][USBIP_HIST_BUCKETS];
+};
+
+/* Clear the counts for generation gen, by the tasks writing them. */
+void usbip_hist_restart(struct usbip_hist *hist, unsigned gen);
+
+static inline void usbip_hist_add(struct usbip_hist *hist, int type,
+				  enum usbip_hist_stage stage, int64_t us)
+{
+	unsigned gen = atomic_load(&hist->gen);
+	int bucket = 0;
+
+	if (hist->counted_gen != gen)
+		usbip_hist_restart(hist, gen);
+	if (us > 0)
+		bucket = 64 - __builtin_clzll((uint64_t)us);
+	if (bucket >= USBIP_HIST_BUCKETS)
+		bucket = USBIP_HIST_BUCKETS - 1;
+
+	hist->count[type & 3][stage][bucket]++;
+}
+
+void usbip_hist_print(const char *busid, const struct usbip_hist *hist);
+
+/* All devices in the table, see usbip.c */
+void usbip_hist_dump(void);
+void usbip_hist_reset(void);
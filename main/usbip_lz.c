@@ -0,0 +1,199 @@
+#include <string.h>
+#include "usbip_lz.h"
+
+#define LZ_MIN_MATCH		4
+/* the end of a block is literals, as the LZ4 format wants */
+#define LZ_LAST_LITERALS	5
+#define LZ_MFLIMIT		12
+#define LZ_MAX_OFFSET		65535
+/* misses before the search starts skipping ahead, 1 << LZ_SKIP_TRIGGER */
+#define LZ_SKIP_TRIGGER		6
+
+static inline uint32_t lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline unsigned lz_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - USBIP_LZ_HASH_BITS);
+}
+
+/* the part of a length beyond its nibble, in bytes of up to 255 */
+static uint8_t *lz_put_len(uint8_t *op, size_t n)
+{
+	for (; n >= 255; n -= 255)
+		*op++ = 255;
+	*op++ = n;
+	return op;
+}
+
+/* bytes a sequence may take at most */
+static inline size_t lz_seq_max(size_t lit, size_t mlen)
+{
+	return 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1;
+}
+
+static uint8_t *lz_put_literals(uint8_t *op, uint8_t *token,
+				const uint8_t *lit, size_t n)
+{
+	if (n >= 15) {
+		*token = 15 << 4;
+		op = lz_put_len(op, n - 15);
+	} else {
+		*token = n << 4;
+	}
+	memcpy(op, lit, n);
+	return op + n;
+}
+
+int usbip_lz_compress(struct usbip_lz *lz, const uint8_t *src, int len,
+		      uint8_t *dst, int cap)
+{
+	const uint8_t *ip = src + 1;
+	const uint8_t *anchor = src;
+	const uint8_t *end = src + len;
+	const uint8_t *mflimit = end - LZ_MFLIMIT;
+	const uint8_t *mlimit = end - LZ_LAST_LITERALS;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + cap;
+	unsigned misses = 1 << LZ_SKIP_TRIGGER;
+	uint8_t *token;
+	size_t lit;
+
+	if (len <= 0 || len > USBIP_LZ_MAX)
+		return 0;
+
+	memset(lz->table, 0, sizeof(lz->table));
+	while (len > LZ_MFLIMIT && ip < mflimit) {
+		uint32_t seq = lz_read32(ip);
+		unsigned h = lz_hash(seq);
+		const uint8_t *ref = src + lz->table[h];
+		const uint8_t *mend, *r;
+		size_t mlen;
+
+		lz->table[h] = ip - src;
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+		    lz_read32(ref) != seq) {
+			ip += misses++ >> LZ_SKIP_TRIGGER;
+			continue;
+		}
+		misses = 1 << LZ_SKIP_TRIGGER;
+
+		/* back over literals that match too, then forward */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+		mend = ip + LZ_MIN_MATCH;
+		r = ref + LZ_MIN_MATCH;
+		while (mend < mlimit && *mend == *r) {
+			mend++;
+			r++;
+		}
+
+		lit = ip - anchor;
+		mlen = mend - ip - LZ_MIN_MATCH;
+		if (lz_seq_max(lit, mlen) > (size_t)(oend - op))
+			return 0;
+
+		token = op++;
+		op = lz_put_literals(op, token, anchor, lit);
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+		if (mlen >= 15) {
+			*token |= 15;
+			op = lz_put_len(op, mlen - 15);
+		} else {
+			*token |= mlen;
+		}
+
+		ip = anchor = mend;
+		/* the position two back is likely to start the next match */
+		if (ip < mflimit)
+			lz->table[lz_hash(lz_read32(ip - 2))] = ip - 2 - src;
+	}
+
+	lit = end - anchor;
+	if (lz_seq_max(lit, 0) - 3 > (size_t)(oend - op))
+		return 0;
+	token = op++;
+	op = lz_put_literals(op, token, anchor, lit);
+
+	return op - dst;
+}
+
+/* the rest of a length whose nibble is 15 */
+static int lz_get_len(const uint8_t **ip, const uint8_t *iend, size_t *n)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		*n += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+int usbip_lz_decompress(const uint8_t *src, int len, uint8_t *dst, int cap)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = src + len;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + cap;
+
+	for (;;) {
+		unsigned token;
+		size_t n, offset;
+		const uint8_t *ref;
+
+		if (ip >= iend)
+			return -1;
+		token = *ip++;
+
+		n = token >> 4;
+		if (n == 15 && lz_get_len(&ip, iend, &n) < 0)
+			return -1;
+		if (n > (size_t)(iend - ip) || n > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, n);
+		op += n;
+		ip += n;
+
+		/* the last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (!offset || offset > (size_t)(op - dst))
+			return -1;
+
+		n = token & 15;
+		if (n == 15 && lz_get_len(&ip, iend, &n) < 0)
+			return -1;
+		n += LZ_MIN_MATCH;
+		if (n > (size_t)(oend - op))
+			return -1;
+
+		ref = op - offset;
+		if (offset >= n) {
+			memcpy(op, ref, n);
+			op += n;
+		} else {
+			/* overlapping: a run repeating the last offset bytes */
+			while (n--)
+				*op++ = *ref++;
+		}
+	}
+
+	return op - dst;
+}
@@ -0,0 +1,35 @@
+#pragma once
+/*
+ * LZ4 block compression, the codec of the payload compression extension
+ * (see OP_REQ_FEATURES in usbip_network.h).
+ *
+ * The format is that of LZ4 blocks, so a client may use liblz4 instead of
+ * this code. The compressor is the greedy single-probe kind: a few cycles
+ * per byte, with zero-filled sectors, text and repeated records shrinking
+ * to a fraction while random data is given up on quickly. Blocks are
+ * limited to 64 KiB, the largest payload ever compressed.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#define USBIP_LZ_MAX		65536
+#define USBIP_LZ_HASH_BITS	12
+
+/* scratch of the compressor, one per caller running at a time */
+struct usbip_lz {
+	uint16_t table[1 << USBIP_LZ_HASH_BITS];
+};
+
+/*
+ * Compress len bytes of src into at most cap bytes of dst. Returns the
+ * compressed size, or 0 when it would not fit: a cap below len makes that
+ * the test of whether compression pays.
+ */
+int usbip_lz_compress(struct usbip_lz *lz, const uint8_t *src, int len,
+		      uint8_t *dst, int cap);
+
+/*
+ * Decompress a block of len bytes into at most cap bytes of dst. Returns
+ * the decompressed size, -1 for a malformed block or one not fitting.
+ */
+int usbip_lz_decompress(const uint8_t *src, int len, uint8_t *dst, int cap);
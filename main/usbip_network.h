@@ -0,0 +1,453 @@
+#pragma once
+#include <stdint.h>
+#include <sys/types.h>
+#include "usbip_port.h"
+#include "usbip.h"
+
+#define __u32 uint32_t
+#define __s32 int32_t
+//#define __packed __attribute__((packed))
+
+#define USBIP_VERSION 0x111
+
+/* Defines for op_code status in server/client op_common PDUs */
+#define ST_OK	0x00
+#define ST_NA	0x01
+	/* Device requested for import is not available */
+#define ST_DEV_BUSY	0x02
+	/* Device requested for import is in error state */
+#define ST_DEV_ERR	0x03
+#define ST_NODEV	0x04
+#define ST_ERROR	0x05
+
+/* ---------------------------------------------------------------------- */
+/* Common header for all the kinds of PDUs. */
+struct op_common {
+	uint16_t version;
+
+#define OP_REQUEST	(0x80 << 8)
+#define OP_REPLY	(0x00 << 8)
+	uint16_t code;
+
+	/* status codes defined in usbip_common.h */
+	uint32_t status; /* op_code status (for reply) */
+
+} __attribute__((packed));
+
+/* ---------------------------------------------------------------------- */
+/* Dummy Code */
+#define OP_UNSPEC	0x00
+#define OP_REQ_UNSPEC	OP_UNSPEC
+#define OP_REP_UNSPEC	OP_UNSPEC
+
+/* ---------------------------------------------------------------------- */
+/* Retrieve USB device information. (still not used) */
+#define OP_DEVINFO	0x02
+#define OP_REQ_DEVINFO	(OP_REQUEST | OP_DEVINFO)
+#define OP_REP_DEVINFO	(OP_REPLY   | OP_DEVINFO)
+
+struct op_devinfo_request {
+	char busid[SYSFS_BUS_ID_SIZE];
+} __attribute__((packed));
+
+struct op_devinfo_reply {
+	struct usbip_usb_device udev;
+	struct usbip_usb_interface uinf[];
+} __attribute__((packed));
+
+/* ---------------------------------------------------------------------- */
+/* Import a remote USB device. */
+#define OP_IMPORT	0x03
+#define OP_REQ_IMPORT	(OP_REQUEST | OP_IMPORT)
+#define OP_REP_IMPORT   (OP_REPLY   | OP_IMPORT)
+
+struct op_import_request {
+	char busid[SYSFS_BUS_ID_SIZE];
+} __attribute__((packed));
+
+struct op_import_reply {
+	struct usbip_usb_device udev;
+//	struct usbip_usb_interface uinf[];
+} __attribute__((packed));
+
+#define PACK_OP_IMPORT_REQUEST(pack, request)  do {\
+} while (0)
+
+#define PACK_OP_IMPORT_REPLY(pack, reply)  do {\
+	usbip_net_pack_usb_device(pack, &(reply)->udev);\
+} while (0)
+
+/* ---------------------------------------------------------------------- */
+/* Export a USB device to a remote host. */
+#define OP_EXPORT	0x06
+#define OP_REQ_EXPORT	(OP_REQUEST | OP_EXPORT)
+#define OP_REP_EXPORT	(OP_REPLY   | OP_EXPORT)
+
+struct op_export_request {
+	struct usbip_usb_device udev;
+} __attribute__((packed));
+
+struct op_export_reply {
+	int returncode;
+} __attribute__((packed));
+
+
+#define PACK_OP_EXPORT_REQUEST(pack, request)  do {\
+	usbip_net_pack_usb_device(pack, &(request)->udev);\
+} while (0)
+
+#define PACK_OP_EXPORT_REPLY(pack, reply)  do {\
+} while (0)
+
+/* ---------------------------------------------------------------------- */
+/* un-Export a USB device from a remote host. */
+#define OP_UNEXPORT	0x07
+#define OP_REQ_UNEXPORT	(OP_REQUEST | OP_UNEXPORT)
+#define OP_REP_UNEXPORT	(OP_REPLY   | OP_UNEXPORT)
+
+struct op_unexport_request {
+	struct usbip_usb_device udev;
+} __attribute__((packed));
+
+struct op_unexport_reply {
+	int returncode;
+} __attribute__((packed));
+
+#define PACK_OP_UNEXPORT_REQUEST(pack, request)  do {\
+	usbip_net_pack_usb_device(pack, &(request)->udev);\
+} while (0)
+
+#define PACK_OP_UNEXPORT_REPLY(pack, reply)  do {\
+} while (0)
+
+
+/* ---------------------------------------------------------------------- */
+/* Retrieve the list of exported USB devices. */
+#define OP_DEVLIST	0x05
+#define OP_REQ_DEVLIST	(OP_REQUEST | OP_DEVLIST)
+#define OP_REP_DEVLIST	(OP_REPLY   | OP_DEVLIST)
+
+struct op_devlist_request {
+} __attribute__((packed));
+
+struct op_devlist_reply {
+	uint32_t ndev;
+	/* followed by reply_extra[] */
+} __attribute__((packed));
+
+struct op_devlist_reply_extra {
+	struct usbip_usb_device    udev;
+	struct usbip_usb_interface uinf[];
+} __attribute__((packed));
+
+#define PACK_OP_DEVLIST_REQUEST(pack, request)  do {\
+} while (0)
+
+#define PACK_OP_DEVLIST_REPLY(pack, reply)  do {\
+	(reply)->ndev = usbip_net_pack_uint32_t(pack, (reply)->ndev);\
+} while (0)
+
+/* ---------------------------------------------------------------------- */
+/*
+ * Extensions of this server, not part of Linux USB/IP. A client asks for
+ * them on the connection it imports on, before OP_REQ_IMPORT, and gets the
+ * ones granted in the reply. Clients that never ask get plain USB/IP.
+ */
+#define OP_FEATURES	0x40
+#define OP_REQ_FEATURES	(OP_REQUEST | OP_FEATURES)
+#define OP_REP_FEATURES	(OP_REPLY   | OP_FEATURES)
+
+/* LZ4 compressed payloads, see USBIP_COMPRESSED */
+#define USBIP_FEAT_COMPRESS	0x00000001
+/* interrupt URBs over UDP, see struct usbip_udp_header */
+#define USBIP_FEAT_UDP_INT	0x00000002
+/* the session outlives its connection for a while, see OP_REQ_RESUME */
+#define USBIP_FEAT_RESUME	0x00000004
+
+struct op_features_request {
+	uint32_t features;
+} __attribute__((packed));
+
+struct op_features_reply {
+	uint32_t features;
+	/* largest payload compressed, in either direction */
+	uint32_t compress_max;
+	/* USBIP_FEAT_UDP_INT: where the datagrams go and what they carry */
+	uint16_t udp_port;
+	uint16_t udp_window;	/* datagrams in flight, at most 32 */
+	uint32_t udp_token;
+	uint32_t udp_max;	/* largest datagram, this header included */
+	/* USBIP_FEAT_RESUME: how long a lost connection is waited for */
+	uint32_t resume_ms;
+	uint8_t resume_token[8];	/* for OP_REQ_RESUME, as it is */
+} __attribute__((packed));
+
+#define PACK_OP_FEATURES_REQUEST(pack, request)  do {\
+	(request)->features = usbip_net_pack_uint32_t(pack, (request)->features);\
+} while (0)
+
+#define PACK_OP_FEATURES_REPLY(pack, reply)  do {\
+	(reply)->features = usbip_net_pack_uint32_t(pack, (reply)->features);\
+	(reply)->compress_max = usbip_net_pack_uint32_t(pack, (reply)->compress_max);\
+	(reply)->udp_port = usbip_net_pack_uint16_t(pack, (reply)->udp_port);\
+	(reply)->udp_window = usbip_net_pack_uint16_t(pack, (reply)->udp_window);\
+	(reply)->udp_token = usbip_net_pack_uint32_t(pack, (reply)->udp_token);\
+	(reply)->udp_max = usbip_net_pack_uint32_t(pack, (reply)->udp_max);\
+	(reply)->resume_ms = usbip_net_pack_uint32_t(pack, (reply)->resume_ms);\
+} while (0)
+
+/*
+ * Take up an imported session again on a new connection, after the old one
+ * failed, within resume_ms of that. Each side counts the bytes of the
+ * session it received, from the end of OP_REQ_IMPORT and OP_REP_IMPORT,
+ * and keeps the last ones it sent. The client tells the server how many it
+ * received; the server answers with its own count and sends on from where
+ * the client stopped, and the client does the same. URBs, seqnums and the
+ * device stay as they were, replies that completed meanwhile come next.
+ *
+ * A request replacing a connection that still looks alive to the server
+ * ends it. Anything but ST_OK in reply ends the session, as when more was
+ * lost than either side kept; the client imports the device again.
+ */
+#define OP_RESUME	0x41
+#define OP_REQ_RESUME	(OP_REQUEST | OP_RESUME)
+#define OP_REP_RESUME	(OP_REPLY   | OP_RESUME)
+
+struct op_resume_request {
+	uint8_t token[8];	/* resume_token of OP_REP_FEATURES */
+	uint32_t received;	/* bytes from the server, modulo 2^32 */
+} __attribute__((packed));
+
+struct op_resume_reply {
+	uint32_t received;	/* bytes from the client, modulo 2^32 */
+	/* followed by the server's bytes from request->received on */
+} __attribute__((packed));
+
+#define PACK_OP_RESUME_REQUEST(pack, request)  do {\
+	(request)->received = usbip_net_pack_uint32_t(pack, (request)->received);\
+} while (0)
+
+#define PACK_OP_RESUME_REPLY(pack, reply)  do {\
+	(reply)->received = usbip_net_pack_uint32_t(pack, (reply)->received);\
+} while (0)
+
+/*
+ * Datagram of a session that was granted USBIP_FEAT_UDP_INT: this header,
+ * then one PDU of an interrupt URB as it would go over TCP, CMD_SUBMIT and
+ * CMD_UNLINK from the client, RET_SUBMIT and RET_UNLINK from the server.
+ * The client sends to udp_port, the server back to where the client's
+ * first datagram came from. Control and bulk stay on TCP, so a lost
+ * segment of a bulk stream holds up nothing sent here.
+ *
+ * Either side numbers its datagrams from 1 and acknowledges the other's in
+ * each one it sends; seq 0 carries nothing but that. A datagram is sent
+ * again every little while until acknowledged, with at most udp_window of
+ * them outstanding, and taken once by the receiver, in whatever order they
+ * come: every PDU stands on its own. Replies that find the window full, or
+ * do not fit in udp_max, go over TCP; an unlink goes the way of its URB.
+ */
+struct usbip_udp_header {
+	uint32_t token;		/* udp_token of OP_REP_FEATURES */
+	uint32_t seq;
+	uint32_t ack;		/* every seq up to this one was received */
+	uint32_t ack_bits;	/* bit i: so was ack + 2 + i */
+} __attribute__((packed));
+
+/*
+ * USB/IP request headers
+ *
+ * Each request is transferred across the network to its counterpart, which
+ * facilitates the normal USB communication. The values contained in the headers
+ * are basically the same as in a URB. Currently, four request types are
+ * defined:
+ *
+ *  - USBIP_CMD_SUBMIT: a USB request block, corresponds to usb_submit_urb()
+ *    (client to server)
+ *
+ *  - USBIP_RET_SUBMIT: the result of USBIP_CMD_SUBMIT
+ *    (server to client)
+ *
+ *  - USBIP_CMD_UNLINK: an unlink request of a pending USBIP_CMD_SUBMIT,
+ *    corresponds to usb_unlink_urb()
+ *    (client to server)
+ *
+ *  - USBIP_RET_UNLINK: the result of USBIP_CMD_UNLINK
+ *    (server to client)
+ *
+ */
+#define USBIP_CMD_SUBMIT	0x0001
+#define USBIP_CMD_UNLINK	0x0002
+#define USBIP_RET_SUBMIT	0x0003
+#define USBIP_RET_UNLINK	0x0004
+
+/*
+ * Or'ed into the command of a CMD_SUBMIT or RET_SUBMIT whose payload is
+ * compressed, on a session that was granted USBIP_FEAT_COMPRESS. The header
+ * is followed by the compressed size, 32 bits, and the LZ4 block, which
+ * decompresses to exactly transfer_buffer_length (CMD_SUBMIT) or
+ * actual_length (RET_SUBMIT) bytes. The server compresses bulk IN data and
+ * takes compressed OUT data for any endpoint but control and isochronous
+ * ones, up to compress_max bytes. Either side sends a payload as it is
+ * wherever compression does not make it smaller.
+ */
+#define USBIP_COMPRESSED	0x80000000
+
+#define USBIP_DIR_OUT	0x00
+#define USBIP_DIR_IN	0x01
+
+/**
+ * struct usbip_header_basic - data pertinent to every request
+ * @command: the usbip request type
+ * @seqnum: sequential number that identifies requests; incremented per
+ *	    connection
+ * @devid: specifies a remote USB device uniquely instead of busnum and devnum;
+ *	   in the stub driver, this value is ((busnum << 16) | devnum)
+ * @direction: direction of the transfer
+ * @ep: endpoint number
+ */
+struct usbip_header_basic {
+	__u32 command;
+	__u32 seqnum;
+	__u32 devid;
+	__u32 direction;
+	__u32 ep;
+} __packed;
+
+/**
+ * struct usbip_header_cmd_submit - USBIP_CMD_SUBMIT packet header
+ * @transfer_flags: URB flags
+ * @transfer_buffer_length: the data size for (in) or (out) transfer
+ * @start_frame: initial frame for isochronous or interrupt transfers
+ * @number_of_packets: number of isochronous packets
+ * @interval: maximum time for the request on the server-side host controller
+ * @setup: setup data for a control request
+ */
+struct usbip_header_cmd_submit {
+	__u32 transfer_flags;
+	__s32 transfer_buffer_length;
+
+	/* it is difficult for usbip to sync frames (reserved only?) */
+	__s32 start_frame;
+	__s32 number_of_packets;
+	__s32 interval;
+
+	unsigned char setup[8];
+} __packed;
+
+/**
+ * struct usbip_header_ret_submit - USBIP_RET_SUBMIT packet header
+ * @status: return status of a non-iso request
+ * @actual_length: number of bytes transferred
+ * @start_frame: initial frame for isochronous or interrupt transfers
+ * @number_of_packets: number of isochronous packets
+ * @error_count: number of errors for isochronous transfers
+ */
+struct usbip_header_ret_submit {
+	__s32 status;
+	__s32 actual_length;
+	__s32 start_frame;
+	__s32 number_of_packets;
+	__s32 error_count;
+} __packed;
+
+/**
+ * struct usbip_header_cmd_unlink - USBIP_CMD_UNLINK packet header
+ * @seqnum: the URB seqnum to unlink
+ */
+struct usbip_header_cmd_unlink {
+	__u32 seqnum;
+} __packed;
+
+/**
+ * struct usbip_header_ret_unlink - USBIP_RET_UNLINK packet header
+ * @status: return status of the request
+ */
+struct usbip_header_ret_unlink {
+	__s32 status;
+} __packed;
+
+/**
+ * struct usbip_header - common header for all usbip packets
+ * @base: the basic header
+ * @u: packet type dependent header
+ */
+struct usbip_header {
+	struct usbip_header_basic base;
+
+	union {
+		struct usbip_header_cmd_submit	cmd_submit;
+		struct usbip_header_ret_submit	ret_submit;
+		struct usbip_header_cmd_unlink	cmd_unlink;
+		struct usbip_header_ret_unlink	ret_unlink;
+	} u;
+} __packed;
+
+/**
+ * struct usbip_iso_packet_descriptor - isochronous packet of a URB, sent
+ * behind the OUT payload of USBIP_CMD_SUBMIT and the IN payload of
+ * USBIP_RET_SUBMIT
+ * @offset: packet offset in the transfer buffer of the client
+ * @length: packet length
+ * @actual_length: bytes transferred, in USBIP_RET_SUBMIT
+ * @status: packet status, in USBIP_RET_SUBMIT
+ */
+struct usbip_iso_packet_descriptor {
+	__u32 offset;
+	__u32 length;
+	__u32 actual_length;
+	__u32 status;
+} __packed;
+
+/* same limit as Linux, more packets in a URB end the session */
+#define USBIP_MAX_ISO_PACKETS	1024
+
+/* Linux errno values carried in RET_SUBMIT/RET_UNLINK status fields */
+#define USBIP_ENOENT		2
+#define USBIP_ENOMEM		12
+#define USBIP_EXDEV		18
+#define USBIP_ENODEV		19
+#define USBIP_EINVAL		22
+#define USBIP_EPIPE		32
+#define USBIP_EPROTO		71
+#define USBIP_EOVERFLOW		75
+#define USBIP_ECONNRESET	104
+#define USBIP_ESHUTDOWN		108
+#define USBIP_ETIMEDOUT		110
+
+/*
+ * Receive buffer of a connection. The socket is read for as much as it has,
+ * and PDUs are taken from the buffer until it runs dry, so a burst of small
+ * requests costs one recv() instead of one per structure. Large payloads
+ * bypass it and go from the socket straight into the caller's buffer.
+ */
+struct usbip_rx {
+	int sockfd;
+	/*
+	 * When set, called instead of recv() on sockfd, with the same result;
+	 * a session that can be resumed counts and waits out its connections
+	 * there.
+	 */
+	ssize_t (*recv)(struct usbip_rx *rx, void *buff, size_t len);
+	void *ctx;
+	uint8_t *buf;
+	size_t size;
+	size_t head;		/* first byte not yet taken */
+	size_t tail;		/* end of the received data */
+};
+
+uint32_t usbip_net_pack_uint32_t(int pack, uint32_t num);
+uint16_t usbip_net_pack_uint16_t(int pack, uint16_t num);
+void usbip_net_pack_usb_device(int pack, struct usbip_usb_device *udev);
+void usbip_net_pack_usb_interface(int pack, struct usbip_usb_interface *uinf);
+void usbip_net_pack_header(int pack, struct usbip_header *pdu);
+
+ssize_t usbip_net_recv(int sockfd, void *buff, size_t bufflen);
+ssize_t usbip_net_send(int sockfd, void *buff, size_t bufflen);
+ssize_t usbip_net_sendv(int sockfd, struct iovec *iov, int iovcnt);
+int usbip_net_send_op_common(int sockfd, uint32_t code, uint32_t status);
+int usbip_net_recv_op_common(int sockfd, uint16_t *code, int *status);
+int usbip_net_set_nodelay(int sockfd);
+
+int usbip_rx_init(struct usbip_rx *rx, int sockfd, size_t size);
+void usbip_rx_free(struct usbip_rx *rx);
+ssize_t usbip_rx_recv(struct usbip_rx *rx, void *buff, size_t len);
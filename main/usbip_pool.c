@@ -0,0 +1,373 @@
+#define LOG_LOCAL_LEVEL	CONFIG_USBIP_LOG_LEVEL_CORE
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbip_pool.h"
+
+#define err(...)    USBIP_LOGE(TAG, __VA_ARGS__)
+#define info(...)   USBIP_LOGI(TAG, __VA_ARGS__)
+#define dbg(...)    USBIP_LOGD(TAG, __VA_ARGS__)
+
+static const char *TAG = "pool";
+
+/* how often a taker waiting for a pooled transfer checks *abort */
+#define POOL_WAIT_US		10000
+
+enum {
+	POOL_CTRL,
+	POOL_INT,
+	POOL_BULK,
+	POOL_NUM_CLASSES,
+};
+
+/*
+ * Bounded multi-producer/multi-consumer ring (D. Vyukov): every cell carries
+ * a sequence number telling whether it is ready to be written or read at a
+ * given position, so producers and consumers only race on their position
+ * with a 32-bit compare-and-swap.
+ */
+struct pool_cell {
+	atomic_uint seq;
+	usb_transfer_t *transfer;
+};
+
+struct pool_class {
+	const char *name;
+	size_t size;
+	unsigned count;
+	unsigned mask;
+	struct pool_cell *cells;
+	atomic_uint enqueue_pos;
+	atomic_uint dequeue_pos;
+	/* transfers on the ring, claimed before one is taken off it */
+	atomic_int free;
+	/* left to usbip_pool_get() by takers of IN transfers */
+	unsigned reserve;
+	/* given on a put while takers wait */
+	usbip_sem_t wake;
+	atomic_uint waiters;
+
+	atomic_uint in_use;
+	atomic_uint max_in_use;
+	atomic_uint waits;
+	atomic_uint empty;
+};
+
+static struct pool_class pool[POOL_NUM_CLASSES] = {
+	[POOL_CTRL]	= { .name = "control" },
+	[POOL_INT]	= { .name = "interrupt" },
+	[POOL_BULK]	= { .name = "bulk" },
+};
+static atomic_uint pool_oversize;
+
+static int pool_ring_put(struct pool_class *c, usb_transfer_t *transfer)
+{
+	unsigned pos = atomic_load_explicit(&c->enqueue_pos, memory_order_relaxed);
+	struct pool_cell *cell;
+
+	for (;;) {
+		int dif;
+
+		cell = &c->cells[pos & c->mask];
+		dif = (int)(atomic_load_explicit(&cell->seq, memory_order_acquire) - pos);
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&c->enqueue_pos, &pos, pos + 1,
+								  memory_order_relaxed,
+								  memory_order_relaxed))
+				break;
+		} else if (dif < 0) {
+			return -1;
+		} else {
+			pos = atomic_load_explicit(&c->enqueue_pos, memory_order_relaxed);
+		}
+	}
+
+	cell->transfer = transfer;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+	return 0;
+}
+
+static usb_transfer_t *pool_ring_get(struct pool_class *c)
+{
+	unsigned pos = atomic_load_explicit(&c->dequeue_pos, memory_order_relaxed);
+	struct pool_cell *cell;
+	usb_transfer_t *transfer;
+
+	for (;;) {
+		int dif;
+
+		cell = &c->cells[pos & c->mask];
+		dif = (int)(atomic_load_explicit(&cell->seq, memory_order_acquire) - (pos + 1));
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&c->dequeue_pos, &pos, pos + 1,
+								  memory_order_relaxed,
+								  memory_order_relaxed))
+				break;
+		} else if (dif < 0) {
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&c->dequeue_pos, memory_order_relaxed);
+		}
+	}
+
+	transfer = cell->transfer;
+	atomic_store_explicit(&cell->seq, pos + c->mask + 1, memory_order_release);
+	return transfer;
+}
+
+static size_t pool_round_up(size_t size, size_t mult)
+{
+	return (size + mult - 1) / mult * mult;
+}
+
+static int pool_class_init(struct pool_class *c, unsigned count, size_t size)
+{
+	unsigned cap;
+
+	for (cap = 1; cap < count; cap <<= 1)
+		;
+
+	c->size = size;
+	c->count = count;
+	c->mask = cap - 1;
+	c->reserve = count > 1 ? (count + 3) / 4 : 0;
+	c->cells = calloc(cap, sizeof(*c->cells));
+	c->wake = usbip_sem_create(count, 0);
+	if (!c->cells || !c->wake)
+		return -1;
+
+	for (unsigned i = 0; i < cap; i++)
+		atomic_init(&c->cells[i].seq, i);
+
+	for (unsigned i = 0; i < count; i++) {
+		usb_transfer_t *transfer;
+
+		if (usbip_transfer_alloc(size, 0, &transfer) < 0) {
+			err("no memory for %u %s transfers of %u bytes", count,
+			    c->name, (unsigned)size);
+			return -1;
+		}
+		pool_ring_put(c, transfer);
+		atomic_fetch_add(&c->free, 1);
+	}
+
+	return 0;
+}
+
+int usbip_pool_init(void)
+{
+	/* control transfers carry the setup packet in front of the data */
+	if (pool_class_init(&pool[POOL_CTRL], CONFIG_USBIP_POOL_CTRL_TRANSFERS,
+			    pool_round_up(CONFIG_USBIP_POOL_CTRL_SIZE, 64) +
+			    sizeof(usb_setup_packet_t)) < 0 ||
+	    pool_class_init(&pool[POOL_INT], CONFIG_USBIP_POOL_INT_TRANSFERS,
+			    pool_round_up(CONFIG_USBIP_POOL_INT_SIZE, 64)) < 0 ||
+	    pool_class_init(&pool[POOL_BULK], CONFIG_USBIP_POOL_BULK_TRANSFERS,
+			    pool_round_up(CONFIG_USBIP_POOL_BULK_SIZE, 512)) < 0)
+		return -1;
+
+	info("%u control x %u, %u interrupt x %u, %u bulk x %u bytes",
+	     pool[POOL_CTRL].count, (unsigned)pool[POOL_CTRL].size,
+	     pool[POOL_INT].count, (unsigned)pool[POOL_INT].size,
+	     pool[POOL_BULK].count, (unsigned)pool[POOL_BULK].size);
+	return 0;
+}
+
+static struct pool_class *pool_class_for(uint8_t type)
+{
+	switch (type & USB_BM_ATTRIBUTES_XFERTYPE_MASK) {
+	case USB_BM_ATTRIBUTES_XFER_CONTROL:
+		return &pool[POOL_CTRL];
+	case USB_BM_ATTRIBUTES_XFER_INT:
+		return &pool[POOL_INT];
+	default:
+		return &pool[POOL_BULK];
+	}
+}
+
+#if CONFIG_USBIP_POOL_HEAP_FALLBACK
+/*
+ * Size of a transfer taken from the heap. No class has it, so
+ * usbip_pool_put() tells heap transfers apart by size.
+ */
+static size_t pool_heap_size(size_t size)
+{
+	for (int i = 0; i < POOL_NUM_CLASSES; i++) {
+		if (size == pool[i].size) {
+			size++;
+			i = -1;
+		}
+	}
+	return size;
+}
+#endif
+
+/* the class a transfer came from, NULL for one from the heap */
+static struct pool_class *pool_class_of(const usb_transfer_t *transfer)
+{
+	if (transfer->num_isoc_packets)
+		return NULL;
+	for (int i = 0; i < POOL_NUM_CLASSES; i++) {
+		if (pool[i].size == transfer->data_buffer_size)
+			return &pool[i];
+	}
+	return NULL;
+}
+
+/*
+ * The class for a transfer of size bytes, NULL if it fits none: a URB too
+ * large for its class may still fit a bulk transfer.
+ */
+static struct pool_class *pool_class_fit(uint8_t type, size_t size)
+{
+	struct pool_class *c = pool_class_for(type);
+
+	if (size > c->size && size <= pool[POOL_BULK].size)
+		c = &pool[POOL_BULK];
+	return size <= c->size ? c : NULL;
+}
+
+/* Claim n of the free transfers of c, leaving keep of them. */
+static int pool_claim(struct pool_class *c, int n, unsigned keep)
+{
+	int free = atomic_load(&c->free);
+
+	do {
+		if (free - n < (int)keep)
+			return 0;
+	} while (!atomic_compare_exchange_weak(&c->free, &free, free - n));
+
+	return 1;
+}
+
+/* Take a transfer off the ring of c, after claiming it. */
+static usb_transfer_t *pool_take(struct pool_class *c)
+{
+	usb_transfer_t *transfer;
+	unsigned in_use, max;
+
+	/*
+	 * The cell at the head may belong to a put that was preempted before
+	 * filling it in, while a later one already counted its transfer.
+	 */
+	while (!(transfer = pool_ring_get(c)))
+		usbip_delay_ms(1);
+
+	in_use = atomic_fetch_add(&c->in_use, 1) + 1;
+	max = atomic_load(&c->max_in_use);
+	while (in_use > max &&
+	       !atomic_compare_exchange_weak(&c->max_in_use, &max, in_use))
+		;
+
+	transfer->flags = 0;
+	transfer->num_bytes = 0;
+	transfer->actual_num_bytes = 0;
+	transfer->timeout_ms = 0;
+	transfer->callback = NULL;
+	transfer->context = NULL;
+	return transfer;
+}
+
+int usbip_pool_get(uint8_t type, size_t size, usb_transfer_t **transfer,
+		   volatile int *abort)
+{
+	struct pool_class *c = pool_class_fit(type, size);
+	int ret = 0;
+
+	if (!c) {
+		atomic_fetch_add(&pool_oversize, 1);
+#if CONFIG_USBIP_POOL_HEAP_FALLBACK
+		dbg("%u bytes exceed the pool, allocating", (unsigned)size);
+		return usbip_transfer_alloc(pool_heap_size(size), 0, transfer);
+#else
+		return -1;
+#endif
+	}
+
+	if (!pool_claim(c, 1, 0)) {
+		atomic_fetch_add(&c->waits, 1);
+		atomic_fetch_add(&c->waiters, 1);
+		while (!pool_claim(c, 1, 0)) {
+			if (abort && *abort) {
+				ret = -1;
+				break;
+			}
+			usbip_sem_take_timeout(c->wake, POOL_WAIT_US);
+		}
+		atomic_fetch_sub(&c->waiters, 1);
+		if (ret < 0)
+			return -1;
+	}
+
+	*transfer = pool_take(c);
+	return 0;
+}
+
+int usbip_pool_try_get_n(uint8_t type, size_t size, int dir_in,
+			 usb_transfer_t **transfers, int n)
+{
+	struct pool_class *c = pool_class_fit(type, size);
+
+	if (!c)
+		return -1;
+	if (!pool_claim(c, n, dir_in ? c->reserve : 0)) {
+		atomic_fetch_add(&c->empty, 1);
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++)
+		transfers[i] = pool_take(c);
+	return 0;
+}
+
+int usbip_pool_try_get(uint8_t type, size_t size, int dir_in,
+		       usb_transfer_t **transfer)
+{
+	return usbip_pool_try_get_n(type, size, dir_in, transfer, 1);
+}
+
+int usbip_pool_in_count(uint8_t type)
+{
+	struct pool_class *c = pool_class_for(type);
+
+	return c->count - c->reserve;
+}
+
+size_t usbip_pool_size(uint8_t type)
+{
+	return pool_class_for(type)->size;
+}
+
+
+void usbip_pool_put(usb_transfer_t *transfer)
+{
+	struct pool_class *c;
+
+	if (!transfer)
+		return;
+
+	c = pool_class_of(transfer);
+	if (!c) {
+		usbip_transfer_free(transfer);
+		return;
+	}
+
+	atomic_fetch_sub(&c->in_use, 1);
+	pool_ring_put(c, transfer);
+	atomic_fetch_add(&c->free, 1);
+	if (atomic_load(&c->waiters))
+		usbip_sem_give(c->wake);
+}
+
+void usbip_pool_log_stats(void)
+{
+	for (int i = 0; i < POOL_NUM_CLASSES; i++) {
+		info("%s: %u of %u in use, peak %u, %u waits, %u times empty",
+		     pool[i].name, atomic_load(&pool[i].in_use), pool[i].count,
+		     atomic_load(&pool[i].max_in_use), atomic_load(&pool[i].waits),
+		     atomic_load(&pool[i].empty));
+	}
+	info("%u URBs larger than the pool", atomic_load(&pool_oversize));
+}
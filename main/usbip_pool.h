@@ -0,0 +1,54 @@
+#pragma once
+/*
+ * Pool of preallocated transfers, shared by all sessions.
+ *
+ * There is one size class per endpoint type (control, interrupt, bulk), with
+ * count and buffer size from Kconfig, rounded up to a multiple of the
+ * largest max packet size of the type. Transfers are kept allocated for the
+ * lifetime of the server so URBs do not churn the heap. Free transfers sit
+ * in a lock-free ring per class: returning one never blocks, so it is safe
+ * from completion callbacks; taking one blocks while the class is exhausted,
+ * which stalls the rx side of the session like any other backpressure.
+ *
+ * An IN URB may wait on the device for OUT data the client sends after it,
+ * so IN transfers are taken without waiting when the URB goes to the bus,
+ * and leave the last few of a class to the OUT payloads: URBs holding the
+ * rest cannot keep the rx side from receiving the one they wait for.
+ *
+ * A URB larger than every class it may use fails, unless
+ * CONFIG_USBIP_POOL_HEAP_FALLBACK gives it a transfer from the heap.
+ * Isochronous transfers are not pooled, their packet count is fixed when
+ * they are allocated: the endpoints of a session keep theirs instead.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include "usbip_port.h"
+
+int usbip_pool_init(void);
+
+/*
+ * Take a transfer for a control, interrupt or bulk endpoint of the given
+ * USB_BM_ATTRIBUTES_XFER_* type with at least size bytes of buffer. Waits
+ * while the class is exhausted, until *abort becomes nonzero. Returns -1 on
+ * abort, or for a size no class has room for.
+ */
+int usbip_pool_get(uint8_t type, size_t size, usb_transfer_t **transfer,
+		   volatile int *abort);
+/*
+ * Same for a bulk or interrupt endpoint without waiting, safe from completion
+ * callbacks, for a size that fits a pooled transfer. Returns -1 when the
+ * class is exhausted, or for dir_in down to its reserve for OUT payloads.
+ */
+int usbip_pool_try_get(uint8_t type, size_t size, int dir_in,
+		       usb_transfer_t **transfer);
+/* n of them at once or none, for a URB that must not wait holding some */
+int usbip_pool_try_get_n(uint8_t type, size_t size, int dir_in,
+			 usb_transfer_t **transfers, int n);
+void usbip_pool_put(usb_transfer_t *transfer);
+
+/* buffer size of the pooled transfers for a USB_BM_ATTRIBUTES_XFER_* type */
+size_t usbip_pool_size(uint8_t type);
+/* pooled transfers of that type IN URBs may hold at once */
+int usbip_pool_in_count(uint8_t type);
+
+void usbip_pool_log_stats(void);
@@ -0,0 +1,93 @@
+#pragma once
+/*
+ * Backend interface of the USB/IP core.
+ *
+ * Everything the protocol code needs from the platform goes through this
+ * header: logging, tasks and their synchronisation, sockets and the USB host
+ * operations of an exported device. usbip_port_esp.h maps it onto ESP-IDF,
+ * FreeRTOS and lwIP, usbip_port_linux.h (in host/) onto POSIX.
+ *
+ * Both ports provide the ESP-IDF chapter 9 and transfer types
+ * (usb_transfer_t, usb_setup_packet_t, ...) so the core reads the same on
+ * either side.
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef ESP_PLATFORM
+#include "usbip_port_esp.h"
+#else
+#include "usbip_port_linux.h"
+#endif
+
+/* Logging, compiled against the port's log backend */
+#define USBIP_LOGE(tag, ...)	USBIP_PORT_LOG(USBIP_LOG_ERROR, tag, __VA_ARGS__)
+#define USBIP_LOGW(tag, ...)	USBIP_PORT_LOG(USBIP_LOG_WARN, tag, __VA_ARGS__)
+#define USBIP_LOGI(tag, ...)	USBIP_PORT_LOG(USBIP_LOG_INFO, tag, __VA_ARGS__)
+#define USBIP_LOGD(tag, ...)	USBIP_PORT_LOG(USBIP_LOG_DEBUG, tag, __VA_ARGS__)
+
+/* Tasks */
+int usbip_task_create(void (*fn)(void *), const char *name,
+		      uint32_t stack_size, void *arg, int prio);
+void usbip_task_exit(void);
+void usbip_delay_ms(uint32_t ms);
+int64_t usbip_time_us(void);
+/* for tokens a client has to present, not for keys */
+uint32_t usbip_random(void);
+
+/* Mutexes, counting semaphores and pointer queues between tasks */
+usbip_mutex_t usbip_mutex_create(void);
+void usbip_mutex_lock(usbip_mutex_t mutex);
+void usbip_mutex_unlock(usbip_mutex_t mutex);
+void usbip_mutex_delete(usbip_mutex_t mutex);
+
+usbip_sem_t usbip_sem_create(unsigned max, unsigned initial);
+void usbip_sem_take(usbip_sem_t sem);
+/* returns 0 once taken, -1 when timeout_us passed first */
+int usbip_sem_take_timeout(usbip_sem_t sem, uint32_t timeout_us);
+void usbip_sem_give(usbip_sem_t sem);
+void usbip_sem_delete(usbip_sem_t sem);
+
+usbip_queue_t usbip_queue_create(unsigned len);
+void usbip_queue_send(usbip_queue_t queue, void *item);
+void *usbip_queue_recv(usbip_queue_t queue);
+/*
+ * returns 0 with the next item in *item, -1 when timeout_us passed first;
+ * the timeout is rounded down to the port's tick
+ */
+int usbip_queue_recv_timeout(usbip_queue_t queue, uint32_t timeout_us,
+			     void **item);
+void usbip_queue_delete(usbip_queue_t queue);
+
+/*
+ * Transfers are allocated by the port so they come from memory the host
+ * controller can use. On completion the transfer callback is invoked from
+ * the port's USB task, never from inside transfer_submit().
+ */
+int usbip_transfer_alloc(size_t data_buffer_size, int num_isoc_packets,
+			 usb_transfer_t **transfer);
+void usbip_transfer_free(usb_transfer_t *transfer);
+
+/*
+ * USB host operations of one exported device. All of them return 0 on
+ * success and a negative value on failure. transfer_submit() handles the
+ * default pipe too, control transfers are recognised by bEndpointAddress 0.
+ */
+struct usbip_host_ops {
+	int (*get_device_descriptor)(void *ctx, const usb_device_desc_t **desc);
+	int (*get_config_descriptor)(void *ctx, const usb_config_desc_t **desc);
+	/* optional: copy string descriptor index in language langid to data */
+	int (*get_string_descriptor)(void *ctx, uint8_t index, uint16_t langid,
+				     uint8_t *data, int *len);
+	int (*interface_claim)(void *ctx, uint8_t intf, uint8_t alt);
+	int (*interface_release)(void *ctx, uint8_t intf);
+	int (*transfer_submit)(void *ctx, usb_transfer_t *transfer);
+	int (*endpoint_halt)(void *ctx, uint8_t addr);
+	int (*endpoint_flush)(void *ctx, uint8_t addr);
+	int (*endpoint_clear)(void *ctx, uint8_t addr);
+	/*
+	 * optional: the device was removed and no session uses ctx any more,
+	 * it may be closed and reused
+	 */
+	void (*device_free)(void *ctx);
+};
@@ -0,0 +1,37 @@
+#pragma once
+/* ESP-IDF port of the USB/IP core, see usbip_port.h */
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "lwip/sockets.h"
+#include "usb/usb_host.h"
+
+typedef SemaphoreHandle_t usbip_mutex_t;
+typedef SemaphoreHandle_t usbip_sem_t;
+typedef QueueHandle_t usbip_queue_t;
+
+#define USBIP_LOG_ERROR		ESP_LOG_ERROR
+#define USBIP_LOG_WARN		ESP_LOG_WARN
+#define USBIP_LOG_INFO		ESP_LOG_INFO
+#define USBIP_LOG_DEBUG		ESP_LOG_DEBUG
+
+#define USBIP_PORT_LOG(level, tag, ...)	ESP_LOG_LEVEL_LOCAL(level, tag, __VA_ARGS__)
+
+/* A device opened through the ESP-IDF USB host library */
+struct usbip_esp_device {
+	usb_host_client_handle_t client_hdl;
+	usb_device_handle_t dev_hdl;
+
+	/*
+	 * Descriptors captured on attach, owned by the host library for as
+	 * long as the device is open. The strings are the ones it read while
+	 * enumerating, in LANGID 0x0409.
+	 */
+	const usb_device_desc_t *device_desc;
+	const usb_config_desc_t *config_desc;
+	const usb_str_desc_t *str_desc[3];	/* manufacturer, product, serial */
+	uint8_t str_index[3];
+};
+
+extern const struct usbip_host_ops usbip_esp_host_ops;
@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include "usbip_trace.h"
+
+#if CONFIG_USBIP_TRACE_EVENTS > 0
+
+struct usbip_trace_event usbip_trace_ring[CONFIG_USBIP_TRACE_EVENTS];
+atomic_uint usbip_trace_head;
+
+static const char *const usbip_trace_names[USBIP_TRACE_NUM_IDS] = {
+	[USBIP_TRACE_CMD_SUBMIT]	= "CMD_SUBMIT",
+	[USBIP_TRACE_SUBMIT]		= "submit",
+	[USBIP_TRACE_COMPLETE]		= "complete",
+	[USBIP_TRACE_RET_SUBMIT]	= "RET_SUBMIT",
+	[USBIP_TRACE_CMD_UNLINK]	= "CMD_UNLINK",
+	[USBIP_TRACE_RET_UNLINK]	= "RET_UNLINK",
+};
+
+void usbip_trace_dump(void)
+{
+	unsigned head = atomic_load(&usbip_trace_head);
+	unsigned i = head > CONFIG_USBIP_TRACE_EVENTS ?
+		     head - CONFIG_USBIP_TRACE_EVENTS : 0;
+
+	printf("trace: %u events, last %u\n", head, head - i);
+	for (; i != head; i++) {
+		const struct usbip_trace_event *ev =
+			&usbip_trace_ring[i & (CONFIG_USBIP_TRACE_EVENTS - 1)];
+		const char *name = ev->id < USBIP_TRACE_NUM_IDS &&
+				   usbip_trace_names[ev->id] ?
+				   usbip_trace_names[ev->id] : "?";
+
+		printf("%10u %-10s fd %-3u seq %-8u len %d\n",
+		       (unsigned)ev->time_us, name, ev->session,
+		       (unsigned)ev->seqnum, (int)ev->len);
+	}
+}
+
+#endif
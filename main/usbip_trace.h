@@ -0,0 +1,66 @@
+#pragma once
+/*
+ * Binary trace of the URB path.
+ *
+ * Recording an event is one atomic increment and a few stores into a ring of
+ * CONFIG_USBIP_TRACE_EVENTS entries, cheap enough for production builds in
+ * which formatted logging is compiled out. usbip_trace_dump() prints the
+ * ring, oldest event first; an event recorded while it runs may show up
+ * half written. With CONFIG_USBIP_TRACE_EVENTS 0 nothing is compiled in.
+ */
+#include <stdint.h>
+#include "usbip_port.h"
+
+enum usbip_trace_id {
+	USBIP_TRACE_CMD_SUBMIT = 1,	/* len: transfer_buffer_length */
+	USBIP_TRACE_SUBMIT,		/* handed to the host stack, len: num_bytes */
+	USBIP_TRACE_COMPLETE,		/* given back, len: actual_num_bytes */
+	USBIP_TRACE_RET_SUBMIT,		/* len: actual_length */
+	USBIP_TRACE_CMD_UNLINK,		/* len: seqnum to unlink */
+	USBIP_TRACE_RET_UNLINK,		/* len: status */
+	USBIP_TRACE_NUM_IDS,
+};
+
+struct usbip_trace_event {
+	uint32_t time_us;
+	uint16_t id;
+	uint16_t session;	/* socket of the session */
+	uint32_t seqnum;
+	uint32_t len;
+};
+
+#if CONFIG_USBIP_TRACE_EVENTS > 0
+#include <stdatomic.h>
+
+_Static_assert((CONFIG_USBIP_TRACE_EVENTS & (CONFIG_USBIP_TRACE_EVENTS - 1)) == 0,
+	       "CONFIG_USBIP_TRACE_EVENTS must be a power of two");
+
+extern struct usbip_trace_event usbip_trace_ring[CONFIG_USBIP_TRACE_EVENTS];
+extern atomic_uint usbip_trace_head;
+
+static inline void usbip_trace(uint16_t id, int session, uint32_t seqnum,
+			       uint32_t len)
+{
+	unsigned i = atomic_fetch_add_explicit(&usbip_trace_head, 1,
+					       memory_order_relaxed);
+	struct usbip_trace_event *ev =
+		&usbip_trace_ring[i & (CONFIG_USBIP_TRACE_EVENTS - 1)];
+
+	ev->time_us = usbip_time_us();
+	ev->id = id;
+	ev->session = session;
+	ev->seqnum = seqnum;
+	ev->len = len;
+}
+
+void usbip_trace_dump(void);
+#else
+static inline void usbip_trace(uint16_t id, int session, uint32_t seqnum,
+			       uint32_t len)
+{
+}
+
+static inline void usbip_trace_dump(void)
+{
+}
+#endif